@@ -7,25 +7,69 @@ typedef struct TreBuffer {
   char dummy[1];
 } TreBuffer;
 
+typedef struct TreBufferStats {
+  long reallocs;
+  long compactions;
+  long long bytes_moved;
+  TRE_Off allocated;
+  TRE_Off text_length;
+} TreBufferStats;
+
 typedef struct TreCursorPosition {
-  int cursor_line;
-  int cursor_column;
-  int cursor_offset;
+  TRE_Off cursor_line;
+  TRE_Off cursor_column;
+  TRE_Off cursor_offset;
 } TreCursorPosition;
 #endif
 
 //--------------------------------------------------------------------
 
-void TreBuffer_MoveCharwise(TreBuffer* buf, int distanceChars) {
+void TreBuffer_MoveCharwise(TreBuffer* buf, TRE_Off distanceChars) {
   TRE_Buf_move_charwise((TRE_Buf*)buf, distanceChars);
 }
 
-void TreBuffer_MoveLinewise(TreBuffer* buf, int distanceLines) {
+void TreBuffer_MoveLinewise(TreBuffer* buf, TRE_Off distanceLines) {
   TRE_Buf_move_linewise((TRE_Buf*)buf, distanceLines);
 }
 
-TRE_OpResult TreBuffer_SetCursorPosition(TreBuffer* buf, int absolutePosition) {
-  return TRE_Buf_move_gap((TRE_Buf*)buf, absolutePosition);
+TRE_OpResult TreBuffer_SetCursorPosition(TreBuffer* buf,
+    TRE_Off absolutePosition) {
+  return TRE_Buf_set_cursor_offset((TRE_Buf*)buf, absolutePosition);
+}
+
+void TreBuffer_GotoLine(TreBuffer* buf, TRE_Off line, TRE_Off column) {
+  TRE_Buf_goto_line((TRE_Buf*)buf, line, column);
+}
+
+// Get the number of lines in the buffer. If the buffer's lines are still being
+// counted in the background, this waits for the count to finish.
+TRE_Off TreBuffer_GetLineCount(TreBuffer* buf) {
+  return TRE_Buf_count_lines((TRE_Buf*)buf);
+}
+
+// Get the length of the text in bytes (including the final newline).
+TRE_Off TreBuffer_GetLength(TreBuffer* buf) {
+  return ((TRE_Buf*)buf)->text_len;
+}
+
+// Get the offset of the start of a line. Returns -1 if there is no such line.
+TRE_Off TreBuffer_LineToOffset(TreBuffer* buf, TRE_Off line) {
+  TRE_Buf* bufptr = (TRE_Buf*)buf;
+  if (line < 0 || line >= bufptr->text_len
+      || line >= TRE_Buf_wait_lines(bufptr, line + 1)) {
+    return -1;
+  }
+  return TRE_Buf_get_line(bufptr, line).off;
+}
+
+// Get the number of the line containing an offset. Returns -1 if the offset
+// is out of bounds.
+TRE_Off TreBuffer_OffsetToLine(TreBuffer* buf, TRE_Off offset) {
+  TRE_Buf* bufptr = (TRE_Buf*)buf;
+  if (offset < 0 || offset >= bufptr->text_len) {
+    return -1;
+  }
+  return TRE_Buf_get_line_at_offset(bufptr, offset).num;
 }
 
 TreCursorPosition TreBuffer_GetCursorPosition(TreBuffer* buf) {
@@ -33,7 +77,7 @@ TreCursorPosition TreBuffer_GetCursorPosition(TreBuffer* buf) {
   TreCursorPosition pos;
   pos.cursor_line = bufptr->cursor_line.num;
   pos.cursor_column = bufptr->cursor_col;
-  pos.cursor_offset = bufptr->gap_start;
+  pos.cursor_offset = TRE_Buf_get_cursor_offset(bufptr);
   return pos;
 }
 
@@ -47,6 +91,12 @@ void TreBuffer_InsertString(TreBuffer* buf, const char* str) {
   TRE_Buf_insert_string((TRE_Buf*)buf, str);
 }
 
+// Insert len bytes from src. Unlike TreBuffer_InsertString, the text can
+// contain null characters.
+void TreBuffer_InsertBytes(TreBuffer* buf, const char* src, TRE_Off len) {
+  TRE_Buf_insert_bytes((TRE_Buf*)buf, src, len);
+}
+
 void TreBuffer_Delete(TreBuffer* buf) {
   TRE_Buf_delete((TRE_Buf*)buf);
 }
@@ -55,10 +105,115 @@ void TreBuffer_Backspace(TreBuffer* buf) {
   TRE_Buf_backspace((TRE_Buf*)buf);
 }
 
+// Delete len bytes starting at an offset, leaving the cursor there.
+void TreBuffer_DeleteRange(TreBuffer* buf, TRE_Off offset, TRE_Off len) {
+  TRE_Buf_delete_range((TRE_Buf*)buf, offset, len);
+}
+
+// Replace len bytes starting at an offset with src_len bytes from src,
+// leaving the cursor after them. This is undone in one step.
+void TreBuffer_ReplaceRange(TreBuffer* buf, TRE_Off offset, TRE_Off len,
+    const char* src, TRE_Off src_len) {
+  TRE_Buf_replace_range((TRE_Buf*)buf, offset, len, src, src_len);
+}
+
+// Read len bytes starting at an offset without copying them. The text comes
+// back in up to two pieces, and the number of bytes they hold is returned
+// (if it's less than len, read the rest from where they end). The pointers
+// are only good until the buffer is next edited.
+TRE_Off TreBuffer_GetRange(TreBuffer* buf, TRE_Off offset, TRE_Off len,
+    TRE_TextRange* range) {
+  return TRE_Buf_get_range((TRE_Buf*)buf, offset, len, range);
+}
+
+// Find the first occurrence of pat_len bytes from pat at or after an offset.
+// Returns its offset, or -1 if there isn't one.
+TRE_Off TreBuffer_Search(TreBuffer* buf, TRE_Off offset, const char* pat,
+    TRE_Off pat_len) {
+  return TRE_Buf_search((TRE_Buf*)buf, offset, pat, pat_len);
+}
+
+// Copy len bytes starting at an offset into dst.
+void TreBuffer_CopyRange(TreBuffer* buf, TRE_Off offset, TRE_Off len,
+    char* dst) {
+  TRE_Buf_copy_text((TRE_Buf*)buf, offset, dst, len);
+}
+
+// Save the buffer to a file (or its own file, if filename is NULL). The file
+// is replaced in one step, so it's never left half written.
+TRE_OpResult TreBuffer_Save(TreBuffer* buf, const char* filename) {
+  return TRE_Buf_save((TRE_Buf*)buf, filename);
+}
+
+// Start saving the buffer on a background thread. It can be edited while it's
+// saved; the text saved is the text as it is now.
+TRE_OpResult TreBuffer_StartSave(TreBuffer* buf, const char* filename) {
+  return TRE_Buf_save_start((TRE_Buf*)buf, filename);
+}
+
+int TreBuffer_SaveDone(TreBuffer* buf) {
+  return TRE_Buf_save_done((TRE_Buf*)buf);
+}
+
+// Wait for a background save and return whether it worked.
+TRE_OpResult TreBuffer_WaitSave(TreBuffer* buf) {
+  return TRE_Buf_save_wait((TRE_Buf*)buf);
+}
+
+// Undo the last edit, or run of typing. Returns TRE_FAIL if there's nothing
+// left to undo.
+TRE_OpResult TreBuffer_Undo(TreBuffer* buf) {
+  return TRE_Buf_undo((TRE_Buf*)buf);
+}
+
+TRE_OpResult TreBuffer_Redo(TreBuffer* buf) {
+  return TRE_Buf_redo((TRE_Buf*)buf);
+}
+
+// Make the next edit a separate undo step.
+void TreBuffer_UndoBoundary(TreBuffer* buf) {
+  TRE_Buf_undo_boundary((TRE_Buf*)buf);
+}
+
+void TreBuffer_SetSavePoint(TreBuffer* buf) {
+  TRE_Buf_set_save_point((TRE_Buf*)buf);
+}
+
+int TreBuffer_IsModified(TreBuffer* buf) {
+  return TRE_Buf_is_modified((TRE_Buf*)buf);
+}
+
 int TreBuffer_ReadCharAtCursor(TreBuffer* buf) {
   return TRE_Buf_read_char_at_cursor((TRE_Buf*)buf);
 }
 
+// Choose how the buffer stores its text: TRE_BUF_STORAGE_GAP (best for
+// editing in one place) or TRE_BUF_STORAGE_PIECES (best for edits scattered
+// through a large text). The text is copied into the new storage.
+void TreBuffer_SetStorage(TreBuffer* buf, TRE_Buf_Storage storage) {
+  TRE_Buf_set_storage((TRE_Buf*)buf, storage);
+}
+
+TRE_Buf_Storage TreBuffer_GetStorage(TreBuffer* buf) {
+  return ((TRE_Buf*)buf)->storage;
+}
+
+// Trim memory the buffer isn't using. Returns TRE_SUCC if anything was freed.
+TRE_OpResult TreBuffer_Compact(TreBuffer* buf) {
+  return TRE_Buf_compact((TRE_Buf*)buf, 1);
+}
+
+TreBufferStats TreBuffer_GetStats(TreBuffer* buf) {
+  TRE_Buf* bufptr = (TRE_Buf*)buf;
+  TreBufferStats stats;
+  stats.reallocs = bufptr->stats.n_reallocs;
+  stats.compactions = bufptr->stats.n_compactions;
+  stats.bytes_moved = bufptr->stats.bytes_moved;
+  stats.allocated = bufptr->buf_size;
+  stats.text_length = bufptr->text_len;
+  return stats;
+}
+
 /*
 TODO: Change basic buffer methods (move charwise/linewise) so that they return
 new positions as return values instead of mutating the buffer. Then add
@@ -76,16 +231,8 @@ Multiple selection
 Marks?
 Read-only status
 Get line length
-Set/clear dirty
-Undo/redo, set save point, checkpointing (undo history as series of diffs vs
-series of specific events?)
 Revert?
-Convert between absolute position and row/col position
-Go to line/col
-Search/replace (in range)
-Get text in range
-Delete text in range
-Replace text range with string (maybe do as atom operation for undo purposes)
+Replace (in range)
 Get/insert/delete line
 Get/set EOL mode
 Expand tab, tab width
@@ -1,121 +1,475 @@
 #include "hdrs.c"
 #include "mh_buf_edit.h"
 
-// Insert a character into the gap.
+#if LOCAL_INTERFACE
+// List of line lengths collected while inserting text. Short lists stay in
+// the fixed array, longer ones move to the heap.
+#define LEN_LIST_FIXED 64
+typedef struct {
+  TRE_Off* lens;
+  int n;
+  int cap;
+  TRE_Off fixed[LEN_LIST_FIXED];
+} len_list_t;
+#endif
+
+// Insert a character at the cursor.
 void TRE_Buf_insert_char(TRE_Buf *buf, char c) {
   logt("Inserting character: %s", char_to_str(c));
   assert(buf != NULL);
+  TRE_Buf_finish_indexing(buf);
   // Editing clears the column affinity.
   TRE_Buf_clear_col_affinity(buf);
-  // Put the character into the buffer at the start of the gap.
-  buf->text.c[buf->gap_start++] = c;
+  TRE_Off off = TRE_Buf_get_cursor_offset(buf);
+  TRE_Buf_record_insert(buf, off, &c, 1, off);
+  TRE_Buf_store_insert(buf, off, &c, 1);
+  damage_lines(buf, buf->cursor_line.num, c == '\n');
   // Update buffer position info.
   if (c == '\n') {
     // Inserting a newline splits the current line. (It's really a new line but
     // the new info is written directly into buf->cursor_line.)
+    TRE_LineIdx_set_len(&buf->lines, buf->cursor_line.num,
+        buf->cursor_col + 1);
     buf->cursor_line.num++;
     buf->cursor_line.off += buf->cursor_col + 1;
     buf->cursor_line.len -= buf->cursor_col;
+    TRE_LineIdx_insert(&buf->lines, buf->cursor_line.num,
+        buf->cursor_line.len);
     buf->cursor_col = 0;
     buf->n_lines++;
   } else {
+    TRE_LineIdx_add_len(&buf->lines, buf->cursor_line.num, 1);
     buf->cursor_col++;
     buf->cursor_line.len++;
   }
-  buf->gap_len--;
-  buf->text_len++;
-  // On insertions (when the gap gets smaller) it's necessary to check if we
-  // have to create a new gap.
-  check_gap(buf, 0);
 }
 
-// Insert an entire string into the gap.
-// FIXME: This could be more efficient. Currently it just adds a character at a
-// time. It should add chars all in one bunch. However, the current
-// implementation is easy to get correct so it's OK for now.
+// Insert an entire (null-terminated) string at the cursor.
 void TRE_Buf_insert_string(TRE_Buf* buf, const char* str) {
   assert(str != NULL);
-  int i = 0;
-  int c;
-  while ((c = str[i++])) {
-    TRE_Buf_insert_char(buf, c);
+  TRE_Buf_insert_bytes(buf, str, strlen(str));
+}
+
+// Insert a block of text at the cursor. The text may contain any bytes,
+// including nulls. The gap is enlarged at most once and the text is copied in
+// one go; the newlines in it are found in the same pass that builds the list
+// of new line lengths for the line index. (The source text must not be part
+// of this buffer, since enlarging the gap can move the buffer's memory.)
+void TRE_Buf_insert_bytes(TRE_Buf* buf, const char* src, TRE_Off len) {
+  assert(buf != NULL);
+  assert(src != NULL && len >= 0);
+  if (len == 0) {
+    return;
+  }
+  logt("Inserting %lld bytes.", len);
+  TRE_Buf_finish_indexing(buf);
+  // Editing clears the column affinity.
+  TRE_Buf_clear_col_affinity(buf);
+  TRE_Off off = TRE_Buf_get_cursor_offset(buf);
+  TRE_Buf_record_insert(buf, off, src, len, off);
+  TRE_Buf_store_insert(buf, off, src, len);
+  // Split the text into segments at each newline. The first segment joins
+  // the part of the cursor line before the cursor, and the last one joins the
+  // rest of the cursor line, so the segment lengths (adjusted for that) are
+  // exactly the line lengths that go into the line index.
+  len_list_t segs;
+  len_list_init(&segs);
+  const char* p = src;
+  const char* end = src + len;
+  const char* nl;
+  while ((nl = TRE_find_newline(p, end - p))) {
+    len_list_push(&segs, nl + 1 - p);
+    p = nl + 1;
+  }
+  int n_newlines = segs.n;
+  TRE_Off new_col = end - p;
+  damage_lines(buf, buf->cursor_line.num, n_newlines > 0);
+  if (n_newlines == 0) {
+    TRE_LineIdx_add_len(&buf->lines, buf->cursor_line.num, len);
+    buf->cursor_col += len;
+    buf->cursor_line.len += len;
+  } else {
+    // The cursor ends up on the last of the new lines, just after the last
+    // newline that was inserted.
+    TRE_Off tail_len = buf->cursor_line.len - buf->cursor_col;
+    len_list_push(&segs, new_col + tail_len);
+    segs.lens[0] += buf->cursor_col;
+    TRE_LineIdx_set_len(&buf->lines, buf->cursor_line.num, segs.lens[0]);
+    TRE_LineIdx_insert_many(&buf->lines, buf->cursor_line.num + 1,
+        segs.lens + 1, n_newlines);
+    buf->cursor_line.num += n_newlines;
+    buf->cursor_line.off = off + len - new_col;
+    buf->cursor_line.len = new_col + tail_len;
+    buf->cursor_col = new_col;
+    buf->n_lines += n_newlines;
   }
+  len_list_free(&segs);
 }
 
-// Delete the first character after the gap.
+// Add bytes read from the end of the buffer's file to the end of the buffer.
+// *partial says whether the file's last line is unfinished, i.e. the
+// buffer's final newline isn't in the file, and is updated to say the same
+// after the new bytes. The bytes aren't recorded for undo (as far as the
+// buffer is concerned they were in the file all along, so it isn't
+// modified), and the cursor stays where it was.
+void TRE_Buf_append_bytes(TRE_Buf* buf, const char* src, TRE_Off len,
+    int* partial) {
+  assert(src != NULL && len >= 0);
+  if (len == 0) {
+    return;
+  }
+  TRE_Buf_finish_indexing(buf);
+  TRE_Off cursor = TRE_Buf_get_cursor_offset(buf);
+  TRE_Off col_affinity = buf->col_affinity;
+  int replaying = buf->undo.replaying;
+  buf->undo.replaying = 1;
+  // The new text goes before the final newline, which stands in for a
+  // newline at its end (if it has one).
+  TRE_Buf_set_cursor_offset(buf, buf->text_len - 1);
+  if (!*partial) {
+    TRE_Buf_insert_char(buf, '\n');
+  }
+  int ends_line = src[len - 1] == '\n';
+  TRE_Buf_insert_bytes(buf, src, len - ends_line);
+  buf->undo.replaying = replaying;
+  *partial = !ends_line;
+  TRE_Buf_set_cursor_offset(buf, cursor);
+  buf->col_affinity = col_affinity;
+}
+
+// Delete the character at the cursor.
 void TRE_Buf_delete(TRE_Buf *buf) {
+  TRE_Buf_finish_indexing(buf);
   // Editing clears the column affinity.
   TRE_Buf_clear_col_affinity(buf);
   // TRE_Buf_OutputBuffer ob;
   // logt("Deleting at: gap_start=%d, text_len=%d, cursor=%s",
   //     buf->gap_start, buf->text_len, TRE_Buf_cursor_to_string(buf, &ob));
-  if (buf->gap_start + 1 == buf->text_len) {
+  TRE_Off off = TRE_Buf_get_cursor_offset(buf);
+  if (off + 1 >= buf->text_len) {
     log_info("Attempted to delete at the end of the buffer.");
     return;
   }
-  int c = buf->text.c[buf->gap_start + buf->gap_len];
+  TRE_Buf_record_delete(buf, off, 1, off);
+  int c = TRE_Buf_char_at(buf, off);
+  damage_lines(buf, buf->cursor_line.num, c == '\n');
   if (c == '\n') {
     // If a newline is being deleted, join this line with the following one.
-    TRE_Line next_line = scan_next_line(buf, buf->cursor_line);
+    TRE_Line next_line = TRE_Buf_next_line(buf, buf->cursor_line);
     buf->cursor_line.len += next_line.len - 1;
+    TRE_LineIdx_set_len(&buf->lines, buf->cursor_line.num,
+        buf->cursor_line.len);
+    TRE_LineIdx_remove(&buf->lines, next_line.num);
     buf->n_lines--;
   } else {
+    TRE_LineIdx_add_len(&buf->lines, buf->cursor_line.num, -1);
     buf->cursor_line.len--;
   }
-  buf->gap_len++;
-  buf->text_len--;
+  TRE_Buf_store_delete(buf, off, 1);
 }
 
-// Delete the last character before the gap.
+// Delete the character before the cursor.
 void TRE_Buf_backspace(TRE_Buf *buf) {
+  TRE_Buf_finish_indexing(buf);
   // Editing clears the column affinity.
   TRE_Buf_clear_col_affinity(buf);
-  if (buf->gap_start == 0) {
+  TRE_Off off = TRE_Buf_get_cursor_offset(buf);
+  if (off == 0) {
     log_info("Attempted to backspace at the start of the buffer.");
     return;
   }
-  int c = buf->text.c[buf->gap_start - 1];
+  TRE_Buf_record_delete(buf, off - 1, 1, off);
+  int c = TRE_Buf_char_at(buf, off - 1);
+  damage_lines(buf, buf->cursor_line.num - (c == '\n'), c == '\n');
   if (c == '\n') {
     // If a newline is being backspaced over, join this line with the previous
     // one.
-    int cur_line_len = buf->cursor_line.len;
-    buf->cursor_line = scan_prev_line(buf, buf->cursor_line);
+    TRE_Off cur_line_num = buf->cursor_line.num;
+    TRE_Off cur_line_len = buf->cursor_line.len;
+    buf->cursor_line = TRE_Buf_prev_line(buf, buf->cursor_line);
     buf->cursor_col = buf->cursor_line.len - 1;
     buf->cursor_line.len += cur_line_len - 1;
+    TRE_LineIdx_set_len(&buf->lines, buf->cursor_line.num,
+        buf->cursor_line.len);
+    TRE_LineIdx_remove(&buf->lines, cur_line_num);
     buf->n_lines--;
   } else {
+    TRE_LineIdx_add_len(&buf->lines, buf->cursor_line.num, -1);
     buf->cursor_col--;
     buf->cursor_line.len--;
   }
-  buf->gap_start--;
-  buf->gap_len++;
-  buf->text_len--;
+  TRE_Buf_store_delete(buf, off - 1, 1);
+}
+
+// Delete len chars starting at an offset, and put the cursor there. The
+// line index is patched once for the whole range, so this costs about the
+// same however many lines are deleted. The final newline of the buffer can't
+// be deleted, so the range is cut short before it.
+void TRE_Buf_delete_range(TRE_Buf* buf, TRE_Off off, TRE_Off len) {
+  TRE_Buf_finish_indexing(buf);
+  // Editing clears the column affinity.
+  TRE_Buf_clear_col_affinity(buf);
+  assert(off >= 0 && len >= 0);
+  if (off + len >= buf->text_len) {
+    len = buf->text_len - 1 - off;
+  }
+  if (len <= 0) {
+    log_info("Attempted to delete at the end of the buffer.");
+    return;
+  }
+  logt("Deleting %lld bytes at %lld.", len, off);
+  TRE_Buf_record_delete(buf, off, len, TRE_Buf_get_cursor_offset(buf));
+  TRE_Line first = TRE_Buf_get_line_at_offset(buf, off);
+  TRE_Line last = TRE_Buf_get_line_at_offset(buf, off + len);
+  TRE_Off n_joined = last.num - first.num;
+  damage_lines(buf, first.num, n_joined > 0);
+  if (n_joined == 0) {
+    TRE_LineIdx_add_len(&buf->lines, first.num, -len);
+  } else {
+    // The first line takes in what's left of the last one.
+    TRE_LineIdx_set_len(&buf->lines, first.num,
+        last.off + last.len - len - first.off);
+    TRE_LineIdx_remove_range(&buf->lines, first.num + 1, n_joined);
+    buf->n_lines -= n_joined;
+  }
+  TRE_Buf_store_delete(buf, off, len);
+  buf->cursor_line = TRE_Buf_get_line(buf, first.num);
+  buf->cursor_col = off - first.off;
+}
+
+// Replace len chars starting at an offset with new text, leaving the cursor
+// after it. The deletion leaves the gap where the new text goes, so the text
+// after the range only moves once. This is a single step for undo.
+void TRE_Buf_replace_range(TRE_Buf* buf, TRE_Off off, TRE_Off len,
+    const char* src, TRE_Off src_len) {
+  TRE_Buf_undo_boundary(buf);
+  TRE_Off old_len = buf->text_len;
+  TRE_Buf_delete_range(buf, off, len);
+  int deleted = buf->text_len < old_len;
+  if (!deleted) {
+    // The range was empty (or only had the final newline in it).
+    TRE_Buf_set_cursor_offset(buf, off);
+  }
+  TRE_Buf_insert_bytes(buf, src, src_len);
+  if (deleted && src_len > 0) {
+    TRE_Buf_undo_link(buf);
+  }
+  TRE_Buf_undo_boundary(buf);
 }
 
-// Check if the gap needs to be expanded. This needs to be done when it
-// completely runs out of space. (The "extra_space" here is space needed if
-// we're going to insert a whole block of text into the buffer at once. After
-// a single-character insert, extra_space is zero.)
-LOCAL void check_gap(TRE_Buf *buf, int extra_space) {
+// Move the record of which lines have changed since the last call into
+// `damage` (adding to whatever is already there), and start a new one.
+void TRE_Buf_take_damage(TRE_Buf* buf, TRE_Damage* damage) {
+  TRE_Damage_merge(damage, &buf->damage);
+  TRE_Damage_clear(&buf->damage);
+}
+
+// Record an edit to a line. If the edit added or removed lines, the lines
+// after it have moved, so they're damaged too.
+LOCAL void damage_lines(TRE_Buf* buf, TRE_Off line, int lines_moved) {
+  TRE_Damage_add(&buf->damage, line, lines_moved ? TRE_DAMAGE_END : line);
+}
+
+// The functions below change the stored text without touching the line index
+// or the cursor, which the caller is responsible for keeping up to date.
+
+// Insert len chars from src at an offset in the buffer's text.
+void TRE_Buf_store_insert(TRE_Buf* buf, TRE_Off off, const char* src,
+    TRE_Off len) {
+  assert(off >= 0 && off <= buf->text_len);
+  TRE_Buf_before_change(buf);
+  buf->version++;
+  if (buf->storage == TRE_BUF_STORAGE_PIECES) {
+    TRE_Pieces_insert(buf->pieces, off, src, len);
+  } else {
+    if (off != buf->gap_start) {
+      TRE_Buf_move_gap(buf, off);
+    }
+    check_gap(buf, len);
+    memcpy(buf->text.c + buf->gap_start, src, len);
+    buf->gap_start += len;
+    buf->gap_len -= len;
+  }
+  buf->text_len += len;
+}
+
+// Delete len chars starting at an offset in the buffer's text.
+void TRE_Buf_store_delete(TRE_Buf* buf, TRE_Off off, TRE_Off len) {
+  assert(off >= 0 && len >= 0 && off + len <= buf->text_len);
+  TRE_Buf_before_change(buf);
+  buf->version++;
+  if (buf->storage == TRE_BUF_STORAGE_PIECES) {
+    TRE_Pieces_delete(buf->pieces, off, len);
+  } else {
+    if (off != buf->gap_start) {
+      TRE_Buf_move_gap(buf, off);
+    }
+    buf->gap_len += len;
+  }
+  buf->text_len -= len;
+}
+
+LOCAL void len_list_init(len_list_t* list) {
+  list->lens = list->fixed;
+  list->n = 0;
+  list->cap = LEN_LIST_FIXED;
+}
+
+LOCAL void len_list_push(len_list_t* list, TRE_Off len) {
+  if (list->n == list->cap) {
+    list->cap *= 2;
+    if (list->lens == list->fixed) {
+      list->lens = my_alloc(list->cap * sizeof(TRE_Off));
+      memcpy(list->lens, list->fixed, sizeof(list->fixed));
+    } else {
+      list->lens = my_realloc(list->lens, list->cap * sizeof(TRE_Off));
+    }
+  }
+  list->lens[list->n++] = len;
+}
+
+LOCAL void len_list_free(len_list_t* list) {
+  if (list->lens != list->fixed) {
+    my_free(list->lens);
+  }
+}
+
+// The growth policy that new buffers start out with.
+TRE_Buf_GrowthPolicy TRE_buf_default_growth_policy = {
+  .growth_num = 3,
+  .growth_den = 2,
+  .max_step = 64 * 1024 * 1024,
+  .min_gap = TRE_BUFFER_GAP_SIZE,
+  .max_gap = 1024 * 1024,
+  .adaptive = 1,
+  .max_slack = 1024 * 1024
+};
+
+void TRE_Buf_set_growth_policy(TRE_Buf* buf,
+    const TRE_Buf_GrowthPolicy* policy) {
+  assert(policy->growth_den > 0 && policy->growth_num >= policy->growth_den);
+  assert(policy->min_gap > 0 && policy->max_gap >= policy->min_gap);
+  buf->growth = *policy;
+}
+
+TRE_Buf_Stats TRE_Buf_get_stats(TRE_Buf* buf) {
+  return buf->stats;
+}
+
+// Make sure the gap has room for at least extra_space chars, so that a block
+// of text that size can be copied into it. If it doesn't, the gap is enlarged
+// to extra_space plus a fresh gap (sized by the growth policy), and the
+// allocation grows geometrically if that doesn't fit. When it grows, all of
+// the new space goes into the gap, so the tail isn't moved again until the
+// gap has been used up.
+LOCAL void check_gap(TRE_Buf *buf, TRE_Off extra_space) {
+  buf->inserted_since_grow += extra_space;
   if (buf->gap_len < extra_space) {
-    buf->gap_len = TRE_BUFFER_GAP_SIZE + extra_space;
-    if (buf->text_len + buf->gap_len > buf->buf_size) {
+    TRE_Off old_gap_len = buf->gap_len;
+    TRE_Off new_gap_len = next_gap_size(buf) + extra_space;
+    TRE_Off needed = buf->text_len + new_gap_len;
+    if (needed > buf->buf_size) {
       // Time to expand the buffer size to fit more text
-      buf->buf_size += TRE_BUFFER_BLOCK_SIZE;
-      buf->text.c = my_realloc(buf->text.c, buf->buf_size);
+      resize_text(buf, grown_size(buf, needed));
+      new_gap_len = buf->buf_size - buf->text_len;
     }
     if (buf->gap_start < buf->text_len) {
       // Gap is before the end of the buffer, so the portion after the gap
       // needs to be relocated to enlarge the gap. (If the gap is at the end of
       // the buffer then nothing else needs to be done.)
-      memmove(buf->text.c + buf->gap_start + buf->gap_len,
-          buf->text.c + buf->gap_start,
-          buf->text_len - buf->gap_start);
+      TRE_Off tail_len = buf->text_len - buf->gap_start;
+      memmove(buf->text.c + buf->gap_start + new_gap_len,
+          buf->text.c + buf->gap_start + old_gap_len, tail_len);
+      buf->stats.bytes_moved += tail_len;
     }
+    buf->gap_len = new_gap_len;
+    buf->inserted_since_grow = 0;
+  }
+}
+
+// Size of the gap to create when the gap is enlarged, not counting the space
+// needed by the text about to be inserted. When adaptive sizing is on, a
+// buffer that's receiving a lot of text gets a bigger gap so that it doesn't
+// have to be enlarged as often.
+LOCAL TRE_Off next_gap_size(TRE_Buf* buf) {
+  const TRE_Buf_GrowthPolicy* policy = &buf->growth;
+  if (!policy->adaptive) {
+    return policy->min_gap;
+  }
+  TRE_Off gap = buf->inserted_since_grow;
+  if (gap < policy->min_gap) {
+    gap = policy->min_gap;
+  } else if (gap > policy->max_gap) {
+    gap = policy->max_gap;
+  }
+  return gap;
+}
+
+// Work out how big the allocation should become when it has to hold at least
+// `needed` bytes.
+LOCAL TRE_Off grown_size(TRE_Buf* buf, TRE_Off needed) {
+  const TRE_Buf_GrowthPolicy* policy = &buf->growth;
+  TRE_Off size = buf->buf_size / policy->growth_den * policy->growth_num
+    + buf->buf_size % policy->growth_den * policy->growth_num
+      / policy->growth_den;
+  if (policy->max_step > 0 && size > buf->buf_size + policy->max_step) {
+    size = buf->buf_size + policy->max_step;
+  }
+  if (size < needed) {
+    size = needed;
+  }
+  size = (size + TRE_BUFFER_BLOCK_SIZE - 1)
+    / TRE_BUFFER_BLOCK_SIZE * TRE_BUFFER_BLOCK_SIZE;
+  if ((unsigned long long)size > SIZE_MAX) {
+    log_fatal("Buffer has grown too large.");
+  }
+  return size;
+}
+
+LOCAL void resize_text(TRE_Buf* buf, TRE_Off new_size) {
+  logt("Resizing buffer from %lld to %lld bytes.", buf->buf_size, new_size);
+  buf->text.c = my_realloc(buf->text.c, new_size);
+  buf->buf_size = new_size;
+  buf->stats.n_reallocs++;
+}
+
+// Give back memory that the buffer isn't using, e.g. after a large delete.
+// The gap is cut down to the policy's minimum size and the allocation is
+// trimmed to match. Unless force is set, nothing is done if the unused space
+// is within the policy's max_slack. Returns TRE_SUCC if the allocation was
+// trimmed.
+TRE_OpResult TRE_Buf_compact(TRE_Buf* buf, int force) {
+  if (buf->storage != TRE_BUF_STORAGE_GAP) {
+    return TRE_FAIL;
+  }
+  // The text can't move while it's being loaded into.
+  TRE_Buf_finish_indexing(buf);
+  TRE_Off gap = buf->growth.min_gap;
+  TRE_Off new_size = (buf->text_len + gap + TRE_BUFFER_BLOCK_SIZE - 1)
+    / TRE_BUFFER_BLOCK_SIZE * TRE_BUFFER_BLOCK_SIZE;
+  if (new_size >= buf->buf_size) {
+    return TRE_FAIL;
+  }
+  if (!force && buf->buf_size - buf->text_len <= buf->growth.max_slack) {
+    return TRE_FAIL;
+  }
+  TRE_Buf_before_change(buf);
+  // Whatever is left over after rounding up to a whole block goes to the gap.
+  TRE_Off new_gap_len = new_size - buf->text_len;
+  TRE_Off tail_len = buf->text_len - buf->gap_start;
+  if (tail_len > 0) {
+    memmove(buf->text.c + buf->gap_start + new_gap_len,
+        buf->text.c + buf->gap_start + buf->gap_len, tail_len);
+    buf->stats.bytes_moved += tail_len;
   }
+  buf->gap_len = new_gap_len;
+  resize_text(buf, new_size);
+  buf->stats.n_compactions++;
+  buf->inserted_since_grow = 0;
+  return TRE_SUCC;
 }
 
 int TRE_Buf_read_char_at_cursor(TRE_Buf* buf) {
-  return buf->text.c[buf->gap_start + buf->gap_len];
+  return TRE_Buf_char_at(buf, TRE_Buf_get_cursor_offset(buf));
 }
 
@@ -0,0 +1,624 @@
+#include "hdrs.c"
+#include "mh_buf_indexer.h"
+
+// The indexer counts the lines of a large text on a background thread, so a
+// buffer can be shown as soon as its file is mapped instead of after every
+// byte has been scanned for newlines.
+//
+// The worker scans the text a chunk at a time, with helper threads (one per
+// core) scanning parts of each chunk alongside it. It adds every line to a
+// line index of its own (using a TRE_LineIdxBuilder), and after each chunk it
+// publishes how far it has got along with a "mark" (the offset of the line)
+// for every TRE_INDEXER_STRIDE-th line. Until the worker finishes, lookups are
+// answered from the marks: jump to the nearest mark at or before the line or
+// offset wanted, then scan forward over at most TRE_INDEXER_STRIDE lines. A
+// lookup past the part that's been scanned waits for the worker to get there.
+//
+// When the worker is done, TRE_Indexer_finish hands its line index over to the
+// buffer. The text must not change until then.
+//
+// An indexer can also load the text as it goes (TRE_Indexer_start_load): the
+// worker reads each chunk from the file into the buffer's memory before
+// counting its lines, so the text is only there as far as it has scanned.
+// Reading the text past that point has to go through TRE_Indexer_wait_text.
+
+#if INTERFACE
+// Number of lines between marks.
+#define TRE_INDEXER_STRIDE 1024
+// Amount of text the worker scans between progress reports.
+#define TRE_INDEXER_CHUNK (1024 * 1024)
+// Most threads that scan a text at once.
+#define TRE_INDEXER_MAX_THREADS 16
+// Least amount of text worth giving a thread to scan.
+#define TRE_INDEXER_MIN_SLICE (64 * 1024)
+// Amount a loader reads first. This is smaller than the other chunks so that
+// the start of the file (and the first screen of it) is there sooner.
+#define TRE_INDEXER_FIRST_CHUNK (256 * 1024)
+
+typedef struct {
+  const char* text; // the text being indexed
+  TRE_Off avail;    // number of chars that can be read from text
+  TRE_Off len;      // length of the text; if this is avail + 1, the text
+                    // ends with a newline that isn't in `text`
+  int fd;           // file the text is being read from (-1 if it's all
+                    // there already)
+  char* dest;       // where the text from fd goes (the same as text)
+  pthread_t thread;
+  int threaded;     // set if the worker is a separate thread
+  int joined;       // set once the worker thread has been joined
+  pthread_mutex_t lock;
+  pthread_cond_t progress;
+  // The fields below are shared with the worker and protected by lock.
+  TRE_Off* marks;   // marks[k] is the offset of line k * TRE_INDEXER_STRIDE
+  TRE_Off n_marks;
+  TRE_Off cap_marks;
+  TRE_Off n_lines;  // number of lines found so far
+  TRE_Off scanned;  // number of chars scanned so far
+  int done;         // set when the worker has finished
+  int cancel;       // set to ask the worker to stop early
+  int load_error;   // errno if reading the file failed, or -1 if the file
+                    // was shorter than expected
+  // If the marks and line count were given at the start (from a saved line
+  // table), the worker only checks them, and sets this if they're wrong.
+  int seeded;
+  int seed_wrong;
+  // The index the worker builds. It belongs to the worker until done is set.
+  TRE_LineIdx lines;
+} TRE_Indexer;
+#endif
+
+#if LOCAL_INTERFACE
+// One thread's share of a round of scanning.
+typedef struct {
+  const char* text;
+  TRE_Off start;   // the part of the text to scan
+  TRE_Off end;
+  TRE_Off* lens;   // lengths of the lines that end in the part
+  TRE_Off n_lens;
+  TRE_Off cap_lens;
+} IndexerSlice;
+
+typedef struct IndexerPool IndexerPool;
+
+typedef struct {
+  IndexerPool* pool;
+  int index;       // which slice of each round this thread scans
+} IndexerHelper;
+
+// The worker's helper threads.
+struct IndexerPool {
+  pthread_mutex_t lock;
+  pthread_cond_t start;  // signalled when a round starts
+  pthread_cond_t done;   // signalled when the helpers have finished a round
+  int round;             // counts rounds started
+  int n_active;          // number of slices in this round
+  int pending;           // helpers still scanning this round
+  int quit;
+  int n_threads;         // the worker plus the helpers that started
+  IndexerSlice slices[TRE_INDEXER_MAX_THREADS];
+  IndexerHelper helpers[TRE_INDEXER_MAX_THREADS];
+  pthread_t threads[TRE_INDEXER_MAX_THREADS];
+};
+#endif
+
+// Number of threads indexers use (0 for one per core).
+LOCAL int indexer_threads = 0;
+
+// Set how many threads each indexer scans with (0 for one per core, which is
+// the default).
+void TRE_Indexer_set_threads(int n) {
+  indexer_threads = n;
+}
+
+// Number of threads each indexer scans with.
+int TRE_Indexer_get_threads() {
+  int n = indexer_threads;
+  if (n <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  }
+  if (n < 1) {
+    n = 1;
+  }
+  return n < TRE_INDEXER_MAX_THREADS ? n : TRE_INDEXER_MAX_THREADS;
+}
+
+// Start indexing a text. `avail` chars can be read from `text`; `len` is the
+// length of the text, which is one more than avail if the text has a newline
+// added to the end of it. The text must stay valid and unchanged until the
+// indexer is freed.
+TRE_Indexer* TRE_Indexer_start(const char* text, TRE_Off avail,
+    TRE_Off len) {
+  return start(text, avail, len, -1, NULL, 0, 0);
+}
+
+// Start indexing a text whose marks are already known (from a saved line
+// table), so that any line can be looked up straight away. marks[k] is the
+// offset of line k * TRE_INDEXER_STRIDE; they must stay valid until the
+// indexer is freed. The worker still builds the line index, and checks the
+// marks against the text as it goes (see TRE_Indexer_seed_was_wrong).
+TRE_Indexer* TRE_Indexer_start_seeded(const char* text, TRE_Off avail,
+    TRE_Off len, const TRE_Off* marks, TRE_Off n_marks, TRE_Off n_lines) {
+  assert(n_marks == n_lines / TRE_INDEXER_STRIDE + 1);
+  return start(text, avail, len, -1, marks, n_marks, n_lines);
+}
+
+// Start loading a text from a file (open for reading, and positioned at the
+// start of the text) into memory at dest, counting the lines as it comes in.
+// The indexer closes the file when it's done with it. Any newline added to
+// the end must already be in dest.
+TRE_Indexer* TRE_Indexer_start_load(int fd, char* dest, TRE_Off avail,
+    TRE_Off len) {
+  return start(dest, avail, len, fd, NULL, 0, 0);
+}
+
+LOCAL TRE_Indexer* start(const char* text, TRE_Off avail, TRE_Off len,
+    int fd, const TRE_Off* marks, TRE_Off n_marks, TRE_Off n_lines) {
+  assert(len == avail || len == avail + 1);
+  TRE_Indexer* ix = my_alloc(sizeof(TRE_Indexer));
+  memset(ix, 0, sizeof(TRE_Indexer));
+  ix->text = text;
+  ix->avail = avail;
+  ix->len = len;
+  ix->fd = fd;
+  ix->dest = (char*)text;
+  if (marks) {
+    // The marks are borrowed, and nothing is added to them.
+    ix->seeded = 1;
+    ix->marks = (TRE_Off*)marks;
+    ix->n_marks = ix->cap_marks = n_marks;
+    ix->n_lines = n_lines;
+    ix->scanned = len;
+  } else {
+    ix->cap_marks = 64;
+    ix->marks = my_alloc(ix->cap_marks * sizeof(TRE_Off));
+    ix->marks[0] = 0;
+    ix->n_marks = 1;
+  }
+  TRE_LineIdx_init(&ix->lines);
+  pthread_mutex_init(&ix->lock, NULL);
+  pthread_cond_init(&ix->progress, NULL);
+  if (0 == pthread_create(&ix->thread, NULL, index_text, ix)) {
+    ix->threaded = 1;
+  } else {
+    // Without a thread, just count all the lines now.
+    log_warn("Unable to start indexer thread: %s", strerror(errno));
+    index_text(ix);
+  }
+  return ix;
+}
+
+// Free an indexer. If it's still running it's stopped first.
+void TRE_Indexer_free(TRE_Indexer* ix) {
+  pthread_mutex_lock(&ix->lock);
+  ix->cancel = 1;
+  pthread_mutex_unlock(&ix->lock);
+  join_worker(ix);
+  pthread_cond_destroy(&ix->progress);
+  pthread_mutex_destroy(&ix->lock);
+  TRE_LineIdx_free(&ix->lines);
+  if (!ix->seeded) {
+    my_free(ix->marks);
+  }
+  my_free(ix);
+}
+
+// Check whether the worker has finished counting lines.
+int TRE_Indexer_is_done(TRE_Indexer* ix) {
+  pthread_mutex_lock(&ix->lock);
+  int done = ix->done;
+  pthread_mutex_unlock(&ix->lock);
+  return done;
+}
+
+// Get the marks, once the worker has finished: marks[k] is the offset of
+// line k * TRE_INDEXER_STRIDE.
+const TRE_Off* TRE_Indexer_marks(TRE_Indexer* ix, TRE_Off* n_marks) {
+  join_worker(ix);
+  *n_marks = ix->n_marks;
+  return ix->marks;
+}
+
+// Check whether the marks the indexer was started with turned out not to
+// match the text (once the worker has finished). Lookups made before then
+// could have been wrong.
+int TRE_Indexer_seed_was_wrong(TRE_Indexer* ix) {
+  join_worker(ix);
+  return ix->seed_wrong;
+}
+
+// Number of chars scanned so far (which for a loader is also how much of the
+// text has been read in).
+TRE_Off TRE_Indexer_progress(TRE_Indexer* ix) {
+  pthread_mutex_lock(&ix->lock);
+  TRE_Off scanned = ix->done ? ix->len : ix->scanned;
+  pthread_mutex_unlock(&ix->lock);
+  return scanned;
+}
+
+// Get the error (if any) that stopped a loader reading its file: an errno
+// value, or -1 if the file was shorter than expected. The part of the text
+// that wasn't read is filled with nulls (apart from the last newline).
+int TRE_Indexer_load_error(TRE_Indexer* ix) {
+  pthread_mutex_lock(&ix->lock);
+  int load_error = ix->load_error;
+  pthread_mutex_unlock(&ix->lock);
+  return load_error;
+}
+
+// Wait until the text at an offset has been read in, and return how many of
+// the n chars from there can be read now. (Only a loader ever waits.)
+TRE_Off TRE_Indexer_wait_text(TRE_Indexer* ix, TRE_Off off, TRE_Off n) {
+  if (ix->fd < 0) {
+    return n;
+  }
+  pthread_mutex_lock(&ix->lock);
+  while (ix->scanned <= off && !ix->done) {
+    pthread_cond_wait(&ix->progress, &ix->lock);
+  }
+  TRE_Off ready = (ix->done ? ix->len : ix->scanned) - off;
+  pthread_mutex_unlock(&ix->lock);
+  return n < ready ? n : ready;
+}
+
+// Wait until at least n lines have been counted (or all of them have, if
+// there are fewer) and return the number of lines counted.
+TRE_Off TRE_Indexer_wait_lines(TRE_Indexer* ix, TRE_Off n) {
+  pthread_mutex_lock(&ix->lock);
+  while (ix->n_lines < n && !ix->done) {
+    pthread_cond_wait(&ix->progress, &ix->lock);
+  }
+  TRE_Off n_lines = ix->n_lines;
+  pthread_mutex_unlock(&ix->lock);
+  return n_lines;
+}
+
+// Get the line with the given number, waiting for the worker to reach it.
+// The line must exist.
+TRE_Line TRE_Indexer_get_line(TRE_Indexer* ix, TRE_Off num) {
+  assert(num >= 0);
+  pthread_mutex_lock(&ix->lock);
+  while (ix->n_lines <= num && !ix->done) {
+    pthread_cond_wait(&ix->progress, &ix->lock);
+  }
+  assert(num < ix->n_lines);
+  TRE_Off off = ix->marks[num / TRE_INDEXER_STRIDE];
+  pthread_mutex_unlock(&ix->lock);
+  for (TRE_Off n = num % TRE_INDEXER_STRIDE; n > 0; n--) {
+    off = line_end(ix, off);
+  }
+  TRE_Line line;
+  line.num = num;
+  line.off = off;
+  line.len = line_end(ix, off) - off;
+  return line;
+}
+
+// Get the line containing an offset, waiting for the worker to reach it.
+// Offsets past the end of the text give the last line.
+TRE_Line TRE_Indexer_find_offset(TRE_Indexer* ix, TRE_Off off) {
+  if (off >= ix->len) {
+    off = ix->len - 1;
+  }
+  if (off < 0) {
+    off = 0;
+  }
+  pthread_mutex_lock(&ix->lock);
+  while (ix->scanned <= off && !ix->done) {
+    pthread_cond_wait(&ix->progress, &ix->lock);
+  }
+  // Find the last mark at or before the offset.
+  TRE_Off lo = 0, hi = ix->n_marks;
+  while (hi - lo > 1) {
+    TRE_Off mid = lo + (hi - lo) / 2;
+    if (ix->marks[mid] <= off) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  TRE_Line line;
+  line.num = lo * TRE_INDEXER_STRIDE;
+  line.off = ix->marks[lo];
+  pthread_mutex_unlock(&ix->lock);
+  for (;;) {
+    TRE_Off end = line_end_wait(ix, line.off);
+    if (off < end) {
+      line.len = end - line.off;
+      return line;
+    }
+    line.num++;
+    line.off = end;
+  }
+}
+
+// Wait for the worker to finish, then move the line index it built into
+// dest (replacing whatever dest held).
+void TRE_Indexer_finish(TRE_Indexer* ix, TRE_LineIdx* dest) {
+  join_worker(ix);
+  assert(ix->done && !ix->cancel);
+  TRE_LineIdx_free(dest);
+  *dest = ix->lines;
+  TRE_LineIdx_init(&ix->lines);
+}
+
+LOCAL void join_worker(TRE_Indexer* ix) {
+  if (ix->threaded && !ix->joined) {
+    pthread_join(ix->thread, NULL);
+    ix->joined = 1;
+  }
+}
+
+// Offset of the start of the line after the one starting at off.
+LOCAL TRE_Off line_end(const TRE_Indexer* ix, TRE_Off off) {
+  if (off >= ix->avail) {
+    // Only a wrong seeded mark can get here.
+    return ix->len;
+  }
+  const char* nl = TRE_find_newline(ix->text + off, ix->avail - off);
+  return nl ? nl + 1 - ix->text : ix->len;
+}
+
+// Like line_end, but for a loader, wait for the end of the line to be read
+// in. (Lines before the last one scanned are always all there.)
+LOCAL TRE_Off line_end_wait(TRE_Indexer* ix, TRE_Off off) {
+  if (ix->fd < 0) {
+    return line_end(ix, off);
+  }
+  for (;;) {
+    TRE_Off ready = TRE_Indexer_wait_text(ix, off, ix->len - off);
+    TRE_Off limit = off + ready < ix->avail ? off + ready : ix->avail;
+    const char* nl = TRE_find_newline(ix->text + off, limit - off);
+    if (nl) {
+      return nl + 1 - ix->text;
+    } else if (off + ready >= ix->len) {
+      return ix->len;
+    }
+    off = limit;
+  }
+}
+
+// Read the text from the file, from pos up to end. If the file comes up
+// short, the rest is filled with nulls so the text is still the length the
+// buffer expects. Returns the error, or 0.
+LOCAL int load_chunk(TRE_Indexer* ix, TRE_Off pos, TRE_Off end) {
+  while (pos < end) {
+    ssize_t n_read = read(ix->fd, ix->dest + pos, end - pos);
+    if (n_read < 0 && errno == EINTR) {
+      continue;
+    } else if (n_read <= 0) {
+      int error = n_read < 0 ? errno : -1;
+      memset(ix->dest + pos, 0, ix->avail - pos);
+      if (ix->len == ix->avail) {
+        ix->dest[ix->avail - 1] = '\n';
+      }
+      return error;
+    }
+    pos += n_read;
+  }
+  return 0;
+}
+
+// The worker. (This doesn't log anything, because logging is only thread safe
+// once TRE_log_start_async has been called, and a program using buffers
+// might not have called it.) It goes through the text a round at a time.
+// Each round is split into slices that the worker and its helper threads
+// scan at the same time, each listing the lengths of the lines that end in
+// its slice. The worker then joins the lists up in order (a line can start
+// in one slice and end in a later one), adds the lines to the index and
+// publishes its progress.
+LOCAL void* index_text(void* arg) {
+  TRE_Indexer* ix = arg;
+  TRE_LineIdxBuilder builder;
+  TRE_LineIdx_builder_start(&builder, &ix->lines);
+  IndexerPool pool;
+  start_pool(&pool, ix->text);
+  TRE_Off* new_marks = NULL;
+  TRE_Off cap_marks = 0;
+  TRE_Off pos = 0, line_start = 0, n_lines = 0;
+  TRE_Off n_checked = 1;  // seeded marks checked so far
+  int cancel = 0, load_error = 0, seed_wrong = 0;
+  while (pos < ix->len && !cancel) {
+    TRE_Off n_new = 0;
+    // A loader reads a chunk at a time (the reading takes longer than the
+    // scanning); otherwise each thread gets a chunk's worth.
+    TRE_Off round = ix->fd < 0 ? pool.n_threads * TRE_INDEXER_CHUNK
+      : pos == 0 ? TRE_INDEXER_FIRST_CHUNK : TRE_INDEXER_CHUNK;
+    TRE_Off end = ix->avail - pos > round ? pos + round : ix->avail;
+    if (ix->fd >= 0 && !load_error) {
+      load_error = load_chunk(ix, pos, end);
+    }
+    run_round(&pool, pos, end);
+    // Each round can't end more lines than it has chars, plus the last line
+    // if it doesn't end in a newline.
+    TRE_Off max_marks = (end - pos) / TRE_INDEXER_STRIDE + 2;
+    if (max_marks > cap_marks) {
+      cap_marks = max_marks;
+      new_marks = my_realloc(new_marks, cap_marks * sizeof(TRE_Off));
+    }
+    for (int t = 0; t < pool.n_active; t++) {
+      IndexerSlice* slice = &pool.slices[t];
+      for (TRE_Off k = 0; k < slice->n_lens; k++) {
+        TRE_Off line_len = slice->lens[k];
+        if (k == 0) {
+          // The first line might have started in an earlier slice.
+          line_len += slice->start - line_start;
+        }
+        TRE_LineIdx_builder_add(&builder, line_len);
+        line_start += line_len;
+        if (++n_lines % TRE_INDEXER_STRIDE == 0) {
+          new_marks[n_new++] = line_start;
+        }
+      }
+    }
+    pos = end;
+    if (pos == ix->avail && line_start < ix->len) {
+      // The last line doesn't end with a newline in the text.
+      TRE_LineIdx_builder_add(&builder, ix->len - line_start);
+      line_start = pos = ix->len;
+      if (++n_lines % TRE_INDEXER_STRIDE == 0) {
+        new_marks[n_new++] = line_start;
+      }
+    }
+    if (ix->seeded) {
+      // The marks and counts are already published, so just check them.
+      // (Nothing else changes them, so this doesn't need the lock.)
+      for (TRE_Off k = 0; k < n_new; k++, n_checked++) {
+        if (n_checked >= ix->n_marks || ix->marks[n_checked] != new_marks[k]) {
+          seed_wrong = 1;
+        }
+      }
+    }
+    pthread_mutex_lock(&ix->lock);
+    if (!ix->seeded) {
+      if (ix->n_marks + n_new > ix->cap_marks) {
+        while (ix->n_marks + n_new > ix->cap_marks) {
+          ix->cap_marks *= 2;
+        }
+        ix->marks = my_realloc(ix->marks, ix->cap_marks * sizeof(TRE_Off));
+      }
+      memcpy(ix->marks + ix->n_marks, new_marks, n_new * sizeof(TRE_Off));
+      ix->n_marks += n_new;
+      ix->n_lines = n_lines;
+      ix->scanned = pos;
+    }
+    if (load_error && !ix->load_error) {
+      ix->load_error = load_error;
+    }
+    cancel = ix->cancel;
+    pthread_cond_broadcast(&ix->progress);
+    pthread_mutex_unlock(&ix->lock);
+  }
+  stop_pool(&pool);
+  if (new_marks) {
+    my_free(new_marks);
+  }
+  TRE_LineIdx_builder_finish(&builder);
+  if (ix->fd >= 0) {
+    close(ix->fd);
+  }
+  pthread_mutex_lock(&ix->lock);
+  if (ix->seeded && !cancel
+      && (seed_wrong || n_checked != ix->n_marks || n_lines != ix->n_lines)) {
+    ix->seed_wrong = 1;
+  }
+  ix->done = 1;
+  pthread_cond_broadcast(&ix->progress);
+  pthread_mutex_unlock(&ix->lock);
+  return NULL;
+}
+
+// Start the helper threads (as many as there are cores, less the worker,
+// unless TRE_Indexer_set_threads says otherwise). If some can't be started,
+// the rest share their work.
+LOCAL void start_pool(IndexerPool* pool, const char* text) {
+  memset(pool, 0, sizeof(IndexerPool));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (int t = 0; t < TRE_INDEXER_MAX_THREADS; t++) {
+    pool->slices[t].text = text;
+  }
+  pool->n_threads = 1;
+  int n_wanted = TRE_Indexer_get_threads();
+  for (int t = 1; t < n_wanted; t++) {
+    pool->helpers[t].pool = pool;
+    pool->helpers[t].index = t;
+    if (0 != pthread_create(&pool->threads[t], NULL, help_index,
+          &pool->helpers[t])) {
+      break;
+    }
+    pool->n_threads++;
+  }
+}
+
+LOCAL void stop_pool(IndexerPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (int t = 1; t < pool->n_threads; t++) {
+    pthread_join(pool->threads[t], NULL);
+  }
+  for (int t = 0; t < TRE_INDEXER_MAX_THREADS; t++) {
+    if (pool->slices[t].lens) {
+      my_free(pool->slices[t].lens);
+    }
+  }
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+// Scan the text from pos to end, splitting it between the threads. Slices
+// are kept to at least TRE_INDEXER_MIN_SLICE chars, so a short round (like
+// the end of the text) isn't worth waking every thread for.
+LOCAL void run_round(IndexerPool* pool, TRE_Off pos, TRE_Off end) {
+  int n = pool->n_threads;
+  if ((end - pos) / TRE_INDEXER_MIN_SLICE < n) {
+    n = (end - pos) / TRE_INDEXER_MIN_SLICE + 1;
+  }
+  TRE_Off slice_len = (end - pos) / n;
+  for (int t = 0; t < n; t++) {
+    pool->slices[t].start = pos + t * slice_len;
+    pool->slices[t].end = t == n - 1 ? end : pos + (t + 1) * slice_len;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->n_active = n;
+  pool->pending = n - 1;
+  pool->round++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  scan_slice(&pool->slices[0]);
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// A helper thread: scan this thread's slice of each round.
+LOCAL void* help_index(void* arg) {
+  IndexerHelper* helper = arg;
+  IndexerPool* pool = helper->pool;
+  int seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->round == seen && !pool->quit) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->quit) {
+      break;
+    }
+    seen = pool->round;
+    if (helper->index < pool->n_active) {
+      pthread_mutex_unlock(&pool->lock);
+      scan_slice(&pool->slices[helper->index]);
+      pthread_mutex_lock(&pool->lock);
+      if (--pool->pending == 0) {
+        pthread_cond_signal(&pool->done);
+      }
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// List the lengths of the lines that end in a slice. The first is measured
+// from the start of the slice.
+LOCAL void scan_slice(IndexerSlice* slice) {
+  const char* text = slice->text;
+  TRE_Off pos = slice->start, line_start = slice->start;
+  const char* nl;
+  slice->n_lens = 0;
+  while ((nl = TRE_find_newline(text + pos, slice->end - pos))) {
+    pos = nl + 1 - text;
+    if (slice->n_lens == slice->cap_lens) {
+      slice->cap_lens = slice->cap_lens ? slice->cap_lens * 2 : 4096;
+      slice->lens = my_realloc(slice->lens, slice->cap_lens * sizeof(TRE_Off));
+    }
+    slice->lens[slice->n_lens++] = pos - line_start;
+    line_start = pos;
+  }
+}
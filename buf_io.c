@@ -3,22 +3,32 @@
 
 #if INTERFACE
 typedef struct {
-  int line;
-  int col;
+  TRE_Off line;
+  TRE_Off col;
 } line_col_t;
-#endif
 
+// Files at least this big are loaded with TRE_Buf_load_mapped.
+#define TRE_BUF_MAP_THRESHOLD (16 * 1024 * 1024)
+// Smaller files at least this big are loaded with TRE_Buf_load_async.
+#define TRE_BUF_ASYNC_THRESHOLD (1024 * 1024)
+
+// Flags for TRE_Buf_load_with.
+// The file is only a temporary copy of the text (like an evicted buffer's),
+// so no line table is looked up or saved for it.
+#define TRE_BUF_LOAD_NO_LINE_CACHE 1
+
+// Directory (in the home directory) where config files are kept.
 #define TRE_DEFAULT_CONFIG_DIR ".tre"
+#endif
+
 #define TRE_MARK_FILE_NAME "marks"
-#define TRE_SAVED_POSITIONS_FILENAME "fpos"
 
 // Create a new (empty) buffer. Put a newline in it.
 TRE_Buf *TRE_Buf_new(const char *filename) {
   // TODO: It would be much better to attempt to save off data before aborting
   // the program here.
-  TRE_Buf *buf = my_alloc(sizeof(TRE_Buf));
+  TRE_Buf *buf = alloc_buf(filename);
   buf->text.c = my_alloc(TRE_BUFFER_BLOCK_SIZE);
-  buf->filename = my_strdup(filename);
   buf->buf_size = TRE_BUFFER_BLOCK_SIZE;
   buf->gap_start = 0;
   buf->gap_len = TRE_BUFFER_GAP_SIZE - 1;
@@ -26,21 +36,110 @@ TRE_Buf *TRE_Buf_new(const char *filename) {
   buf->text_len = 1;
   buf->n_lines = 1;
   buf->cursor_line.len = 1;
+  TRE_LineIdx_insert(&buf->lines, 0, 1);
+  return buf;
+}
+
+// Free a buffer and everything it owns.
+void TRE_Buf_free(TRE_Buf* buf) {
+  assert(buf != NULL);
+  if (buf->save) {
+    // Don't lose a save that's still being written.
+    TRE_Buf_save_wait(buf);
+  }
+  if (buf->filename) {
+    TRE_Buf_remember_position(buf);
+    my_free(buf->filename);
+  }
+  if (buf->indexer) {
+    TRE_Indexer_free(buf->indexer);
+  }
+  if (buf->line_cache) {
+    // (After the indexer, which can be using its marks.)
+    TRE_LineCache_free(buf->line_cache);
+  }
+  if (buf->pieces) {
+    TRE_Pieces_free(buf->pieces);
+  }
+  if (buf->text.c) {
+    my_free(buf->text.c);
+  }
+  if (buf->map_addr) {
+    unmap_file(buf->map_addr, buf->map_len);
+  }
+  TRE_LineIdx_free(&buf->lines);
+  TRE_Undo_free(&buf->undo);
+  my_free(buf);
+}
+
+// Allocate a buffer structure with all its fields in their initial (empty)
+// state. The caller has to set up the text.
+LOCAL TRE_Buf* alloc_buf(const char* filename) {
+  TRE_Buf *buf = my_alloc(sizeof(TRE_Buf));
+  memset(buf, 0, sizeof(TRE_Buf));
+  buf->filename = filename ? my_strdup(filename) : NULL;
   buf->encoding = TRE_BUF_ENCODING_ASCII;
   buf->col_affinity = -1;
+  TRE_LineIdx_init(&buf->lines);
+  buf->growth = TRE_buf_default_growth_policy;
   return buf;
 }
 
-TRE_Buf* TRE_Buf_load_from_string(const char* src) {
-  // Scan the string once to find its size and count the lines.
-  TRE_Buf *buf = my_alloc(sizeof(TRE_Buf));
-  buf->filename = NULL;
-  if (TRE_FAIL == scan_string(buf, src)) {
-    return TRE_FAIL;
+// Switch a buffer to a different kind of storage, copying its text. The
+// cursor and the line index aren't affected. A gap buffer is best for editing
+// in one place; a piece buffer makes edits anywhere in the text equally cheap
+// (and is what big files are loaded into).
+void TRE_Buf_set_storage(TRE_Buf* buf, TRE_Buf_Storage storage) {
+  if (storage == buf->storage) {
+    return;
+  }
+  // The indexer might still be reading the mapped file, or loading the text.
+  TRE_Buf_finish_indexing(buf);
+  TRE_Off cursor = TRE_Buf_get_cursor_offset(buf);
+  TRE_Buf_before_free_text(buf);
+  if (storage == TRE_BUF_STORAGE_PIECES) {
+    TRE_Pieces* pieces = TRE_Pieces_new(NULL, 0);
+    TRE_Pieces_insert(pieces, 0, buf->text.c, buf->gap_start);
+    TRE_Pieces_insert(pieces, buf->gap_start,
+        buf->text.c + buf->gap_start + buf->gap_len,
+        buf->text_len - buf->gap_start);
+    my_free(buf->text.c);
+    buf->text.c = NULL;
+    buf->buf_size = buf->gap_start = buf->gap_len = 0;
+    buf->pieces = pieces;
+  } else {
+    TRE_Off size = (buf->text_len + buf->growth.min_gap
+        + TRE_BUFFER_BLOCK_SIZE - 1)
+      / TRE_BUFFER_BLOCK_SIZE * TRE_BUFFER_BLOCK_SIZE;
+    char* text = my_alloc(size);
+    TRE_Off gap_len = size - buf->text_len;
+    // Put the gap at the cursor, since that's where the next edit is likely.
+    TRE_Buf_copy_text(buf, 0, text, cursor);
+    TRE_Buf_copy_text(buf, cursor, text + cursor + gap_len,
+        buf->text_len - cursor);
+    TRE_Pieces_free(buf->pieces);
+    buf->pieces = NULL;
+    if (buf->map_addr) {
+      unmap_file(buf->map_addr, buf->map_len);
+      buf->map_addr = NULL;
+      buf->map_len = 0;
+    }
+    buf->text.c = text;
+    buf->buf_size = size;
+    buf->gap_start = cursor;
+    buf->gap_len = gap_len;
   }
-  int buf_size_blocks =
+  buf->storage = storage;
+  logt("Buffer storage changed to %s.",
+      storage == TRE_BUF_STORAGE_PIECES ? "pieces" : "gap");
+}
+
+TRE_Buf* TRE_Buf_load_from_string(const char* src) {
+  TRE_Buf *buf = alloc_buf(NULL);
+  buf->text_len = strlen(src);
+  TRE_Off buf_size_blocks =
     (buf->text_len + TRE_BUFFER_GAP_SIZE) / TRE_BUFFER_BLOCK_SIZE + 1;
-  int bufsize = buf_size_blocks * TRE_BUFFER_BLOCK_SIZE;
+  TRE_Off bufsize = buf_size_blocks * TRE_BUFFER_BLOCK_SIZE;
   buf->buf_size = bufsize;
   // Copy the string into the buffer.
   // TODO: Remove CR characters.
@@ -50,7 +149,8 @@ TRE_Buf* TRE_Buf_load_from_string(const char* src) {
   buf->gap_len = TRE_BUFFER_GAP_SIZE;
   // Handle the buffer copy a little differently depending on whether a newline
   // needs to be added to the end.
-  int needs_newline_added = (src[buf->text_len - 1] != '\n');
+  int needs_newline_added =
+    (buf->text_len == 0 || src[buf->text_len - 1] != '\n');
   if (needs_newline_added) {
     buf->gap_len--;
   }
@@ -58,51 +158,23 @@ TRE_Buf* TRE_Buf_load_from_string(const char* src) {
   if (needs_newline_added) {
     *(buf->text.c + buf->gap_len + buf->text_len) = '\n';
     buf->text_len++;
-    buf->n_lines++;
   }
-  // If this is a single-line file and there was no terminating newline, then
-  // the line length will not have been set correctly. Set it now.
-  if (buf->cursor_line.len == 0) {
-    buf->cursor_line.len = buf->text_len;
-  }
-  // Set col affinity and encoding
-  buf->encoding = TRE_BUF_ENCODING_ASCII;
-  buf->col_affinity = -1;
+  // Index the lines. The cursor starts out on the first line.
+  TRE_LineIdx_build_from_text(&buf->lines, buf->text.c + buf->gap_len,
+      buf->text_len);
+  buf->n_lines = TRE_LineIdx_count(&buf->lines);
+  buf->cursor_line = TRE_LineIdx_get(&buf->lines, 0);
   return buf;
 }
 
-// This function scans the target string incrementally. In other words, it can
-// be called repeatedly to process more text.
-LOCAL TRE_OpResult scan_string(TRE_Buf* buf, const char* str) {
-  while (*str) {
-    if (*str == '\n') {
-      // When the end of a line is reached, check if that line is the one the
-      // cursor is supposed to be on, and if so, record the info about the end
-      // of the cursor line.
-      if (buf->cursor_line.num == buf->n_lines) {
-        buf->cursor_line.len = buf->text_len - buf->cursor_line.off + 1;
-        if (buf->cursor_col >= buf->cursor_line.len) {
-          buf->cursor_col = buf->cursor_line.len - 1;
-        }
-      }
-      // Increment the line count.
-      buf->n_lines++;
-      // At the beginning of a new line, check if it's the cursor line and if
-      // so then note its start point. (If the cursor is in line zero then its
-      // offset is already set to zero so nothing needs to be done.)
-      if (buf->cursor_line.num == buf->n_lines) {
-        buf->cursor_line.off = buf->text_len + 1;
-      }
-    }
-    buf->text_len++;
-    str++;
-  }
-  return TRE_SUCC;
-}
-
 // TODO: Save/load last file position.
 // TODO: Strip CR chars from file as it loads.
 TRE_Buf *TRE_Buf_load(const char *filename) {
+  return TRE_Buf_load_with(filename, 0);
+}
+
+// Load a file, with TRE_BUF_LOAD_* flags.
+TRE_Buf* TRE_Buf_load_with(const char* filename, int flags) {
   struct stat fstat_buf;
   int fd = open(filename, O_RDONLY);
   if (fd == -1) {
@@ -110,205 +182,301 @@ TRE_Buf *TRE_Buf_load(const char *filename) {
     return NULL;
   }
   fstat(fd, &fstat_buf);
-  off_t file_size = fstat_buf.st_size;
+  TRE_Off file_size = fstat_buf.st_size;
   if (file_size == 0) {
     // Loading an empty file is pretty much like creating a new buffer.
     close(fd);
     logt("Loading empty file.");
     return TRE_Buf_new(filename);
   }
-  else if (file_size > INT_MAX) {
-    log_err("File is too large to open on this system.");
-    return NULL;
+  else if (file_size >= TRE_BUF_MAP_THRESHOLD) {
+    // Big files are mapped instead of being read in.
+    close(fd);
+    return load_mapped(filename, flags);
   }
-  int buf_size_blocks =
+  else if (file_size >= TRE_BUF_ASYNC_THRESHOLD) {
+    close(fd);
+    return TRE_Buf_load_async(filename);
+  }
+  TRE_Off buf_size_blocks =
     (file_size + TRE_BUFFER_GAP_SIZE) / TRE_BUFFER_BLOCK_SIZE + 1;
-  int bufsize = buf_size_blocks * TRE_BUFFER_BLOCK_SIZE;
-  TRE_Buf *buf = my_alloc(sizeof(TRE_Buf));
+  TRE_Off bufsize = buf_size_blocks * TRE_BUFFER_BLOCK_SIZE;
+  TRE_Buf *buf = alloc_buf(filename);
   buf->text.c = my_alloc(bufsize);
-  buf->filename = my_strdup(filename);
   buf->buf_size = bufsize;
   buf->text_len = file_size;
-  // Cursor starts at offset 0.
+  // Text is loaded after the gap, which starts at offset 0.
   buf->gap_start = 0;
   buf->gap_len = TRE_BUFFER_GAP_SIZE;
-  buf->col_affinity = -1;
-  // Whatever line number is set here is searched for below and its bounds will
-  // be saved in buf->cursor_line.
-  line_col_t saved_file_position;
-  if (lookup_file_position(filename, &saved_file_position)) {
-    logt("Using saved file position: %d, %d", saved_file_position.line,
-        saved_file_position.col);
-    buf->cursor_line.num = saved_file_position.line;
-    buf->cursor_col = saved_file_position.col;
-  } else {
-    logt("No saved file position.");
-    buf->cursor_line.num = 0;
-    buf->cursor_col = 0;
-  }
-  buf->n_lines = 0; // This is initialized here, but updated below.
   // Load the file contents into the buffer. (The call to read isn't guaranteed
   // to return all the requested data the first time it's called.)
-  int n_read_total = 0;
-  int insert_pos = buf->gap_start + buf->gap_len;
+  TRE_Off n_read_total = 0;
+  TRE_Off insert_pos = buf->gap_start + buf->gap_len;
   do {
     // Read as much as possible from the file in one go
-    ssize_t n_read = read(fd, buf->text.c + insert_pos, file_size);
+    ssize_t n_read = read(fd, buf->text.c + insert_pos,
+        file_size - n_read_total);
     if (n_read == -1) {
       log_err("Unable to read file.");
       //TRE_RT_err_msg(rt, "Unable to read file.");
       close(fd);
+      TRE_Buf_free(buf);
       return NULL;
-    }
-    // Count the lines in the portion just read.
-    // TODO: While we're at it, find the position for the cursor.
-    // (But for now we don't remember cursor position.)
-    for (int i=0; i < n_read; i++) {
-      if ('\n' == *(buf->text.c + insert_pos + i)) {
-        // If this ends the line containing the cursor, calculate the line length.
-        if (buf->n_lines == buf->cursor_line.num) {
-          int next_line_begin_pos = n_read_total + i + 1;
-          buf->cursor_line.len = next_line_begin_pos - buf->cursor_line.off;
-        }
-        // Keep track of total lines in the file.
-        buf->n_lines++;
-        // If this begins the line containing the cursor, save the offset.
-        if (buf->n_lines == buf->cursor_line.num) {
-          int line_begin_pos = n_read_total + i + 1;
-          buf->cursor_line.off = line_begin_pos;
-        }
-      }
+    } else if (n_read == 0) {
+      // The file got shorter since we checked its size.
+      buf->text_len = n_read_total;
+      break;
     }
     // Update counts
     n_read_total += n_read;
     insert_pos += n_read;
   } while (n_read_total < file_size);
+  close(fd);
+  buf->file_len = buf->text_len;
   // If the file isn't newline-terminated, add a newline at the end.
-  if (buf->text.c[buf->text_len + buf->gap_len - 1] != '\n') {
+  if (buf->text_len == 0
+      || buf->text.c[buf->text_len + buf->gap_len - 1] != '\n') {
     buf->text.c[++buf->text_len + buf->gap_len - 1] = '\n';
-    buf->n_lines++;
   }
-  // Make sure the cursor line/col are in bounds
-  if (buf->cursor_line.num >= buf->n_lines) {
+  // Index the lines.
+  TRE_LineIdx_build_from_text(&buf->lines, buf->text.c + buf->gap_len,
+      buf->text_len);
+  buf->n_lines = TRE_LineIdx_count(&buf->lines);
+  restore_file_position(buf, filename);
+  logt("File loaded: %s", filename);
+  return buf;
+}
+
+// Load a file in the background. The buffer is a gap buffer like the one
+// TRE_Buf_load makes, but it's returned once the text up to the saved cursor
+// position has been read; the indexer reads the rest on its own thread,
+// counting lines as it goes. Reading text that hasn't arrived yet waits for
+// it, and the first edit waits for the whole file. TRE_Buf_loaded tells how
+// far the load has got.
+TRE_Buf* TRE_Buf_load_async(const char* filename) {
+  struct stat fstat_buf;
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  if (-1 == fstat(fd, &fstat_buf)) {
+    log_err("Unable to stat file '%s': %s", filename, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  TRE_Off file_size = fstat_buf.st_size;
+  char last;
+  if (file_size == 0) {
+    close(fd);
+    logt("Loading empty file.");
+    return TRE_Buf_new(filename);
+  } else if (1 != pread(fd, &last, 1, file_size - 1)) {
+    log_err("Unable to read file '%s': %s", filename, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  TRE_Off buf_size_blocks =
+    (file_size + TRE_BUFFER_GAP_SIZE) / TRE_BUFFER_BLOCK_SIZE + 1;
+  TRE_Off bufsize = buf_size_blocks * TRE_BUFFER_BLOCK_SIZE;
+  TRE_Buf *buf = alloc_buf(filename);
+  buf->text.c = my_alloc(bufsize);
+  buf->buf_size = bufsize;
+  buf->text_len = file_size;
+  buf->file_len = file_size;
+  // Text is loaded after the gap, which starts at offset 0.
+  buf->gap_start = 0;
+  buf->gap_len = TRE_BUFFER_GAP_SIZE;
+  char* dest = buf->text.c + buf->gap_len;
+  // If the file isn't newline-terminated, add a newline at the end. (It goes
+  // in now, before the text around it is read in.)
+  if (last != '\n') {
+    dest[buf->text_len++] = '\n';
+  }
+  buf->indexer = TRE_Indexer_start_load(fd, dest, file_size, buf->text_len);
+  restore_file_position(buf, filename);
+  logt("File loading: %s (%lld bytes)", filename, file_size);
+  return buf;
+}
+
+// Load a file without reading it in. The file is mapped read-only and becomes
+// the original text of a piece buffer, so edits never write to it, and its
+// lines are counted by a background indexer. The buffer is ready to use
+// straight away, however big the file is; anything that needs a line that
+// hasn't been counted yet waits for the indexer to get to it (unless there's
+// a line table saved from the last time the file was opened, and it still
+// matches, in which case every line can be found at once).
+// (If the file is truncated by another program while it's mapped, reading
+// the missing part will crash the editor, which is why TRE_Follow_start
+// makes a copy.)
+TRE_Buf* TRE_Buf_load_mapped(const char* filename) {
+  return load_mapped(filename, 0);
+}
+
+LOCAL TRE_Buf* load_mapped(const char* filename, int flags) {
+  struct stat fstat_buf;
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  if (-1 == fstat(fd, &fstat_buf)) {
+    log_err("Unable to stat file '%s': %s", filename, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  TRE_Off file_size = fstat_buf.st_size;
+  if (file_size == 0) {
+    close(fd);
+    logt("Loading empty file.");
+    return TRE_Buf_new(filename);
+  } else if ((unsigned long long)file_size > SIZE_MAX) {
+    log_err("File is too large to open on this system.");
+    close(fd);
+    return NULL;
+  }
+  const char* text = map_file(fd, file_size);
+  close(fd);
+  if (!text) {
+    log_err("Unable to map file '%s': %s", filename, strerror(errno));
+    return NULL;
+  }
+  TRE_Buf* buf = alloc_buf(filename);
+  buf->storage = TRE_BUF_STORAGE_PIECES;
+  buf->map_addr = (void*)text;
+  buf->map_len = file_size;
+  buf->pieces = TRE_Pieces_new(text, file_size);
+  buf->text_len = file_size;
+  buf->file_len = file_size;
+  // If the file isn't newline-terminated, add a newline at the end. (The
+  // mapping is read-only, so the newline goes into the piece list.)
+  if (text[file_size - 1] != '\n') {
+    TRE_Buf_store_insert(buf, file_size, "\n", 1);
+  }
+  // If the lines were counted the last time the file was opened, the saved
+  // table lets the cursor go straight back to where it was.
+  if (!(flags & TRE_BUF_LOAD_NO_LINE_CACHE)) {
+    buf->line_cache = TRE_LineCache_open(filename, text, file_size);
+  }
+  if (buf->line_cache && buf->line_cache->marks) {
+    buf->indexer = TRE_Indexer_start_seeded(text, file_size, buf->text_len,
+        buf->line_cache->marks, buf->line_cache->header.n_marks,
+        buf->line_cache->header.n_lines);
+  } else {
+    buf->indexer = TRE_Indexer_start(text, file_size, buf->text_len);
+  }
+  restore_file_position(buf, filename);
+  logt("File mapped: %s (%lld bytes)", filename, file_size);
+  return buf;
+}
+
+// Map a file into memory, read-only. Returns NULL on failure.
+LOCAL void* map_file(int fd, TRE_Off size) {
+#ifndef _WIN32
+  void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  return addr == MAP_FAILED ? NULL : addr;
+#else
+  // There's no mmap here, so read the file into memory instead. Edits still
+  // go to the piece list, and the lines are still counted in the background.
+  char* addr = my_alloc(size);
+  TRE_Off n_read_total = 0;
+  while (n_read_total < size) {
+    ssize_t n_read = read(fd, addr + n_read_total, size - n_read_total);
+    if (n_read <= 0) {
+      my_free(addr);
+      return NULL;
+    }
+    n_read_total += n_read;
+  }
+  return addr;
+#endif
+}
+
+LOCAL void unmap_file(void* addr, TRE_Off size) {
+#ifndef _WIN32
+  munmap(addr, size);
+#else
+  (void)size;
+  my_free(addr);
+#endif
+}
+
+// Put the cursor at the position saved for a file, if there is one, or else
+// at the start of the buffer.
+LOCAL void restore_file_position(TRE_Buf* buf, const char* filename) {
+  line_col_t saved_file_position;
+  if (lookup_file_position(filename, &saved_file_position)) {
+    logt("Using saved file position: %lld, %lld", saved_file_position.line,
+        saved_file_position.col);
+  } else {
+    logt("No saved file position.");
+    saved_file_position.line = 0;
+    saved_file_position.col = 0;
+  }
+  if (saved_file_position.line < 0
+      || saved_file_position.line >= buf->text_len
+      || saved_file_position.line
+        >= TRE_Buf_wait_lines(buf, saved_file_position.line + 1)) {
     // If saved cursor line doesn't exist, put the cursor at the start of the
     // buffer.
-    buf->cursor_line.num = 0;
-    buf->cursor_line.off = 0;
-    for (buf->cursor_line.len = 0;
-        '\n' != buf->text.c[buf->cursor_line.len];
-        buf->cursor_line.len++) {}
+    saved_file_position.line = 0;
+    saved_file_position.col = 0;
+  }
+  buf->cursor_line = TRE_Buf_get_line(buf, saved_file_position.line);
+  buf->cursor_col = saved_file_position.col;
+  if (buf->cursor_col < 0) {
     buf->cursor_col = 0;
   } else if (buf->cursor_col >= buf->cursor_line.len) {
     // If the saved cursor column doesn't exist, put the cursor at the end of
     // the line.
-    buf->cursor_col = buf->cursor_line.len;
+    buf->cursor_col = buf->cursor_line.len - 1;
   }
-  // Set the gap to the cursor position
-  TRE_Buf_move_gap(buf, buf->cursor_line.off + buf->cursor_col);
-  // Assume ASCII as the default (only) encoding for now.
-  buf->encoding = TRE_BUF_ENCODING_ASCII;
-  logt("File loaded: %s", filename);
-  return buf;
 }
 
 LOCAL TRE_OpResult lookup_file_position(const char* filename,
     line_col_t* pos) {
+  TRE_FposStore* store = TRE_fpos_default_store();
   char edited_file_path[PATH_MAX];
-  if (!my_realpath(filename, edited_file_path)) {
-    log_err("File path too long.");
+  if (!store) {
     return TRE_FAIL;
   }
-  char fpos_file_path[PATH_MAX];
-  int path_len = TRE_find_config_file(TRE_SAVED_POSITIONS_FILENAME, fpos_file_path, PATH_MAX);
-  TRE_OpResult result = TRE_FAIL;
-  if (NULL == edited_file_path) {
+  if (!my_realpath(filename, edited_file_path)) {
     log_err("Unable to resolve path to file '%s': %s", filename,
-        strerror(errno)); // FIXME: check errno in TRE_find_config_file
-  } else {
-    if (0 < path_len) {
-      char* fpos_file_contents;
-      const char* error;
-      if (!(fpos_file_contents = my_file_get_contents(fpos_file_path, &error))) {
-        log_err("Error opening fpos file '%s': %s", fpos_file_path, error);
-      } else {
-        if (lookup_fpos_in_cont(edited_file_path, fpos_file_contents, pos)) {
-          result = TRE_SUCC;
-        }
-        my_free(fpos_file_contents);
-      }
-    }
-  }
-  return result;
-}
-
-LOCAL TRE_OpResult lookup_fpos_in_cont(const char* filename,
-    char* fpos_file_contents, line_col_t* file_pos) {
-  logt("Searching for saved position for file: '%s'", filename);
-  TRE_Line line;
-  line.num = -1;
-  line.off = -1;
-  line.len = 0;
-  // Get the first line in the file. It's a file type identifier.
-  if (!next_line_in_buffer(fpos_file_contents, &line)) {
-    log_err("The fpos file is empty.");
+        strerror(errno));
     return TRE_FAIL;
   }
-  if (0 != strcmp(fpos_file_contents + line.off, "TRE_FPOS")) {
-    log_err("The fpos file lacks the expected header line.");
+  if (TRE_FAIL == TRE_FposStore_get(store, edited_file_path, pos)) {
+    logt("Found no saved position for this file.");
     return TRE_FAIL;
   }
-  // Read the file line-by-line. Any parsing failure means the file isn't
-  // valid; we won't attempt to parse it any further.
-  logt("Reading fpos file.");
-  while (next_line_in_buffer(fpos_file_contents, &line)) {
-    char* read_pos = fpos_file_contents + line.off;
-    char* tail;
-    long f_line = strtol(read_pos, &tail, 10);
-    if (f_line == 0 && tail == read_pos) {
-      return TRE_FAIL;
-    }
-    read_pos = tail;
-    long f_col = strtol(read_pos, &tail, 10);
-    if (f_col == 0 && tail == read_pos) {
-      return TRE_FAIL;
-    }
-    read_pos = tail;
-    while (' ' == *read_pos) {
-      read_pos++;
-    }
-    // The remainder of the line should be the filename.
-    logt("Scanned saved file position: %d, %d, '%s'", f_line, f_col, read_pos);
-    if (0 == strcmp(filename, read_pos)) {
-      file_pos->line = f_line;
-      file_pos->col = f_col;
-      logt("Found saved position for this file: %d, %d", f_line, f_col);
-      return TRE_SUCC;
-    }
-  }
-  logt("Found no saved position for this file.");
-  return TRE_FAIL;
+  logt("Found saved position for this file: %lld, %lld", pos->line,
+      pos->col);
+  return TRE_SUCC;
 }
 
-LOCAL int next_line_in_buffer(char* b, TRE_Line* line) {
-  line->num++;
-  line->off += line->len + 1;
-  for (int i = line->off; b[i] != '\0'; i++) {
-    if (b[i] == '\n') {
-      b[i] = '\0';
-      line->len = i - line->off;
-      return 1;
-    }
+// Save the cursor position for the buffer's file, so that it's restored the
+// next time the file is opened.
+void TRE_Buf_remember_position(TRE_Buf* buf) {
+  TRE_FposStore* store = TRE_fpos_default_store();
+  char edited_file_path[PATH_MAX];
+  if (!store || !buf->filename
+      || !my_realpath(buf->filename, edited_file_path)) {
+    return;
   }
-  line->num = -1;
-  return 0;
+  line_col_t pos;
+  pos.line = buf->cursor_line.num;
+  pos.col = buf->cursor_col;
+  TRE_FposStore_put(store, edited_file_path, pos);
 }
 
-// Return the path to the specified config file, if it exists. Returns NULL if
-// the file doesn't exist, otherwise returns a string that must be freed
-// afterward.
-int TRE_find_config_file(const char* filename, char* config_file_path, int config_file_path_len) {
+// Put the path to a config file (which might not exist) in config_file_path.
+// Returns the length of the path, or 0 if there's no home directory or the
+// path is too long.
+int TRE_config_path(const char* filename, char* config_file_path,
+    int config_file_path_len) {
   const char* config_dir = TRE_DEFAULT_CONFIG_DIR;
   const char* home_dir = getenv("HOME");
+  if (!home_dir) {
+    return 0;
+  }
   // FIXME: Implement more flexible string handling here.
   int path_len = snprintf(config_file_path, config_file_path_len,\
                           "%s/%s/%s", home_dir, config_dir, filename);
@@ -316,7 +484,19 @@ int TRE_find_config_file(const char* filename, char* config_file_path, int confi
     logt("Config path too long.\n");
     return 0;
   }
-  logt("Looking for fpos file: %s", config_file_path);
+  return path_len;
+}
+
+// Return the path to the specified config file, if it exists. Returns NULL if
+// the file doesn't exist, otherwise returns a string that must be freed
+// afterward.
+int TRE_find_config_file(const char* filename, char* config_file_path, int config_file_path_len) {
+  int path_len = TRE_config_path(filename, config_file_path,
+      config_file_path_len);
+  if (!path_len) {
+    return 0;
+  }
+  logt("Looking for config file: %s", config_file_path);
   // Check that file exists, and is a regular file. If not, return nothing.
   struct stat statbuf;
   if (-1 == stat(config_file_path, &statbuf)) {
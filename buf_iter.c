@@ -0,0 +1,119 @@
+#include "hdrs.c"
+#include "mh_buf_iter.h"
+
+// Reading a buffer's text in place. The text of a gap buffer is in two
+// blocks of memory (before and after the gap) and the text of a piece buffer
+// is in one block per piece, so code that goes over a range of text (drawing,
+// searching, saving) asks for it a block at a time:
+//
+//   TRE_BufIter it;
+//   const char* text;
+//   TRE_Off len;
+//   TRE_BufIter_init(&it, buf, off, n);
+//   while (TRE_BufIter_next(&it, &text, &len)) {
+//     ... len chars at text ...
+//   }
+//
+// Nothing is copied and the gap isn't moved. The pointers are only good
+// until the buffer is next edited.
+
+#if INTERFACE
+typedef struct {
+  TRE_Buf* buf;
+  TRE_Off block;  // offset of the block returned last
+  TRE_Off off;    // start of the next block
+  TRE_Off end;    // end of the range
+} TRE_BufIter;
+#endif
+
+// Start going over len chars of the text, from an offset.
+void TRE_BufIter_init(TRE_BufIter* it, TRE_Buf* buf, TRE_Off off,
+    TRE_Off len) {
+  assert(off >= 0 && len >= 0 && off + len <= buf->text_len);
+  it->buf = buf;
+  it->block = off;
+  it->off = off;
+  it->end = off + len;
+}
+
+// Get the next block of the range. Returns 0 when there are no more.
+int TRE_BufIter_next(TRE_BufIter* it, const char** text, TRE_Off* len) {
+  if (it->off >= it->end) {
+    return 0;
+  }
+  TRE_Off n = TRE_Buf_span_at(it->buf, it->off, text);
+  if (n > it->end - it->off) {
+    n = it->end - it->off;
+  }
+  *len = n;
+  it->block = it->off;
+  it->off += n;
+  return 1;
+}
+
+// Find the first occurrence of a string at or after an offset. Returns its
+// offset, or -1 if it isn't there. Each block is searched where it is; only
+// a match that crosses from one block to the next is checked by copying the
+// few chars around the boundary.
+TRE_Off TRE_Buf_search(TRE_Buf* buf, TRE_Off from, const char* pat,
+    TRE_Off pat_len) {
+  assert(pat_len > 0);
+  if (from < 0 || from + pat_len > buf->text_len) {
+    return -1;
+  }
+  // Chars either side of a block boundary that a match could cover.
+  char* window = pat_len > 1 ? my_alloc(2 * (pat_len - 1)) : NULL;
+  TRE_Off found = -1;
+  TRE_BufIter it;
+  const char* text;
+  TRE_Off len;
+  TRE_BufIter_init(&it, buf, from, buf->text_len - from);
+  while (found < 0 && TRE_BufIter_next(&it, &text, &len)) {
+    TRE_Off off = it.block;
+    if (window && off > from) {
+      // Matches that start in earlier blocks and end in this one.
+      TRE_Off w_start = off - (pat_len - 1);
+      if (w_start < from) {
+        w_start = from;
+      }
+      TRE_Off w_end = off + pat_len - 1;
+      if (w_end > buf->text_len) {
+        w_end = buf->text_len;
+      }
+      TRE_Buf_copy_text(buf, w_start, window, w_end - w_start);
+      const char* m = find_bytes(window, w_end - w_start, pat, pat_len);
+      if (m && w_start + (m - window) < off) {
+        found = w_start + (m - window);
+        break;
+      }
+    }
+    const char* m = find_bytes(text, len, pat, pat_len);
+    if (m) {
+      found = off + (m - text);
+    }
+  }
+  if (window) {
+    my_free(window);
+  }
+  return found;
+}
+
+// Find a string in a block of memory. (memmem isn't standard C.)
+LOCAL const char* find_bytes(const char* p, TRE_Off len, const char* pat,
+    TRE_Off pat_len) {
+  if (len < pat_len) {
+    return NULL;
+  }
+  const char* end = p + len - pat_len + 1;
+  while (p < end) {
+    p = memchr(p, pat[0], end - p);
+    if (!p) {
+      return NULL;
+    }
+    if (0 == memcmp(p, pat, pat_len)) {
+      return p;
+    }
+    p++;
+  }
+  return NULL;
+}
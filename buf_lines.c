@@ -0,0 +1,602 @@
+#include "hdrs.c"
+#include "mh_buf_lines.h"
+
+// The line index records the length of every line in a buffer so that the
+// buffer code can go from a line number to an offset (or the other way around)
+// without scanning the text for newlines.
+//
+// Line lengths are stored in blocks of up to TRE_LINE_BLOCK_SIZE lines. The
+// blocks are kept in order in an implicit treap (a randomized balanced binary
+// tree that is ordered by position rather than by key). Every block keeps
+// totals for its subtree: number of blocks, number of lines and number of
+// chars. Finding a line by number or by offset is a walk down the tree
+// followed by a short scan within one block, so it's O(log n). Edits update
+// the totals along the same path.
+//
+// Blocks live in a pool and refer to each other by their index in the pool
+// rather than by pointer, so the pool can be reallocated as it grows. Block 0
+// is a sentinel meaning "no block"; its totals are always zero, which saves a
+// lot of null checks.
+
+#if INTERFACE
+// Number of line lengths stored in each block of the line index.
+#define TRE_LINE_BLOCK_SIZE 128
+
+typedef struct {
+  int left;       // left child in the treap (0 if none)
+  int right;      // right child in the treap (0 if none)
+  unsigned prio;  // treap priority (parents have priority >= children)
+  int n;          // number of lines in this block
+  int sub_blocks; // number of blocks in this subtree
+  TRE_Off sum;    // total length of the lines in this block
+  TRE_Off sub_n;  // number of lines in this subtree
+  TRE_Off sub_sum; // total length of the lines in this subtree
+  TRE_Off lens[TRE_LINE_BLOCK_SIZE]; // lengths of the lines (incl. newline)
+} TRE_LineBlock;
+
+typedef struct {
+  TRE_LineBlock* blocks; // block pool (block 0 is the "no block" sentinel)
+  int n_blocks;   // number of pool entries in use, including the sentinel
+  int cap;        // number of pool entries allocated
+  int free_list;  // released blocks, chained through their left field
+  int root;       // root block of the treap (0 if the index is empty)
+  unsigned seed;  // state of the priority generator
+} TRE_LineIdx;
+
+// Blocks built in bulk are only filled to this level so that lines can be
+// inserted into them later without splitting them right away.
+#define TRE_LINE_BLOCK_FILL (TRE_LINE_BLOCK_SIZE * 3 / 4)
+
+// Builds an index one line at a time, in order. (This is faster than
+// inserting the lines one by one, and produces a balanced tree.)
+typedef struct {
+  TRE_LineIdx* idx;
+  int* ids;    // blocks created so far, in order
+  int n_ids;
+  int cap_ids;
+  TRE_Off lens[TRE_LINE_BLOCK_FILL]; // lines not yet put into a block
+  int n;
+} TRE_LineIdxBuilder;
+#endif
+
+// Bulk inserts of fewer lines than this are done one line at a time.
+#define LINE_BULK_THRESHOLD 8
+
+#define BLK(idx, i) (&(idx)->blocks[i])
+
+void TRE_LineIdx_init(TRE_LineIdx* idx) {
+  idx->cap = 16;
+  idx->blocks = my_alloc(idx->cap * sizeof(TRE_LineBlock));
+  memset(&idx->blocks[0], 0, sizeof(TRE_LineBlock));
+  idx->n_blocks = 1;
+  idx->free_list = 0;
+  idx->root = 0;
+  idx->seed = 0x9e3779b9u;
+}
+
+void TRE_LineIdx_free(TRE_LineIdx* idx) {
+  if (idx->blocks) {
+    my_free(idx->blocks);
+  }
+  idx->blocks = NULL;
+  idx->n_blocks = idx->cap = 0;
+  idx->free_list = idx->root = 0;
+}
+
+// Remove all lines from the index.
+void TRE_LineIdx_clear(TRE_LineIdx* idx) {
+  idx->n_blocks = 1;
+  idx->free_list = 0;
+  idx->root = 0;
+}
+
+// Number of lines in the index.
+TRE_Off TRE_LineIdx_count(const TRE_LineIdx* idx) {
+  return BLK(idx, idx->root)->sub_n;
+}
+
+// Total length of all the lines in the index.
+TRE_Off TRE_LineIdx_length(const TRE_LineIdx* idx) {
+  return BLK(idx, idx->root)->sub_sum;
+}
+
+// Bytes of memory the index has allocated.
+TRE_Off TRE_LineIdx_memory(const TRE_LineIdx* idx) {
+  return idx->cap * (TRE_Off)sizeof(TRE_LineBlock);
+}
+
+// Replace the contents of the index with the given line lengths.
+void TRE_LineIdx_build(TRE_LineIdx* idx, const TRE_Off* lens, TRE_Off n) {
+  TRE_LineIdx_clear(idx);
+  idx->root = build_tree(idx, lens, n);
+}
+
+// Replace the contents of the index with the lines found in a block of text.
+// If the text doesn't end with a newline, the remainder after the last
+// newline counts as a line.
+void TRE_LineIdx_build_from_text(TRE_LineIdx* idx, const char* text,
+    TRE_Off len) {
+  TRE_LineIdxBuilder builder;
+  TRE_LineIdx_builder_start(&builder, idx);
+  const char* end = text + len;
+  const char* p = text;
+  while (p < end) {
+    const char* nl = TRE_find_newline(p, end - p);
+    const char* line_end = nl ? nl + 1 : end;
+    TRE_LineIdx_builder_add(&builder, line_end - p);
+    p = line_end;
+  }
+  TRE_LineIdx_builder_finish(&builder);
+}
+
+// Start building the contents of an index. Whatever the index holds now is
+// discarded. Lines are added with TRE_LineIdx_builder_add, and the index
+// can't be used until TRE_LineIdx_builder_finish is called.
+void TRE_LineIdx_builder_start(TRE_LineIdxBuilder* builder,
+    TRE_LineIdx* idx) {
+  TRE_LineIdx_clear(idx);
+  builder_init(builder, idx);
+}
+
+// Add the next line to an index that's being built.
+void TRE_LineIdx_builder_add(TRE_LineIdxBuilder* builder, TRE_Off len) {
+  builder->lens[builder->n++] = len;
+  if (builder->n == TRE_LINE_BLOCK_FILL) {
+    flush_builder(builder);
+  }
+}
+
+// Finish building an index.
+void TRE_LineIdx_builder_finish(TRE_LineIdxBuilder* builder) {
+  builder->idx->root = builder_link(builder);
+}
+
+// Look up a line by number. The line number must be in range.
+TRE_Line TRE_LineIdx_get(const TRE_LineIdx* idx, TRE_Off num) {
+  TRE_Line line;
+  int ord, local;
+  assert(num >= 0 && num < TRE_LineIdx_count(idx));
+  int b = locate_line(idx, num, &ord, &local, &line.off);
+  line.num = num;
+  line.len = BLK(idx, b)->lens[local];
+  return line;
+}
+
+// Find the line that contains the given offset. Offsets past the end of the
+// text are treated as belonging to the last line.
+TRE_Line TRE_LineIdx_find_offset(const TRE_LineIdx* idx, TRE_Off off) {
+  TRE_Line line;
+  int t = idx->root;
+  assert(t != 0);
+  if (off >= TRE_LineIdx_length(idx)) {
+    return TRE_LineIdx_get(idx, TRE_LineIdx_count(idx) - 1);
+  }
+  line.num = 0;
+  line.off = 0;
+  while (t) {
+    const TRE_LineBlock* b = BLK(idx, t);
+    const TRE_LineBlock* l = BLK(idx, b->left);
+    if (off < l->sub_sum) {
+      t = b->left;
+      continue;
+    }
+    off -= l->sub_sum;
+    line.off += l->sub_sum;
+    line.num += l->sub_n;
+    if (off < b->sum) {
+      int i = 0;
+      while (off >= b->lens[i]) {
+        off -= b->lens[i];
+        line.off += b->lens[i];
+        i++;
+      }
+      line.num += i;
+      line.len = b->lens[i];
+      return line;
+    }
+    off -= b->sum;
+    line.off += b->sum;
+    line.num += b->n;
+    t = b->right;
+  }
+  assert(0); // unreachable as long as the totals are consistent
+  return line;
+}
+
+// Change the length of a line by the given amount.
+void TRE_LineIdx_add_len(TRE_LineIdx* idx, TRE_Off num, TRE_Off delta) {
+  int t = idx->root;
+  assert(num >= 0 && num < TRE_LineIdx_count(idx));
+  while (t) {
+    TRE_LineBlock* b = BLK(idx, t);
+    TRE_LineBlock* l = BLK(idx, b->left);
+    b->sub_sum += delta;
+    if (num < l->sub_n) {
+      t = b->left;
+      continue;
+    }
+    num -= l->sub_n;
+    if (num < b->n) {
+      b->lens[num] += delta;
+      b->sum += delta;
+      return;
+    }
+    num -= b->n;
+    t = b->right;
+  }
+}
+
+// Set the length of a line.
+void TRE_LineIdx_set_len(TRE_LineIdx* idx, TRE_Off num, TRE_Off len) {
+  TRE_LineIdx_add_len(idx, num, len - TRE_LineIdx_get(idx, num).len);
+}
+
+// Insert a new line so that it becomes line number num. (Passing the line
+// count as num appends the line.)
+void TRE_LineIdx_insert(TRE_LineIdx* idx, TRE_Off num, TRE_Off len) {
+  TRE_Off count = TRE_LineIdx_count(idx);
+  TRE_Off off;
+  int ord, local;
+  assert(num >= 0 && num <= count);
+  if (count == 0) {
+    int b = alloc_block(idx);
+    BLK(idx, b)->lens[0] = len;
+    BLK(idx, b)->n = 1;
+    BLK(idx, b)->sum = len;
+    pull(idx, b);
+    idx->root = b;
+    return;
+  }
+  // Find the block the line goes into. Appending goes at the end of the last
+  // block, anything else goes in front of the line that is there now.
+  TRE_Off target = num < count ? num : count - 1;
+  int b = locate_line(idx, target, &ord, &local, &off);
+  if (BLK(idx, b)->n == TRE_LINE_BLOCK_SIZE) {
+    split_block(idx, ord, TRE_LINE_BLOCK_SIZE / 2);
+    b = locate_line(idx, target, &ord, &local, &off);
+  }
+  if (num == count) {
+    local++;
+  }
+  adjust_path(idx, ord, 1, len);
+  TRE_LineBlock* blk = BLK(idx, b);
+  memmove(blk->lens + local + 1, blk->lens + local,
+      (blk->n - local) * sizeof(TRE_Off));
+  blk->lens[local] = len;
+  blk->n++;
+  blk->sum += len;
+}
+
+// Insert several lines at once, so that the first of them becomes line number
+// num.
+void TRE_LineIdx_insert_many(TRE_LineIdx* idx, TRE_Off num,
+    const TRE_Off* lens, TRE_Off n) {
+  assert(num >= 0 && num <= TRE_LineIdx_count(idx));
+  if (n < LINE_BULK_THRESHOLD) {
+    for (TRE_Off i = 0; i < n; i++) {
+      TRE_LineIdx_insert(idx, num + i, lens[i]);
+    }
+    return;
+  }
+  int left, right;
+  int ord = cut_before(idx, num);
+  split(idx, idx->root, ord, &left, &right);
+  int middle = build_tree(idx, lens, n);
+  idx->root = merge(idx, merge(idx, left, middle), right);
+}
+
+// Remove a line from the index.
+void TRE_LineIdx_remove(TRE_LineIdx* idx, TRE_Off num) {
+  TRE_Off off;
+  int ord, local;
+  int b = locate_line(idx, num, &ord, &local, &off);
+  TRE_LineBlock* blk = BLK(idx, b);
+  if (blk->n == 1) {
+    // Removing the only line in the block: unlink the whole block.
+    int left, mid, right;
+    split(idx, idx->root, ord, &left, &mid);
+    split(idx, mid, 1, &mid, &right);
+    release_block(idx, mid);
+    idx->root = merge(idx, left, right);
+    return;
+  }
+  TRE_Off len = blk->lens[local];
+  adjust_path(idx, ord, -1, -len);
+  blk = BLK(idx, b);
+  memmove(blk->lens + local, blk->lens + local + 1,
+      (blk->n - local - 1) * sizeof(TRE_Off));
+  blk->n--;
+  blk->sum -= len;
+}
+
+// Remove n consecutive lines starting at line number num.
+void TRE_LineIdx_remove_range(TRE_LineIdx* idx, TRE_Off num, TRE_Off n) {
+  assert(num >= 0 && n >= 0 && num + n <= TRE_LineIdx_count(idx));
+  if (n < LINE_BULK_THRESHOLD) {
+    for (TRE_Off i = 0; i < n; i++) {
+      TRE_LineIdx_remove(idx, num);
+    }
+    return;
+  }
+  int left, mid, right;
+  int ord_first = cut_before(idx, num);
+  int ord_end = cut_before(idx, num + n);
+  split(idx, idx->root, ord_first, &left, &mid);
+  split(idx, mid, ord_end - ord_first, &mid, &right);
+  release_tree(idx, mid);
+  idx->root = merge(idx, left, right);
+}
+
+// Find the block holding line num. Returns the block and fills in its
+// position among the blocks, the line's position within the block, and the
+// offset of the start of the line.
+LOCAL int locate_line(const TRE_LineIdx* idx, TRE_Off num, int* ordinal,
+    int* local, TRE_Off* off) {
+  int t = idx->root;
+  int ord = 0;
+  TRE_Off o = 0;
+  while (t) {
+    const TRE_LineBlock* b = BLK(idx, t);
+    const TRE_LineBlock* l = BLK(idx, b->left);
+    if (num < l->sub_n) {
+      t = b->left;
+      continue;
+    }
+    num -= l->sub_n;
+    o += l->sub_sum;
+    ord += l->sub_blocks;
+    if (num < b->n) {
+      for (int i = 0; i < num; i++) {
+        o += b->lens[i];
+      }
+      *ordinal = ord;
+      *local = (int)num;
+      *off = o;
+      return t;
+    }
+    num -= b->n;
+    o += b->sum;
+    ord++;
+    t = b->right;
+  }
+  return 0;
+}
+
+// Add to the line and char totals of every block on the path from the root to
+// the block at the given position. (This includes the block itself, whose own
+// counts have to be updated by the caller.)
+LOCAL void adjust_path(TRE_LineIdx* idx, int ordinal, TRE_Off d_lines,
+    TRE_Off d_chars) {
+  int t = idx->root;
+  while (t) {
+    TRE_LineBlock* b = BLK(idx, t);
+    int left_blocks = BLK(idx, b->left)->sub_blocks;
+    b->sub_n += d_lines;
+    b->sub_sum += d_chars;
+    if (ordinal < left_blocks) {
+      t = b->left;
+    } else if (ordinal == left_blocks) {
+      return;
+    } else {
+      ordinal -= left_blocks + 1;
+      t = b->right;
+    }
+  }
+}
+
+// Make sure that line num is the first line of a block, splitting the block
+// that contains it if necessary. Returns the position of that block among the
+// blocks (or the number of blocks, if num is the line count).
+LOCAL int cut_before(TRE_LineIdx* idx, TRE_Off num) {
+  TRE_Off off;
+  int ord, local;
+  if (num == TRE_LineIdx_count(idx)) {
+    return BLK(idx, idx->root)->sub_blocks;
+  }
+  locate_line(idx, num, &ord, &local, &off);
+  if (local == 0) {
+    return ord;
+  }
+  split_block(idx, ord, local);
+  return ord + 1;
+}
+
+// Split the block at the given position in two. The first `at` lines stay
+// where they are, and the rest move into a new block that follows it.
+LOCAL void split_block(TRE_LineIdx* idx, int ordinal, int at) {
+  int left, mid, right;
+  split(idx, idx->root, ordinal, &left, &mid);
+  split(idx, mid, 1, &mid, &right);
+  int fresh = alloc_block(idx); // may move the pool
+  TRE_LineBlock* old_blk = BLK(idx, mid);
+  TRE_LineBlock* new_blk = BLK(idx, fresh);
+  new_blk->n = old_blk->n - at;
+  memcpy(new_blk->lens, old_blk->lens + at, new_blk->n * sizeof(TRE_Off));
+  new_blk->sum = 0;
+  for (int i = 0; i < new_blk->n; i++) {
+    new_blk->sum += new_blk->lens[i];
+  }
+  old_blk->n = at;
+  old_blk->sum -= new_blk->sum;
+  pull(idx, mid);
+  pull(idx, fresh);
+  idx->root = merge(idx, merge(idx, left, mid), merge(idx, fresh, right));
+}
+
+// Recompute the subtree totals of a block from its children.
+LOCAL void pull(TRE_LineIdx* idx, int t) {
+  TRE_LineBlock* b = BLK(idx, t);
+  const TRE_LineBlock* l = BLK(idx, b->left);
+  const TRE_LineBlock* r = BLK(idx, b->right);
+  b->sub_blocks = l->sub_blocks + r->sub_blocks + 1;
+  b->sub_n = l->sub_n + r->sub_n + b->n;
+  b->sub_sum = l->sub_sum + r->sub_sum + b->sum;
+}
+
+// Join two treaps, where every block in a comes before every block in b.
+LOCAL int merge(TRE_LineIdx* idx, int a, int b) {
+  if (!a) {
+    return b;
+  }
+  if (!b) {
+    return a;
+  }
+  if (BLK(idx, a)->prio >= BLK(idx, b)->prio) {
+    int r = merge(idx, BLK(idx, a)->right, b);
+    BLK(idx, a)->right = r;
+    pull(idx, a);
+    return a;
+  } else {
+    int l = merge(idx, a, BLK(idx, b)->left);
+    BLK(idx, b)->left = l;
+    pull(idx, b);
+    return b;
+  }
+}
+
+// Split a treap into one holding its first k blocks and one holding the rest.
+LOCAL void split(TRE_LineIdx* idx, int t, int k, int* out_left,
+    int* out_right) {
+  if (!t) {
+    *out_left = *out_right = 0;
+    return;
+  }
+  TRE_LineBlock* b = BLK(idx, t);
+  int left_blocks = BLK(idx, b->left)->sub_blocks;
+  if (k <= left_blocks) {
+    split(idx, b->left, k, out_left, &b->left);
+    *out_right = t;
+  } else {
+    split(idx, b->right, k - left_blocks - 1, &b->right, out_right);
+    *out_left = t;
+  }
+  pull(idx, t);
+}
+
+// Build a balanced treap out of a sequence of line lengths, and return its
+// root. (The treap isn't attached to the index.)
+LOCAL int build_tree(TRE_LineIdx* idx, const TRE_Off* lens, TRE_Off n) {
+  TRE_LineIdxBuilder builder;
+  builder_init(&builder, idx);
+  for (TRE_Off i = 0; i < n; i++) {
+    TRE_LineIdx_builder_add(&builder, lens[i]);
+  }
+  return builder_link(&builder);
+}
+
+LOCAL void builder_init(TRE_LineIdxBuilder* builder, TRE_LineIdx* idx) {
+  builder->idx = idx;
+  builder->ids = NULL;
+  builder->n_ids = 0;
+  builder->cap_ids = 0;
+  builder->n = 0;
+}
+
+// Link all the blocks a builder has made into a treap, and return its root.
+LOCAL int builder_link(TRE_LineIdxBuilder* builder) {
+  flush_builder(builder);
+  int root = link_balanced(builder->idx, builder->ids, builder->n_ids, NULL);
+  if (builder->ids) {
+    my_free(builder->ids);
+  }
+  builder->ids = NULL;
+  builder->n_ids = builder->cap_ids = 0;
+  return root;
+}
+
+// Put the lines that have been added to a builder since the last flush into
+// a new block.
+LOCAL void flush_builder(TRE_LineIdxBuilder* builder) {
+  if (builder->n == 0) {
+    return;
+  }
+  if (builder->n_ids == builder->cap_ids) {
+    builder->cap_ids = builder->cap_ids ? builder->cap_ids * 2 : 16;
+    builder->ids = my_realloc(builder->ids, builder->cap_ids * sizeof(int));
+  }
+  int t = alloc_block(builder->idx);
+  TRE_LineBlock* b = BLK(builder->idx, t);
+  memcpy(b->lens, builder->lens, builder->n * sizeof(TRE_Off));
+  b->n = builder->n;
+  b->sum = 0;
+  for (int i = 0; i < b->n; i++) {
+    b->sum += b->lens[i];
+  }
+  builder->ids[builder->n_ids++] = t;
+  builder->n = 0;
+}
+
+// Link a run of blocks into a perfectly balanced tree. Priorities are assigned
+// by height (taller subtrees get higher bands) so that the result is a valid
+// treap without any rotations.
+LOCAL int link_balanced(TRE_LineIdx* idx, const int* ids, int n,
+    int* height) {
+  int h_left, h_right;
+  if (n == 0) {
+    if (height) {
+      *height = 0;
+    }
+    return 0;
+  }
+  int mid = n / 2;
+  int t = ids[mid];
+  int l = link_balanced(idx, ids, mid, &h_left);
+  int r = link_balanced(idx, ids + mid + 1, n - mid - 1, &h_right);
+  int h = (h_left > h_right ? h_left : h_right) + 1;
+  TRE_LineBlock* b = BLK(idx, t);
+  b->left = l;
+  b->right = r;
+  b->prio = ((unsigned)(h < 63 ? h : 63) << 26) | (next_prio(idx) >> 6);
+  pull(idx, t);
+  if (height) {
+    *height = h;
+  }
+  return t;
+}
+
+LOCAL int alloc_block(TRE_LineIdx* idx) {
+  int t;
+  if (idx->free_list) {
+    t = idx->free_list;
+    idx->free_list = BLK(idx, t)->left;
+  } else {
+    if (idx->n_blocks == idx->cap) {
+      idx->cap *= 2;
+      idx->blocks = my_realloc(idx->blocks, idx->cap * sizeof(TRE_LineBlock));
+    }
+    t = idx->n_blocks++;
+  }
+  TRE_LineBlock* b = BLK(idx, t);
+  b->left = b->right = 0;
+  b->prio = next_prio(idx);
+  b->n = 0;
+  b->sum = 0;
+  pull(idx, t);
+  return t;
+}
+
+LOCAL void release_block(TRE_LineIdx* idx, int t) {
+  BLK(idx, t)->left = idx->free_list;
+  idx->free_list = t;
+}
+
+LOCAL void release_tree(TRE_LineIdx* idx, int t) {
+  if (t) {
+    int l = BLK(idx, t)->left;
+    int r = BLK(idx, t)->right;
+    release_tree(idx, l);
+    release_tree(idx, r);
+    release_block(idx, t);
+  }
+}
+
+// Xorshift generator for treap priorities. (Quality doesn't matter much here,
+// and a fixed seed keeps the tree shape reproducible between runs.)
+LOCAL unsigned next_prio(TRE_LineIdx* idx) {
+  unsigned x = idx->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  idx->seed = x;
+  return x;
+}
@@ -6,6 +6,10 @@
 
 #if INTERFACE
 
+// Offsets, lengths and line numbers in a buffer. These are 64 bits wide so
+// that files larger than 2 GB can be opened.
+typedef long long TRE_Off;
+
 // Type representing return values of operations that can succeed
 // or fail.
 enum TRE_OpResult {
@@ -21,30 +25,88 @@ typedef struct {
   char buf[TRE_BUF_OUTPUT_BUFFER_LEN];
 } TRE_Buf_OutputBuffer;
 
+// Up to two pieces of a buffer's text, read in place (see
+// TRE_Buf_get_range).
+typedef struct {
+  const char* text[2];
+  TRE_Off len[2];
+  int n;
+} TRE_TextRange;
+
 typedef struct TRE_Line {
-  int num; // line number of this line
-  int off; // offset of first char in the line from start of file
-  int len; // length of line (including newline)
+  TRE_Off num; // line number of this line
+  TRE_Off off; // offset of first char in the line from start of file
+  TRE_Off len; // length of line (including newline)
 } TRE_Line;
 
+// Controls how a buffer's allocation grows when the gap runs out of room.
+typedef struct {
+  // The allocation grows by a factor of growth_num / growth_den (but always
+  // at least enough to fit the request)...
+  int growth_num;
+  int growth_den;
+  // ...and by no more than max_step bytes at a time (0 means no limit).
+  int max_step;
+  // Bounds on the size of a gap when it gets created or enlarged.
+  int min_gap;
+  int max_gap;
+  // If set, new gaps are sized to match the amount of text inserted since the
+  // gap was last enlarged (within min_gap and max_gap). Otherwise new gaps are
+  // always min_gap.
+  int adaptive;
+  // TRE_Buf_compact leaves the allocation alone unless the unused space is
+  // larger than this.
+  int max_slack;
+} TRE_Buf_GrowthPolicy;
+
+// Counters for memory management work done by a buffer.
+typedef struct {
+  long n_reallocs;       // times the text allocation was resized
+  long n_compactions;    // times the allocation was trimmed
+  long long bytes_moved; // bytes moved by memmove (gap moves and resizes)
+} TRE_Buf_Stats;
+
 typedef struct {
   // The filename string will be freed when the buffer is destroyed.
   char *filename;  // name of disk file for buffer (NULL if none)
+  TRE_Off file_len; // bytes of the file the text came from (loaded or saved)
+  // How the text is stored. Gap buffers use the text and gap fields; piece
+  // buffers keep their text in `pieces` and leave those fields empty.
+  TRE_Buf_Storage storage;
   // This type supports other char types, but for now only char is used.
   union { // the actual text buffer, which can use different pointer types
     char *c;
     uint16_t *wc;
     uint32_t *wc32;
   } text;
-  int buf_size;    // space actually allocated for the buffer currently
-  int text_len;    // length of text in chars (excluding gap)
-  int gap_start;   // offset of the start of the gap
-  int gap_len;     // length of the gap
-  int n_lines;     // total number of lines in text
-  int encoding;    // determines char width
-  int cursor_col;  // cursor position, column
-  int col_affinity; // col that vertical move should land on if possible
+  TRE_Off buf_size;  // space actually allocated for the buffer currently
+  TRE_Off text_len;  // length of text in chars (excluding gap)
+  TRE_Off gap_start; // offset of the start of the gap
+  TRE_Off gap_len;   // length of the gap
+  TRE_Off n_lines;   // total number of lines in text (so far, if indexing)
+  int encoding;      // determines char width
+  TRE_Off cursor_col;   // cursor position, column
+  TRE_Off col_affinity; // col that vertical move should land on if possible
   TRE_Line cursor_line; // position info about the line where the cursor is
+  TRE_LineIdx lines; // lengths of all the lines in the text
+  TRE_Buf_GrowthPolicy growth; // how the allocation grows
+  TRE_Off inserted_since_grow; // chars inserted since gap was last enlarged
+  TRE_Buf_Stats stats; // memory management counters
+  TRE_Damage damage;  // lines changed since the last TRE_Buf_take_damage
+  TRE_Undo undo;      // edits that can be undone and redone
+  long long version;  // bumped by every change to the text
+  TRE_SaveJob* save;  // save in progress (NULL if none)
+  TRE_Pieces* pieces; // text of a piece buffer (NULL for gap buffers)
+  // Counts lines in the background after a mapped load. While it's set the
+  // line index is incomplete and line queries go through the indexer.
+  TRE_Indexer* indexer;
+  // The saved line table for the file, while the indexer is running (NULL if
+  // tables aren't kept).
+  TRE_LineCache* line_cache;
+  // The file contents when the buffer was loaded with TRE_Buf_load_mapped.
+  // The pieces refer into this memory, so it lives as long as the buffer.
+  void* map_addr;
+  TRE_Off map_len;
 } TRE_Buf;
 
 // High byte is an encoding ID, low byte is the width (8, 16 or 32 bits).
@@ -54,6 +116,12 @@ typedef struct {
 #define TRE_BUF_ENCODING_UTF16 ((2 << 8) | 16)
 #define TRE_BUF_ENCODING_UTF32 ((3 << 8) | 32)
 
+// Ways a buffer can store its text.
+enum TRE_Buf_Storage {
+  TRE_BUF_STORAGE_GAP,   // one allocation with a gap at the editing point
+  TRE_BUF_STORAGE_PIECES // unmodified original text plus a list of edits
+};
+
 enum move_linewrap_style_t {
   MOVE_LINEWRAP_NO,
   MOVE_LINEWRAP_YES
@@ -65,34 +133,40 @@ enum move_linewrap_style_t {
 #define TRE_BUFFER_GAP_SIZE TRE_BUFFER_BLOCK_SIZE
 #endif
 
+// The cursor and the gap are independent of each other. Moving the cursor
+// only updates the cursor fields; the text stays where it is until an edit
+// is made, and then the editing functions move the gap to where the edit is
+// (see TRE_Buf_store_insert). So moving around the buffer never moves any
+// text, and reading the text (TRE_Buf_char_at, TRE_Buf_span_at) works
+// wherever the gap happens to be.
+
 #define LOG_CURSOR_POSITION() \
-  logt("Cursor: (aff=%d) LC=%d,%d; line off=%d," \
-     " len=%d; gap start=%d", \
+  logt("Cursor: (aff=%lld) LC=%lld,%lld; line off=%lld," \
+     " len=%lld; gap start=%lld", \
       buf->col_affinity, buf->cursor_line.num, buf->cursor_col, \
       buf->cursor_line.off, buf->cursor_line.len, buf->gap_start);
 
 // Move forward (positive) or backward (negative) in the buffer by a given
 // number of characters.
 // TODO: Parameterize line wraparound behavior.
-void TRE_Buf_move_charwise(TRE_Buf* buf, int distance_chars) {
+void TRE_Buf_move_charwise(TRE_Buf* buf, TRE_Off distance_chars) {
   assert(buf != NULL);
   const enum move_linewrap_style_t linewrap_style = MOVE_LINEWRAP_YES;
   // Sideward movement clears the column affinity.
   TRE_Buf_clear_col_affinity(buf);
-  // This movement would pass the start of the buffer.
-  if (distance_chars < 0
-      && buf->gap_start < -distance_chars) {
+  TRE_Off pos = TRE_Buf_get_cursor_offset(buf);
+  // This movement would pass the start of the buffer. (The checks are
+  // written so that they can't overflow, whatever the distance.)
+  if (distance_chars < 0 && distance_chars < -pos) {
     log_warn("Movement attempted to pass the start of the buffer.");
     return;
   }
   // Movement would pass the end of the buffer.
-  int end = buf->text_len + buf->gap_len;
-  if (distance_chars > 0
-      && buf->gap_start + buf->gap_len + distance_chars > end) {
+  if (distance_chars > 0 && distance_chars > buf->text_len - pos) {
     log_warn("Movement attempted to pass the end of the buffer.");
     return;
   }
-  logt("Moving character from %d, dist %d.", buf->gap_start, distance_chars);
+  logt("Moving character from %lld, dist %lld.", pos, distance_chars);
   // Scan the text to see where the cursor will end up.
   if (distance_chars > 0) {
     mv_curs_right_charwise(buf, distance_chars, linewrap_style);
@@ -105,217 +179,215 @@ void TRE_Buf_move_charwise(TRE_Buf* buf, int distance_chars) {
 }
 
 LOCAL TRE_OpResult mv_curs_right_charwise(TRE_Buf* buf,
-    int n_chars, move_linewrap_style_t linewrap_style) {
+    TRE_Off n_chars, move_linewrap_style_t linewrap_style) {
   TRE_Line line = buf->cursor_line;
-  // Figure movement from the beginning of the line to make looping over
-  // subsequent lines simpler. This means we "back up" to the beginning by
-  // adding the cursor column number to the number of chars to be moved.
-  int chars_left_to_move = n_chars + buf->cursor_col;
-  int last_line_num = buf->n_lines - 1;
-  // Don't do any linewise movement if settings prevent it.
-  if (linewrap_style != MOVE_LINEWRAP_NO) {
-    // Count characters from the beginning of this line to the beginning of the
-    // next, going until enough chars have been crossed to satisfy the move
-    // distance.
-    logt("Moving right from line %d, last line = %d", line.num, last_line_num);
-    while (line.num < last_line_num) {
-      chars_left_to_move -= line.len;
-      if (chars_left_to_move < 0) {
-        break;
+  TRE_Off target = line.off + buf->cursor_col + n_chars;
+  if (linewrap_style == MOVE_LINEWRAP_NO
+      || target >= line.off + line.len) {
+    // The movement leaves the current line (or would, if settings allowed
+    // it). Either stop at the end of the line, or look up the line containing
+    // the target position. Movement past the end of the buffer stops at the
+    // end of the last line.
+    if (linewrap_style != MOVE_LINEWRAP_NO) {
+      logt("Move right charwise ends on another line.");
+      if (target >= buf->text_len) {
+        target = buf->text_len - 1;
       }
-      line = scan_next_line(buf, line);
+      line = TRE_Buf_get_line_at_offset(buf, target);
     }
-  }
-  // Whether chars_left_to_move is positive or negative tells us how/why the
-  // loop was terminated.
-  if (chars_left_to_move >= 0) {
-    // Movement stopped because the last line was reached, or because settings
-    // prevent movement from wrapping to the next line.
-    if (chars_left_to_move + 1 > line.len) {
-      // Requested distance takes us past the end of the line.
-      logt("Move right charwise passes end of buffer, limiting to end of line.");
-      buf->cursor_col = line.len - 1;
-    } else {
-      // The movement lands us somewhere inside the bounds of the last line.
-      logt("Move right charwise ends within last line.");
-      buf->cursor_col = chars_left_to_move;
+    if (target >= line.off + line.len) {
+      logt("Move right charwise passes end of line, limiting to end of line.");
+      target = line.off + line.len - 1;
     }
-  } else {
-    // In normal movement (not at the end of the buffer), chars_left_to_move
-    // ends up negative. In that case, its value tells us how far we have to
-    // back up from the end of the current line to get to the correct position.
-    logt("Move right charwise ends before last line.");
-    buf->cursor_col = line.len + chars_left_to_move;
   }
+  buf->cursor_col = target - line.off;
   buf->cursor_line = line;
-  TRE_Buf_move_gap(buf, line.off + buf->cursor_col);
   return TRE_SUCC;
 }
 
 LOCAL TRE_OpResult mv_curs_left_charwise(TRE_Buf* buf,
-    int n_chars, move_linewrap_style_t linewrap_style) {
+    TRE_Off n_chars, move_linewrap_style_t linewrap_style) {
   TRE_Line line = buf->cursor_line;
-  // Figure movement from the beginning of the line to make looping over
-  // subsequent lines simpler. We do this "backing up" by adjusting the value
-  // of chars_left_to_move accordingly. The notion of being at the start of
-  // each line is just an assumption in the following code.
-  int chars_left_to_move = n_chars - buf->cursor_col;
-  // Don't do any linewise movement if settings prevent it.
-  if (linewrap_style != MOVE_LINEWRAP_NO) {
-    // Count characters from the beginning of this line to the beginning of the
-    // next, going until enough chars have been crossed to satisfy the move
-    // distance.
-    while (line.num > 0) {
-      if (chars_left_to_move <= 0) {
-        break;
-      }
-      line = scan_prev_line(buf, line);
-      chars_left_to_move -= line.len;
-    }
-  }
-  if (chars_left_to_move > 0) {
-    // Movement stopped because the first line was reached, or because settings
-    // prevent movement from wrapping to the next line.
-    if (chars_left_to_move >= line.len) {
-      // Requested distance takes us past the start of the line.
-      buf->cursor_col = 0;
+  TRE_Off target = line.off + buf->cursor_col - n_chars;
+  if (target < line.off) {
+    // The movement leaves the current line. Either stop at the start of the
+    // line (if settings prevent wrapping) or look up the line containing the
+    // target position.
+    if (linewrap_style == MOVE_LINEWRAP_NO) {
+      target = line.off;
     } else {
-      // The movement lands us somewhere inside the bounds of the line.
-      buf->cursor_col = line.len - chars_left_to_move - 1;
+      if (target < 0) {
+        target = 0;
+      }
+      line = TRE_Buf_get_line_at_offset(buf, target);
     }
-  } else {
-    // In normal movement (not at the end of the buffer), chars_left_to_move
-    // ends up <= 0. In that case, its value tells us how far we have to move
-    // rightward from the beginning of the line to get to the right position.
-    buf->cursor_col = -chars_left_to_move;
   }
+  buf->cursor_col = target - line.off;
   buf->cursor_line = line;
-  TRE_Buf_move_gap(buf, line.off + buf->cursor_col);
   return TRE_SUCC;
 }
 
-// The functions scan_prev_line and scan_next_line are the core of the movement
-// code. These functions keep track of the line/column count and respect the
-// details of the buffer data structure, particularly including the gap. Other
-// movement functions should be implemented in terms of lines, with these
-// functions being used to move between lines.
-
-// Scan chars to find the position and length of the line previous to the one
-// given. It is illegal to call this on the first line of the buffer (i.e. when
-// no previous line exists).
-TRE_Line scan_prev_line(TRE_Buf* buf, TRE_Line from_line) {
-  TRE_Line prev_line;
+// Line positions come from the line index (buf->lines), which holds the length
+// of every line and is kept up to date by the editing functions. Looking up a
+// line by number or by offset costs O(log n) no matter how far away it is, so
+// movement code never needs to scan the text for newlines.
+//
+// A buffer loaded with TRE_Buf_load_mapped starts out with an empty index and
+// a background indexer counting its lines. Until that finishes, lookups go to
+// the indexer, waiting for it if it hasn't reached the requested line yet, and
+// n_lines only counts the lines found so far.
+
+// Get the position and length of the line with the given number.
+TRE_Line TRE_Buf_get_line(TRE_Buf* buf, TRE_Off num) {
+  poll_indexer(buf);
+  if (buf->indexer) {
+    return TRE_Indexer_get_line(buf->indexer, num);
+  }
+  assert(num >= 0 && num < buf->n_lines);
+  return TRE_LineIdx_get(&buf->lines, num);
+}
+
+// Get the position and length of the line containing the given offset.
+TRE_Line TRE_Buf_get_line_at_offset(TRE_Buf* buf, TRE_Off offset) {
+  poll_indexer(buf);
+  if (buf->indexer) {
+    return TRE_Indexer_find_offset(buf->indexer, offset);
+  }
+  return TRE_LineIdx_find_offset(&buf->lines, offset);
+}
+
+// Get the line previous to the one given. It is illegal to call this on the
+// first line of the buffer (i.e. when no previous line exists).
+TRE_Line TRE_Buf_prev_line(TRE_Buf* buf, TRE_Line from_line) {
   assert(from_line.num > 0); // don't call if this is line zero
-  // Keeping track of the line number is straightforward.
-  prev_line.num = from_line.num - 1;
-  // Check if this is the first line.
-  if (prev_line.num == 0) {
-    // Don't scan line zero because we know there will be no newline.
-    prev_line.off = 0;
-    prev_line.len = from_line.off;
-  } else {
-    // Scan backward to find the next newline. It's not necessary to check for
-    // hitting the start of the buffer because we've already stipulated that
-    // this isn't line zero.
-    int pos = from_line.off - 1;
-    // Scanning works differently depending on whether we might encounter gap.
-    if (pos < buf->gap_start) {
-      // Scanning before the gap. Don't need to account for gap size.
-before_gap:
-      do {} while (buf->text.c[--pos] != '\n');
-    } else {
-      // Scanning after the gap. Account for the gap size, and skip past the
-      // gap if we reach it.
-      int chars_until_gap = pos - buf->gap_start;
-      pos += buf->gap_len;
-      do {
-        ++pos;
-        --chars_until_gap;
-        if (0 == chars_until_gap) {
-          pos -= buf->gap_len;
-          goto before_gap;
-        }
-      } while (buf->text.c[pos] != '\n');
-      pos -= buf->gap_len;
-    }
-    prev_line.off = pos + 1;
-    prev_line.len = from_line.off - prev_line.off;
+  return TRE_Buf_get_line(buf, from_line.num - 1);
+}
+
+// Get the line following the one given. It is illegal to call this on the
+// last line of the buffer.
+TRE_Line TRE_Buf_next_line(TRE_Buf* buf, TRE_Line from_line) {
+  assert(from_line.num + 1 < TRE_Buf_wait_lines(buf, from_line.num + 2));
+  return TRE_Buf_get_line(buf, from_line.num + 1);
+}
+
+// Make sure that at least n_lines lines have been counted, or that the whole
+// buffer has, and return the number of lines counted. This only has to wait
+// while a background indexer is running; otherwise it returns n_lines.
+TRE_Off TRE_Buf_wait_lines(TRE_Buf* buf, TRE_Off n_lines) {
+  poll_indexer(buf);
+  if (buf->indexer) {
+    buf->n_lines = TRE_Indexer_wait_lines(buf->indexer, n_lines);
+    poll_indexer(buf);
   }
-  return prev_line;
+  return buf->n_lines;
 }
 
-// Scan forward from the end of the given line to the end of the next line, and
-// return a line object containing the details about the line just scanned.
-TRE_Line scan_next_line(TRE_Buf* buf, TRE_Line from_line) {
-  TRE_Line next_line;
-  TRE_Buf_OutputBuffer strbuf;
-  logt("Begin scanning line: %s", TRE_Buf_cursor_to_string(buf, &strbuf));
-  assert(from_line.num + 1 < buf->n_lines); // don't call if curs in last line
-  // Keeping track of the line number is straightforward.
-  next_line.num = from_line.num + 1;
-  // The next line offset is 1 past the end of the previous line.
-  next_line.off = from_line.off + from_line.len;
-  // Check if this is the last line.
-  if (next_line.num == buf->n_lines) {
-    // Don't scan last line because we know it ends at end of buffer.
-    logt("Last line, not scanning.");
-    next_line.len = buf->text_len - next_line.off;
-  } else {
-    // Scan forward to find the next newline. It's not necessary to check for
-    // hitting the end of the buffer because we've already stipulated that
-    // this isn't the last line.
-    int pos = next_line.off;
-    // Scanning works differently depending on whether we might encounter gap.
-    if (pos >= buf->gap_start) {
-      // Scanning after the gap. Account for the gap size. (Line offsets
-      // are file positions, not buffer positions, i.e. they pretend that the
-      // file text is contiguous from start to finish.)
-after_gap:
-      logt("Scanning after the gap.");
-      pos += buf->gap_len;
-      do {
-        logt("(POST) Pos: %d / %d, Char: %s", pos - buf->gap_len, pos,
-            char_to_str(buf->text.c[pos]));
-      } while (buf->text.c[pos++] != '\n');
-      pos -= buf->gap_len;
-    } else {
-      // Scanning before gap, have to switch scanning mode if we reach it.
-      logt("Scanning before the gap.");
-      int chars_until_gap = buf->gap_start - pos;
-      do {
-        logt("(PRE) Pos: %d, Char: %s", pos, char_to_str(buf->text.c[pos]));
-        if (0 == chars_until_gap) {
-          logt("Reached the gap.");
-          goto after_gap; // goto considered awesome
-        }
-        --chars_until_gap;
-      } while (buf->text.c[pos++] != '\n');
-    }
-    logt("Done scanning. Pos: %d", pos);
-    next_line.len = pos - next_line.off;
+// Get the total number of lines, waiting for the background indexer to count
+// them if necessary.
+TRE_Off TRE_Buf_count_lines(TRE_Buf* buf) {
+  TRE_Buf_finish_indexing(buf);
+  return buf->n_lines;
+}
+
+// Wait for the background indexer (if any) to finish and move the line index
+// it built into the buffer. Anything that edits the buffer does this first,
+// because the indexer only knows about the text as it was loaded.
+void TRE_Buf_finish_indexing(TRE_Buf* buf) {
+  if (!buf->indexer) {
+    return;
+  }
+  TRE_Indexer_finish(buf->indexer, &buf->lines);
+  if (buf->line_cache) {
+    finish_line_cache(buf);
+  }
+  int load_error = TRE_Indexer_load_error(buf->indexer);
+  if (load_error) {
+    log_warn("File '%s' was not read in full (%s); the rest of the buffer "
+        "is blank.", buf->filename ? buf->filename : "",
+        load_error > 0 ? strerror(load_error) : "it got shorter");
+  }
+  TRE_Indexer_free(buf->indexer);
+  buf->indexer = NULL;
+  if (buf->line_cache) {
+    TRE_LineCache_free(buf->line_cache);
+    buf->line_cache = NULL;
+  }
+  buf->n_lines = TRE_LineIdx_count(&buf->lines);
+  logt("Line index complete: %lld lines.", buf->n_lines);
+}
+
+// Number of chars of the text that have been loaded (all of them, unless the
+// buffer is still being loaded in the background).
+TRE_Off TRE_Buf_loaded(TRE_Buf* buf) {
+  poll_indexer(buf);
+  return buf->indexer ? TRE_Indexer_progress(buf->indexer) : buf->text_len;
+}
+
+// Bytes of memory the buffer has allocated: its text (or pieces), line index
+// and undo history. The file mapping of a mapped buffer isn't counted, since
+// the system can drop those pages and read them from the file again.
+TRE_Off TRE_Buf_memory_usage(TRE_Buf* buf) {
+  TRE_Off memory = sizeof(TRE_Buf) + buf->buf_size
+    + TRE_LineIdx_memory(&buf->lines) + TRE_Undo_bytes(&buf->undo);
+  if (buf->pieces) {
+    memory += TRE_Pieces_memory(buf->pieces);
+  }
+  return memory;
+}
+
+// Save the line table once the lines have been counted, or throw it away if
+// the indexer found that it was wrong. (Finishing the indexer has just put
+// the real index into the buffer.)
+LOCAL void finish_line_cache(TRE_Buf* buf) {
+  TRE_LineCache* cache = buf->line_cache;
+  if (!cache->marks) {
+    TRE_Off n_marks;
+    const TRE_Off* marks = TRE_Indexer_marks(buf->indexer, &n_marks);
+    TRE_LineCache_save(cache, marks, n_marks,
+        TRE_LineIdx_count(&buf->lines));
+  } else if (TRE_Indexer_seed_was_wrong(buf->indexer)) {
+    log_warn("Saved line table for '%s' was wrong; deleting it.",
+        buf->filename);
+    TRE_LineCache_discard(cache);
+    // The cursor could be anywhere, so put it back on a real line.
+    TRE_Off off = TRE_Buf_get_cursor_offset(buf);
+    buf->cursor_line = TRE_LineIdx_find_offset(&buf->lines, off);
+    buf->cursor_col = off - buf->cursor_line.off;
+  }
+}
+
+// Take over the line index if the indexer has finished counting. (This never
+// waits.)
+LOCAL void poll_indexer(TRE_Buf* buf) {
+  if (buf->indexer && TRE_Indexer_is_done(buf->indexer)) {
+    TRE_Buf_finish_indexing(buf);
   }
-  return next_line;
 }
 
 // Move forward (positive) or backward (negative) in the buffer by a given
 // number of lines.
-void TRE_Buf_move_linewise(TRE_Buf* buf, int distance_lines) {
-  logt("Moving line from (%d), dist %d", buf->gap_start, distance_lines);
+void TRE_Buf_move_linewise(TRE_Buf* buf, TRE_Off distance_lines) {
+  logt("Moving line from (%lld), dist %lld", TRE_Buf_get_cursor_offset(buf),
+      distance_lines);
   if (distance_lines == 0) {
     log_info("Linewise move called for a distance of zero.");
     return;
   }
   TRE_Line line = buf->cursor_line;
-  logt("Start move at line: num %d, off %d, len %d",
+  logt("Start move at line: num %lld, off %lld, len %lld",
       line.num, line.off, line.len);
   if (distance_lines > 0) { // moving forward/down
     line = mv_curs_down_linewise(buf, distance_lines, line);
   } else { // distance_lines is negative (moving backward)
+    // LLONG_MIN can't be negated, but it's past the first line all the same.
+    if (distance_lines < -LLONG_MAX) {
+      distance_lines = -LLONG_MAX;
+    }
     line = mv_curs_up_linewise(buf, -distance_lines, line);
   }
   // Set the cursor column affinity if unset.
   if (buf->col_affinity == -1) {
-    logt("Setting col affinity to match cursor col (%d)", buf->cursor_col);
+    logt("Setting col affinity to match cursor col (%lld)", buf->cursor_col);
     buf->col_affinity = buf->cursor_col;
   }
   // Set the cursor position.
@@ -323,38 +395,74 @@ void TRE_Buf_move_linewise(TRE_Buf* buf, int distance_lines) {
     ? buf->col_affinity
     : line.len - 1;
   buf->cursor_line = line;
-  // Move the buffer gap.
-  TRE_Buf_move_gap(buf, line.off + buf->cursor_col);
   LOG_CURSOR_POSITION();
 }
 
-TRE_Line mv_curs_up_linewise(TRE_Buf* buf, int n_lines, TRE_Line line) {
-  for (int ln = n_lines; ln > 0; ln--) {
-    logt("Moving one line up.");
-    if (line.num == 0) {
-      logt("Move prevented because this is the first line.");
-      break;
-    }
-    line = scan_prev_line(buf, line);
-    logt("Scanned prev line: num %d, off %d, len %d",
-        line.num, line.off, line.len);
+TRE_Line mv_curs_up_linewise(TRE_Buf* buf, TRE_Off n_lines, TRE_Line line) {
+  if (line.num == 0) {
+    logt("Move prevented because this is the first line.");
+    return line;
+  }
+  TRE_Off target = line.num - n_lines;
+  if (target < 0) {
+    logt("Move limited to the first line.");
+    target = 0;
   }
-  return line;
+  return TRE_Buf_get_line(buf, target);
 }
 
-TRE_Line mv_curs_down_linewise(TRE_Buf* buf, int n_lines, TRE_Line line) {
-  int last_line = buf->n_lines - 1;
-  for (int ln = n_lines; ln > 0; ln--) {
-    logt("Moving one line down.");
-    if (line.num == last_line) {
-      logt("Move prevented because this is the last line.");
-      break;
-    }
-    line = scan_next_line(buf, line);
-    logt("Scanned next line: num %d, off %d, len %d",
-        line.num, line.off, line.len);
+TRE_Line mv_curs_down_linewise(TRE_Buf* buf, TRE_Off n_lines,
+    TRE_Line line) {
+  TRE_Off target = n_lines < LLONG_MAX - 1 - line.num
+    ? line.num + n_lines
+    : LLONG_MAX - 1;
+  TRE_Off last_line = TRE_Buf_wait_lines(buf, target + 1) - 1;
+  if (line.num == last_line) {
+    logt("Move prevented because this is the last line.");
+    return line;
+  }
+  if (target > last_line) {
+    logt("Move limited to the last line.");
+    target = last_line;
   }
-  return line;
+  return TRE_Buf_get_line(buf, target);
+}
+
+// Move the cursor to the given line and column. Both are limited to the
+// bounds of the buffer. This clears the column affinity.
+void TRE_Buf_goto_line(TRE_Buf* buf, TRE_Off line_num, TRE_Off col) {
+  TRE_Buf_clear_col_affinity(buf);
+  if (line_num < 0) {
+    line_num = 0;
+  } else if (line_num >= buf->text_len) {
+    // There can't be more lines than characters. (Checking this first also
+    // keeps line_num + 1 below from overflowing.)
+    line_num = TRE_Buf_count_lines(buf) - 1;
+  } else if (line_num >= TRE_Buf_wait_lines(buf, line_num + 1)) {
+    line_num = buf->n_lines - 1;
+  }
+  TRE_Line line = TRE_Buf_get_line(buf, line_num);
+  if (col < 0) {
+    col = 0;
+  } else if (col >= line.len) {
+    col = line.len - 1;
+  }
+  buf->cursor_line = line;
+  buf->cursor_col = col;
+  LOG_CURSOR_POSITION();
+}
+
+// Move the cursor to an absolute position in the buffer, updating the line and
+// column to match. This clears the column affinity.
+TRE_OpResult TRE_Buf_set_cursor_offset(TRE_Buf* buf, TRE_Off absolute_pos) {
+  if (absolute_pos < 0 || absolute_pos >= buf->text_len) {
+    log_warn("Cursor position is out of bounds, call ignored.");
+    return TRE_FAIL;
+  }
+  TRE_Buf_clear_col_affinity(buf);
+  buf->cursor_line = TRE_Buf_get_line_at_offset(buf, absolute_pos);
+  buf->cursor_col = absolute_pos - buf->cursor_line.off;
+  return TRE_SUCC;
 }
 
 // Clear the cursor column affinity. This should be done whenever the cursor
@@ -366,27 +474,34 @@ void TRE_Buf_clear_col_affinity(TRE_Buf* buf) {
 }
 
 // Go to an absolute position in the buffer, expressed in bytes. (Ignoring the
-// space taken up by the gap.)
-// TODO: This needs to account for line numbers.
-TRE_OpResult TRE_Buf_move_gap(TRE_Buf* buf, int absolute_pos) {
-  if (absolute_pos >= buf->text_len) {
+// space taken up by the gap.) This only moves the gap; the cursor line and
+// column aren't touched. Use TRE_Buf_set_cursor_offset to move the cursor.
+// The editing functions call this when they need the gap somewhere else.
+// Piece buffers have no gap, so for them this does nothing.
+TRE_OpResult TRE_Buf_move_gap(TRE_Buf* buf, TRE_Off absolute_pos) {
+  if (absolute_pos > buf->text_len) {
     log_warn("Goto position is out of bounds, goto call ignored.");
     return TRE_FAIL;
   }
+  if (buf->storage != TRE_BUF_STORAGE_GAP) {
+    return TRE_SUCC;
+  }
+  TRE_Buf_before_change(buf);
   // If moving to before the gap, shift the gap up.
   // --------------------------------------------|
   //      |ABSPOS          |  GAP  |             |
   // ->   |  GAP  |                |             |
   // --------------------------------------------|
   if (absolute_pos < buf->gap_start) {
-    int block_len = buf->gap_start - absolute_pos;
-    int move_to = absolute_pos + buf->gap_len;
-    int move_from = absolute_pos;
-    logt("Moving gap LEFT from %d to %d"
-       " (move %d b from %d to %d)",
+    TRE_Off block_len = buf->gap_start - absolute_pos;
+    TRE_Off move_to = absolute_pos + buf->gap_len;
+    TRE_Off move_from = absolute_pos;
+    logt("Moving gap LEFT from %lld to %lld"
+       " (move %lld b from %lld to %lld)",
        buf->gap_start, absolute_pos,
        block_len, move_from, move_to);
     memmove(buf->text.c + move_to, buf->text.c + move_from, block_len);
+    buf->stats.bytes_moved += block_len;
   }
   // If the target is after the gap, shift the gap down.
   // --------------------------------------------|
@@ -397,14 +512,15 @@ TRE_OpResult TRE_Buf_move_gap(TRE_Buf* buf, int absolute_pos) {
     // Remember in these calculations that the value of absolute_pos doesn't
     // account for the gap size. (In other words, the actual new gap_start
     // after this move will be at absolute_pos, not absolute_pos + gap_len.)
-    int block_len =  absolute_pos - buf->gap_start;
-    int move_to = buf->gap_start;
-    int move_from = buf->gap_start + buf->gap_len;
-    logt("Moving gap RIGHT from %d to %d"
-       " (move %d b from %d to %d)",
+    TRE_Off block_len =  absolute_pos - buf->gap_start;
+    TRE_Off move_to = buf->gap_start;
+    TRE_Off move_from = buf->gap_start + buf->gap_len;
+    logt("Moving gap RIGHT from %lld to %lld"
+       " (move %lld b from %lld to %lld)",
        buf->gap_start, absolute_pos,
        block_len, move_from, move_to);
     memmove(buf->text.c + move_to, buf->text.c + move_from, block_len);
+    buf->stats.bytes_moved += block_len;
   }
   else {
     log_info("Moved gap to current position, nothing to do.");
@@ -413,8 +529,105 @@ TRE_OpResult TRE_Buf_move_gap(TRE_Buf* buf, int absolute_pos) {
   return TRE_SUCC;
 }
 
-int TRE_Buf_get_cursor_offset(TRE_Buf* buf) {
-  return buf->gap_start;
+// Get the offset of the cursor from the start of the buffer.
+TRE_Off TRE_Buf_get_cursor_offset(TRE_Buf* buf) {
+  return buf->cursor_line.off + buf->cursor_col;
+}
+
+// Get the character at an offset in the buffer's text.
+char TRE_Buf_char_at(TRE_Buf* buf, TRE_Off off) {
+  assert(off >= 0 && off < buf->text_len);
+  if (buf->indexer) {
+    // The text might still be loading.
+    TRE_Indexer_wait_text(buf->indexer, off, 1);
+  }
+  if (buf->storage == TRE_BUF_STORAGE_PIECES) {
+    return TRE_Pieces_char_at(buf->pieces, off);
+  }
+  return buf->text.c[off < buf->gap_start ? off : off + buf->gap_len];
+}
+
+// Get a pointer to the text at an offset. Returns the number of chars that
+// can be read from there in one go (i.e. before the gap or the end of a
+// piece). The pointer is only good until the buffer is next edited.
+TRE_Off TRE_Buf_span_at(TRE_Buf* buf, TRE_Off off, const char** text) {
+  assert(off >= 0 && off < buf->text_len);
+  if (buf->storage == TRE_BUF_STORAGE_PIECES) {
+    return TRE_Pieces_span_at(buf->pieces, off, text);
+  }
+  if (off < buf->gap_start) {
+    *text = buf->text.c + off;
+    return buf->gap_start - off;
+  }
+  *text = buf->text.c + off + buf->gap_len;
+  if (buf->indexer) {
+    // Only the part of the text that has loaded can be read.
+    return TRE_Indexer_wait_text(buf->indexer, off, buf->text_len - off);
+  }
+  return buf->text_len - off;
+}
+
+// Get len chars of the buffer's text, starting at an offset, without copying
+// them: the text before the gap and the text after it. Returns how many
+// chars the range covers, which is len for a gap buffer but can be less for
+// a piece buffer (whose text can be in any number of pieces), in which case
+// the caller carries on from where the range ends. The pointers are only
+// good until the buffer is next edited.
+TRE_Off TRE_Buf_get_range(TRE_Buf* buf, TRE_Off off, TRE_Off len,
+    TRE_TextRange* range) {
+  TRE_BufIter it;
+  TRE_BufIter_init(&it, buf, off, len);
+  range->n = 0;
+  while (range->n < 2
+      && TRE_BufIter_next(&it, &range->text[range->n], &range->len[range->n])) {
+    range->n++;
+  }
+  return it.off - off;
+}
+
+// Copy len chars of the buffer's text, starting at an offset, into dst.
+void TRE_Buf_copy_text(TRE_Buf* buf, TRE_Off off, char* dst, TRE_Off len) {
+  TRE_BufIter it;
+  const char* text;
+  TRE_Off n;
+  TRE_BufIter_init(&it, buf, off, len);
+  while (TRE_BufIter_next(&it, &text, &n)) {
+    memcpy(dst, text, n);
+    dst += n;
+  }
+}
+
+// Count the newlines in len chars of the buffer's text, starting at an offset.
+TRE_Off TRE_Buf_count_newlines(TRE_Buf* buf, TRE_Off off, TRE_Off len) {
+  TRE_Off n_newlines = 0;
+  TRE_BufIter it;
+  const char* text;
+  TRE_Off n;
+  TRE_BufIter_init(&it, buf, off, len);
+  while (TRE_BufIter_next(&it, &text, &n)) {
+    n_newlines += TRE_count_newlines(text, n);
+  }
+  return n_newlines;
+}
+
+// Find the first newline at or after an offset. Returns its offset, or -1 if
+// there's no newline after off.
+TRE_Off TRE_Buf_find_newline(TRE_Buf* buf, TRE_Off off) {
+  assert(off >= 0);
+  if (off >= buf->text_len) {
+    return -1;
+  }
+  TRE_BufIter it;
+  const char* text;
+  TRE_Off n;
+  TRE_BufIter_init(&it, buf, off, buf->text_len - off);
+  while (TRE_BufIter_next(&it, &text, &n)) {
+    const char* nl = TRE_find_newline(text, n);
+    if (nl) {
+      return it.block + (nl - text);
+    }
+  }
+  return -1;
 }
 
 // Generate a string representing the contents of the current line and cursor
@@ -423,7 +636,7 @@ int TRE_Buf_get_cursor_offset(TRE_Buf* buf) {
 const char* TRE_Buf_cursor_to_string(TRE_Buf* buf,
     TRE_Buf_OutputBuffer* strbuf) {
   snprintf(strbuf->buf, TRE_BUF_OUTPUT_BUFFER_LEN,
-      "{num=%d, off=%d, len=%d, col=%d}", buf->cursor_line.num,
+      "{num=%lld, off=%lld, len=%lld, col=%lld}", buf->cursor_line.num,
       buf->cursor_line.off, buf->cursor_line.len, buf->cursor_col);
   return strbuf->buf;
 }
@@ -434,7 +647,7 @@ const char* TRE_Buf_cursor_to_string(TRE_Buf* buf,
 const char* TRE_Buf_line_to_string(TRE_Line* line,
     TRE_Buf_OutputBuffer* strbuf) {
   snprintf(strbuf->buf, TRE_BUF_OUTPUT_BUFFER_LEN,
-      "{num=%d, off=%d, len=%d}", line->num, line->off, line->len);
+      "{num=%lld, off=%lld, len=%lld}", line->num, line->off, line->len);
   return strbuf->buf;
 }
 
@@ -0,0 +1,373 @@
+#include "hdrs.c"
+#include "mh_buf_piece.h"
+
+// A piece list holds a buffer's text without ever copying the text it was
+// loaded with. The original text stays where it is (usually a read-only
+// mapping of the file) and text that gets inserted is appended to separate
+// "add" chunks. The list of pieces says which runs of which source make up the
+// text, in order. Inserting splits at most one piece and adds one; deleting
+// splits at most one and trims or drops the ones in the deleted range.
+//
+// Add chunks are never moved or reallocated once they're created, so pointers
+// into them (and into the original text) stay valid for as long as the piece
+// list exists.
+//
+// The pieces are kept in blocks of up to TRE_PIECE_BLOCK_SIZE, each of which
+// knows the total length of its pieces. Finding the piece at an offset means
+// stepping over whole blocks and then over the pieces in one block, and an
+// insert or delete only shifts pieces within one block, so edits stay cheap
+// at any position however many pieces there are. Lookups start from the block
+// found by the previous lookup, so working at or near the same place (typing,
+// drawing a screenful of text) is cheaper still.
+
+#if INTERFACE
+// Source of a piece that refers to the original text.
+#define TRE_PIECE_ORIG (-1)
+// Size of the chunks that inserted text is appended to. (Inserts larger than
+// this get a chunk of their own.)
+#define TRE_PIECE_CHUNK_SIZE (64 * 1024)
+// Maximum number of pieces in a block.
+#define TRE_PIECE_BLOCK_SIZE 64
+
+typedef struct {
+  int src;     // TRE_PIECE_ORIG or the index of an add chunk
+  TRE_Off off; // offset of the text within its source
+  TRE_Off len; // length of the text (never zero)
+} TRE_Piece;
+
+typedef struct {
+  int n;       // number of pieces in the block (never zero)
+  TRE_Off len; // total length of the pieces
+  TRE_Piece pieces[TRE_PIECE_BLOCK_SIZE];
+} TRE_PieceBlock;
+
+typedef struct {
+  const char* orig;  // the original text (not owned by the piece list)
+  TRE_Off orig_len;
+  TRE_PieceBlock** blocks; // the blocks of pieces, in text order
+  int n_blocks;
+  int cap_blocks;
+  char** chunks;     // add chunks, in order of creation
+  int n_chunks;
+  int cap_chunks;
+  TRE_Off chunk_used; // bytes used in the last add chunk
+  TRE_Off chunk_size; // size of the last add chunk
+  TRE_Off chunk_total; // size of all the add chunks
+  TRE_Off len;        // total length of the text
+  int hint;           // block found by the last lookup...
+  TRE_Off hint_off;   // ...and the offset where it starts
+} TRE_Pieces;
+#endif
+
+// Create a piece list whose text is the given original text. The original
+// text has to stay valid until the piece list is freed.
+TRE_Pieces* TRE_Pieces_new(const char* orig, TRE_Off orig_len) {
+  TRE_Pieces* p = my_alloc(sizeof(TRE_Pieces));
+  memset(p, 0, sizeof(TRE_Pieces));
+  p->orig = orig;
+  p->orig_len = orig_len;
+  if (orig_len > 0) {
+    TRE_Piece piece;
+    piece.src = TRE_PIECE_ORIG;
+    piece.off = 0;
+    piece.len = orig_len;
+    insert_block(p, 0);
+    int b = 0, i = 0;
+    TRE_Off block_off = 0;
+    insert_piece(p, &b, &i, &block_off, piece);
+  }
+  p->len = orig_len;
+  return p;
+}
+
+void TRE_Pieces_free(TRE_Pieces* p) {
+  for (int i = 0; i < p->n_chunks; i++) {
+    my_free(p->chunks[i]);
+  }
+  if (p->chunks) {
+    my_free(p->chunks);
+  }
+  for (int i = 0; i < p->n_blocks; i++) {
+    my_free(p->blocks[i]);
+  }
+  if (p->blocks) {
+    my_free(p->blocks);
+  }
+  my_free(p);
+}
+
+// Bytes of memory the piece list has allocated (not counting the original
+// text, which it doesn't own).
+TRE_Off TRE_Pieces_memory(const TRE_Pieces* p) {
+  return sizeof(TRE_Pieces) + p->chunk_total
+    + p->cap_chunks * (TRE_Off)sizeof(char*)
+    + p->n_blocks * (TRE_Off)sizeof(TRE_PieceBlock)
+    + p->cap_blocks * (TRE_Off)sizeof(TRE_PieceBlock*);
+}
+
+TRE_Off TRE_Pieces_length(const TRE_Pieces* p) {
+  return p->len;
+}
+
+// Number of pieces the text is made of.
+TRE_Off TRE_Pieces_count(const TRE_Pieces* p) {
+  TRE_Off n = 0;
+  for (int i = 0; i < p->n_blocks; i++) {
+    n += p->blocks[i]->n;
+  }
+  return n;
+}
+
+// Get the character at an offset.
+char TRE_Pieces_char_at(TRE_Pieces* p, TRE_Off off) {
+  const char* text;
+  TRE_Pieces_span_at(p, off, &text);
+  return *text;
+}
+
+// Get a pointer to the text at an offset. Returns the number of chars that
+// can be read from there before the end of the piece.
+TRE_Off TRE_Pieces_span_at(TRE_Pieces* p, TRE_Off off, const char** text) {
+  assert(off >= 0 && off < p->len);
+  int b, i;
+  TRE_Off start = find_piece(p, off, &b, &i);
+  const TRE_Piece* piece = &p->blocks[b]->pieces[i];
+  *text = piece_text(p, piece) + (off - start);
+  return piece->len - (off - start);
+}
+
+// Insert text at an offset. Text inserted right after the previous insert
+// (e.g. while typing) extends the piece that holds it instead of adding a
+// new one.
+void TRE_Pieces_insert(TRE_Pieces* p, TRE_Off off, const char* src,
+    TRE_Off len) {
+  assert(off >= 0 && off <= p->len);
+  if (len == 0) {
+    return;
+  }
+  TRE_Piece piece;
+  piece.src = append_text(p, src, len, &piece.off);
+  piece.len = len;
+  int b, i;
+  TRE_Off block_off;
+  if (p->n_blocks == 0) {
+    insert_block(p, 0);
+    b = i = 0;
+    block_off = 0;
+  } else if (off == p->len) {
+    b = p->n_blocks - 1;
+    i = p->blocks[b]->n;
+    block_off = p->len - p->blocks[b]->len;
+  } else {
+    TRE_Off start = find_piece(p, off, &b, &i);
+    block_off = p->hint_off;
+    if (start != off) {
+      // Split the piece, and insert between the two halves.
+      TRE_Piece* head = &p->blocks[b]->pieces[i];
+      TRE_Piece tail = *head;
+      tail.off += off - start;
+      tail.len -= off - start;
+      head->len = off - start;
+      p->blocks[b]->len -= tail.len;
+      i++;
+      insert_piece(p, &b, &i, &block_off, piece);
+      insert_piece(p, &b, &i, &block_off, tail);
+      p->len += len;
+      return;
+    }
+  }
+  // The new text might follow on from the piece before it.
+  TRE_Piece* prev = NULL;
+  if (i > 0) {
+    prev = &p->blocks[b]->pieces[i - 1];
+  } else if (b > 0) {
+    TRE_PieceBlock* prev_block = p->blocks[b - 1];
+    prev = &prev_block->pieces[prev_block->n - 1];
+  }
+  if (prev && prev->src == piece.src && prev->off + prev->len == piece.off) {
+    prev->len += len;
+    if (i > 0) {
+      p->blocks[b]->len += len;
+    } else {
+      p->blocks[b - 1]->len += len;
+      p->hint = b - 1;
+      p->hint_off = block_off - (p->blocks[b - 1]->len - len);
+    }
+  } else {
+    insert_piece(p, &b, &i, &block_off, piece);
+  }
+  p->len += len;
+}
+
+// Delete len chars starting at an offset.
+void TRE_Pieces_delete(TRE_Pieces* p, TRE_Off off, TRE_Off len) {
+  assert(off >= 0 && len >= 0 && off + len <= p->len);
+  while (len > 0) {
+    int b, i;
+    TRE_Off start = find_piece(p, off, &b, &i);
+    TRE_Off block_off = p->hint_off;
+    TRE_PieceBlock* block = p->blocks[b];
+    TRE_Piece* piece = &block->pieces[i];
+    TRE_Off head = off - start;
+    TRE_Off rest = piece->len - head;
+    if (head == 0 && rest <= len) {
+      // The whole piece goes.
+      remove_piece(p, b, i, block_off);
+      p->len -= rest;
+      len -= rest;
+    } else if (head == 0) {
+      // The start of the piece goes.
+      piece->off += len;
+      piece->len -= len;
+      block->len -= len;
+      p->len -= len;
+      len = 0;
+    } else if (rest <= len) {
+      // The end of the piece goes.
+      piece->len = head;
+      block->len -= rest;
+      p->len -= rest;
+      len -= rest;
+    } else {
+      // The middle of the piece goes, leaving two pieces.
+      TRE_Piece tail = *piece;
+      tail.off += head + len;
+      tail.len = rest - len;
+      piece->len = head;
+      block->len -= rest;
+      i++;
+      insert_piece(p, &b, &i, &block_off, tail);
+      p->len -= len;
+      len = 0;
+    }
+  }
+}
+
+LOCAL const char* piece_text(const TRE_Pieces* p, const TRE_Piece* piece) {
+  const char* base = piece->src == TRE_PIECE_ORIG
+    ? p->orig
+    : p->chunks[piece->src];
+  return base + piece->off;
+}
+
+// Find the piece containing an offset (which must be within the text). Sets
+// *b and *i to the block and the index within the block, and returns the
+// offset where the piece starts. The search starts from the hint, which is
+// left pointing to the block found.
+LOCAL TRE_Off find_piece(TRE_Pieces* p, TRE_Off off, int* b, int* i) {
+  int blk = p->hint;
+  TRE_Off s = p->hint_off;
+  while (off < s) {
+    s -= p->blocks[--blk]->len;
+  }
+  while (off >= s + p->blocks[blk]->len) {
+    s += p->blocks[blk++]->len;
+  }
+  p->hint = blk;
+  p->hint_off = s;
+  const TRE_PieceBlock* block = p->blocks[blk];
+  int k = 0;
+  while (off >= s + block->pieces[k].len) {
+    s += block->pieces[k++].len;
+  }
+  *b = blk;
+  *i = k;
+  return s;
+}
+
+// Insert a piece at index *i of block *b, which starts at offset *block_off.
+// If the block is full it's split in two first. Afterward *b, *i and
+// *block_off give the position of the piece following the new one, and the
+// hint points to its block.
+LOCAL void insert_piece(TRE_Pieces* p, int* b, int* i, TRE_Off* block_off,
+    TRE_Piece piece) {
+  TRE_PieceBlock* block = p->blocks[*b];
+  if (block->n == TRE_PIECE_BLOCK_SIZE) {
+    // Move the second half of the block into a new block.
+    int half = TRE_PIECE_BLOCK_SIZE / 2;
+    TRE_PieceBlock* next = insert_block(p, *b + 1);
+    memcpy(next->pieces, block->pieces + half, half * sizeof(TRE_Piece));
+    next->n = half;
+    block->n = half;
+    for (int k = 0; k < half; k++) {
+      next->len += next->pieces[k].len;
+    }
+    block->len -= next->len;
+    if (*i > half) {
+      *block_off += block->len;
+      *i -= half;
+      (*b)++;
+      block = next;
+    }
+  }
+  memmove(block->pieces + *i + 1, block->pieces + *i,
+      (block->n - *i) * sizeof(TRE_Piece));
+  block->pieces[*i] = piece;
+  block->n++;
+  block->len += piece.len;
+  (*i)++;
+  p->hint = *b;
+  p->hint_off = *block_off;
+}
+
+// Remove piece i of block b (which starts at block_off), and remove the block
+// too if that leaves it empty.
+LOCAL void remove_piece(TRE_Pieces* p, int b, int i, TRE_Off block_off) {
+  TRE_PieceBlock* block = p->blocks[b];
+  block->len -= block->pieces[i].len;
+  block->n--;
+  memmove(block->pieces + i, block->pieces + i + 1,
+      (block->n - i) * sizeof(TRE_Piece));
+  if (block->n == 0) {
+    my_free(block);
+    p->n_blocks--;
+    memmove(p->blocks + b, p->blocks + b + 1,
+        (p->n_blocks - b) * sizeof(TRE_PieceBlock*));
+  }
+  // The block at index b (if any) still starts at block_off.
+  if (b < p->n_blocks) {
+    p->hint = b;
+    p->hint_off = block_off;
+  } else {
+    p->hint = 0;
+    p->hint_off = 0;
+  }
+}
+
+// Add an empty block at the given index in the list of blocks.
+LOCAL TRE_PieceBlock* insert_block(TRE_Pieces* p, int at) {
+  if (p->n_blocks == p->cap_blocks) {
+    p->cap_blocks = p->cap_blocks ? p->cap_blocks * 2 : 8;
+    p->blocks = my_realloc(p->blocks,
+        p->cap_blocks * sizeof(TRE_PieceBlock*));
+  }
+  memmove(p->blocks + at + 1, p->blocks + at,
+      (p->n_blocks - at) * sizeof(TRE_PieceBlock*));
+  TRE_PieceBlock* block = my_alloc(sizeof(TRE_PieceBlock));
+  block->n = 0;
+  block->len = 0;
+  p->blocks[at] = block;
+  p->n_blocks++;
+  return block;
+}
+
+// Copy text into the add chunks, starting a new chunk if it doesn't fit in
+// the current one. Returns the index of the chunk and sets *off to the
+// text's offset within it.
+LOCAL int append_text(TRE_Pieces* p, const char* src, TRE_Off len,
+    TRE_Off* off) {
+  if (p->n_chunks == 0 || p->chunk_size - p->chunk_used < len) {
+    if (p->n_chunks == p->cap_chunks) {
+      p->cap_chunks = p->cap_chunks ? p->cap_chunks * 2 : 8;
+      p->chunks = my_realloc(p->chunks, p->cap_chunks * sizeof(char*));
+    }
+    p->chunk_size = len > TRE_PIECE_CHUNK_SIZE ? len : TRE_PIECE_CHUNK_SIZE;
+    p->chunks[p->n_chunks++] = my_alloc(p->chunk_size);
+    p->chunk_total += p->chunk_size;
+    p->chunk_used = 0;
+  }
+  *off = p->chunk_used;
+  memcpy(p->chunks[p->n_chunks - 1] + p->chunk_used, src, len);
+  p->chunk_used += len;
+  return p->n_chunks - 1;
+}
@@ -0,0 +1,412 @@
+#include "hdrs.c"
+#include "mh_buf_save.h"
+
+// Saving a buffer to a file.
+//
+// The text is written straight from where it is in memory (the blocks before
+// and after the gap, or the pieces of a piece buffer) with writev, so it's
+// never flattened into one copy first. It goes to a temporary file next to
+// the real one, which is synced to disk and then renamed over the real file,
+// so a crash part way through never leaves a half written file behind. (This
+// is also what makes it safe to save a buffer that was loaded with
+// TRE_Buf_load_mapped: the old file stays in existence, under no name, for as
+// long as the mapping refers to it.)
+//
+// A save can also run on a background thread. It starts by taking a snapshot
+// of the buffer, which is only a list of where the blocks of text are, and
+// the buffer can go on being edited while the snapshot is written:
+//
+// - A piece buffer never changes or frees the text its pieces refer to, so
+//   the snapshot stays good by itself.
+// - A gap buffer moves its text around when it's edited, so the first edit
+//   while a save is running copies whatever hasn't been written yet into
+//   memory owned by the save (copy-on-write). The worker writes a chunk at a
+//   time, so the copy never waits for more than one chunk.
+
+// Most blocks of text written by one writev call.
+#if defined(IOV_MAX) && IOV_MAX < 256
+#define TRE_SAVE_IOV_MAX IOV_MAX
+#else
+#define TRE_SAVE_IOV_MAX 256
+#endif
+
+#if INTERFACE
+// Most bytes written by one writev call.
+#define TRE_SAVE_CHUNK (4 * 1024 * 1024)
+
+typedef struct {
+  const char* text;
+  TRE_Off len;
+} TRE_SaveSpan;
+
+// The step of a save that failed.
+typedef enum {
+  TRE_SAVE_OK = 0,
+  TRE_SAVE_WRITE,
+  TRE_SAVE_SYNC,
+  TRE_SAVE_RENAME
+} TRE_SaveStep;
+
+typedef struct {
+  char* path;
+  char* tmp_path;
+  int fd;
+  long long version;  // buf->version when the snapshot was taken
+  pthread_t thread;
+  int threaded;
+  // Set by the worker when it finishes. `done` is set last, atomically, so
+  // checking it doesn't have to wait for the lock.
+  int done;
+  TRE_OpResult result;
+  TRE_SaveStep failed_step;  // and errno from it, to be logged by the caller
+  int error;
+  // The fields below are shared with the worker and protected by lock. An
+  // edit that needs the lock takes `gate` first, which stops the worker from
+  // taking the lock straight back between chunks.
+  pthread_mutex_t lock;
+  pthread_mutex_t gate;
+  TRE_SaveSpan* spans;  // the text to write
+  int n_spans;
+  int span;             // the span being written, and how far into it
+  TRE_Off span_off;
+  char* owned;          // private copy of the text, once one is made
+  TRE_Off written;
+} TRE_SaveJob;
+#endif
+
+// Save the buffer to a file (or to its own file, if filename is NULL), and
+// make the result the buffer's file. Returns when the text is safely on disk.
+TRE_OpResult TRE_Buf_save(TRE_Buf* buf, const char* filename) {
+  if (TRE_FAIL == start_save(buf, filename, 0)) {
+    return TRE_FAIL;
+  }
+  return TRE_Buf_save_wait(buf);
+}
+
+// Start saving the buffer in the background. The buffer can be edited while
+// the save is running; what gets saved is the text as it was when this was
+// called. Use TRE_Buf_save_wait to find out how it went.
+TRE_OpResult TRE_Buf_save_start(TRE_Buf* buf, const char* filename) {
+  return start_save(buf, filename, 1);
+}
+
+// Check whether a background save has finished (or none is running).
+int TRE_Buf_save_done(TRE_Buf* buf) {
+  if (!buf->save) {
+    return 1;
+  }
+  return __atomic_load_n(&buf->save->done, __ATOMIC_ACQUIRE);
+}
+
+// Wait for a save to finish and return whether it worked. If the buffer
+// wasn't edited while it ran, the buffer is now unmodified.
+TRE_OpResult TRE_Buf_save_wait(TRE_Buf* buf) {
+  TRE_SaveJob* job = buf->save;
+  if (!job) {
+    return TRE_FAIL;
+  }
+  if (job->threaded) {
+    pthread_join(job->thread, NULL);
+  }
+  TRE_OpResult result = job->result;
+  if (result == TRE_FAIL) {
+    log_job_error(job);
+  } else {
+    logt("Saved %lld bytes to '%s'.", job->written, job->path);
+    if (!buf->filename || 0 != strcmp(buf->filename, job->path)) {
+      if (buf->filename) {
+        my_free(buf->filename);
+      }
+      buf->filename = my_strdup(job->path);
+    }
+    buf->file_len = job->written;
+    if (buf->version == job->version) {
+      TRE_Buf_set_save_point(buf);
+    }
+    TRE_Buf_remember_position(buf);
+  }
+  buf->save = NULL;
+  free_job(job);
+  return result;
+}
+
+// Called before an edit changes a buffer's text. If a background save is
+// reading a gap buffer's memory, the save gets its own copy of what's left
+// to write first. (A piece buffer's edits don't touch the text the save is
+// reading.)
+void TRE_Buf_before_change(TRE_Buf* buf) {
+  if (buf->save && buf->storage == TRE_BUF_STORAGE_GAP) {
+    detach_job(buf->save);
+  }
+}
+
+// Called before a buffer's text memory is freed or replaced. (The caller
+// must be about to free or replace it, or a save of a piece buffer would be
+// copied for nothing.)
+void TRE_Buf_before_free_text(TRE_Buf* buf) {
+  if (buf->save) {
+    detach_job(buf->save);
+  }
+}
+
+LOCAL TRE_OpResult start_save(TRE_Buf* buf, const char* filename,
+    int threaded) {
+  if (buf->save) {
+    // Only one save at a time.
+    TRE_Buf_save_wait(buf);
+  }
+  if (!filename && !(filename = buf->filename)) {
+    log_err("Buffer has no file to save to.");
+    return TRE_FAIL;
+  }
+  TRE_SaveJob* job = my_alloc(sizeof(TRE_SaveJob));
+  memset(job, 0, sizeof(TRE_SaveJob));
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_mutex_init(&job->gate, NULL);
+  job->path = my_strdup(filename);
+  job->version = buf->version;
+  job->fd = open_temp_file(job->path, &job->tmp_path);
+  if (job->fd < 0) {
+    log_err("Unable to create a file to save '%s': %s", filename,
+        strerror(errno));
+    free_job(job);
+    return TRE_FAIL;
+  }
+  take_snapshot(job, buf);
+  buf->save = job;
+  if (threaded && 0 == pthread_create(&job->thread, NULL, run_job, job)) {
+    job->threaded = 1;
+  } else {
+    if (threaded) {
+      log_warn("Unable to start save thread: %s", strerror(errno));
+    }
+    run_job(job);
+  }
+  return TRE_SUCC;
+}
+
+// Make a list of where the buffer's text is.
+LOCAL void take_snapshot(TRE_SaveJob* job, TRE_Buf* buf) {
+  int cap = 2;
+  job->spans = my_alloc(cap * sizeof(TRE_SaveSpan));
+  TRE_BufIter it;
+  const char* text;
+  TRE_Off len;
+  TRE_BufIter_init(&it, buf, 0, buf->text_len);
+  while (TRE_BufIter_next(&it, &text, &len)) {
+    if (job->n_spans == cap) {
+      cap *= 2;
+      job->spans = my_realloc(job->spans, cap * sizeof(TRE_SaveSpan));
+    }
+    job->spans[job->n_spans].text = text;
+    job->spans[job->n_spans].len = len;
+    job->n_spans++;
+  }
+}
+
+// Write out the snapshot, then put the file in place. This runs on the save
+// thread, if there is one, so like the indexer it doesn't log (logging is
+// only thread safe after TRE_log_start_async): what went wrong is kept in
+// the job for TRE_Buf_save_wait to report.
+LOCAL void* run_job(void* arg) {
+  TRE_SaveJob* job = arg;
+  TRE_OpResult result = write_spans(job);
+  if (result == TRE_SUCC && 0 != fsync(job->fd)) {
+    result = job_failed(job, TRE_SAVE_SYNC);
+  }
+  if (0 != close(job->fd) && result == TRE_SUCC) {
+    result = job_failed(job, TRE_SAVE_WRITE);
+  }
+  job->fd = -1;
+  if (result == TRE_SUCC && 0 != rename(job->tmp_path, job->path)) {
+    result = job_failed(job, TRE_SAVE_RENAME);
+  }
+  if (result == TRE_SUCC) {
+    sync_dir(job->path);
+  } else {
+    unlink(job->tmp_path);
+  }
+  job->result = result;
+  __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Note which step of a save failed, with errno. Returns TRE_FAIL.
+LOCAL TRE_OpResult job_failed(TRE_SaveJob* job, TRE_SaveStep step) {
+  job->failed_step = step;
+  job->error = errno;
+  return TRE_FAIL;
+}
+
+LOCAL void log_job_error(TRE_SaveJob* job) {
+  const char* err = strerror(job->error);
+  switch (job->failed_step) {
+    case TRE_SAVE_WRITE:
+      log_err("Unable to write '%s': %s", job->tmp_path, err);
+      break;
+    case TRE_SAVE_SYNC:
+      log_err("Unable to sync '%s': %s", job->tmp_path, err);
+      break;
+    case TRE_SAVE_RENAME:
+      log_err("Unable to rename '%s' to '%s': %s", job->tmp_path, job->path,
+          err);
+      break;
+    case TRE_SAVE_OK:
+      break;
+  }
+}
+
+// Write the spans to the temporary file, a chunk at a time.
+LOCAL TRE_OpResult write_spans(TRE_SaveJob* job) {
+  TRE_OpResult result = TRE_SUCC;
+  pthread_mutex_lock(&job->lock);
+  while (result == TRE_SUCC && job->span < job->n_spans) {
+    ssize_t n = write_chunk(job);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      result = job_failed(job, TRE_SAVE_WRITE);
+      break;
+    }
+    job->written += n;
+    // Move past what was written, which can end part way through a span.
+    while (n > 0) {
+      TRE_Off left = job->spans[job->span].len - job->span_off;
+      if (n < left) {
+        job->span_off += n;
+        n = 0;
+      } else {
+        n -= left;
+        job->span++;
+        job->span_off = 0;
+      }
+    }
+    // Let an edit make its copy between chunks.
+    pthread_mutex_unlock(&job->lock);
+    pthread_mutex_lock(&job->gate);
+    pthread_mutex_unlock(&job->gate);
+    pthread_mutex_lock(&job->lock);
+  }
+  pthread_mutex_unlock(&job->lock);
+  return result;
+}
+
+// Write up to TRE_SAVE_CHUNK bytes from the current span onwards in one
+// call. Returns the number of bytes written, or -1.
+LOCAL ssize_t write_chunk(TRE_SaveJob* job) {
+#ifndef _WIN32
+  struct iovec iov[TRE_SAVE_IOV_MAX];
+  int n_iov = 0;
+  TRE_Off total = 0;
+  for (int i = job->span; i < job->n_spans && n_iov < TRE_SAVE_IOV_MAX
+      && total < TRE_SAVE_CHUNK; i++) {
+    TRE_Off off = i == job->span ? job->span_off : 0;
+    TRE_Off len = job->spans[i].len - off;
+    if (len > TRE_SAVE_CHUNK - total) {
+      len = TRE_SAVE_CHUNK - total;
+    }
+    iov[n_iov].iov_base = (void*)(job->spans[i].text + off);
+    iov[n_iov].iov_len = len;
+    n_iov++;
+    total += len;
+  }
+  return writev(job->fd, iov, n_iov);
+#else
+  TRE_Off len = job->spans[job->span].len - job->span_off;
+  if (len > TRE_SAVE_CHUNK) {
+    len = TRE_SAVE_CHUNK;
+  }
+  return write(job->fd, job->spans[job->span].text + job->span_off, len);
+#endif
+}
+
+// Give a running save its own copy of the text it hasn't written yet, so the
+// buffer's memory can change.
+LOCAL void detach_job(TRE_SaveJob* job) {
+  pthread_mutex_lock(&job->gate);
+  pthread_mutex_lock(&job->lock);
+  if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE) && !job->owned) {
+    TRE_Off len = 0;
+    for (int i = job->span; i < job->n_spans; i++) {
+      len += job->spans[i].len - (i == job->span ? job->span_off : 0);
+    }
+    logt("Copying %lld bytes for a background save.", len);
+    char* copy = my_alloc(len > 0 ? len : 1);
+    char* p = copy;
+    for (int i = job->span; i < job->n_spans; i++) {
+      TRE_Off off = i == job->span ? job->span_off : 0;
+      memcpy(p, job->spans[i].text + off, job->spans[i].len - off);
+      p += job->spans[i].len - off;
+    }
+    job->owned = copy;
+    job->spans[0].text = copy;
+    job->spans[0].len = len;
+    job->n_spans = len > 0 ? 1 : 0;
+    job->span = 0;
+    job->span_off = 0;
+  }
+  pthread_mutex_unlock(&job->lock);
+  pthread_mutex_unlock(&job->gate);
+}
+
+// Create a new file to write the text to, next to the file it's going to
+// replace (rename only works within one file system), with the same
+// permissions.
+LOCAL int open_temp_file(const char* path, char** tmp_path) {
+  static int counter;
+  struct stat st;
+  mode_t mode = 0666;
+  if (0 == stat(path, &st)) {
+    mode = st.st_mode & 07777;
+  }
+  size_t size = strlen(path) + 32;
+  *tmp_path = my_alloc(size);
+  for (int tries = 0; tries < 100; tries++) {
+    snprintf(*tmp_path, size, "%s.tre-%ld-%d", path, (long)getpid(),
+        counter++);
+    int fd = open(*tmp_path, O_WRONLY | O_CREAT | O_EXCL, mode);
+    if (fd >= 0 || errno != EEXIST) {
+      return fd;
+    }
+  }
+  return -1;
+}
+
+// Sync the directory a file is in, so that the rename is on disk too.
+LOCAL void sync_dir(const char* path) {
+#ifndef _WIN32
+  char* dir = my_strdup(path);
+  char* slash = strrchr(dir, '/');
+  if (slash) {
+    *(slash == dir ? slash + 1 : slash) = '\0';
+  }
+  int fd = open(slash ? dir : ".", O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  my_free(dir);
+#else
+  (void)path;
+#endif
+}
+
+LOCAL void free_job(TRE_SaveJob* job) {
+  pthread_mutex_destroy(&job->gate);
+  pthread_mutex_destroy(&job->lock);
+  if (job->fd >= 0) {
+    close(job->fd);
+  }
+  if (job->spans) {
+    my_free(job->spans);
+  }
+  if (job->owned) {
+    my_free(job->owned);
+  }
+  if (job->tmp_path) {
+    my_free(job->tmp_path);
+  }
+  my_free(job->path);
+  my_free(job);
+}
@@ -0,0 +1,418 @@
+#include "hdrs.c"
+#include "mh_bufreg.h"
+
+// The buffer registry keeps track of every buffer open in an editor session.
+// Buffers are referred to by handle, which stays valid (and is never reused
+// for another buffer) until the buffer is closed, so a stale handle is caught
+// instead of reaching a different buffer.
+//
+// The registry keeps the buffers within a memory budget. When it's over, the
+// buffers used least recently have their text evicted: an unmodified buffer
+// whose file hasn't changed is simply freed (its text is still in the file),
+// and any other buffer has its text written to a temporary file first. The
+// cursor and undo history stay with the registry, and the buffer is loaded
+// again the next time it's asked for. Buffers that are in use (like the one
+// on the screen) can be pinned so they're never evicted.
+//
+// Getting a buffer that's loaded is a lookup in an array, so switching
+// between buffers never reads or scans a file.
+
+#if INTERFACE
+typedef uint64_t TRE_BufHandle;  // 0 is never a valid handle
+
+// Memory the registry lets buffers use by default, in bytes.
+#define TRE_BUFREG_DEFAULT_BUDGET (256 * 1024 * 1024)
+
+typedef struct {
+  TRE_Buf* buf;         // NULL while evicted
+  int in_use;
+  int pinned;
+  uint32_t gen;         // bumped each time the slot is used for a buffer
+  unsigned long long last_used;
+  TRE_Off memory;       // memory use when last measured (0 while evicted)
+  char* filename;       // the buffer's file (NULL if none)
+  time_t file_mtime;    // the file as it was when it was loaded
+  off_t file_size;
+  // While the buffer is evicted:
+  char* spill_path;     // where its text is (NULL if it's in its file)
+  line_col_t cursor;
+  TRE_Undo undo;
+  long long version;
+  TRE_Off file_len;
+  TRE_Buf_Storage storage;
+} TRE_BufRegEntry;
+
+typedef struct {
+  TRE_BufRegEntry* entries;
+  int n_entries;
+  int cap_entries;
+  unsigned long long clock;  // counts uses, for finding the least recent
+  TRE_Off budget;
+  TRE_Off memory;            // total of the entries' memory
+  long n_evictions;
+  long n_reloads;
+} TRE_BufReg;
+#endif
+
+TRE_BufReg* TRE_BufReg_new() {
+  TRE_BufReg* reg = my_alloc(sizeof(TRE_BufReg));
+  memset(reg, 0, sizeof(TRE_BufReg));
+  reg->budget = TRE_BUFREG_DEFAULT_BUDGET;
+  return reg;
+}
+
+// Free the registry and every buffer in it.
+void TRE_BufReg_free(TRE_BufReg* reg) {
+  for (int i = 0; i < reg->n_entries; i++) {
+    if (reg->entries[i].in_use) {
+      close_entry(reg, &reg->entries[i]);
+    }
+  }
+  if (reg->entries) {
+    my_free(reg->entries);
+  }
+  my_free(reg);
+}
+
+// Set how much memory the buffers can use (0 for the default), evicting
+// buffers if they're already over it.
+void TRE_BufReg_set_budget(TRE_BufReg* reg, TRE_Off budget) {
+  reg->budget = budget ? budget : TRE_BUFREG_DEFAULT_BUDGET;
+  enforce_budget(reg, NULL);
+}
+
+// Open a file in a buffer. If the file is already open, the buffer it's in
+// is used, without reading the file again. Returns 0 if the file can't be
+// loaded.
+TRE_BufHandle TRE_BufReg_open(TRE_BufReg* reg, const char* filename) {
+  TRE_BufHandle handle = TRE_BufReg_find(reg, filename);
+  if (handle) {
+    return handle;
+  }
+  TRE_Buf* buf = TRE_Buf_load(filename);
+  if (!buf) {
+    return 0;
+  }
+  return TRE_BufReg_add(reg, buf);
+}
+
+// Put a buffer into the registry, which then owns it.
+TRE_BufHandle TRE_BufReg_add(TRE_BufReg* reg, TRE_Buf* buf) {
+  TRE_BufRegEntry* e = new_entry(reg);
+  e->buf = buf;
+  e->filename = buf->filename ? my_strdup(buf->filename) : NULL;
+  stat_file(e->filename, &e->file_mtime, &e->file_size);
+  touch(reg, e);
+  TRE_BufHandle handle = make_handle(reg, e);
+  enforce_budget(reg, e);
+  return handle;
+}
+
+// Find the buffer a file is open in. Returns 0 if it isn't open.
+TRE_BufHandle TRE_BufReg_find(TRE_BufReg* reg, const char* filename) {
+  char path[PATH_MAX];
+  char open_path[PATH_MAX];
+  if (!my_realpath(filename, path)) {
+    return 0;
+  }
+  for (int i = 0; i < reg->n_entries; i++) {
+    TRE_BufRegEntry* e = &reg->entries[i];
+    if (e->in_use && e->filename && my_realpath(e->filename, open_path)
+        && 0 == strcmp(path, open_path)) {
+      return make_handle(reg, e);
+    }
+  }
+  return 0;
+}
+
+// Get the buffer for a handle, loading its text again if it was evicted.
+// Returns NULL if the handle is stale (or the text can't be loaded). The
+// buffer stays valid until it's closed or evicted; pin it to keep it from
+// being evicted while it's in use.
+TRE_Buf* TRE_BufReg_get(TRE_BufReg* reg, TRE_BufHandle handle) {
+  TRE_BufRegEntry* e = lookup(reg, handle);
+  if (!e) {
+    return NULL;
+  }
+  touch(reg, e);
+  if (!e->buf) {
+    if (TRE_FAIL == reload(reg, e)) {
+      return NULL;
+    }
+    enforce_budget(reg, e);
+  } else {
+    measure(reg, e);
+  }
+  return e->buf;
+}
+
+// Keep a buffer from being evicted (or let it be again).
+void TRE_BufReg_pin(TRE_BufReg* reg, TRE_BufHandle handle, int pinned) {
+  TRE_BufRegEntry* e = lookup(reg, handle);
+  if (e) {
+    e->pinned = pinned;
+  }
+}
+
+// Close a buffer, freeing it. The handle is no good after this.
+void TRE_BufReg_close(TRE_BufReg* reg, TRE_BufHandle handle) {
+  TRE_BufRegEntry* e = lookup(reg, handle);
+  if (e) {
+    close_entry(reg, e);
+  }
+}
+
+// Evict a buffer's text now. Returns TRE_FAIL if it's pinned, already
+// evicted, or its text can't be put aside.
+TRE_OpResult TRE_BufReg_evict(TRE_BufReg* reg, TRE_BufHandle handle) {
+  TRE_BufRegEntry* e = lookup(reg, handle);
+  if (!e || !e->buf || e->pinned) {
+    return TRE_FAIL;
+  }
+  return evict(reg, e);
+}
+
+// Check whether a buffer's text is loaded.
+int TRE_BufReg_is_loaded(TRE_BufReg* reg, TRE_BufHandle handle) {
+  TRE_BufRegEntry* e = lookup(reg, handle);
+  return e && e->buf;
+}
+
+// Memory a buffer was using when it was last measured (when it was added or
+// last got). An evicted buffer uses none.
+TRE_Off TRE_BufReg_memory(TRE_BufReg* reg, TRE_BufHandle handle) {
+  TRE_BufRegEntry* e = lookup(reg, handle);
+  return e ? e->memory : 0;
+}
+
+// Measure every buffer again, and evict buffers if they've grown past the
+// budget.
+void TRE_BufReg_trim(TRE_BufReg* reg) {
+  for (int i = 0; i < reg->n_entries; i++) {
+    if (reg->entries[i].in_use && reg->entries[i].buf) {
+      measure(reg, &reg->entries[i]);
+    }
+  }
+  enforce_budget(reg, NULL);
+}
+
+LOCAL TRE_BufRegEntry* new_entry(TRE_BufReg* reg) {
+  TRE_BufRegEntry* e = NULL;
+  for (int i = 0; i < reg->n_entries; i++) {
+    if (!reg->entries[i].in_use) {
+      e = &reg->entries[i];
+      break;
+    }
+  }
+  if (!e) {
+    if (reg->n_entries == reg->cap_entries) {
+      reg->cap_entries = reg->cap_entries ? reg->cap_entries * 2 : 16;
+      reg->entries = my_realloc(reg->entries,
+          reg->cap_entries * sizeof(TRE_BufRegEntry));
+    }
+    e = &reg->entries[reg->n_entries++];
+    e->gen = 0;
+  }
+  uint32_t gen = e->gen + 1;
+  memset(e, 0, sizeof(TRE_BufRegEntry));
+  e->gen = gen;
+  e->in_use = 1;
+  return e;
+}
+
+// A handle has the slot (plus one, so it's never 0) in the low half and the
+// slot's generation in the high half.
+LOCAL TRE_BufHandle make_handle(TRE_BufReg* reg, TRE_BufRegEntry* e) {
+  return (TRE_BufHandle)e->gen << 32 | (uint32_t)(e - reg->entries + 1);
+}
+
+LOCAL TRE_BufRegEntry* lookup(TRE_BufReg* reg, TRE_BufHandle handle) {
+  uint32_t slot = (uint32_t)handle;
+  if (slot == 0 || slot > (uint32_t)reg->n_entries) {
+    return NULL;
+  }
+  TRE_BufRegEntry* e = &reg->entries[slot - 1];
+  if (!e->in_use || e->gen != handle >> 32) {
+    return NULL;
+  }
+  return e;
+}
+
+LOCAL void touch(TRE_BufReg* reg, TRE_BufRegEntry* e) {
+  e->last_used = ++reg->clock;
+}
+
+LOCAL void measure(TRE_BufReg* reg, TRE_BufRegEntry* e) {
+  TRE_Off memory = e->buf ? TRE_Buf_memory_usage(e->buf) : 0;
+  reg->memory += memory - e->memory;
+  e->memory = memory;
+}
+
+LOCAL void close_entry(TRE_BufReg* reg, TRE_BufRegEntry* e) {
+  if (e->buf) {
+    TRE_Buf_free(e->buf);
+    e->buf = NULL;
+  } else {
+    TRE_Undo_free(&e->undo);
+  }
+  measure(reg, e);
+  if (e->spill_path) {
+    unlink(e->spill_path);
+    my_free(e->spill_path);
+  }
+  if (e->filename) {
+    my_free(e->filename);
+  }
+  e->in_use = 0;
+}
+
+// Evict the least recently used buffers until the total is within the
+// budget. The buffer `keep` (if any) was just asked for, so it stays.
+LOCAL void enforce_budget(TRE_BufReg* reg, TRE_BufRegEntry* keep) {
+  if (keep) {
+    measure(reg, keep);
+  }
+  while (reg->memory > reg->budget) {
+    TRE_BufRegEntry* victim = NULL;
+    for (int i = 0; i < reg->n_entries; i++) {
+      TRE_BufRegEntry* e = &reg->entries[i];
+      if (e->in_use && e->buf && !e->pinned && e != keep
+          && (!victim || e->last_used < victim->last_used)) {
+        victim = e;
+      }
+    }
+    if (!victim || TRE_FAIL == evict(reg, victim)) {
+      break;
+    }
+  }
+}
+
+LOCAL TRE_OpResult evict(TRE_BufReg* reg, TRE_BufRegEntry* e) {
+  TRE_Buf* buf = e->buf;
+  if (buf->save) {
+    TRE_Buf_save_wait(buf);
+  }
+  time_t mtime;
+  off_t size;
+  int in_file = e->filename && !TRE_Buf_is_modified(buf)
+    && TRE_SUCC == stat_file(e->filename, &mtime, &size)
+    && mtime == e->file_mtime && size == e->file_size;
+  if (!in_file && TRE_FAIL == spill_text(buf, &e->spill_path)) {
+    return TRE_FAIL;
+  }
+  logt("Evicting buffer for '%s' (%lld bytes)%s.",
+      e->filename ? e->filename : "(no file)", e->memory,
+      in_file ? "" : ", text put aside");
+  e->cursor.line = buf->cursor_line.num;
+  e->cursor.col = buf->cursor_col;
+  e->version = buf->version;
+  e->file_len = buf->file_len;
+  e->storage = buf->storage;
+  // The undo history stays here, so it's there when the buffer comes back.
+  e->undo = buf->undo;
+  memset(&buf->undo, 0, sizeof(TRE_Undo));
+  TRE_Buf_free(buf);
+  e->buf = NULL;
+  measure(reg, e);
+  reg->n_evictions++;
+  return TRE_SUCC;
+}
+
+LOCAL TRE_OpResult reload(TRE_BufReg* reg, TRE_BufRegEntry* e) {
+  const char* path = e->spill_path ? e->spill_path : e->filename;
+  // A spilled buffer's file is about to be deleted, so a line table saved
+  // for it would never be used.
+  TRE_Buf* buf = TRE_Buf_load_with(path,
+      e->spill_path ? TRE_BUF_LOAD_NO_LINE_CACHE : 0);
+  if (!buf) {
+    log_err("Unable to load evicted buffer from '%s': %s", path,
+        strerror(errno));
+    return TRE_FAIL;
+  }
+  time_t mtime;
+  off_t size;
+  if (!e->spill_path && (TRE_FAIL == stat_file(path, &mtime, &size)
+        || mtime != e->file_mtime || size != e->file_size)) {
+    // The file has changed, so the history doesn't apply to it any more.
+    log_info("File '%s' changed while its buffer was evicted.", path);
+    TRE_Undo_free(&e->undo);
+    e->file_mtime = mtime;
+    e->file_size = size;
+  } else {
+    TRE_Undo_free(&buf->undo);
+    buf->undo = e->undo;
+    buf->version = e->version;
+    buf->file_len = e->file_len;
+    memset(&e->undo, 0, sizeof(TRE_Undo));
+  }
+  if (e->spill_path) {
+    unlink(e->spill_path);
+    my_free(e->spill_path);
+    e->spill_path = NULL;
+    if (buf->filename) {
+      my_free(buf->filename);
+    }
+    buf->filename = e->filename ? my_strdup(e->filename) : NULL;
+  }
+  if (buf->storage != e->storage) {
+    TRE_Buf_set_storage(buf, e->storage);
+  }
+  TRE_Buf_goto_line(buf, e->cursor.line, e->cursor.col);
+  e->buf = buf;
+  reg->n_reloads++;
+  return TRE_SUCC;
+}
+
+// Write a buffer's text to a new temporary file.
+LOCAL TRE_OpResult spill_text(TRE_Buf* buf, char** path) {
+  const char* dir = getenv("TMPDIR");
+  size_t size = strlen(dir ? dir : "/tmp") + 32;
+  *path = my_alloc(size);
+  snprintf(*path, size, "%s/tre-buf-XXXXXX", dir ? dir : "/tmp");
+  int fd = mkstemp(*path);
+  if (fd < 0) {
+    log_err("Unable to create a file for an evicted buffer: %s",
+        strerror(errno));
+    my_free(*path);
+    *path = NULL;
+    return TRE_FAIL;
+  }
+  TRE_OpResult result = TRE_SUCC;
+  TRE_BufIter it;
+  const char* text;
+  TRE_Off len;
+  TRE_BufIter_init(&it, buf, 0, buf->text_len);
+  while (result == TRE_SUCC && TRE_BufIter_next(&it, &text, &len)) {
+    while (len > 0) {
+      ssize_t n = write(fd, text, len);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n < 0) {
+        log_err("Unable to write evicted buffer: %s", strerror(errno));
+        result = TRE_FAIL;
+        break;
+      }
+      text += n;
+      len -= n;
+    }
+  }
+  close(fd);
+  if (result == TRE_FAIL) {
+    unlink(*path);
+    my_free(*path);
+    *path = NULL;
+  }
+  return result;
+}
+
+LOCAL TRE_OpResult stat_file(const char* path, time_t* mtime, off_t* size) {
+  struct stat st;
+  if (!path || 0 != stat(path, &st)) {
+    *mtime = 0;
+    *size = -1;
+    return TRE_FAIL;
+  }
+  *mtime = st.st_mtime;
+  *size = st.st_size;
+  return TRE_SUCC;
+}
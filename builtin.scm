@@ -1,6 +1,6 @@
 
 (define (insert-string buf s)
-  (string-for-each (lambda (c) (insert-char! buf c)) s))
+  (replace-range! buf (cursor-offset buf) 0 s))
 
 (define (help a)
   (insert-string (current-buffer) "help"))
@@ -23,17 +23,12 @@
 
 ; Emacs-style kill-to-end-of-line function.
 (define (del-to-eol)
-  (let ((b (current-buffer)))
-    (let ((first-char (read-char-at-cursor b)))
-      ; If the cursor begins at the newline, delete it. Otherwise, delete up to
-      ; but not including the newline.
-      (if (eq? first-char #\newline)
-        (delete-char-at-cursor! b)
-        (let keep-deleting ((c first-char))
-          (if (not (eq? c #\newline))
-            (begin
-              (delete-char-at-cursor! b)
-              (keep-deleting (read-char-at-cursor b)))))))))
+  (let* ((b (current-buffer))
+         (start (cursor-offset b))
+         (end (line-end-offset b)))
+    ; If the cursor begins at the newline, delete it. Otherwise, delete up to
+    ; but not including the newline.
+    (delete-range! b start (if (= start end) 1 (- end start)))))
 
 (define (format-apply args)
   (apply format args))
@@ -12,6 +12,11 @@ void g_init_funcs() {
   scm_c_define_gsubr("insert-char!", 2, 0, 0, g_insert_char);
   scm_c_define_gsubr("read-char-at-cursor", 1, 0, 0, g_read_char);
   scm_c_define_gsubr("delete-char-at-cursor!", 1, 0, 0, g_delete_char);
+  scm_c_define_gsubr("cursor-offset", 1, 0, 0, g_cursor_offset);
+  scm_c_define_gsubr("line-end-offset", 1, 0, 0, g_line_end_offset);
+  scm_c_define_gsubr("buffer-substring", 3, 0, 0, g_buffer_substring);
+  scm_c_define_gsubr("delete-range!", 3, 0, 0, g_delete_range);
+  scm_c_define_gsubr("replace-range!", 4, 0, 0, g_replace_range);
 }
 
 LOCAL TRE_Buf* scm_to_buf(SCM _buf) {
@@ -59,3 +64,57 @@ LOCAL SCM g_delete_char(SCM _buf) {
   return SCM_UNSPECIFIED;
 }
 
+LOCAL SCM g_cursor_offset(SCM _buf) {
+  TRE_Buf* buf = scm_to_buf(_buf);
+  return scm_from_int64(TRE_Buf_get_cursor_offset(buf));
+}
+
+// Offset of the newline at the end of the cursor line.
+LOCAL SCM g_line_end_offset(SCM _buf) {
+  TRE_Buf* buf = scm_to_buf(_buf);
+  return scm_from_int64(buf->cursor_line.off + buf->cursor_line.len - 1);
+}
+
+LOCAL SCM g_buffer_substring(SCM _buf, SCM _off, SCM _len) {
+  TRE_Buf* buf = scm_to_buf(_buf);
+  TRE_Off off = scm_to_int64(_off);
+  TRE_Off len = scm_to_int64(_len);
+  if (off < 0 || len < 0 || off + len > buf->text_len) {
+    scm_out_of_range("buffer-substring", _len);
+  }
+  // Read the text in place where it's all in one piece.
+  TRE_TextRange range;
+  if (TRE_Buf_get_range(buf, off, len, &range) == len && range.n <= 1) {
+    return scm_from_latin1_stringn(range.n ? range.text[0] : "", len);
+  }
+  char* text = my_alloc(len);
+  TRE_Buf_copy_text(buf, off, text, len);
+  SCM str = scm_from_latin1_stringn(text, len);
+  my_free(text);
+  return str;
+}
+
+LOCAL SCM g_delete_range(SCM _buf, SCM _off, SCM _len) {
+  TRE_Buf* buf = scm_to_buf(_buf);
+  TRE_Off off = scm_to_int64(_off);
+  TRE_Off len = scm_to_int64(_len);
+  if (off < 0 || len < 0 || off + len > buf->text_len) {
+    scm_out_of_range("delete-range!", _len);
+  }
+  TRE_Buf_delete_range(buf, off, len);
+  return SCM_UNSPECIFIED;
+}
+
+LOCAL SCM g_replace_range(SCM _buf, SCM _off, SCM _len, SCM _str) {
+  TRE_Buf* buf = scm_to_buf(_buf);
+  TRE_Off off = scm_to_int64(_off);
+  TRE_Off len = scm_to_int64(_len);
+  if (off < 0 || len < 0 || off + len > buf->text_len) {
+    scm_out_of_range("replace-range!", _len);
+  }
+  size_t str_len;
+  char* str = scm_to_latin1_stringn(_str, &str_len);
+  TRE_Buf_replace_range(buf, off, len, str, str_len);
+  free(str);
+  return SCM_UNSPECIFIED;
+}
@@ -13,8 +13,11 @@ enum TRE_mode_t {
 typedef struct {
   // Current editing mode
   TRE_mode_t mode;
-  // Current buffer (only one supported right now)
+  // Window showing the current buffer
   TRE_Win *win;
+  // All open buffers, and the one in the window (which is kept pinned)
+  TRE_BufReg *bufs;
+  TRE_BufHandle cur_buf;
   // The status line
   WINDOW *statln;
 } TRE_RT;
@@ -35,14 +38,16 @@ void TRE_RT_err_msg(TRE_RT *rt, const char *msg)
 
 // This should only be called once
 TRE_RT *TRE_RT_init(TRE_Opts* opts) {
-  static TRE_RT rt;
+  TRE_RT* rt = my_alloc(sizeof(TRE_RT));
   if (NULL != opts) {
     // Init with opts
   }
-  rt.win = TRE_Win_new(LINES - 1, COLS, 0, 0);
-  rt.statln = newwin(1, COLS, LINES - 1, 0);
-  rt.mode = TRE_MODE_NORMAL;
-  return &rt;
+  rt->win = TRE_Win_new(LINES - 1, COLS, 0, 0);
+  rt->statln = newwin(1, COLS, LINES - 1, 0);
+  rt->mode = TRE_MODE_NORMAL;
+  rt->bufs = TRE_BufReg_new();
+  rt->cur_buf = 0;
+  return rt;
 }
 
 TRE_mode_t TRE_RT_get_mode(TRE_RT *this) {
@@ -50,16 +55,31 @@ TRE_mode_t TRE_RT_get_mode(TRE_RT *this) {
 }
 
 void TRE_RT_load_buffer(TRE_RT *this, const char *filename) {
-  TRE_Buf *buf = TRE_Buf_load(this, filename);
-  if (buf == NULL) {
+  TRE_BufHandle handle = TRE_BufReg_open(this->bufs, filename);
+  if (!handle || TRE_FAIL == TRE_RT_switch_buffer(this, handle)) {
     // ignore for now
     log_err("Failed to load buffer.");
     exit(1);
   }
-  TRE_Win_set_buf(this->win, buf);
   logt("File loaded into buffer.");
 }
 
+// Show another open buffer in the window. The buffer that was there can be
+// evicted once it's not on the screen.
+TRE_OpResult TRE_RT_switch_buffer(TRE_RT *this, TRE_BufHandle handle) {
+  TRE_Buf *buf = TRE_BufReg_get(this->bufs, handle);
+  if (buf == NULL) {
+    return TRE_FAIL;
+  }
+  if (this->cur_buf && this->cur_buf != handle) {
+    TRE_BufReg_pin(this->bufs, this->cur_buf, 0);
+  }
+  TRE_BufReg_pin(this->bufs, handle, 1);
+  this->cur_buf = handle;
+  TRE_Win_set_buf(this->win, buf);
+  return TRE_SUCC;
+}
+
 void TRE_RT_update_screen(TRE_RT *this) {
   TRE_Win_draw(this->win);
   // TODO: Draw status line
@@ -68,11 +88,17 @@ void TRE_RT_update_screen(TRE_RT *this) {
     addch(' ');
   }
   TRE_Buf_OutputBuffer b;
+  TRE_Buf *buf = this->win->buf;
+  TRE_Off loaded = TRE_Buf_loaded(buf);
   mvprintw(LINES - 1, 0,
-      "CURSOR: %s {lines: %d; text len: %d}",
-      TRE_Buf_cursor_to_string(this->win->buf, &b),
-      this->win->buf->n_lines,
-      this->win->buf->text_len);
+      "CURSOR: %s {lines: %lld; text len: %lld}",
+      TRE_Buf_cursor_to_string(buf, &b),
+      buf->n_lines,
+      buf->text_len);
+  if (loaded < buf->text_len) {
+    // Still loading in the background (the lines so far are counted).
+    printw(" loading %d%%", (int)(loaded * 100 / buf->text_len));
+  }
   TRE_Win_set_focus(this->win);
   refresh();
 }
@@ -5,7 +5,7 @@
 #if INTERFACE
 typedef struct {
   TRE_Buf *buf;
-  int view_start_pos;
+  TRE_Screen *screen; // what the window is showing
   int cursor_x;
   int cursor_y;
   WINDOW *win; // the ncurses window; abstract this later
@@ -15,7 +15,7 @@ typedef struct {
 TRE_Win *TRE_Win_new(int sz_y, int sz_x, int pos_y, int pos_x) {
   TRE_Win *this = g_new(TRE_Win, 1);
   this->buf = NULL; // start with no buffer loaded
-  this->view_start_pos = 0;
+  this->screen = TRE_Screen_new(sz_y, sz_x);
   this->win = newwin(sz_y, sz_x, pos_y, pos_x);
   logt("Created new %dx%d window at (%d, %d)", sz_y, sz_x, pos_y, pos_x);
   return this;
@@ -23,31 +23,22 @@ TRE_Win *TRE_Win_new(int sz_y, int sz_x, int pos_y, int pos_x) {
 
 void TRE_Win_set_buf(TRE_Win *this, TRE_Buf *buf) {
   this->buf = buf;
-  int view_start_pos = 0;
-  //int view_start_pos = TRE_Buf_get_cursor_offset(buf);
-  // Back up the view start position to the start of the line with the cursor
-  // in it (or to the beginning of the file, whichever comes first)
-  while (view_start_pos > 0) {
-    view_start_pos--;
-    if (buf->text.c[view_start_pos] == '\n') {
-      view_start_pos++;
-      break;
-    }
-  }
-  this->view_start_pos = view_start_pos;
+  // Start from the top, with everything redrawn.
+  this->screen->top_line = 0;
+  TRE_Screen_invalidate(this->screen);
 }
 
-// TODO: Most of this logic should really be in buffer.c, since it's
-// buffer-related logic. Only buffer.c should be dealing with offsets and
-// especially with the gap.
+// Redraw the parts of the window that have changed since the last draw.
 void TRE_Win_draw(TRE_Win *this) {
   logt("Drawing window");
   int winsz_x, winsz_y;
-  // Clear the old contents of the window
-  wclear(this->win);
-  // Get some bounds info
   getmaxyx(this->win, winsz_y, winsz_x);
-  TRE_Buf_draw(this->buf, winsz_y, winsz_x, this->view_start_pos, this);
+  if (winsz_y != this->screen->rows || winsz_x != this->screen->cols) {
+    // The screen starts out blank after a resize, so the window has to too.
+    TRE_Screen_resize(this->screen, winsz_y, winsz_x);
+    wclear(this->win);
+  }
+  TRE_Buf_draw(this->buf, this);
   wrefresh(this->win);
 }
 
@@ -57,6 +48,21 @@ TRE_OpResult TRE_Win_display_char(TRE_Win* this, int y, int x, int c) {
   return TRE_SUCC;
 }
 
+// Display a run of chars on one row, handing them to curses all at once.
+TRE_OpResult TRE_Win_display_span(TRE_Win* this, int y, int x,
+    const char* text, int len) {
+  if (ERR == mvwaddnstr(this->win, y, x, text, len)) {
+    // (curses reports an error for a span that ends in the bottom right
+    // corner, after drawing it, because the cursor can't move past it.)
+    int winsz_y, winsz_x;
+    getmaxyx(this->win, winsz_y, winsz_x);
+    if (y != winsz_y - 1 || x + len != winsz_x) {
+      return TRE_FAIL;
+    }
+  }
+  return TRE_SUCC;
+}
+
 void TRE_Win_move_cursor(TRE_Win* this, int y, int x) {
   this->cursor_y = y;
   this->cursor_x = x;
@@ -0,0 +1,147 @@
+#include "hdrs.c"
+#include "mh_compress.h"
+
+// A small, fast LZ77 compressor for blocks of text that get put aside on
+// disk (like old undo history). It favours speed over compression: matches
+// are found with a single hash table lookup, and the output is a sequence of
+// (literals, match) pairs in the same layout LZ4 uses:
+//
+//   token:1 | [more literal length] | literals | offset:2 | [more match length]
+//
+// The token's high four bits are the number of literals and the low four the
+// match length minus 4; a field of 15 means more length bytes follow (each
+// adding up to 255; a byte under 255 ends the run). The last sequence has
+// only literals.
+
+#if LOCAL_INTERFACE
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+// The compressor leaves the last few bytes as literals, so that match
+// extension never has to check for the end of the input.
+#define LZ_TAIL 5
+#endif
+
+// Most bytes TRE_compress can produce from len bytes of input.
+TRE_Off TRE_compress_bound(TRE_Off len) {
+  return len + len / 255 + 16;
+}
+
+// Compress len bytes from src into dst, which must have room for
+// TRE_compress_bound(len) bytes. Returns the compressed length.
+TRE_Off TRE_compress(const char* src, TRE_Off len, char* dst) {
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof table);
+  const unsigned char* in = (const unsigned char*)src;
+  unsigned char* out = (unsigned char*)dst;
+  TRE_Off i = 0, anchor = 0;
+  while (i + LZ_MIN_MATCH + LZ_TAIL <= len) {
+    uint32_t seq;
+    memcpy(&seq, in + i, 4);
+    uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+    TRE_Off cand = (TRE_Off)table[h] - 1;
+    table[h] = i + 1;
+    if (cand < 0 || i - cand > LZ_MAX_OFFSET
+        || 0 != memcmp(in + cand, in + i, LZ_MIN_MATCH)) {
+      i++;
+      continue;
+    }
+    TRE_Off match = LZ_MIN_MATCH;
+    while (i + match < len - LZ_TAIL && in[cand + match] == in[i + match]) {
+      match++;
+    }
+    out = put_sequence(out, in + anchor, i - anchor, i - cand, match);
+    i += match;
+    anchor = i;
+  }
+  out = put_sequence(out, in + anchor, len - anchor, 0, 0);
+  return (char*)out - dst;
+}
+
+// Decompress src into dst, which must be exactly the original length.
+// Returns TRE_FAIL if the data is corrupt (or isn't that length).
+TRE_OpResult TRE_decompress(const char* src, TRE_Off len, char* dst,
+    TRE_Off dst_len) {
+  const unsigned char* in = (const unsigned char*)src;
+  const unsigned char* end = in + len;
+  TRE_Off o = 0;
+  while (in < end) {
+    int token = *in++;
+    TRE_Off lits = token >> 4;
+    if (lits == 15 && TRE_FAIL == get_length(&in, end, &lits)) {
+      return TRE_FAIL;
+    }
+    if (lits > end - in || lits > dst_len - o) {
+      return TRE_FAIL;
+    }
+    memcpy(dst + o, in, lits);
+    in += lits;
+    o += lits;
+    if (in == end) {
+      break;
+    }
+    if (end - in < 2) {
+      return TRE_FAIL;
+    }
+    TRE_Off offset = in[0] | (in[1] << 8);
+    in += 2;
+    TRE_Off match = token & 15;
+    if (match == 15 && TRE_FAIL == get_length(&in, end, &match)) {
+      return TRE_FAIL;
+    }
+    match += LZ_MIN_MATCH;
+    if (offset == 0 || offset > o || match > dst_len - o) {
+      return TRE_FAIL;
+    }
+    // The match can overlap what it's producing, so copy a byte at a time.
+    for (TRE_Off k = 0; k < match; k++, o++) {
+      dst[o] = dst[o - offset];
+    }
+  }
+  return o == dst_len ? TRE_SUCC : TRE_FAIL;
+}
+
+LOCAL unsigned char* put_sequence(unsigned char* out,
+    const unsigned char* lits, TRE_Off n_lits, TRE_Off offset,
+    TRE_Off match) {
+  unsigned char* token = out++;
+  *token = (n_lits < 15 ? n_lits : 15) << 4;
+  if (n_lits >= 15) {
+    out = put_length(out, n_lits - 15);
+  }
+  memcpy(out, lits, n_lits);
+  out += n_lits;
+  if (match == 0) {
+    return out;
+  }
+  *out++ = offset & 0xff;
+  *out++ = offset >> 8;
+  match -= LZ_MIN_MATCH;
+  *token |= match < 15 ? match : 15;
+  if (match >= 15) {
+    out = put_length(out, match - 15);
+  }
+  return out;
+}
+
+LOCAL unsigned char* put_length(unsigned char* out, TRE_Off n) {
+  while (n >= 255) {
+    *out++ = 255;
+    n -= 255;
+  }
+  *out++ = n;
+  return out;
+}
+
+LOCAL TRE_OpResult get_length(const unsigned char** in,
+    const unsigned char* end, TRE_Off* n) {
+  int b;
+  do {
+    if (*in == end) {
+      return TRE_FAIL;
+    }
+    b = *(*in)++;
+    *n += b;
+  } while (b == 255);
+  return TRE_SUCC;
+}
@@ -0,0 +1,96 @@
+#include "hdrs.c"
+#include "mh_damage.h"
+
+// Damage records which lines of a buffer have changed since someone last
+// looked, so that whatever is showing the buffer can redraw just those lines.
+//
+// It's a sorted list of disjoint ranges of line numbers. An edit within a
+// line damages only that line; an edit that adds or removes lines shifts
+// everything after it, so it damages from its line to the end. Overlapping
+// and adjacent ranges are merged as they're added, and if a lot of scattered
+// ranges pile up they're merged into one, so the list stays short no matter
+// how many edits there are between redraws.
+
+#if INTERFACE
+// Use as the last line of a range that goes to the end of the buffer.
+#define TRE_DAMAGE_END ((TRE_Off)1 << 62)
+// Most ranges kept before they're all merged into one.
+#define TRE_DAMAGE_MAX_SPANS 32
+
+typedef struct {
+  TRE_Off first;  // first damaged line
+  TRE_Off last;   // last damaged line (inclusive), or TRE_DAMAGE_END
+} TRE_DamageSpan;
+
+typedef struct {
+  TRE_DamageSpan spans[TRE_DAMAGE_MAX_SPANS];
+  int n;
+} TRE_Damage;
+#endif
+
+void TRE_Damage_clear(TRE_Damage* d) {
+  d->n = 0;
+}
+
+int TRE_Damage_is_empty(const TRE_Damage* d) {
+  return d->n == 0;
+}
+
+// Mark lines first..last (inclusive) as damaged.
+void TRE_Damage_add(TRE_Damage* d, TRE_Off first, TRE_Off last) {
+  assert(first >= 0 && last >= first);
+  // Find the first range that ends at or after the line before this one.
+  int i = 0;
+  while (i < d->n && d->spans[i].last + 1 < first) {
+    i++;
+  }
+  // Swallow every range that starts at or before the line after this one.
+  int j = i;
+  while (j < d->n && d->spans[j].first <= last + 1) {
+    if (d->spans[j].first < first) {
+      first = d->spans[j].first;
+    }
+    if (d->spans[j].last > last) {
+      last = d->spans[j].last;
+    }
+    j++;
+  }
+  if (i == j && d->n == TRE_DAMAGE_MAX_SPANS) {
+    // No room for another range, so cover everything with one.
+    first = first < d->spans[0].first ? first : d->spans[0].first;
+    last = last > d->spans[d->n - 1].last ? last : d->spans[d->n - 1].last;
+    d->spans[0].first = first;
+    d->spans[0].last = last;
+    d->n = 1;
+    return;
+  }
+  // Replace ranges i..j-1 with the new one.
+  memmove(d->spans + i + 1, d->spans + j,
+      (d->n - j) * sizeof(TRE_DamageSpan));
+  d->n += 1 - (j - i);
+  d->spans[i].first = first;
+  d->spans[i].last = last;
+}
+
+// Mark every line as damaged.
+void TRE_Damage_add_all(TRE_Damage* d) {
+  d->spans[0].first = 0;
+  d->spans[0].last = TRE_DAMAGE_END;
+  d->n = 1;
+}
+
+// Add all of src's damage to dst.
+void TRE_Damage_merge(TRE_Damage* dst, const TRE_Damage* src) {
+  for (int i = 0; i < src->n; i++) {
+    TRE_Damage_add(dst, src->spans[i].first, src->spans[i].last);
+  }
+}
+
+int TRE_Damage_contains(const TRE_Damage* d, TRE_Off line) {
+  for (int i = 0; i < d->n && d->spans[i].first <= line; i++) {
+    if (line <= d->spans[i].last) {
+      return 1;
+    }
+  }
+  return 0;
+}
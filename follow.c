@@ -0,0 +1,284 @@
+#include "hdrs.c"
+#include "mh_follow.h"
+#ifndef _WIN32
+# include <poll.h>
+#endif
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
+
+// Follow mode keeps a buffer up to date with a file that's being added to,
+// such as a log, by reading only the bytes added to the end of the file
+// since the last look and appending them to the buffer. The line index is
+// extended as they go in, so the cost is in proportion to what was added,
+// not to the size of the file.
+//
+// On Linux an inotify instance watches the file (and its directory), so the
+// caller can sleep until something happens: wait on TRE_Follow_fd in an
+// event loop, or call TRE_Follow_wait. Elsewhere TRE_Follow_wait just sleeps
+// for the timeout, which makes it polling. Either way TRE_Follow_poll looks
+// at the file itself, so missed or spurious events don't matter.
+//
+// If the file gets shorter than what's been read, it was truncated (as by a
+// copytruncate log rotation), so the buffer is emptied and the file read
+// again from the start. (A big file's buffer refers to the file mapped into
+// memory, so following copies its text into the buffer first.) If the path
+// comes to name a different file (the old one was moved away or deleted and
+// a new one created), whatever was added to the old file is read, then the
+// new file is followed from its start, its lines going after the old ones.
+//
+// Saving a buffer replaces its file, so stop following before saving.
+
+#if INTERFACE
+// Most bytes read from the file at a time.
+#define TRE_FOLLOW_CHUNK (256 * 1024)
+
+typedef struct {
+  TRE_Buf* buf;
+  char* path;
+  int fd;             // the file being followed (-1 if there isn't one)
+  dev_t dev;          // which file that is
+  ino_t ino;
+  TRE_Off off;        // bytes of the file that are in the buffer
+  int partial;        // the file's last line is unfinished
+  int notify_fd;      // inotify instance (-1 if there isn't one)
+  int file_wd;        // watch on the file
+  int dir_wd;         // watch on its directory, for a new file at the path
+  char* chunk;        // bytes read from the file
+  long long n_truncations;
+  long long n_rotations;
+} TRE_Follow;
+#endif
+
+// Start following a buffer's file. Reading carries on from where the buffer
+// was loaded (or last saved), so edits made since then are kept: the new
+// bytes only ever go at the end. Returns NULL if the buffer has no file or
+// the file can't be opened.
+TRE_Follow* TRE_Follow_start(TRE_Buf* buf) {
+  if (!buf->filename) {
+    log_warn("Buffer has no file to follow.");
+    return NULL;
+  }
+  int fd = open(buf->filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || 0 != fstat(fd, &st)) {
+    log_err("Unable to follow '%s': %s", buf->filename, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  TRE_Follow* f = my_alloc(sizeof(TRE_Follow));
+  memset(f, 0, sizeof(TRE_Follow));
+  f->buf = buf;
+  f->path = my_strdup(buf->filename);
+  f->fd = fd;
+  f->dev = st.st_dev;
+  f->ino = st.st_ino;
+  f->chunk = my_alloc(TRE_FOLLOW_CHUNK);
+  if (buf->map_addr) {
+    // Reading a mapped file past its end crashes, so once the file can be
+    // truncated under the buffer, the text has to be a copy.
+    TRE_Buf_set_storage(buf, TRE_BUF_STORAGE_GAP);
+  }
+  f->off = buf->file_len;
+  // The buffer's final newline is either the last byte that was loaded, or
+  // was added because the file's last line was unfinished. (If the file is
+  // shorter now, the first poll finds it was truncated.)
+  char last;
+  f->partial = f->off == 0
+    || (st.st_size >= f->off && 1 == pread(fd, &last, 1, f->off - 1)
+      && last != '\n');
+  add_watches(f);
+  logt("Following '%s' from %lld.", f->path, f->off);
+  return f;
+}
+
+void TRE_Follow_stop(TRE_Follow* f) {
+  if (f->notify_fd >= 0) {
+    close(f->notify_fd);
+  }
+  if (f->fd >= 0) {
+    close(f->fd);
+  }
+  my_free(f->chunk);
+  my_free(f->path);
+  my_free(f);
+}
+
+// The descriptor to wait on (for reading) in an event loop, which becomes
+// ready when the file may have changed. Returns -1 if there isn't one, in
+// which case the caller has to poll now and then.
+int TRE_Follow_fd(TRE_Follow* f) {
+  return f->notify_fd;
+}
+
+// Bring the buffer up to date with the file. Returns the number of bytes
+// added to the buffer. If the cursor was on the last line, it moves to the
+// new last line, so a view showing it follows the end of the file; anywhere
+// else, it stays put.
+TRE_Off TRE_Follow_poll(TRE_Follow* f) {
+  drain_events(f);
+  TRE_Buf* buf = f->buf;
+  int at_end = buf->cursor_line.num == buf->n_lines - 1;
+  int truncated = 0;
+  TRE_Off added = 0;
+  struct stat st;
+  if (f->fd >= 0) {
+    if (0 == fstat(f->fd, &st) && st.st_size < f->off) {
+      log_info("'%s' was truncated; reading it again.", f->path);
+      clear_buffer(f);
+      f->n_truncations++;
+      truncated = 1;
+    }
+    added += read_new(f);
+  }
+  // Has the path been given to another file?
+  if (0 == stat(f->path, &st)
+      && (f->fd < 0 || st.st_dev != f->dev || st.st_ino != f->ino)) {
+    int fd = open(f->path, O_RDONLY);
+    if (fd >= 0 && 0 == fstat(fd, &st)) {
+      log_info("'%s' was replaced; following the new file.", f->path);
+      if (f->fd >= 0) {
+        close(f->fd);
+      }
+      f->fd = fd;
+      f->dev = st.st_dev;
+      f->ino = st.st_ino;
+      f->off = 0;
+      // The old file's last line ends where the new file starts (unless
+      // there's nothing in the buffer for it to end).
+      if (buf->text_len > 1) {
+        f->partial = 0;
+      }
+      f->n_rotations++;
+      add_file_watch(f);
+      added += read_new(f);
+    } else if (fd >= 0) {
+      close(fd);
+    }
+  }
+  if (at_end && (added > 0 || truncated)) {
+    TRE_Buf_goto_line(buf, buf->n_lines - 1, buf->cursor_col);
+  }
+  return added;
+}
+
+// Wait up to timeout_ms for the file to change, then bring the buffer up to
+// date. Returns the number of bytes added to the buffer.
+TRE_Off TRE_Follow_wait(TRE_Follow* f, int timeout_ms) {
+#ifndef _WIN32
+  struct pollfd pfd;
+  pfd.fd = f->notify_fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  // With no descriptor this just sleeps.
+  poll(&pfd, f->notify_fd >= 0 ? 1 : 0, timeout_ms);
+#else
+  (void)timeout_ms;
+#endif
+  return TRE_Follow_poll(f);
+}
+
+// Read from the end of what's been read to the end of the file, appending it
+// to the buffer.
+LOCAL TRE_Off read_new(TRE_Follow* f) {
+  TRE_Off added = 0;
+  for (;;) {
+    ssize_t n_read = pread(f->fd, f->chunk, TRE_FOLLOW_CHUNK, f->off);
+    if (n_read < 0 && errno == EINTR) {
+      continue;
+    } else if (n_read < 0) {
+      log_err("Unable to read '%s': %s", f->path, strerror(errno));
+      break;
+    }
+    TRE_Buf_append_bytes(f->buf, f->chunk, n_read, &f->partial);
+    f->off += n_read;
+    added += n_read;
+    // A short read means that's the end of the file (for now).
+    if (n_read < TRE_FOLLOW_CHUNK) {
+      break;
+    }
+  }
+  return added;
+}
+
+// Empty the buffer, so the file can be read again from the start. The undo
+// history goes too, since it's about text that's gone.
+LOCAL void clear_buffer(TRE_Follow* f) {
+  TRE_Buf* buf = f->buf;
+  TRE_Off budget = buf->undo.budget;
+  int spill = buf->undo.spill;
+  buf->undo.replaying = 1;
+  TRE_Buf_delete_range(buf, 0, buf->text_len - 1);
+  TRE_Undo_free(&buf->undo);
+  TRE_Buf_set_undo_limit(buf, budget, spill);
+  // What's left is the newline that goes with an empty file.
+  f->off = 0;
+  f->partial = 1;
+}
+
+// Set up the inotify watches: on the file, for changes to it, and on its
+// directory, for a new file taking its name.
+LOCAL void add_watches(TRE_Follow* f) {
+  f->notify_fd = -1;
+  f->file_wd = -1;
+  f->dir_wd = -1;
+#ifdef __linux__
+  f->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (f->notify_fd < 0) {
+    log_warn("Unable to watch '%s': %s", f->path, strerror(errno));
+    return;
+  }
+  add_file_watch(f);
+  char dir[PATH_MAX];
+  const char* slash = strrchr(f->path, '/');
+  if (!slash) {
+    strcpy(dir, ".");
+  } else if (PATH_MAX <= snprintf(dir, PATH_MAX, "%.*s",
+        slash == f->path ? 1 : (int)(slash - f->path), f->path)) {
+    return;
+  }
+  f->dir_wd = inotify_add_watch(f->notify_fd, dir, IN_CREATE | IN_MOVED_TO);
+  if (f->dir_wd < 0) {
+    log_warn("Unable to watch '%s': %s", dir, strerror(errno));
+  }
+#endif
+}
+
+// Watch the file at the path (in place of whatever file was watched
+// before).
+LOCAL void add_file_watch(TRE_Follow* f) {
+#ifdef __linux__
+  if (f->notify_fd < 0) {
+    return;
+  }
+  if (f->file_wd >= 0) {
+    // This fails harmlessly if the old file is gone, taking its watch.
+    inotify_rm_watch(f->notify_fd, f->file_wd);
+  }
+  f->file_wd = inotify_add_watch(f->notify_fd, f->path,
+      IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  if (f->file_wd < 0) {
+    log_warn("Unable to watch '%s': %s", f->path, strerror(errno));
+  }
+#else
+  (void)f;
+#endif
+}
+
+// Throw away the events that have come in. They only say it's time to look
+// at the file, which TRE_Follow_poll does anyway.
+LOCAL void drain_events(TRE_Follow* f) {
+#ifdef __linux__
+  if (f->notify_fd < 0) {
+    return;
+  }
+  char events[4096]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (read(f->notify_fd, events, sizeof events) > 0) {
+  }
+#else
+  (void)f;
+#endif
+}
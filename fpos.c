@@ -0,0 +1,301 @@
+#include "hdrs.c"
+#include "mh_fpos.h"
+
+// The saved-position store remembers where the cursor was in each file that
+// has been edited, so the next time the file is opened the cursor goes back
+// there.
+//
+// The store is a fixed-size hash table in a file (~/.tre/fpos.db), mapped
+// into memory. Each slot holds a 128-bit hash of a file's real path (the
+// path itself isn't kept, so every slot is the same size), the saved
+// position, and when it was last written. A path's slot is somewhere in the
+// TRE_FPOS_PROBE slots starting at the one its hash picks, so lookups and
+// updates look at that many slots at most, however many files there are.
+// When all of them are taken, an update evicts the least recently written
+// one, so the file never grows and the positions kept are the most recent.
+//
+// Several editors can use the store at once. Lookups take a shared lock on
+// the file and updates an exclusive one (fcntl record locks, which work
+// across processes), and a mutex does the same for threads in one process.
+
+#if INTERFACE
+// Number of slots in the table.
+#define TRE_FPOS_SLOTS 4096
+// Number of slots a path can be in.
+#define TRE_FPOS_PROBE 16
+
+typedef struct {
+  uint64_t key[2];     // hash of the path (0, 0 if the slot is free)
+  int64_t line;
+  int64_t col;
+  uint64_t last_used;  // value of the store's clock when last written
+  uint64_t unused[3];
+} TRE_FposSlot;
+
+typedef struct {
+  char magic[8];
+  uint32_t n_slots;
+  uint32_t unused;
+  uint64_t clock;      // counts updates, for LRU eviction
+  uint64_t n_used;
+  uint64_t reserved[4];
+} TRE_FposHeader;
+
+typedef struct {
+  int fd;
+  TRE_FposHeader* header;  // start of the mapping
+  TRE_FposSlot* slots;
+  size_t map_len;
+  pthread_mutex_t lock;
+} TRE_FposStore;
+#endif
+
+#if LOCAL_INTERFACE
+#define FPOS_MAGIC "TREFPOS2"
+#define FPOS_DB_FILENAME "fpos.db"
+// The old text file that the store replaces (imported when the store is
+// created).
+#define FPOS_TEXT_FILENAME "fpos"
+#endif
+
+// The store that buffers use, once it's been opened (or failed to open).
+LOCAL TRE_FposStore* default_store;
+LOCAL int default_store_tried;
+
+// Open (or create) a store. Returns NULL if it can't be used.
+TRE_FposStore* TRE_FposStore_open(const char* path) {
+#ifndef _WIN32
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    log_err("Unable to open position store '%s': %s", path, strerror(errno));
+    return NULL;
+  }
+  size_t map_len = sizeof(TRE_FposHeader)
+    + TRE_FPOS_SLOTS * sizeof(TRE_FposSlot);
+  // Whoever gets the lock first sets up a new (or broken) file.
+  if (TRE_FAIL == lock_file(fd, F_WRLCK)) {
+    close(fd);
+    return NULL;
+  }
+  int created = 0;
+  if (TRE_FAIL == check_file(fd, map_len, &created)) {
+    lock_file(fd, F_UNLCK);
+    close(fd);
+    return NULL;
+  }
+  lock_file(fd, F_UNLCK);
+  void* addr = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    log_err("Unable to map position store '%s': %s", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  TRE_FposStore* store = my_alloc(sizeof(TRE_FposStore));
+  store->fd = fd;
+  store->header = addr;
+  store->slots = (TRE_FposSlot*)(store->header + 1);
+  store->map_len = map_len;
+  pthread_mutex_init(&store->lock, NULL);
+  if (created) {
+    import_text_file(store, path);
+  }
+  return store;
+#else
+  (void)path;
+  return NULL;
+#endif
+}
+
+void TRE_FposStore_close(TRE_FposStore* store) {
+#ifndef _WIN32
+  munmap(store->header, store->map_len);
+#endif
+  close(store->fd);
+  pthread_mutex_destroy(&store->lock);
+  my_free(store);
+}
+
+// Look up the saved position for a file (given by its real path).
+TRE_OpResult TRE_FposStore_get(TRE_FposStore* store, const char* path,
+    line_col_t* pos) {
+  uint64_t key[2];
+  my_hash128(path, key);
+  TRE_OpResult result = TRE_FAIL;
+  pthread_mutex_lock(&store->lock);
+  lock_file(store->fd, F_RDLCK);
+  TRE_FposSlot* slot = find_slot(store, key);
+  if (slot->key[0] == key[0] && slot->key[1] == key[1]) {
+    pos->line = slot->line;
+    pos->col = slot->col;
+    result = TRE_SUCC;
+  }
+  lock_file(store->fd, F_UNLCK);
+  pthread_mutex_unlock(&store->lock);
+  return result;
+}
+
+// Save the position for a file (given by its real path).
+void TRE_FposStore_put(TRE_FposStore* store, const char* path,
+    line_col_t pos) {
+  uint64_t key[2];
+  my_hash128(path, key);
+  pthread_mutex_lock(&store->lock);
+  lock_file(store->fd, F_WRLCK);
+  TRE_FposSlot* slot = find_slot(store, key);
+  if (slot->key[0] == 0 && slot->key[1] == 0) {
+    store->header->n_used++;
+  } else if (slot->key[0] != key[0] || slot->key[1] != key[1]) {
+    logt("Evicting saved position to make room for '%s'.", path);
+  }
+  slot->key[0] = key[0];
+  slot->key[1] = key[1];
+  slot->line = pos.line;
+  slot->col = pos.col;
+  slot->last_used = ++store->header->clock;
+  lock_file(store->fd, F_UNLCK);
+  pthread_mutex_unlock(&store->lock);
+}
+
+// Get the store in the config directory, opening it the first time. Returns
+// NULL if there's no config directory (the store isn't created unless the
+// directory exists) or the store can't be used.
+TRE_FposStore* TRE_fpos_default_store() {
+  if (!default_store_tried) {
+    default_store_tried = 1;
+    char path[PATH_MAX];
+    struct stat st;
+    if (TRE_config_path(".", path, PATH_MAX)
+        && 0 == stat(path, &st) && S_ISDIR(st.st_mode)
+        && TRE_config_path(FPOS_DB_FILENAME, path, PATH_MAX)) {
+      default_store = TRE_FposStore_open(path);
+    }
+  }
+  return default_store;
+}
+
+// Use a different store for buffers (or none, if store is NULL). The caller
+// still owns the store.
+void TRE_fpos_set_default_store(TRE_FposStore* store) {
+  default_store = store;
+  default_store_tried = 1;
+}
+
+// Find the slot that has a key, or else the slot the key should go in: the
+// first free one, or failing that the least recently written one.
+LOCAL TRE_FposSlot* find_slot(TRE_FposStore* store, const uint64_t key[2]) {
+  uint32_t start = key[0] % TRE_FPOS_SLOTS;
+  TRE_FposSlot* victim = NULL;
+  for (int i = 0; i < TRE_FPOS_PROBE; i++) {
+    TRE_FposSlot* slot = &store->slots[(start + i) % TRE_FPOS_SLOTS];
+    if (slot->key[0] == key[0] && slot->key[1] == key[1]) {
+      return slot;
+    }
+    if (slot->key[0] == 0 && slot->key[1] == 0) {
+      // Slots are never emptied, so the key can't be any further on.
+      return slot;
+    }
+    if (!victim || slot->last_used < victim->last_used) {
+      victim = slot;
+    }
+  }
+  return victim;
+}
+
+// Check that a store file has a header and the right size, and set it up as
+// a new store if it doesn't. The caller holds the write lock.
+LOCAL TRE_OpResult check_file(int fd, size_t map_len, int* created) {
+  struct stat st;
+  TRE_FposHeader header;
+  if (0 != fstat(fd, &st)) {
+    return TRE_FAIL;
+  }
+  if ((size_t)st.st_size == map_len
+      && sizeof header == pread(fd, &header, sizeof header, 0)
+      && 0 == memcmp(header.magic, FPOS_MAGIC, 8)
+      && header.n_slots == TRE_FPOS_SLOTS) {
+    return TRE_SUCC;
+  }
+  if (st.st_size > 0) {
+    log_warn("Position store is damaged or from another version; "
+        "starting a new one.");
+  }
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, FPOS_MAGIC, 8);
+  header.n_slots = TRE_FPOS_SLOTS;
+  // Zeroing the file frees every slot.
+  if (0 != ftruncate(fd, 0) || 0 != ftruncate(fd, map_len)
+      || sizeof header != pwrite(fd, &header, sizeof header, 0)) {
+    log_err("Unable to set up position store: %s", strerror(errno));
+    return TRE_FAIL;
+  }
+  *created = 1;
+  return TRE_SUCC;
+}
+
+LOCAL TRE_OpResult lock_file(int fd, int type) {
+#ifndef _WIN32
+  struct flock fl;
+  memset(&fl, 0, sizeof fl);
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  while (0 != fcntl(fd, F_SETLKW, &fl)) {
+    if (errno != EINTR) {
+      log_err("Unable to lock position store: %s", strerror(errno));
+      return TRE_FAIL;
+    }
+  }
+#else
+  (void)fd;
+  (void)type;
+#endif
+  return TRE_SUCC;
+}
+
+// Bring in the positions from the text file that the store replaces, if
+// there is one next to it. Each line of that file after the first
+// ("TRE_FPOS") is a line number, a column and a path, separated by spaces.
+LOCAL void import_text_file(TRE_FposStore* store, const char* db_path) {
+  char path[PATH_MAX];
+  const char* slash = strrchr(db_path, '/');
+  int dir_len = slash ? slash + 1 - db_path : 0;
+  if (PATH_MAX <= snprintf(path, PATH_MAX, "%.*s%s", dir_len, db_path,
+        FPOS_TEXT_FILENAME)) {
+    return;
+  }
+  const char* error;
+  char* contents = my_file_get_contents(path, &error);
+  if (!contents) {
+    return;
+  }
+  char* line = contents;
+  int n_imported = 0;
+  if (0 == strncmp(line, "TRE_FPOS\n", 9)) {
+    line += 9;
+    while (*line) {
+      char* end = strchr(line, '\n');
+      if (end) {
+        *end = '\0';
+      }
+      char* tail;
+      line_col_t pos;
+      pos.line = strtoll(line, &tail, 10);
+      if (tail != line) {
+        char* col_start = tail;
+        pos.col = strtoll(col_start, &tail, 10);
+        if (tail != col_start && *tail == ' ') {
+          while (*tail == ' ') {
+            tail++;
+          }
+          TRE_FposStore_put(store, tail, pos);
+          n_imported++;
+        }
+      }
+      if (!end) {
+        break;
+      }
+      line = end + 1;
+    }
+  }
+  logt("Imported %d saved positions from '%s'.", n_imported, path);
+  my_free(contents);
+}
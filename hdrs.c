@@ -1,18 +1,25 @@
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
 #define _XOPEN_SOURCE_EXTENDED
+#define _FILE_OFFSET_BITS 64
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <sys/uio.h>
+#endif
 // #include <glib.h>
 // #include <glib/gstdio.h>
 // #include <libguile.h>
@@ -0,0 +1,249 @@
+#include "hdrs.c"
+#include "mh_linecache.h"
+
+// The line cache keeps the line index of big files between editing sessions,
+// so that reopening a file that hasn't changed doesn't have to wait for its
+// lines to be counted before the cursor can go back to where it was.
+//
+// Each file gets a sidecar file in ~/.tre/lines, named after a hash of the
+// file's real path. It starts with a header identifying the file as it was
+// when its lines were counted (its path, size and modification time, and a
+// hash of its first and last TRE_LINECACHE_SAMPLE bytes), followed by the
+// offset of every TRE_INDEXER_STRIDE-th line: the same marks the indexer
+// keeps while it works. If the header still matches the file, the table is
+// mapped and the indexer starts out with all of its marks, so any line can
+// be found straight away. The indexer still counts the lines in the
+// background, to build the full index and to check the table against the
+// text; a table that turns out to be wrong is deleted.
+//
+// The sidecar is only a cache: it's written without syncing, and anything
+// wrong with it (including a torn write) just means the lines are counted
+// the slow way.
+
+#if INTERFACE
+// Bytes at each end of a file that go into its sample hash.
+#define TRE_LINECACHE_SAMPLE (64 * 1024)
+
+typedef struct {
+  char magic[8];
+  uint32_t byte_order;   // LINECACHE_BYTE_ORDER, as it was written
+  uint32_t stride;       // lines between marks
+  uint64_t path_key[2];  // hash of the file's real path
+  int64_t size;          // the file's size and modification time
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t sample_hash;  // hash of the start and end of the file
+  int64_t n_lines;       // number of lines in the text
+  int64_t n_marks;       // number of marks after the header
+} TRE_LineCacheHeader;
+
+typedef struct {
+  TRE_LineCacheHeader header;  // the file as it is now
+  char* path;                  // the sidecar file
+  void* map;                   // the sidecar, mapped (NULL if it didn't match)
+  size_t map_len;
+  const TRE_Off* marks;        // the marks in the sidecar (NULL if none)
+} TRE_LineCache;
+#endif
+
+#if LOCAL_INTERFACE
+#define LINECACHE_MAGIC "TRELIDX1"
+#define LINECACHE_BYTE_ORDER 0x01020304
+// Directory (in the config directory) where the sidecar files go.
+#define LINECACHE_DIR "lines"
+#endif
+
+// Where the sidecar files go, once that's been worked out (NULL if they
+// aren't kept).
+LOCAL char* cache_dir;
+LOCAL int cache_dir_tried;
+
+// Look for a file's line table. The text is the file's contents, as loaded.
+// Returns NULL if line tables aren't kept; otherwise the cache's marks are
+// the table's, or NULL if there isn't one that matches the file (in which
+// case TRE_LineCache_save can write one once the lines are counted).
+TRE_LineCache* TRE_LineCache_open(const char* filename, const char* text,
+    TRE_Off size) {
+  const char* dir = TRE_linecache_dir();
+  char real_path[PATH_MAX];
+  struct stat st;
+  if (!dir || !my_realpath(filename, real_path)
+      || 0 != stat(real_path, &st) || st.st_size != size) {
+    return NULL;
+  }
+  TRE_LineCache* cache = my_alloc(sizeof(TRE_LineCache));
+  memset(cache, 0, sizeof(TRE_LineCache));
+  TRE_LineCacheHeader* header = &cache->header;
+  memcpy(header->magic, LINECACHE_MAGIC, 8);
+  header->byte_order = LINECACHE_BYTE_ORDER;
+  header->stride = TRE_INDEXER_STRIDE;
+  my_hash128(real_path, header->path_key);
+  header->size = size;
+  header->mtime_sec = st.st_mtim.tv_sec;
+  header->mtime_nsec = st.st_mtim.tv_nsec;
+  header->sample_hash = hash_sample(text, size);
+  size_t path_len = strlen(dir) + 40;
+  cache->path = my_alloc(path_len);
+  snprintf(cache->path, path_len, "%s/%016llx%016llx.idx", dir,
+      (unsigned long long)header->path_key[0],
+      (unsigned long long)header->path_key[1]);
+  if (TRE_SUCC == map_table(cache)) {
+    logt("Using cached line table for '%s' (%lld lines).", filename,
+        cache->header.n_lines);
+  }
+  return cache;
+}
+
+void TRE_LineCache_free(TRE_LineCache* cache) {
+#ifndef _WIN32
+  if (cache->map) {
+    munmap(cache->map, cache->map_len);
+  }
+#endif
+  my_free(cache->path);
+  my_free(cache);
+}
+
+// Write the line table for the file. marks[k] is the offset of line
+// k * TRE_INDEXER_STRIDE.
+void TRE_LineCache_save(TRE_LineCache* cache, const TRE_Off* marks,
+    TRE_Off n_marks, TRE_Off n_lines) {
+  assert(n_marks == n_lines / TRE_INDEXER_STRIDE + 1);
+  TRE_LineCacheHeader header = cache->header;
+  header.n_lines = n_lines;
+  header.n_marks = n_marks;
+  if (cache_dir) {
+    mkdir(cache_dir, 0755);
+  }
+  size_t tmp_len = strlen(cache->path) + 32;
+  char* tmp_path = my_alloc(tmp_len);
+  snprintf(tmp_path, tmp_len, "%s.tmp-%ld", cache->path, (long)getpid());
+  FILE* f = fopen(tmp_path, "wb");
+  int ok = f != NULL
+    && 1 == fwrite(&header, sizeof header, 1, f)
+    && (size_t)n_marks == fwrite(marks, sizeof(TRE_Off), n_marks, f);
+  if (f && 0 != fclose(f)) {
+    ok = 0;
+  }
+  if (ok && 0 == rename(tmp_path, cache->path)) {
+    logt("Saved line table (%lld lines) to '%s'.", n_lines, cache->path);
+  } else {
+    log_warn("Unable to save line table '%s': %s", cache->path,
+        strerror(errno));
+    remove(tmp_path);
+  }
+  my_free(tmp_path);
+}
+
+// Delete the file's line table (because it was wrong).
+void TRE_LineCache_discard(TRE_LineCache* cache) {
+  remove(cache->path);
+}
+
+// Get the directory the sidecar files go in (creating it the first time, if
+// the config directory exists). Returns NULL if line tables aren't kept.
+const char* TRE_linecache_dir() {
+  if (!cache_dir_tried) {
+    cache_dir_tried = 1;
+    char path[PATH_MAX];
+    struct stat st;
+    if (TRE_config_path(".", path, PATH_MAX)
+        && 0 == stat(path, &st) && S_ISDIR(st.st_mode)
+        && TRE_config_path(LINECACHE_DIR, path, PATH_MAX)
+        && (0 == mkdir(path, 0755) || errno == EEXIST)) {
+      cache_dir = my_strdup(path);
+    }
+  }
+  return cache_dir;
+}
+
+// Keep the sidecar files in a different directory (or don't keep them, if
+// dir is NULL).
+void TRE_linecache_set_dir(const char* dir) {
+  if (cache_dir) {
+    my_free(cache_dir);
+  }
+  cache_dir = dir ? my_strdup(dir) : NULL;
+  cache_dir_tried = 1;
+}
+
+// Map the sidecar file, if it's there and matches the file.
+LOCAL TRE_OpResult map_table(TRE_LineCache* cache) {
+  int fd = open(cache->path, O_RDONLY);
+  if (fd < 0) {
+    return TRE_FAIL;
+  }
+  TRE_LineCacheHeader header;
+  struct stat st;
+  // Everything before the counts has to match the file as it is now.
+  size_t key_len = offsetof(TRE_LineCacheHeader, n_lines);
+  if (0 != fstat(fd, &st)
+      || sizeof header != pread(fd, &header, sizeof header, 0)
+      || 0 != memcmp(&header, &cache->header, key_len)
+      || header.n_lines <= 0
+      || header.n_marks != header.n_lines / TRE_INDEXER_STRIDE + 1
+      || (unsigned long long)st.st_size
+        != sizeof header + header.n_marks * sizeof(TRE_Off)) {
+    logt("Line table '%s' doesn't match the file.", cache->path);
+    close(fd);
+    return TRE_FAIL;
+  }
+#ifndef _WIN32
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    log_warn("Unable to map line table '%s': %s", cache->path,
+        strerror(errno));
+    return TRE_FAIL;
+  }
+  const TRE_Off* marks = (const TRE_Off*)((const char*)map + sizeof header);
+  if (TRE_FAIL == check_marks(marks, &header)) {
+    logt("Line table '%s' is damaged.", cache->path);
+    munmap(map, st.st_size);
+    return TRE_FAIL;
+  }
+  cache->map = map;
+  cache->map_len = st.st_size;
+  cache->marks = marks;
+  cache->header.n_lines = header.n_lines;
+  cache->header.n_marks = header.n_marks;
+  return TRE_SUCC;
+#else
+  close(fd);
+  return TRE_FAIL;
+#endif
+}
+
+// Check that marks are in order and within the text, so that looking lines
+// up with them is safe even if they're wrong.
+LOCAL TRE_OpResult check_marks(const TRE_Off* marks,
+    const TRE_LineCacheHeader* header) {
+  if (marks[0] != 0) {
+    return TRE_FAIL;
+  }
+  for (TRE_Off k = 1; k < header->n_marks; k++) {
+    if (marks[k] <= marks[k - 1]) {
+      return TRE_FAIL;
+    }
+  }
+  // Only a mark for the line after the last one can be at the end.
+  TRE_Off last = marks[header->n_marks - 1];
+  return last < header->size
+    || (last <= header->size + 1
+      && header->n_lines % TRE_INDEXER_STRIDE == 0)
+    ? TRE_SUCC : TRE_FAIL;
+}
+
+// FNV-1a hash of the first and last TRE_LINECACHE_SAMPLE bytes of a text
+// (which are the same bytes, for a small one), along with its size.
+LOCAL uint64_t hash_sample(const char* text, TRE_Off size) {
+  uint64_t h = 14695981039346656037ULL ^ (uint64_t)size;
+  TRE_Off head = size < TRE_LINECACHE_SAMPLE ? size : TRE_LINECACHE_SAMPLE;
+  for (TRE_Off i = 0; i < head; i++) {
+    h = (h ^ (unsigned char)text[i]) * 1099511628211ULL;
+  }
+  for (TRE_Off i = size - head; i < size; i++) {
+    h = (h ^ (unsigned char)text[i]) * 1099511628211ULL;
+  }
+  return h;
+}
@@ -3,8 +3,6 @@
 #include <time.h>
 #ifdef _WIN32
 # include <windows.h>
-#else
-# include <execinfo.h>
 #endif
 
 #if INTERFACE
@@ -16,8 +14,22 @@ typedef enum {
 , LL_ERROR = 5
 , LL_FATAL = 6
 } TRE_LogLevel;
+// Log calls below this level are compiled out. It can be set with
+// -DTRE_LOG_MIN_LEVEL=n (using the numbers above).
+#ifndef TRE_LOG_MIN_LEVEL
+# ifdef NDEBUG
+#  define TRE_LOG_MIN_LEVEL 3
+# else
+#  define TRE_LOG_MIN_LEVEL 1
+# endif
+#endif
+// The level check is done before the call, so when a message isn't going to
+// be logged its arguments aren't evaluated. When the level is below
+// TRE_LOG_MIN_LEVEL the condition is a constant and the whole call goes away.
 #define logmsg(level, ...) \
-  impl_log(level, __FILE__, __LINE__, __VA_ARGS__)
+  ((level) >= TRE_LOG_MIN_LEVEL && (level) >= log_level \
+   ? impl_log(level, __FILE__, __LINE__, __func__, __VA_ARGS__) \
+   : (void)0)
 #define logt(...) logmsg(LL_TRACE, __VA_ARGS__)
 #define logd(...) logmsg(LL_DEBUG, __VA_ARGS__)
 #define log_info(...) logmsg(LL_INFO, __VA_ARGS__)
@@ -30,13 +42,9 @@ typedef enum {
    exit(-1))
 #endif
 
-TRE_LogLevel log_level =
-#ifdef NDEBUG
-  LL_INFO
-#else
-  LL_TRACE
-#endif
-;
+// Messages below this level aren't logged. (It can't be set lower than
+// TRE_LOG_MIN_LEVEL.)
+TRE_LogLevel log_level = TRE_LOG_MIN_LEVEL;
 FILE *log_file = NULL;
 
 //void print_err(const char *err_msg)
@@ -65,81 +73,471 @@ void dummy_func()
   print_err("abc");
 }
 
+#if LOCAL_INTERFACE
+// Number of records the async log ring holds. Must be a power of two.
+#define LOG_RING_SIZE 4096
+// Most arguments (including '*' widths and precisions) a queued message can
+// have. A message with more is formatted by the logging thread instead.
+#define LOG_MAX_ARGS 8
+// Room in a queued record for the format and the text of its string
+// arguments (or for the formatted message; longer ones are cut off).
+#define LOG_DATA_LEN 192
+// How long the log writer sleeps when there's nothing to write.
+#define LOG_WRITER_SLEEP_NS (5 * 1000 * 1000)
+
+// An argument of a queued message. String arguments are copied into the
+// record, and `i` is where the copy is.
+typedef union {
+  long long i;
+  unsigned long long u;
+  double d;
+  long double ld;
+  const void* p;
+} log_arg_t;
+
+// A message waiting in the async log ring. `seq` says whose turn it is to
+// use the slot: when it equals the position a producer is writing to, the
+// slot is free; when it's one more, the record is ready to be written.
+typedef struct {
+  unsigned long long seq;
+  TRE_LogLevel level;
+  int line;
+  const char* file;
+  const char* func;
+  time_t time;
+  int n_args;           // -1 if data is the message, already formatted
+  log_arg_t args[LOG_MAX_ARGS];
+  char data[LOG_DATA_LEN];  // the format, then the string arguments
+} log_record_t;
+
+// A printf conversion spec, as the async logger understands it.
+typedef struct {
+  const char* flags;
+  int n_flags;
+  const char* width;    // digits, or "*"
+  int n_width;
+  int has_prec;
+  const char* prec;     // digits, or "*"
+  int n_prec;
+  char len_mod;         // 0, 'H' (hh), 'h', 'l', 'q' (ll), 'j', 'z', 't', 'L'
+  char conv;
+} log_spec_t;
+#endif
+
+// The async log ring. Producers claim positions by bumping log_ring_tail
+// (so several threads can log at once without locking); the writer thread
+// is the only one that touches log_ring_head. If the ring is full, the
+// message is dropped and counted instead of making the producer wait.
+LOCAL log_record_t log_ring[LOG_RING_SIZE];
+LOCAL unsigned long long log_ring_head = 0;
+LOCAL unsigned long long log_ring_tail = 0;
+LOCAL unsigned long long log_dropped = 0;
+LOCAL int log_async = 0;
+LOCAL int log_writer_stop = 0;
+LOCAL pthread_t log_writer;
+LOCAL int log_open_failed = 0;
+// Set once the log file has been opened. The file is started afresh the
+// first time, and added to if it's opened again after close_log_file.
+LOCAL int log_opened = 0;
+
+// Switch to asynchronous logging. The logging thread copies each message's
+// format and arguments into a ring buffer, and a background thread formats
+// them and writes them out in batches, so logging never waits for the disk
+// and does little more than a memcpy. (A message the ring can't hold that
+// way, with too many arguments or too much text, is formatted before it's
+// queued.) close_log_file (which is run at exit) writes out whatever is
+// left.
+TRE_OpResult TRE_log_start_async() {
+  if (log_async) {
+    return TRE_SUCC;
+  }
+  if (!open_log_file()) {
+    return TRE_FAIL;
+  }
+  for (int i = 0; i < LOG_RING_SIZE; i++) {
+    log_ring[i].seq = i;
+  }
+  log_ring_head = log_ring_tail = 0;
+  __atomic_store_n(&log_dropped, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&log_writer_stop, 0, __ATOMIC_RELAXED);
+  if (0 != pthread_create(&log_writer, NULL, write_log_records, NULL)) {
+    log_warn("Unable to start log writer thread: %s", strerror(errno));
+    return TRE_FAIL;
+  }
+  __atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+  return TRE_SUCC;
+}
+
+// Number of messages the async logger has had to drop because the ring was
+// full.
+unsigned long long TRE_log_dropped() {
+  return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
+
 // TODO: Figure out some way to get prototype for this to include
 // __attribute__((format(printf,4,5))) in a way that's compatible with
 // Makeheaders.
-void impl_log(TRE_LogLevel level, const char *file, int line, const char *format, ...)
+void impl_log(TRE_LogLevel level, const char *file, int line, const char *func, const char *format, ...)
 {
-  static int attempted_open = 0;
   va_list args;
-  char time_fmt[20];
   if (level < log_level) return;
-  if (NULL == log_file && !attempted_open)
+  if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)) {
+    va_start(args, format);
+    queue_log_record(level, file, line, func, format, args);
+    va_end(args);
+    return;
+  }
+  if (!open_log_file()) return;
+  write_log_prefix(level, file, line, func, time(NULL));
+  va_start(args, format);
+  vfprintf(log_file, format, args);
+  va_end(args);
+  putc('\n', log_file);
+  fflush(log_file);
+}
+
+// Open the log file if it isn't open yet. Returns zero if it can't be.
+LOCAL int open_log_file()
+{
+  if (NULL == log_file && !log_open_failed)
   {
-    log_file = fopen(default_log_filename, "w");
+    log_file = fopen(default_log_filename, log_opened ? "a" : "w");
     if (NULL == log_file)
     {
-      print_err("Unable to open log file.");
-      attempted_open = 1;
-      return;
+      fprintf(stderr, "Unable to open log file.\n");
+      log_open_failed = 1;
+      return 0;
+    }
+    if (!log_opened)
+    {
+      log_opened = 1;
+      atexit(close_log_file);
     }
-    atexit(close_log_file);
   }
-  fprintf(log_file, "[%s][%s:%d] ", iso_time(time_fmt), file, line);
+  return NULL != log_file;
+}
+
+LOCAL void write_log_prefix(TRE_LogLevel level, const char *file, int line,
+    const char *func, time_t when)
+{
+  char time_fmt[20];
+  fprintf(log_file, "[%s][%s:%d] ", iso_time(time_fmt, when), file, line);
   if (level == LL_FATAL) {
     fprintf(log_file, "(FATAL) ");
   }
-#if !defined(NDEBUG) && !defined(_WIN32)
   else if (level == LL_TRACE) {
-    char func[256];
-    fprintf(log_file, "(%s) ", current_function(func, 256));
+    fprintf(log_file, "(%s) ", func);
   }
-#endif
-  va_start(args, format);
-  vfprintf(log_file, format, args);
-  va_end(args);
-  va_start(args, format);
-  //vfprintf(stderr, format, args); // XXX: Do we need 2 streams here?
-  va_end(args);
-  putc('\n', log_file);
-  //putc('\n', stderr);
-  fflush(log_file);
 }
 
-#ifndef _WIN32
-char* current_function(char* func, int len) {
-  void *btbuf[256];
-  int btsz = backtrace(btbuf, 256);
-  if (btsz > 0) {
-    char** btsym = backtrace_symbols(btbuf, btsz);
-    if (NULL != btsym) {
-      // Stack entries look like this: ./tre(TRE_Buf_load+0x1e6) [0x403e55]
-      char* func_nm = btsym[2];
-      // Find the left paren that precedes the function name
-      func_nm = strchr(func_nm, '(');
-      if (func_nm == NULL) {
-        return "?L";
-      } else {
-        func_nm++;
+// Put a message into the async log ring (or count it as dropped, if the
+// ring is full).
+LOCAL void queue_log_record(TRE_LogLevel level, const char *file, int line,
+    const char *func, const char *format, va_list args)
+{
+  unsigned long long pos =
+    __atomic_load_n(&log_ring_tail, __ATOMIC_RELAXED);
+  log_record_t* rec;
+  for (;;) {
+    rec = &log_ring[pos & (LOG_RING_SIZE - 1)];
+    unsigned long long seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    long long diff = (long long)(seq - pos);
+    if (diff == 0) {
+      // The slot is free; try to claim it. (On failure pos is reloaded.)
+      if (__atomic_compare_exchange_n(&log_ring_tail, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The writer hasn't got to this slot's last record yet: full.
+      __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      // Another producer got this slot first.
+      pos = __atomic_load_n(&log_ring_tail, __ATOMIC_RELAXED);
+    }
+  }
+  rec->level = level;
+  rec->file = file;
+  rec->line = line;
+  rec->func = func;
+  rec->time = time(NULL);
+  va_list args_copy;
+  va_copy(args_copy, args);
+  if (!capture_message(rec, format, args_copy)) {
+    vsnprintf(rec->data, LOG_DATA_LEN, format, args);
+    rec->n_args = -1;
+  }
+  va_end(args_copy);
+  __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Copy a message's format and arguments into a record, for the writer to
+// format. Returns zero if the message doesn't fit, or has a conversion that
+// isn't handled (in which case args has been partly used up).
+LOCAL int capture_message(log_record_t* rec, const char* format,
+    va_list args)
+{
+  size_t used = strlen(format) + 1;
+  if (used >= LOG_DATA_LEN) {
+    return 0;
+  }
+  memcpy(rec->data, format, used);
+  int n = 0;
+  log_spec_t spec;
+  for (const char* p = format; *p; p++) {
+    if (*p != '%') {
+      continue;
+    }
+    if (p[1] == '%') {
+      p++;
+      continue;
+    }
+    if (!(p = parse_spec(p + 1, &spec))) {
+      return 0;
+    }
+    p--;
+    int n_needed = 1 + (spec.width && *spec.width == '*')
+      + (spec.has_prec && *spec.prec == '*');
+    if (n + n_needed > LOG_MAX_ARGS) {
+      return 0;
+    }
+    if (spec.width && *spec.width == '*') {
+      rec->args[n++].i = va_arg(args, int);
+    }
+    if (spec.has_prec && *spec.prec == '*') {
+      rec->args[n++].i = va_arg(args, int);
+    }
+    log_arg_t* arg = &rec->args[n++];
+    switch (spec.conv) {
+      case 'd': case 'i':
+        switch (spec.len_mod) {
+          case 'H': arg->i = (signed char)va_arg(args, int); break;
+          case 'h': arg->i = (short)va_arg(args, int); break;
+          case 'l': arg->i = va_arg(args, long); break;
+          case 'q': arg->i = va_arg(args, long long); break;
+          case 'j': arg->i = va_arg(args, intmax_t); break;
+          case 'z': arg->i = va_arg(args, ssize_t); break;
+          case 't': arg->i = va_arg(args, ptrdiff_t); break;
+          default: arg->i = va_arg(args, int); break;
+        }
+        break;
+      case 'u': case 'x': case 'X': case 'o':
+        switch (spec.len_mod) {
+          case 'H': arg->u = (unsigned char)va_arg(args, unsigned); break;
+          case 'h': arg->u = (unsigned short)va_arg(args, unsigned); break;
+          case 'l': arg->u = va_arg(args, unsigned long); break;
+          case 'q': arg->u = va_arg(args, unsigned long long); break;
+          case 'j': arg->u = va_arg(args, uintmax_t); break;
+          case 'z': arg->u = va_arg(args, size_t); break;
+          case 't': arg->u = va_arg(args, ptrdiff_t); break;
+          default: arg->u = va_arg(args, unsigned); break;
+        }
+        break;
+      case 'c':
+        arg->i = va_arg(args, int);
+        break;
+      case 'p':
+        arg->p = va_arg(args, void*);
+        break;
+      case 's': {
+        // The string may not be around by the time the writer gets to it.
+        const char* s = va_arg(args, const char*);
+        if (!s) {
+          s = "(null)";
+        }
+        if (used >= LOG_DATA_LEN) {
+          return 0;
+        }
+        size_t len = strlen(s);
+        if (len > LOG_DATA_LEN - used - 1) {
+          len = LOG_DATA_LEN - used - 1;
+        }
+        memcpy(rec->data + used, s, len);
+        rec->data[used + len] = '\0';
+        arg->i = used;
+        used += len + 1;
+        break;
       }
-      // Find the plus that follows the function name
-      char* right_edge = strchr(func_nm, '+');
-      if (right_edge == NULL) {
-        // return "ROOT";
-        return btsym[2];
+      default:
+        if (spec.len_mod == 'L') {
+          arg->ld = va_arg(args, long double);
+        } else {
+          arg->d = va_arg(args, double);
+        }
+        break;
+    }
+  }
+  rec->n_args = n;
+  return 1;
+}
+
+// Parse a conversion spec (starting just after the '%'). Returns a pointer
+// past it, or NULL if it's one the async logger doesn't handle.
+LOCAL const char* parse_spec(const char* p, log_spec_t* spec)
+{
+  memset(spec, 0, sizeof(log_spec_t));
+  spec->flags = p;
+  while (*p && strchr("-+ #0", *p)) {
+    p++;
+  }
+  spec->n_flags = p - spec->flags;
+  if (*p == '*') {
+    spec->width = p++;
+    spec->n_width = 1;
+  } else if (isdigit((unsigned char)*p)) {
+    spec->width = p;
+    while (isdigit((unsigned char)*p)) {
+      p++;
+    }
+    spec->n_width = p - spec->width;
+  }
+  if (*p == '.') {
+    spec->has_prec = 1;
+    spec->prec = ++p;
+    if (*p == '*') {
+      p++;
+    } else {
+      while (isdigit((unsigned char)*p)) {
+        p++;
       }
-      *right_edge = 0;
-      strncpy(func, func_nm, len);
-      free(btsym);
-      return func;
+    }
+    spec->n_prec = p - spec->prec;
+  }
+  if (p[0] == 'h' && p[1] == 'h') {
+    spec->len_mod = 'H';
+    p += 2;
+  } else if (p[0] == 'l' && p[1] == 'l') {
+    spec->len_mod = 'q';
+    p += 2;
+  } else if (*p && strchr("hljztL", *p)) {
+    spec->len_mod = *p++;
+  }
+  spec->conv = *p;
+  // Keep the spec short enough for write_log_message to rebuild it.
+  if (spec->n_flags > 5 || spec->n_width > 9 || spec->n_prec > 9) {
+    return NULL;
+  }
+  if (*p && strchr("diuxXo", *p)) {
+    return spec->len_mod == 'L' ? NULL : p + 1;
+  } else if (*p && strchr("csp", *p)) {
+    return spec->len_mod ? NULL : p + 1;
+  } else if (*p && strchr("fFeEgGaA", *p)) {
+    return !spec->len_mod || spec->len_mod == 'l' || spec->len_mod == 'L'
+      ? p + 1 : NULL;
+  }
+  return NULL;
+}
+
+// Format a queued message and write it out.
+LOCAL void write_log_message(const log_record_t* rec)
+{
+  if (rec->n_args < 0) {
+    fputs(rec->data, log_file);
+    return;
+  }
+  const log_arg_t* arg = rec->args;
+  log_spec_t spec;
+  for (const char* p = rec->data; *p; p++) {
+    if (*p != '%') {
+      putc(*p, log_file);
+      continue;
+    }
+    if (p[1] == '%') {
+      putc('%', log_file);
+      p++;
+      continue;
+    }
+    // The message was checked when it was queued, so this can't fail.
+    p = parse_spec(p + 1, &spec) - 1;
+    // Rebuild the spec with the '*' values filled in and the length that the
+    // argument was kept at.
+    char fmt[48];
+    int n = snprintf(fmt, sizeof fmt, "%%%.*s", spec.n_flags, spec.flags);
+    if (spec.width && *spec.width == '*') {
+      n += snprintf(fmt + n, sizeof fmt - n, "%d", (int)(arg++)->i);
     } else {
-      return "?N";
+      n += snprintf(fmt + n, sizeof fmt - n, "%.*s", spec.n_width,
+          spec.width ? spec.width : "");
+    }
+    if (spec.has_prec && spec.n_prec == 1 && *spec.prec == '*') {
+      n += snprintf(fmt + n, sizeof fmt - n, ".%d", (int)(arg++)->i);
+    } else if (spec.has_prec) {
+      n += snprintf(fmt + n, sizeof fmt - n, ".%.*s", spec.n_prec,
+          spec.prec);
+    }
+    switch (spec.conv) {
+      case 'd': case 'i':
+        snprintf(fmt + n, sizeof fmt - n, "ll%c", spec.conv);
+        fprintf(log_file, fmt, arg->i);
+        break;
+      case 'u': case 'x': case 'X': case 'o':
+        snprintf(fmt + n, sizeof fmt - n, "ll%c", spec.conv);
+        fprintf(log_file, fmt, arg->u);
+        break;
+      case 'c':
+        snprintf(fmt + n, sizeof fmt - n, "c");
+        fprintf(log_file, fmt, (int)arg->i);
+        break;
+      case 'p':
+        snprintf(fmt + n, sizeof fmt - n, "p");
+        fprintf(log_file, fmt, arg->p);
+        break;
+      case 's':
+        snprintf(fmt + n, sizeof fmt - n, "s");
+        fprintf(log_file, fmt, rec->data + arg->i);
+        break;
+      default:
+        if (spec.len_mod == 'L') {
+          snprintf(fmt + n, sizeof fmt - n, "L%c", spec.conv);
+          fprintf(log_file, fmt, arg->ld);
+        } else {
+          snprintf(fmt + n, sizeof fmt - n, "%c", spec.conv);
+          fprintf(log_file, fmt, arg->d);
+        }
+        break;
     }
-  } else {
-    return "?0";
+    arg++;
   }
 }
-#endif
+
+// Write out every record that's ready. Returns the number written.
+LOCAL int drain_log_ring()
+{
+  int n = 0;
+  for (;;) {
+    log_record_t* rec = &log_ring[log_ring_head & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != log_ring_head + 1) {
+      break;
+    }
+    write_log_prefix(rec->level, rec->file, rec->line, rec->func, rec->time);
+    write_log_message(rec);
+    putc('\n', log_file);
+    // Hand the slot back to the producers, for the next time round the ring.
+    __atomic_store_n(&rec->seq, log_ring_head + LOG_RING_SIZE,
+        __ATOMIC_RELEASE);
+    log_ring_head++;
+    n++;
+  }
+  if (n > 0) {
+    fflush(log_file);
+  }
+  return n;
+}
+
+// The log writer thread.
+LOCAL void* write_log_records(void* arg)
+{
+  (void)arg;
+  const struct timespec nap = { 0, LOG_WRITER_SLEEP_NS };
+  while (!__atomic_load_n(&log_writer_stop, __ATOMIC_ACQUIRE)) {
+    if (0 == drain_log_ring()) {
+      nanosleep(&nap, NULL);
+    }
+  }
+  drain_log_ring();
+  return NULL;
+}
 
 /*
 void log_raw(const char *prefix_msg, const char *data, int len)
@@ -166,20 +564,30 @@ void log_raw(const char *prefix_msg, const char *data, int len)
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat"
 
-const char *iso_time(char time_fmt[20])
+const char *iso_time(char time_fmt[20], time_t when)
 {
-  time_t rawtime;
-  time(&rawtime);
-  // struct tm *gmt = ;
-  strftime(time_fmt, 20, "%F %T", gmtime(&rawtime));
+  strftime(time_fmt, 20, "%F %T", gmtime(&when));
   return time_fmt;
 }
 
 #pragma GCC diagnostic pop
 
+// Close the log file. If logging is async, the writer thread is stopped
+// first, after it has written out everything in the ring. Messages logged
+// after this go to the file synchronously again (reopening it to add to it).
 void close_log_file()
 {
+  if (log_async)
+  {
+    __atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_writer_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(log_writer, NULL);
+    unsigned long long dropped = TRE_log_dropped();
+    if (dropped > 0)
+      fprintf(log_file, "(%llu log messages dropped)\n", dropped);
+  }
   if (NULL != log_file)
     fclose(log_file);
+  log_file = NULL;
 }
 
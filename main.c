@@ -13,44 +13,49 @@
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
+// Usage: tre [-u socket-path] [file]
+// With -u the server listens on a Unix domain socket instead of TCP.
 int main(int argc, char *argv[]) {
+  const char* socket_path = NULL;
+  int opt;
+  while (-1 != (opt = getopt(argc, argv, "u:"))) {
+    switch (opt) {
+      case 'u':
+        socket_path = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-u socket-path] [file]\n", argv[0]);
+        return 1;
+    }
+  }
+  TRE_log_start_async();
   net_init();
-  main_loop();
+  main_loop(optind < argc ? argv[optind] : NULL, socket_path);
   return 0;
 }
 
-void main_loop() {
-  int server_fd = net_listen();
-  for (;;) {
-    int client_fd = net_accept(server_fd);
-    if (client_fd >= 0) {
-      for (;;) {
-        char client_cmd[BUFSIZ];
-        char server_cmd[BUFSIZ];
-        int client_cmd_len = net_recv(client_fd, client_cmd, BUFSIZ - 1);
-        if (client_cmd_len < 1)
-          break;
-        client_cmd[client_cmd_len] = '\0';
-        int server_cmd_len = process_command(client_cmd, client_cmd_len, server_cmd);
-        if (server_cmd_len == 6 && !strcmp("quit\r\n", server_cmd)) {
-          net_close(client_fd);
-          break;
-        }
-        int send_result = net_send(client_fd, server_cmd, server_cmd_len);
-        if (send_result < 1)
-          break;
-      }
-    }
+// Serve the buffer for a file (or an empty buffer) to any number of clients,
+// using the protocol in proto.c.
+void main_loop(const char* filename, const char* socket_path) {
+  TRE_Buf* buf = filename ? TRE_Buf_load(filename) : NULL;
+  if (buf == NULL) {
+    buf = TRE_Buf_new(filename);
   }
-}
-
-int process_command(const char* client_cmd, int client_cmd_len, char* server_cmd) {
-  if (client_cmd_len == 6 && !strcmp("quit\r\n", client_cmd)) {
-    strcpy(server_cmd, "quit\r\n");
-  } else {
-    strcpy(server_cmd, "OK\r\n");
+  int server_fd = socket_path ? net_listen_unix(socket_path) : net_listen();
+  if (server_fd < 0) {
+    TRE_Buf_free(buf);
+    return;
+  }
+  TRE_Server* srv = TRE_Server_new(server_fd, TRE_Proto_handle);
+  srv->handle_close = TRE_Proto_close;
+  srv->data = buf;
+  TRE_Server_run(srv);
+  TRE_Server_free(srv);
+  net_close(server_fd);
+  if (socket_path) {
+    unlink(socket_path);
   }
-  return strlen(server_cmd);
+  TRE_Buf_free(buf);
 }
 
 /*
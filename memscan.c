@@ -0,0 +1,237 @@
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define TRE_SCAN_X86 1
+#endif
+
+#include "hdrs.c"
+#ifdef TRE_SCAN_X86
+# include <immintrin.h>
+#endif
+#include "mh_memscan.h"
+
+// Kernels for finding and counting the newlines in a block of memory. Every
+// scan of the text for line breaks (loading, indexing, inserting) ends up in
+// here, so these are worth making fast.
+//
+// On x86 there are SSE2 and AVX2 versions, which compare 16 or 32 chars at a
+// time. They're compiled with target attributes, so the rest of the program
+// doesn't need any special flags, and which one gets used is decided the
+// first time a scan is done, from what the CPU supports. Everywhere else (and
+// on CPUs with neither) the generic version is used.
+//
+// The generic find is just memchr. glibc's memchr is already vectorized (and
+// picks its own version for the CPU), and it's at least as fast as the
+// kernels here, so with glibc it's used for finding even when a vector
+// kernel is chosen for counting. Other C libraries (e.g. the Windows one)
+// have a plain loop.
+
+#if INTERFACE
+typedef enum {
+  TRE_SCAN_GENERIC,
+  TRE_SCAN_SSE2,
+  TRE_SCAN_AVX2,
+  TRE_SCAN_N_KERNELS
+} TRE_Scan_Kernel;
+#endif
+
+#if LOCAL_INTERFACE
+typedef struct {
+  const char* name;
+  const char* (*find)(const char* p, TRE_Off len);
+  TRE_Off (*count)(const char* p, TRE_Off len);
+} scan_kernel_t;
+#endif
+
+LOCAL const scan_kernel_t scan_kernels[TRE_SCAN_N_KERNELS] = {
+  { "generic", find_generic, count_generic },
+#ifdef TRE_SCAN_X86
+  { "sse2", find_sse2, count_sse2 },
+  { "avx2", find_avx2, count_avx2 },
+#else
+  { "sse2", NULL, NULL },
+  { "avx2", NULL, NULL },
+#endif
+};
+
+LOCAL const char* (*scan_find)(const char* p, TRE_Off len) = NULL;
+LOCAL TRE_Off (*scan_count)(const char* p, TRE_Off len) = NULL;
+LOCAL pthread_once_t scan_kernel_once = PTHREAD_ONCE_INIT;
+
+// Return a pointer to the first newline in the len chars at p, or NULL if
+// there isn't one.
+const char* TRE_find_newline(const char* p, TRE_Off len) {
+  pthread_once(&scan_kernel_once, choose_kernel);
+  return scan_find(p, len);
+}
+
+// Count the newlines in the len chars at p.
+TRE_Off TRE_count_newlines(const char* p, TRE_Off len) {
+  pthread_once(&scan_kernel_once, choose_kernel);
+  return scan_count(p, len);
+}
+
+// Check whether a kernel can be used on this machine.
+int TRE_scan_kernel_supported(TRE_Scan_Kernel k) {
+  switch (k) {
+    case TRE_SCAN_GENERIC:
+      return 1;
+#ifdef TRE_SCAN_X86
+    case TRE_SCAN_SSE2:
+      return __builtin_cpu_supports("sse2");
+    case TRE_SCAN_AVX2:
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return 0;
+  }
+}
+
+const char* TRE_scan_kernel_name(TRE_Scan_Kernel k) {
+  assert(k >= 0 && k < TRE_SCAN_N_KERNELS);
+  return scan_kernels[k].name;
+}
+
+// Make all scans use a particular kernel (for testing and benchmarking). This
+// mustn't be called while another thread might be scanning.
+TRE_OpResult TRE_scan_use_kernel(TRE_Scan_Kernel k) {
+  if (!TRE_scan_kernel_supported(k)) {
+    return TRE_FAIL;
+  }
+  pthread_once(&scan_kernel_once, choose_kernel);
+  scan_find = scan_kernels[k].find;
+  scan_count = scan_kernels[k].count;
+  return TRE_SUCC;
+}
+
+// Go back to the kernel that would have been chosen automatically.
+void TRE_scan_use_best_kernel() {
+  pthread_once(&scan_kernel_once, choose_kernel);
+  choose_kernel();
+}
+
+LOCAL void choose_kernel() {
+  TRE_Scan_Kernel k = TRE_SCAN_N_KERNELS - 1;
+  while (!TRE_scan_kernel_supported(k)) {
+    k--;
+  }
+#ifdef __GLIBC__
+  scan_find = find_generic;
+#else
+  scan_find = scan_kernels[k].find;
+#endif
+  scan_count = scan_kernels[k].count;
+}
+
+LOCAL const char* find_generic(const char* p, TRE_Off len) {
+  return memchr(p, '\n', len);
+}
+
+LOCAL TRE_Off count_generic(const char* p, TRE_Off len) {
+  TRE_Off n = 0;
+  for (TRE_Off i = 0; i < len; i++) {
+    n += p[i] == '\n';
+  }
+  return n;
+}
+
+#ifdef TRE_SCAN_X86
+
+// The vector loops below leave whatever doesn't fill a whole vector at the
+// end to the generic kernel.
+
+// The find kernels check 64 chars per round, and only look for which vector
+// had the newline once one of them has.
+__attribute__((target("sse2")))
+LOCAL const char* find_sse2(const char* p, TRE_Off len) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  TRE_Off i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), nl);
+    __m128i b =
+      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 16)), nl);
+    __m128i c =
+      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 32)), nl);
+    __m128i d =
+      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 48)), nl);
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b),
+            _mm_or_si128(c, d)))) {
+      uint64_t mask = (uint64_t)_mm_movemask_epi8(a)
+        | (uint64_t)_mm_movemask_epi8(b) << 16
+        | (uint64_t)_mm_movemask_epi8(c) << 32
+        | (uint64_t)_mm_movemask_epi8(d) << 48;
+      return p + i + __builtin_ctzll(mask);
+    }
+  }
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    if (mask) {
+      return p + i + __builtin_ctz(mask);
+    }
+  }
+  return find_generic(p + i, len - i);
+}
+
+// Matches are counted by subtracting the comparison results (-1 for a match)
+// from per-byte counters. A byte counter would overflow after 255 rounds, so
+// every 255 rounds the counters are summed into a total.
+__attribute__((target("sse2")))
+LOCAL TRE_Off count_sse2(const char* p, TRE_Off len) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i zero = _mm_setzero_si128();
+  TRE_Off n = 0, i = 0;
+  while (i + 16 <= len) {
+    __m128i counts = zero;
+    for (int round = 0; round < 255 && i + 16 <= len; round++, i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+      counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(v, nl));
+    }
+    __m128i sums = _mm_sad_epu8(counts, zero);
+    n += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+  }
+  return n + count_generic(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+LOCAL const char* find_avx2(const char* p, TRE_Off len) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  TRE_Off i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m256i a =
+      _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), nl);
+    __m256i b =
+      _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 32)), nl);
+    if (_mm256_movemask_epi8(_mm256_or_si256(a, b))) {
+      uint64_t mask = (uint32_t)_mm256_movemask_epi8(a)
+        | (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+      return p + i + __builtin_ctzll(mask);
+    }
+  }
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    if (mask) {
+      return p + i + __builtin_ctz(mask);
+    }
+  }
+  return find_generic(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+LOCAL TRE_Off count_avx2(const char* p, TRE_Off len) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i zero = _mm256_setzero_si256();
+  TRE_Off n = 0, i = 0;
+  while (i + 32 <= len) {
+    __m256i counts = zero;
+    for (int round = 0; round < 255 && i + 32 <= len; round++, i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+      counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(v, nl));
+    }
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i*)sums, _mm256_sad_epu8(counts, zero));
+    n += sums[0] + sums[1] + sums[2] + sums[3];
+  }
+  return n + count_generic(p + i, len - i);
+}
+
+#endif
@@ -7,9 +7,15 @@
 # define socklen_t int
 #else
 # include <sys/socket.h>
+# include <sys/un.h>
 # include <netinet/in.h>
 #endif
 
+#if INTERFACE
+// Port the server listens on.
+#define TRE_NET_PORT 31909
+#endif
+
 void net_init() {
 #ifdef _WIN32
   WORD versionWanted = MAKEWORD(1, 1);
@@ -47,85 +53,185 @@ int net_listen() {
     fprintf(stderr, "Unable to open socket.\n");
     exit(1);
   }
+  // Allow the server to be restarted right away, without waiting for the
+  // old connections to time out.
+  int reuse = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse,
+      sizeof reuse);
   //struct sockaddr my_addr;
   struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
   addr.sin_family = AF_INET;
-#ifdef _WIN32
-  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-#else
-  inet_aton("127.0.0.1", &addr.sin_addr.s_addr);
-#endif
-  addr.sin_port = htons(31909);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(TRE_NET_PORT);
   int bind_result = bind(server_fd, (struct sockaddr*)&addr, sizeof addr);
   if (0 != bind_result) {
     fprintf(stderr, "Unable to bind socket.\n");
     exit(1);
   }
-  int listen_result = listen(server_fd, 3);
+  int listen_result = listen(server_fd, SOMAXCONN);
   if (0 != listen_result) {
     fprintf(stderr, "Unable to listen on socket.\n");
     exit(1);
   }
+  if (0 != net_set_nonblocking(server_fd)) {
+    fprintf(stderr, "Unable to make socket nonblocking.\n");
+    exit(1);
+  }
+  return server_fd;
+}
+
+// Listen on a Unix domain socket at the given path, for front-ends running
+// on the same machine. (This avoids the overhead of going through TCP.) Any
+// old socket file at the path is removed first. Returns the (nonblocking)
+// listening socket, or -1 if it couldn't be set up.
+int net_listen_unix(const char* path) {
+#ifdef _WIN32
+  log_err("Unix domain sockets aren't supported on this platform.");
+  (void)path;
+  return -1;
+#else
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof addr.sun_path) {
+    log_err("Socket path is too long: %s", path);
+    return -1;
+  }
+  int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (-1 == server_fd) {
+    log_err("Unable to open socket: %s", strerror(errno));
+    return -1;
+  }
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (0 != bind(server_fd, (struct sockaddr*)&addr, sizeof addr)
+      || 0 != listen(server_fd, SOMAXCONN)
+      || 0 != net_set_nonblocking(server_fd)) {
+    log_err("Unable to listen on %s: %s", path, strerror(errno));
+    net_close(server_fd);
+    return -1;
+  }
   return server_fd;
+#endif
+}
+
+// Connect to a server listening on a Unix domain socket. Returns the
+// (blocking) socket, or -1 if the connection couldn't be made.
+int net_connect_unix(const char* path) {
+#ifdef _WIN32
+  (void)path;
+  return -1;
+#else
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof addr.sun_path) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (-1 == fd) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (0 != connect(fd, (struct sockaddr*)&addr, sizeof addr)) {
+    net_close(fd);
+    return -1;
+  }
+  return fd;
+#endif
+}
+
+// Check whether a socket is a Unix domain socket, so the other end is on
+// this machine.
+int net_is_unix(int sock_fd) {
+#ifdef _WIN32
+  (void)sock_fd;
+  return 0;
+#else
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof addr;
+  return 0 == getsockname(sock_fd, (struct sockaddr*)&addr, &addr_len)
+    && addr.ss_family == AF_UNIX;
+#endif
+}
+
+// Put a socket in nonblocking mode. Returns 0 on success.
+int net_set_nonblocking(int sock_fd) {
+#ifdef _WIN32
+  u_long nonblocking = 1;
+  return ioctlsocket(sock_fd, FIONBIO, &nonblocking);
+#else
+  int flags = fcntl(sock_fd, F_GETFL, 0);
+  return flags == -1 ? -1 : fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+// Check whether the last socket call failed only because it would have
+// blocked.
+int net_would_block() {
+#ifdef _WIN32
+  return WSAEWOULDBLOCK == WSAGetLastError();
+#else
+  return EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno;
+#endif
 }
 
+// Accept a connection on a (nonblocking) listening socket. Returns the new
+// connection's socket, which is nonblocking too, or -1 if there's no
+// connection waiting (or it couldn't be accepted).
 int net_accept(int server_fd) {
-  //struct sockaddr client_addr;
-  //socklen_t client_addr_len;
-  //int client_fd = accept(server_fd, &client_addr, &client_addr_len);
   int client_fd = accept(server_fd, NULL, NULL);
   if (-1 == client_fd) {
-    fprintf(stderr, "Unable to accept incoming connection.\n");
+    if (!net_would_block()) {
+      log_err("Unable to accept incoming connection: %s", strerror(errno));
 #ifdef _WIN32
-    fprintf(stderr, "Winsock error: %d\n", WSAGetLastError());
+      log_err("Winsock error: %d", WSAGetLastError());
 #endif
-    exit(1);
+    }
+    return -1;
   }
-  int close_result = net_close(server_fd);
-  if (-1 == close_result) {
-    fprintf(stderr, "Unable to close socket.\n");
-    exit(1);
+  if (0 != net_set_nonblocking(client_fd)) {
+    log_err("Unable to make connection nonblocking.");
+    net_close(client_fd);
+    return -1;
   }
   return client_fd;
 }
 
+// Receive whatever data is available on a nonblocking socket. Returns the
+// number of bytes received, 0 if the connection was closed, -1 if there's
+// nothing to read yet, or -2 on an error.
 int net_recv(int client_fd, char* buf, int buf_len) {
-  // TODO: MSG_DONTWAIT flag for nonblocking
-  //char buf[BUFSIZ];
-  //int buf_len = BUFSIZ;
   int recv_len = recv(client_fd, buf, buf_len, 0);
   if (-1 == recv_len) {
-    if (EAGAIN == errno || EWOULDBLOCK == errno) {
+    if (net_would_block()) {
       return -1;
-    } else {
-      fprintf(stderr, "Error sending data via socket.\n");
-      exit(1);
     }
-  }
-  if (0 == recv_len) {
-    // Connection closed.
-    return 0;
+    log_err("Error receiving data via socket: %s", strerror(errno));
+    return -2;
   }
   return recv_len;
 }
 
-int net_send(int client_fd, char* buf, int buf_len) {
-  // TODO: MSG_DONTWAIT flag for nonblocking
-  int send_result = send(client_fd, buf, buf_len, 0);
+// Send as much data as the socket will take without blocking. Returns the
+// number of bytes sent (which can be less than buf_len, or 0 if the socket
+// can't take any more right now), or -1 on an error.
+int net_send(int client_fd, const char* buf, int buf_len) {
+  int flags = 0;
+#ifdef MSG_NOSIGNAL
+  // Report a closed connection as an error instead of raising SIGPIPE.
+  flags |= MSG_NOSIGNAL;
+#endif
+  int send_result = send(client_fd, buf, buf_len, flags);
   if (-1 == send_result) {
-    if (EAGAIN == errno || EWOULDBLOCK == errno) {
-      return -1;
-    } else {
-      fprintf(stderr, "Error receiving data via socket.\n");
-      exit(1);
+    if (net_would_block()) {
+      return 0;
     }
+    log_err("Error sending data via socket: %s", strerror(errno));
+    return -1;
   }
-  if (send_result < buf_len) {
-    // TODO: If not all data is sent, loop, or queue the rest for later.
-    fprintf(stderr, "Send truncated.\n");
-    exit(1);
-  }
-  return 1;
+  return send_result;
 }
 
 int net_close(int sock_fd) {
@@ -0,0 +1,456 @@
+#include "hdrs.c"
+#include "mh_proto.h"
+
+// The binary protocol front-ends use to talk to the editor server.
+//
+// Every message is a frame: a 4-byte length, then that many bytes of body.
+// A request body is a 1-byte operation code followed by its arguments; a
+// reply body is the operation code it answers, a 1-byte status, and the
+// results. Integers are 8 bytes and, like the length, little-endian.
+//
+//   request:  len:4 | op:1 | args...
+//   reply:    len:4 | op:1 | status:1 | results...
+//
+// Each request gets exactly one reply, in order. The server runs every
+// complete request it has received before sending anything, and the replies
+// go out together, so a client can send thousands of requests without
+// waiting and read all the replies in one go.
+//
+// A client that shows the buffer can ask for a view of it (TRE_PROTO_VIEW).
+// From then on, whenever a batch of requests (from any client) changes what
+// its screen should show, the server sends it a TRE_PROTO_SCREEN frame after
+// the replies. The frame isn't a reply to anything; it carries the cursor's
+// row and column, then the spans of the screen that changed (see screen.c),
+// each as row, column, length and that many chars:
+//
+//   screen:   len:4 | op:1 | status:1 | row | col | (row | col | len | text)...
+//
+// The operations map onto the buffer API (api.c):
+//
+//   TRE_PROTO_MOVE_CHARS  distance        -> offset
+//   TRE_PROTO_MOVE_LINES  distance        -> offset
+//   TRE_PROTO_SET_CURSOR  offset          -> offset
+//   TRE_PROTO_GOTO_LINE   line, column    -> offset
+//   TRE_PROTO_INSERT      text (the rest of the frame)
+//   TRE_PROTO_DELETE
+//   TRE_PROTO_BACKSPACE
+//   TRE_PROTO_GET_CURSOR                  -> line, column, offset
+//   TRE_PROTO_LINE_COUNT                  -> lines
+//   TRE_PROTO_QUIT        (the server closes the connection after replying)
+//   TRE_PROTO_ATTACH_SHM  channel name (see shm.c; Unix domain sockets only)
+//   TRE_PROTO_VIEW        rows, columns   (sends the whole screen)
+//
+// The movements' arguments have to be within 2^48 of zero, or the request is
+// bad. A character move that would pass either end of the buffer fails (and
+// the cursor stays put); line moves and line numbers stop at the first or
+// last line.
+
+#if INTERFACE
+// Length of the frame length field.
+#define TRE_PROTO_HEADER_LEN 4
+// Longest frame body accepted. (Longer inserts have to be split up.)
+#define TRE_PROTO_MAX_FRAME (TRE_CONN_MAX_INPUT - TRE_PROTO_HEADER_LEN)
+// Most integers a request or reply has.
+#define TRE_PROTO_MAX_ARGS 3
+
+typedef enum {
+  TRE_PROTO_MOVE_CHARS = 1,
+  TRE_PROTO_MOVE_LINES = 2,
+  TRE_PROTO_SET_CURSOR = 3,
+  TRE_PROTO_GOTO_LINE = 4,
+  TRE_PROTO_INSERT = 5,
+  TRE_PROTO_DELETE = 6,
+  TRE_PROTO_BACKSPACE = 7,
+  TRE_PROTO_GET_CURSOR = 8,
+  TRE_PROTO_LINE_COUNT = 9,
+  TRE_PROTO_QUIT = 10,
+  TRE_PROTO_ATTACH_SHM = 11,
+  TRE_PROTO_VIEW = 12,
+  TRE_PROTO_SCREEN = 13       // sent by the server, never requested
+} TRE_Proto_Op;
+
+typedef enum {
+  TRE_PROTO_OK = 0,
+  TRE_PROTO_FAILED = 1,       // the operation couldn't be done
+  TRE_PROTO_BAD_REQUEST = 2   // unknown operation or wrong arguments
+} TRE_Proto_Status;
+
+typedef struct {
+  TRE_Proto_Op op;
+  TRE_Proto_Status status;
+  int n_results;
+  TRE_Off results[TRE_PROTO_MAX_ARGS];
+  // The rest of a TRE_PROTO_SCREEN frame (the spans), which points into the
+  // data passed to TRE_Proto_get_reply.
+  const char* data;
+  TRE_Off data_len;
+} TRE_Proto_Reply;
+
+// A changed part of a row, from a TRE_PROTO_SCREEN frame.
+typedef struct {
+  int row;
+  int col;
+  int len;
+  const char* text;
+} TRE_Proto_Span;
+#endif
+
+#if LOCAL_INTERFACE
+// What the server keeps for each connection.
+typedef struct {
+  TRE_Screen* screen;  // NULL until the client asks for a view
+  int cursor_row;      // cursor position last sent
+  int cursor_col;
+} proto_conn_t;
+
+// Largest screen a client can ask for.
+#define PROTO_MAX_ROWS 1000
+#define PROTO_MAX_COLS 1000
+// Largest position or distance a request can give (far beyond any buffer,
+// but small enough that the buffer's arithmetic on it can't overflow).
+#define PROTO_MAX_OFF (1LL << 48)
+#endif
+
+// Server handler (see TRE_Server_new) that runs requests against the buffer
+// in srv->data.
+TRE_OpResult TRE_Proto_handle(TRE_Server* srv, TRE_Conn* conn) {
+  TreBuffer* buf = srv->data;
+  TRE_ByteQueue* in = &conn->in;
+  while (!conn->closing) {
+    TRE_Off avail = TRE_ByteQueue_length(in);
+    if (avail < TRE_PROTO_HEADER_LEN) {
+      break;
+    }
+    const unsigned char* frame = (const unsigned char*)in->data + in->start;
+    TRE_Off body_len = get_u32(frame);
+    if (body_len < 1 || body_len > TRE_PROTO_MAX_FRAME) {
+      log_warn("Bad frame length %lld; closing connection.", body_len);
+      send_reply(conn, 0, TRE_PROTO_BAD_REQUEST, NULL, 0);
+      TRE_Conn_close(conn);
+      break;
+    }
+    if (avail < TRE_PROTO_HEADER_LEN + body_len) {
+      break;
+    }
+    run_request(buf, conn, frame + TRE_PROTO_HEADER_LEN, body_len);
+    TRE_ByteQueue_consume(in, TRE_PROTO_HEADER_LEN + body_len);
+  }
+  push_screens(srv);
+  return TRE_SUCC;
+}
+
+// Server close handler (for srv->handle_close) that frees what
+// TRE_Proto_handle kept for a connection.
+void TRE_Proto_close(TRE_Server* srv, TRE_Conn* conn) {
+  (void)srv;
+  proto_conn_t* pc = conn->data;
+  if (pc) {
+    if (pc->screen) {
+      TRE_Screen_free(pc->screen);
+    }
+    my_free(pc);
+    conn->data = NULL;
+  }
+}
+
+// Add a request to a queue (for clients). `args` are the operation's
+// integer arguments; `text` (which can be NULL) is for TRE_PROTO_INSERT and
+// TRE_PROTO_ATTACH_SHM.
+void TRE_Proto_put_request(TRE_ByteQueue* q, TRE_Proto_Op op,
+    const TRE_Off* args, int n_args, const char* text, TRE_Off text_len) {
+  assert(n_args <= TRE_PROTO_MAX_ARGS);
+  assert(1 + 8 * n_args + text_len <= TRE_PROTO_MAX_FRAME);
+  unsigned char* p = (unsigned char*)TRE_ByteQueue_reserve(q,
+      TRE_PROTO_HEADER_LEN + 1 + 8 * n_args + text_len);
+  put_u32(p, 1 + 8 * n_args + text_len);
+  p[4] = op;
+  p += 5;
+  for (int i = 0; i < n_args; i++, p += 8) {
+    put_i64(p, args[i]);
+  }
+  if (text_len > 0) {
+    memcpy(p, text, text_len);
+  }
+  q->len += TRE_PROTO_HEADER_LEN + 1 + 8 * n_args + text_len;
+}
+
+// Parse the reply at the front of `data` (for clients). Returns the length
+// of the reply frame, 0 if it hasn't all arrived yet, or -1 if it's
+// malformed.
+TRE_Off TRE_Proto_get_reply(const char* data, TRE_Off avail,
+    TRE_Proto_Reply* reply) {
+  const unsigned char* p = (const unsigned char*)data;
+  if (avail < TRE_PROTO_HEADER_LEN) {
+    return 0;
+  }
+  TRE_Off body_len = get_u32(p);
+  if (avail < TRE_PROTO_HEADER_LEN + 1) {
+    return 0;
+  }
+  int is_screen = p[4] == TRE_PROTO_SCREEN;
+  if (is_screen ? body_len < 2 + 16
+      : body_len < 2 || (body_len - 2) % 8 != 0
+      || (body_len - 2) / 8 > TRE_PROTO_MAX_ARGS) {
+    return -1;
+  }
+  if (avail < TRE_PROTO_HEADER_LEN + body_len) {
+    return 0;
+  }
+  reply->op = p[4];
+  reply->status = p[5];
+  reply->n_results = is_screen ? 2 : (body_len - 2) / 8;
+  for (int i = 0; i < reply->n_results; i++) {
+    reply->results[i] = get_i64(p + 6 + 8 * i);
+  }
+  reply->data = data + 6 + 8 * reply->n_results;
+  reply->data_len = body_len - 2 - 8 * reply->n_results;
+  return TRE_PROTO_HEADER_LEN + body_len;
+}
+
+// Get the next span from the data of a TRE_PROTO_SCREEN frame, advancing
+// *data past it. Returns 1 if there was one, 0 if there are no more, or -1
+// if the data is malformed.
+int TRE_Proto_next_span(const char** data, TRE_Off* len,
+    TRE_Proto_Span* span) {
+  if (*len == 0) {
+    return 0;
+  }
+  const unsigned char* p = (const unsigned char*)*data;
+  if (*len < 24) {
+    return -1;
+  }
+  TRE_Off row = get_i64(p), col = get_i64(p + 8), n = get_i64(p + 16);
+  if (row < 0 || row >= PROTO_MAX_ROWS || col < 0 || n < 0
+      || col + n > PROTO_MAX_COLS || *len - 24 < n) {
+    return -1;
+  }
+  span->row = row;
+  span->col = col;
+  span->len = n;
+  span->text = *data + 24;
+  *data += 24 + n;
+  *len -= 24 + n;
+  return 1;
+}
+
+LOCAL void run_request(TreBuffer* buf, TRE_Conn* conn,
+    const unsigned char* body, TRE_Off len) {
+  TRE_Proto_Op op = body[0];
+  const unsigned char* args = body + 1;
+  TRE_Off n_arg_bytes = len - 1;
+  TRE_Off results[TRE_PROTO_MAX_ARGS];
+  int n_results = 0;
+  TRE_Proto_Status status = TRE_PROTO_OK;
+  // Number of integer arguments each operation takes (-1 for the ones that
+  // take the rest of the frame as text).
+  static const int n_args[] = { 0, 1, 1, 1, 2, -1, 0, 0, 0, 0, 0, -1, 2 };
+  if (op < 1 || op > TRE_PROTO_VIEW
+      || (n_args[op] >= 0 && n_arg_bytes != 8 * n_args[op])
+      || !args_in_range(op, args, n_args[op])) {
+    send_reply(conn, op, TRE_PROTO_BAD_REQUEST, NULL, 0);
+    return;
+  }
+  switch (op) {
+    case TRE_PROTO_MOVE_CHARS: {
+      // The buffer doesn't make a move that would pass either end of it.
+      TRE_Off distance = get_i64(args);
+      TRE_Off pos = TreBuffer_GetCursorPosition(buf).cursor_offset;
+      if (distance < -pos || distance > TreBuffer_GetLength(buf) - pos) {
+        status = TRE_PROTO_FAILED;
+        break;
+      }
+      TreBuffer_MoveCharwise(buf, distance);
+      break;
+    }
+    case TRE_PROTO_MOVE_LINES:
+      TreBuffer_MoveLinewise(buf, get_i64(args));
+      break;
+    case TRE_PROTO_SET_CURSOR:
+      if (TRE_FAIL == TreBuffer_SetCursorPosition(buf, get_i64(args))) {
+        status = TRE_PROTO_FAILED;
+      }
+      break;
+    case TRE_PROTO_GOTO_LINE:
+      TreBuffer_GotoLine(buf, get_i64(args), get_i64(args + 8));
+      break;
+    case TRE_PROTO_INSERT:
+      TreBuffer_InsertBytes(buf, (const char*)args, n_arg_bytes);
+      break;
+    case TRE_PROTO_DELETE:
+      TreBuffer_Delete(buf);
+      break;
+    case TRE_PROTO_BACKSPACE:
+      TreBuffer_Backspace(buf);
+      break;
+    case TRE_PROTO_GET_CURSOR: {
+      TreCursorPosition pos = TreBuffer_GetCursorPosition(buf);
+      results[n_results++] = pos.cursor_line;
+      results[n_results++] = pos.cursor_column;
+      results[n_results++] = pos.cursor_offset;
+      break;
+    }
+    case TRE_PROTO_LINE_COUNT:
+      results[n_results++] = TreBuffer_GetLineCount(buf);
+      break;
+    case TRE_PROTO_QUIT:
+      TRE_Conn_close(conn);
+      break;
+    case TRE_PROTO_ATTACH_SHM: {
+      char name[TRE_SHM_MAX_NAME + 1];
+      TRE_ShmChannel* ch = NULL;
+      // Only for clients on this machine, which the shared memory is.
+      if (conn->local && n_arg_bytes <= TRE_SHM_MAX_NAME
+          && !conn->shm && !conn->shm_pending) {
+        memcpy(name, args, n_arg_bytes);
+        name[n_arg_bytes] = '\0';
+        ch = TRE_ShmChannel_open(name);
+      }
+      if (ch) {
+        TRE_Conn_attach_shm(conn, ch);
+      } else {
+        status = TRE_PROTO_FAILED;
+      }
+      break;
+    }
+    case TRE_PROTO_VIEW: {
+      TRE_Off rows = get_i64(args), cols = get_i64(args + 8);
+      if (rows < 1 || rows > PROTO_MAX_ROWS
+          || cols < 1 || cols > PROTO_MAX_COLS) {
+        status = TRE_PROTO_FAILED;
+        break;
+      }
+      proto_conn_t* pc = conn->data;
+      if (!pc) {
+        pc = conn->data = my_alloc(sizeof(proto_conn_t));
+        memset(pc, 0, sizeof(proto_conn_t));
+      }
+      if (pc->screen) {
+        TRE_Screen_resize(pc->screen, rows, cols);
+      } else {
+        pc->screen = TRE_Screen_new(rows, cols);
+      }
+      // Make sure the first screen goes out even if it's blank.
+      pc->cursor_row = -1;
+      break;
+    }
+    case TRE_PROTO_SCREEN:
+      // (Only the server sends these; they're rejected above.)
+      break;
+  }
+  // Movements report where the cursor ended up.
+  if (op >= TRE_PROTO_MOVE_CHARS && op <= TRE_PROTO_GOTO_LINE) {
+    results[n_results++] = TreBuffer_GetCursorPosition(buf).cursor_offset;
+  }
+  send_reply(conn, op, status, results, n_results);
+}
+
+// Check the integer arguments of a request that moves the cursor: each has to
+// be within PROTO_MAX_OFF of zero.
+LOCAL int args_in_range(TRE_Proto_Op op, const unsigned char* args,
+    int n_args) {
+  if (op < TRE_PROTO_MOVE_CHARS || op > TRE_PROTO_GOTO_LINE) {
+    return 1;
+  }
+  for (int i = 0; i < n_args; i++) {
+    TRE_Off arg = get_i64(args + 8 * i);
+    if (arg < -PROTO_MAX_OFF || arg > PROTO_MAX_OFF) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Send a TRE_PROTO_SCREEN frame to each connection with a view whose screen
+// has changed. The buffer's damage is shared out among all the views.
+LOCAL void push_screens(TRE_Server* srv) {
+  TRE_Buf* buf = srv->data;
+  TRE_Damage damage;
+  TRE_Damage_clear(&damage);
+  TRE_Buf_take_damage(buf, &damage);
+  for (int i = 0; i < srv->n_conns; i++) {
+    TRE_Conn* conn = srv->conns[i];
+    proto_conn_t* pc = conn->data;
+    if (!pc || !pc->screen || conn->closing || conn->failed) {
+      continue;
+    }
+    TRE_Screen_damage(pc->screen, &damage);
+    // Write the frame header with the cursor position, then the spans, and
+    // take it back if it turns out nothing changed.
+    // (Adding to the queue can move its contents, so the frame's position is
+    // kept relative to the start.)
+    TRE_Off frame_at = TRE_ByteQueue_length(&conn->out);
+    unsigned char* p =
+      (unsigned char*)TRE_ByteQueue_reserve(&conn->out, 6 + 16);
+    p[4] = TRE_PROTO_SCREEN;
+    p[5] = TRE_PROTO_OK;
+    conn->out.len += 6 + 16;
+    int n_spans = TRE_Screen_update(pc->screen, buf, put_span, &conn->out);
+    TRE_Screen* screen = pc->screen;
+    if (n_spans == 0 && screen->cursor_row == pc->cursor_row
+        && screen->cursor_col == pc->cursor_col) {
+      conn->out.len = conn->out.start + frame_at;
+      continue;
+    }
+    p = (unsigned char*)conn->out.data + conn->out.start + frame_at;
+    put_u32(p, TRE_ByteQueue_length(&conn->out) - frame_at
+        - TRE_PROTO_HEADER_LEN);
+    put_i64(p + 6, screen->cursor_row);
+    put_i64(p + 14, screen->cursor_col);
+    pc->cursor_row = screen->cursor_row;
+    pc->cursor_col = screen->cursor_col;
+  }
+}
+
+// Screen emit function that adds a span to a TRE_PROTO_SCREEN frame.
+LOCAL void put_span(void* ctx, int row, int col, const char* text, int len) {
+  TRE_ByteQueue* out = ctx;
+  unsigned char* p = (unsigned char*)TRE_ByteQueue_reserve(out, 24 + len);
+  put_i64(p, row);
+  put_i64(p + 8, col);
+  put_i64(p + 16, len);
+  memcpy(p + 24, text, len);
+  out->len += 24 + len;
+}
+
+LOCAL void send_reply(TRE_Conn* conn, TRE_Proto_Op op,
+    TRE_Proto_Status status, const TRE_Off* results, int n_results) {
+  TRE_Off len = TRE_PROTO_HEADER_LEN + 2 + 8 * n_results;
+  unsigned char* p =
+    (unsigned char*)TRE_ByteQueue_reserve(&conn->out, len);
+  put_u32(p, len - TRE_PROTO_HEADER_LEN);
+  p[4] = op;
+  p[5] = status;
+  for (int i = 0; i < n_results; i++) {
+    put_i64(p + 6 + 8 * i, results[i]);
+  }
+  conn->out.len += len;
+}
+
+LOCAL void put_u32(unsigned char* p, TRE_Off v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = (v >> (8 * i)) & 0xff;
+  }
+}
+
+LOCAL TRE_Off get_u32(const unsigned char* p) {
+  TRE_Off v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= (TRE_Off)p[i] << (8 * i);
+  }
+  return v;
+}
+
+LOCAL void put_i64(unsigned char* p, TRE_Off v) {
+  unsigned long long u = v;
+  for (int i = 0; i < 8; i++) {
+    p[i] = (u >> (8 * i)) & 0xff;
+  }
+}
+
+LOCAL TRE_Off get_i64(const unsigned char* p) {
+  unsigned long long u = 0;
+  for (int i = 0; i < 8; i++) {
+    u |= (unsigned long long)p[i] << (8 * i);
+  }
+  return (TRE_Off)u;
+}
@@ -0,0 +1,282 @@
+#include "hdrs.c"
+#include "mh_screen.h"
+
+// A screen is a model of what a front-end is showing: a grid of rows and
+// columns holding part of a buffer, with long lines wrapped onto as many rows
+// as they need. It's used to work out what has to change on the real screen
+// after an edit, so that only that gets sent (over the network) or drawn (by
+// curses), rather than the whole thing every time.
+//
+// An update re-renders only the lines that the buffer's damage (damage.c)
+// says have changed, plus any that have moved to different rows because of
+// scrolling, and compares each row it renders against what the front-end
+// already has. Each run of changed cells is handed to an emit function as a
+// span: a row, a starting column, and the new text for that part of the row.
+//
+// Laying out a line (finding its length and where it wraps, and copying the
+// part of it that fits) means going to the buffer, so each screen keeps the
+// layouts of the lines it has shown, keyed by line number. Damage drops the
+// layouts of the lines it covers; everything else, like scrolling back and
+// forth or moving the cursor, is done from the cache.
+
+#if INTERFACE
+// Called with each span of changed cells. The text isn't null-terminated.
+typedef void (*TRE_Screen_Emit)(void* ctx, int row, int col, const char* text,
+    int len);
+
+// A line laid out for a screen.
+typedef struct {
+  TRE_Off line;     // line number (-1 if this cache entry is empty)
+  TRE_Off len;      // length of the line, without its newline
+  TRE_Off n_rows;   // rows it takes up
+  char* text;       // as much of the line as fits on the screen
+  TRE_Off text_cap;
+} TRE_LineLayout;
+
+typedef struct {
+  int rows;
+  int cols;
+  char* cells;        // what the front-end has: rows * cols chars
+  TRE_Off* row_line;  // line shown on each row (-1 if none)
+  TRE_Off* row_seg;   // which part of that line (0 for the first cols chars)
+  TRE_Off top_line;   // first line shown
+  int cursor_row;
+  int cursor_col;
+  TRE_Damage dirty;   // lines that have to be rendered again
+  char* row_text;     // one row of rendered text (scratch space)
+  // Cache of line layouts, indexed by line number modulo n_layouts. It has
+  // room for more lines than fit on the screen, so the lines that are showing
+  // never push each other out.
+  TRE_LineLayout* layouts;
+  int n_layouts;
+  long long n_laid_out; // lines laid out from the buffer (for testing)
+} TRE_Screen;
+#endif
+
+// Make a screen of the given size. Its cells start out blank (which is what
+// the front-end should start with too) and everything is dirty.
+TRE_Screen* TRE_Screen_new(int rows, int cols) {
+  TRE_Screen* screen = my_alloc(sizeof(TRE_Screen));
+  memset(screen, 0, sizeof(TRE_Screen));
+  TRE_Screen_resize(screen, rows, cols);
+  return screen;
+}
+
+void TRE_Screen_free(TRE_Screen* screen) {
+  my_free(screen->cells);
+  my_free(screen->row_line);
+  my_free(screen->row_seg);
+  my_free(screen->row_text);
+  for (int i = 0; i < screen->n_layouts; i++) {
+    if (screen->layouts[i].text) {
+      my_free(screen->layouts[i].text);
+    }
+  }
+  my_free(screen->layouts);
+  my_free(screen);
+}
+
+// Change the size of a screen. As with a new screen, the front-end should
+// clear its screen, and the next update redraws everything.
+void TRE_Screen_resize(TRE_Screen* screen, int rows, int cols) {
+  assert(rows > 0 && cols > 0);
+  screen->rows = rows;
+  screen->cols = cols;
+  screen->cells = my_realloc(screen->cells, (size_t)rows * cols);
+  screen->row_line = my_realloc(screen->row_line, rows * sizeof(TRE_Off));
+  screen->row_seg = my_realloc(screen->row_seg, rows * sizeof(TRE_Off));
+  screen->row_text = my_realloc(screen->row_text, cols);
+  for (int i = 0; i < screen->n_layouts; i++) {
+    if (screen->layouts[i].text) {
+      my_free(screen->layouts[i].text);
+    }
+  }
+  screen->n_layouts = 2 * rows + 1;
+  screen->layouts = my_realloc(screen->layouts,
+      screen->n_layouts * sizeof(TRE_LineLayout));
+  memset(screen->layouts, 0, screen->n_layouts * sizeof(TRE_LineLayout));
+  memset(screen->cells, ' ', (size_t)rows * cols);
+  for (int row = 0; row < rows; row++) {
+    screen->row_line[row] = -1;
+    screen->row_seg[row] = 0;
+  }
+  screen->cursor_row = 0;
+  screen->cursor_col = 0;
+  TRE_Screen_invalidate(screen);
+}
+
+// Add to the lines that have to be rendered again (from TRE_Buf_take_damage),
+// and forget their layouts.
+void TRE_Screen_damage(TRE_Screen* screen, const TRE_Damage* damage) {
+  TRE_Damage_merge(&screen->dirty, damage);
+  for (int i = 0; i < screen->n_layouts; i++) {
+    TRE_LineLayout* layout = &screen->layouts[i];
+    if (layout->line >= 0 && TRE_Damage_contains(damage, layout->line)) {
+      layout->line = -1;
+    }
+  }
+}
+
+// Render everything again on the next update (e.g. for a different buffer).
+void TRE_Screen_invalidate(TRE_Screen* screen) {
+  TRE_Damage_add_all(&screen->dirty);
+  for (int i = 0; i < screen->n_layouts; i++) {
+    screen->layouts[i].line = -1;
+  }
+}
+
+// Bring the screen up to date with the buffer, scrolling if the cursor isn't
+// on it, and call emit for each span of cells that changed. Returns the
+// number of spans.
+int TRE_Screen_update(TRE_Screen* screen, TRE_Buf* buf, TRE_Screen_Emit emit,
+    void* ctx) {
+  TRE_Off cursor_line = buf->cursor_line.num;
+  scroll_to_cursor(screen, buf, cursor_line, buf->cursor_col);
+  TRE_Off n_lines = TRE_Buf_wait_lines(buf, screen->top_line + screen->rows);
+  int n_spans = 0;
+  int row = 0;
+  for (TRE_Off line = screen->top_line;
+      row < screen->rows && line < n_lines; line++) {
+    TRE_LineLayout* layout = get_layout(screen, buf, line);
+    TRE_Off n_rows = layout->n_rows;
+    if (n_rows > screen->rows - row) {
+      n_rows = screen->rows - row;
+    }
+    if (line == cursor_line) {
+      screen->cursor_row = row + buf->cursor_col / screen->cols;
+      screen->cursor_col = buf->cursor_col % screen->cols;
+    }
+    if (!TRE_Damage_contains(&screen->dirty, line)
+        && shows_line(screen, row, line, n_rows)) {
+      row += n_rows;
+      continue;
+    }
+    for (int seg = 0; seg < n_rows && row < screen->rows; seg++, row++) {
+      TRE_Off start = (TRE_Off)seg * screen->cols;
+      TRE_Off seg_len = layout->len - start;
+      if (seg_len > screen->cols) {
+        seg_len = screen->cols;
+      } else if (seg_len < 0) {
+        seg_len = 0;
+      }
+      screen->row_line[row] = line;
+      screen->row_seg[row] = seg;
+      n_spans += render_row(screen, row, layout->text + start, seg_len,
+          emit, ctx);
+    }
+  }
+  // Blank out whatever is below the end of the buffer.
+  for (; row < screen->rows; row++) {
+    screen->row_line[row] = -1;
+    screen->row_seg[row] = 0;
+    n_spans += render_row(screen, row, NULL, 0, emit, ctx);
+  }
+  if (screen->cursor_row >= screen->rows) {
+    screen->cursor_row = screen->rows - 1;
+  }
+  TRE_Damage_clear(&screen->dirty);
+  return n_spans;
+}
+
+// Change the first line shown if the cursor is above it, or below the
+// bottom of the screen.
+LOCAL void scroll_to_cursor(TRE_Screen* screen, TRE_Buf* buf,
+    TRE_Off cursor_line, TRE_Off cursor_col) {
+  if (cursor_line < screen->top_line) {
+    screen->top_line = cursor_line;
+    return;
+  }
+  // Every line takes at least one row, so the screen can't start any
+  // further up than this.
+  if (cursor_line - screen->top_line >= screen->rows) {
+    screen->top_line = cursor_line - screen->rows + 1;
+  }
+  // Count the rows down to the cursor, dropping lines off the top until it
+  // fits.
+  TRE_Off used = cursor_col / screen->cols + 1;
+  TRE_Off line = cursor_line;
+  while (line > screen->top_line) {
+    TRE_Off n = get_layout(screen, buf, line - 1)->n_rows;
+    if (used + n > screen->rows) {
+      break;
+    }
+    used += n;
+    line--;
+  }
+  screen->top_line = line;
+}
+
+// Get a line's layout, from the cache if it's there. The text is cut off at
+// the size of the screen, since no more than that can ever be shown.
+LOCAL TRE_LineLayout* get_layout(TRE_Screen* screen, TRE_Buf* buf,
+    TRE_Off line) {
+  TRE_LineLayout* layout = &screen->layouts[line % screen->n_layouts];
+  if (layout->line == line) {
+    return layout;
+  }
+  TRE_Line info = TRE_Buf_get_line(buf, line);
+  layout->line = line;
+  layout->len = line_length(buf, info);
+  layout->n_rows = rows_for_length(screen, layout->len);
+  TRE_Off visible = (TRE_Off)screen->rows * screen->cols;
+  TRE_Off len = layout->len < visible ? layout->len : visible;
+  if (len > layout->text_cap) {
+    layout->text_cap = len;
+    layout->text = my_realloc(layout->text, len);
+  }
+  TRE_Buf_copy_text(buf, info.off, layout->text, len);
+  screen->n_laid_out++;
+  return layout;
+}
+
+// Check whether rows row.. already show all of a line (as it was when the
+// rows were rendered).
+LOCAL int shows_line(TRE_Screen* screen, int row, TRE_Off line,
+    TRE_Off n_rows) {
+  for (int seg = 0; seg < n_rows && row < screen->rows; seg++, row++) {
+    if (screen->row_line[row] != line || screen->row_seg[row] != seg) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Put new text (padded with blanks) on a row, emitting the part of it that
+// differs from what was there. Returns the number of spans emitted (0 or 1).
+LOCAL int render_row(TRE_Screen* screen, int row, const char* text,
+    TRE_Off len, TRE_Screen_Emit emit, void* ctx) {
+  char* new_text = screen->row_text;
+  char* cells = screen->cells + (size_t)row * screen->cols;
+  if (len > 0) {
+    memcpy(new_text, text, len);
+  }
+  memset(new_text + len, ' ', screen->cols - len);
+  int first = 0, last = screen->cols - 1;
+  while (first <= last && new_text[first] == cells[first]) {
+    first++;
+  }
+  if (first > last) {
+    return 0;
+  }
+  while (new_text[last] == cells[last]) {
+    last--;
+  }
+  memcpy(cells + first, new_text + first, last - first + 1);
+  emit(ctx, row, first, cells + first, last - first + 1);
+  return 1;
+}
+
+// Length of a line without its newline.
+LOCAL TRE_Off line_length(TRE_Buf* buf, TRE_Line line) {
+  if (line.len > 0 && TRE_Buf_char_at(buf, line.off + line.len - 1) == '\n') {
+    return line.len - 1;
+  }
+  return line.len;
+}
+
+// Number of rows a line takes up. A line that fills its last row exactly
+// gets another (empty) row, so that there's somewhere to show the cursor at
+// its end.
+LOCAL TRE_Off rows_for_length(TRE_Screen* screen, TRE_Off len) {
+  return len / screen->cols + 1;
+}
@@ -0,0 +1,422 @@
+#include "hdrs.c"
+#include "mh_server.h"
+#ifdef _WIN32
+# include <winsock2.h>
+# define poll WSAPoll
+#else
+# include <poll.h>
+#endif
+
+// The editor server: one thread serving any number of front-end connections
+// with poll(). All the sockets are nonblocking. Each connection has an input
+// queue, which received data is appended to until the protocol handler can
+// make use of it, and an output queue, which holds whatever the socket
+// wouldn't take yet. So neither a slow client nor a partial command holds up
+// the others (or the buffers).
+//
+// The protocol is up to the handler: it's called whenever a connection's
+// input queue gets more data, consumes as much of the input as it can, and
+// queues its replies with TRE_Conn_send.
+//
+// A connection can also carry its data through a shared memory channel
+// (shm.c). Those channels are checked on every poll, and while any are
+// attached the server spins for a moment before going to sleep.
+
+#if INTERFACE
+// Amount of input a connection can have queued before the server stops
+// reading from it.
+#define TRE_CONN_MAX_INPUT (1024 * 1024)
+// Amount of output a connection can have queued before the server stops
+// reading from it (until the client has read some of its replies).
+#define TRE_CONN_MAX_OUTPUT (4 * 1024 * 1024)
+// Amount read from a socket at once.
+#define TRE_CONN_READ_SIZE (64 * 1024)
+
+// A queue of bytes. Data is appended at the end and consumed from the front.
+typedef struct {
+  char* data;
+  TRE_Off start;  // start of the unconsumed data
+  TRE_Off len;    // end of the unconsumed data
+  TRE_Off cap;
+} TRE_ByteQueue;
+
+typedef struct TRE_Conn {
+  int fd;
+  TRE_ByteQueue in;
+  TRE_ByteQueue out;
+  int eof;        // set when the client has closed its end
+  int closing;    // set to close the connection once its output is sent
+  int failed;     // set if the connection has had an error
+  int local;      // set if it's a Unix domain socket (not TCP)
+  void* data;     // for use by the protocol handler
+  // If the client has attached a shared memory channel, the data goes
+  // through that and the socket is just a doorbell (see shm.c).
+  TRE_ShmChannel* shm;
+  TRE_ShmChannel* shm_pending;  // attached once the queued output is sent
+} TRE_Conn;
+
+typedef struct TRE_Server TRE_Server;
+typedef TRE_OpResult (*TRE_Server_Handler)(TRE_Server* srv, TRE_Conn* conn);
+
+struct TRE_Server {
+  int listen_fd;  // -1 if the server doesn't accept connections itself
+  TRE_Server_Handler handle_input;
+  void (*handle_close)(TRE_Server* srv, TRE_Conn* conn);
+  TRE_Conn** conns;
+  int n_conns;
+  int cap_conns;
+  int running;
+  void* data;     // for use by the protocol handler
+};
+#endif
+
+// Make a server. It accepts connections on listen_fd (which should be
+// nonblocking), if that isn't -1, and calls handle_input when a connection
+// has new input.
+TRE_Server* TRE_Server_new(int listen_fd, TRE_Server_Handler handle_input) {
+  TRE_Server* srv = my_alloc(sizeof(TRE_Server));
+  memset(srv, 0, sizeof(TRE_Server));
+  srv->listen_fd = listen_fd;
+  srv->handle_input = handle_input;
+  return srv;
+}
+
+// Free a server, closing all its connections (but not the listening
+// socket).
+void TRE_Server_free(TRE_Server* srv) {
+  for (int i = 0; i < srv->n_conns; i++) {
+    free_conn(srv, srv->conns[i]);
+  }
+  my_free(srv->conns);
+  my_free(srv);
+}
+
+// Add a connected socket to the server. The socket is made nonblocking.
+TRE_Conn* TRE_Server_add_conn(TRE_Server* srv, int fd) {
+  if (0 != net_set_nonblocking(fd)) {
+    log_err("Unable to make connection nonblocking.");
+    return NULL;
+  }
+  TRE_Conn* conn = my_alloc(sizeof(TRE_Conn));
+  memset(conn, 0, sizeof(TRE_Conn));
+  conn->fd = fd;
+  conn->local = net_is_unix(fd);
+  if (srv->n_conns == srv->cap_conns) {
+    srv->cap_conns = srv->cap_conns ? srv->cap_conns * 2 : 16;
+    srv->conns = my_realloc(srv->conns, srv->cap_conns * sizeof(TRE_Conn*));
+  }
+  srv->conns[srv->n_conns++] = conn;
+  logt("Connection %d added; %d connections.", fd, srv->n_conns);
+  return conn;
+}
+
+// Serve connections until TRE_Server_stop is called.
+void TRE_Server_run(TRE_Server* srv) {
+  srv->running = 1;
+  while (srv->running) {
+    if (TRE_FAIL == TRE_Server_poll(srv, -1)) {
+      break;
+    }
+  }
+}
+
+void TRE_Server_stop(TRE_Server* srv) {
+  srv->running = 0;
+}
+
+// Wait up to timeout_ms (or forever, if it's negative) for something to
+// happen on the server's sockets, then deal with it: accept connections,
+// read input and hand it to the handler, and send queued output.
+TRE_OpResult TRE_Server_poll(TRE_Server* srv, int timeout_ms) {
+  int n_conns = srv->n_conns;
+  int first = srv->listen_fd >= 0 ? 1 : 0;
+  struct pollfd* pfds = my_alloc((n_conns + 1) * sizeof(struct pollfd));
+  if (first) {
+    pfds[0].fd = srv->listen_fd;
+    pfds[0].events = POLLIN;
+    pfds[0].revents = 0;
+  }
+  for (int i = 0; i < n_conns; i++) {
+    TRE_Conn* conn = srv->conns[i];
+    struct pollfd* pfd = &pfds[first + i];
+    pfd->fd = conn->fd;
+    pfd->events = 0;
+    pfd->revents = 0;
+    if (conn->shm) {
+      // Only doorbells come in on the socket.
+      pfd->events |= POLLIN;
+    } else {
+      if (wants_input(conn)) {
+        pfd->events |= POLLIN;
+      }
+      if (TRE_ByteQueue_length(&conn->out) > 0) {
+        pfd->events |= POLLOUT;
+      }
+    }
+  }
+  if (timeout_ms != 0 && !shm_ready(srv)) {
+    timeout_ms = 0;
+  }
+  int n_ready = poll(pfds, first + n_conns, timeout_ms);
+  for (int i = 0; i < n_conns; i++) {
+    if (srv->conns[i]->shm) {
+      TRE_ShmChannel_end_wait(srv->conns[i]->shm, TRE_SHM_TO_SERVER);
+    }
+  }
+  if (n_ready < 0) {
+    my_free(pfds);
+    if (net_would_block()) {
+      return TRE_SUCC;
+    }
+    log_err("poll failed: %s", strerror(errno));
+    return TRE_FAIL;
+  }
+  for (int i = 0; i < n_conns; i++) {
+    TRE_Conn* conn = srv->conns[i];
+    short revents = pfds[first + i].revents;
+    if (revents & (POLLIN | POLLHUP | POLLERR) || conn->shm) {
+      read_conn(conn, revents);
+      if (TRE_ByteQueue_length(&conn->in) > 0 && !conn->failed) {
+        srv->handle_input(srv, conn);
+      }
+    }
+    // Send replies right away rather than waiting for the next poll.
+    if (TRE_ByteQueue_length(&conn->out) > 0 && !conn->failed) {
+      flush_conn(conn);
+    }
+  }
+  if (first && (pfds[0].revents & POLLIN)) {
+    int fd;
+    while ((fd = net_accept(srv->listen_fd)) >= 0) {
+      TRE_Server_add_conn(srv, fd);
+    }
+  }
+  my_free(pfds);
+  remove_finished_conns(srv);
+  return TRE_SUCC;
+}
+
+// Queue data to be sent on a connection. It goes out as soon as the socket
+// will take it.
+void TRE_Conn_send(TRE_Conn* conn, const char* data, TRE_Off len) {
+  TRE_ByteQueue_push(&conn->out, data, len);
+}
+
+// Switch a connection over to a shared memory channel, once the replies
+// queued so far have gone out on the socket. The connection owns the
+// channel from then on.
+void TRE_Conn_attach_shm(TRE_Conn* conn, TRE_ShmChannel* ch) {
+  assert(conn->shm == NULL && conn->shm_pending == NULL);
+  conn->shm_pending = ch;
+}
+
+// Close a connection once everything queued for it has been sent.
+void TRE_Conn_close(TRE_Conn* conn) {
+  conn->closing = 1;
+}
+
+LOCAL int wants_input(const TRE_Conn* conn) {
+  return !conn->eof && !conn->closing && !conn->failed
+    && TRE_ByteQueue_length(&conn->in) < TRE_CONN_MAX_INPUT
+    && TRE_ByteQueue_length(&conn->out) < TRE_CONN_MAX_OUTPUT;
+}
+
+// Before the server goes to sleep in poll(): spin for a moment if there are
+// shared memory channels, in case a request is about to come in, and then
+// tell their clients to ring the doorbell. Returns zero if there's already
+// something to do, so the server shouldn't sleep.
+LOCAL int shm_ready(TRE_Server* srv) {
+  int n_shm = 0;
+  for (int i = 0; i < srv->n_conns; i++) {
+    TRE_Conn* conn = srv->conns[i];
+    if (conn->shm) {
+      n_shm++;
+      if (TRE_ShmChannel_available(conn->shm, TRE_SHM_TO_SERVER) > 0
+          || TRE_ByteQueue_length(&conn->out) > 0) {
+        // (If the output ring was full, check again soon.)
+        return 0;
+      }
+    }
+  }
+  if (n_shm == 0) {
+    return 1;
+  }
+  long long deadline = TRE_shm_now_ns() + TRE_shm_spin_ns();
+  while (TRE_shm_now_ns() < deadline) {
+    for (int i = 0; i < srv->n_conns; i++) {
+      TRE_Conn* conn = srv->conns[i];
+      if (conn->shm
+          && TRE_ShmChannel_available(conn->shm, TRE_SHM_TO_SERVER) > 0) {
+        return 0;
+      }
+    }
+  }
+  for (int i = 0; i < srv->n_conns; i++) {
+    TRE_Conn* conn = srv->conns[i];
+    if (conn->shm
+        && !TRE_ShmChannel_prepare_wait(conn->shm, TRE_SHM_TO_SERVER)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Read whatever the socket (or shared memory channel) has, up to the input
+// limit, into the input queue.
+LOCAL void read_conn(TRE_Conn* conn, short revents) {
+  if (conn->shm) {
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+      // Throw away the doorbell bytes.
+      char bells[64];
+      int n = net_recv(conn->fd, bells, sizeof bells);
+      if (n == 0) {
+        conn->eof = 1;
+      } else if (n < -1) {
+        conn->failed = 1;
+      }
+    }
+    while (TRE_ByteQueue_length(&conn->in) < TRE_CONN_MAX_INPUT
+        && TRE_ByteQueue_length(&conn->out) < TRE_CONN_MAX_OUTPUT) {
+      char* dst = TRE_ByteQueue_reserve(&conn->in, TRE_CONN_READ_SIZE);
+      TRE_Off n = TRE_ShmChannel_read(conn->shm, TRE_SHM_TO_SERVER, dst,
+          TRE_CONN_READ_SIZE);
+      if (n == 0) {
+        break;
+      }
+      conn->in.len += n;
+    }
+    return;
+  }
+  while (wants_input(conn)) {
+    char* dst = TRE_ByteQueue_reserve(&conn->in, TRE_CONN_READ_SIZE);
+    int n = net_recv(conn->fd, dst, TRE_CONN_READ_SIZE);
+    if (n > 0) {
+      conn->in.len += n;
+    } else if (n == 0) {
+      conn->eof = 1;
+    } else if (n == -1) {
+      break;
+    } else {
+      conn->failed = 1;
+    }
+  }
+}
+
+// Send as much of the output queue as the socket (or shared memory channel)
+// will take.
+LOCAL void flush_conn(TRE_Conn* conn) {
+  if (conn->shm) {
+    TRE_Off n = TRE_ShmChannel_write(conn->shm, TRE_SHM_TO_CLIENT,
+        conn->out.data + conn->out.start, TRE_ByteQueue_length(&conn->out));
+    TRE_ByteQueue_consume(&conn->out, n);
+    if (TRE_ShmChannel_needs_wakeup(conn->shm, TRE_SHM_TO_CLIENT)
+        && net_send(conn->fd, "", 1) < 0) {
+      conn->failed = 1;
+    }
+    return;
+  }
+  while (TRE_ByteQueue_length(&conn->out) > 0) {
+    TRE_Off len = TRE_ByteQueue_length(&conn->out);
+    int n = net_send(conn->fd, conn->out.data + conn->out.start,
+        len > INT_MAX ? INT_MAX : len);
+    if (n < 0) {
+      conn->failed = 1;
+      return;
+    }
+    if (n == 0) {
+      return;
+    }
+    TRE_ByteQueue_consume(&conn->out, n);
+  }
+  if (conn->shm_pending) {
+    conn->shm = conn->shm_pending;
+    conn->shm_pending = NULL;
+  }
+}
+
+LOCAL int conn_finished(const TRE_Conn* conn) {
+  if (conn->failed) {
+    return 1;
+  }
+  if (TRE_ByteQueue_length(&conn->out) > 0) {
+    return 0;
+  }
+  return conn->closing || conn->eof;
+}
+
+LOCAL void remove_finished_conns(TRE_Server* srv) {
+  int j = 0;
+  for (int i = 0; i < srv->n_conns; i++) {
+    TRE_Conn* conn = srv->conns[i];
+    if (conn_finished(conn)) {
+      free_conn(srv, conn);
+    } else {
+      srv->conns[j++] = conn;
+    }
+  }
+  srv->n_conns = j;
+}
+
+LOCAL void free_conn(TRE_Server* srv, TRE_Conn* conn) {
+  logt("Closing connection %d.", conn->fd);
+  if (srv->handle_close) {
+    srv->handle_close(srv, conn);
+  }
+  net_close(conn->fd);
+  if (conn->shm) {
+    TRE_ShmChannel_free(conn->shm);
+  }
+  if (conn->shm_pending) {
+    TRE_ShmChannel_free(conn->shm_pending);
+  }
+  TRE_ByteQueue_free(&conn->in);
+  TRE_ByteQueue_free(&conn->out);
+  my_free(conn);
+}
+
+TRE_Off TRE_ByteQueue_length(const TRE_ByteQueue* q) {
+  return q->len - q->start;
+}
+
+// Make room for at least n more bytes at the end of the queue and return a
+// pointer to where they go. (The caller adds them to q->len.)
+char* TRE_ByteQueue_reserve(TRE_ByteQueue* q, TRE_Off n) {
+  if (q->len + n > q->cap) {
+    // Move the data down to the front first, if that's enough.
+    TRE_Off used = q->len - q->start;
+    if (q->start > 0) {
+      memmove(q->data, q->data + q->start, used);
+      q->start = 0;
+      q->len = used;
+    }
+    if (used + n > q->cap) {
+      TRE_Off cap = q->cap ? q->cap : 4096;
+      while (cap < used + n) {
+        cap *= 2;
+      }
+      q->data = my_realloc(q->data, cap);
+      q->cap = cap;
+    }
+  }
+  return q->data + q->len;
+}
+
+void TRE_ByteQueue_push(TRE_ByteQueue* q, const char* data, TRE_Off n) {
+  memcpy(TRE_ByteQueue_reserve(q, n), data, n);
+  q->len += n;
+}
+
+void TRE_ByteQueue_consume(TRE_ByteQueue* q, TRE_Off n) {
+  assert(n <= q->len - q->start);
+  q->start += n;
+  if (q->start == q->len) {
+    q->start = q->len = 0;
+  }
+}
+
+void TRE_ByteQueue_free(TRE_ByteQueue* q) {
+  if (q->data) {
+    my_free(q->data);
+  }
+  memset(q, 0, sizeof(TRE_ByteQueue));
+}
@@ -0,0 +1,430 @@
+#include "hdrs.c"
+#include "mh_shm.h"
+#include <time.h>
+#ifdef _WIN32
+# include <winsock2.h>
+#else
+# include <poll.h>
+# include <sys/socket.h>
+#endif
+
+// A shared memory transport between a front-end and the server, for when
+// they're on the same machine and the cost of going through a socket for
+// every keystroke matters.
+//
+// A channel is a shared memory segment holding two rings of bytes: one
+// carrying requests to the server and one carrying replies (and anything
+// else the server sends, like screen updates) back. Each ring has one writer
+// and one reader, so they don't need locks: the writer only moves the tail
+// and the reader only moves the head. The bytes are the same protocol frames
+// that would otherwise go over the socket.
+//
+// A channel goes with a socket connection, which carries no data once the
+// channel is attached but is used as a doorbell. A reader that runs out of
+// data spins for a moment (TRE_shm_spin_ns) in case more is on the way, then
+// sets its ring's `reader_waiting` flag and waits on the socket; a writer
+// that sees the flag set sends a byte on the socket to wake it up. So while
+// messages are flowing neither side makes any system calls. (With only one
+// CPU the other side can't run while we spin, so there's no spinning.)
+//
+// To attach a channel, a client creates it with TRE_ShmChannel_create,
+// sends a TRE_PROTO_ATTACH_SHM request with its name over the socket, and
+// waits for the reply (on the socket). Everything after that goes through
+// the channel. Only a client on a Unix domain socket can attach one, since
+// a channel only works on the same machine anyway.
+
+#if INTERFACE
+// Size of each ring, by default. Must be a power of two.
+#define TRE_SHM_RING_SIZE (1024 * 1024)
+// How long a reader spins looking for data before it goes to sleep.
+#define TRE_SHM_SPIN_NS 50000
+// Longest channel name.
+#define TRE_SHM_MAX_NAME 64
+// What channel names start with. The server won't open anything else.
+#define TRE_SHM_NAME_PREFIX "/tre-"
+
+typedef enum {
+  TRE_SHM_TO_SERVER = 0,
+  TRE_SHM_TO_CLIENT = 1
+} TRE_Shm_Dir;
+
+// The state of one ring, at the start of its part of the shared segment. The
+// head and tail are kept on separate cache lines, since they're written by
+// different processes.
+typedef struct {
+  unsigned long long head;    // total bytes read
+  char pad1[56];
+  unsigned long long tail;    // total bytes written
+  char pad2[56];
+  int reader_waiting;         // set while the reader is asleep
+  char pad3[60];
+} TRE_ShmRing;
+
+typedef struct {
+  void* addr;                 // the mapped segment
+  TRE_Off map_len;
+  TRE_Off ring_size;
+  TRE_ShmRing* rings[2];
+  char* data[2];
+} TRE_ShmChannel;
+#endif
+
+#if LOCAL_INTERFACE
+// The header at the start of a shared segment.
+typedef struct {
+  unsigned magic;
+  unsigned version;
+  long long ring_size;
+  char pad[48];
+} shm_header_t;
+#define SHM_MAGIC 0x6d686574  // "tehm"
+#endif
+
+// Create a channel, as a new shared memory segment with the given name
+// (which should start with a slash and be unique, e.g. include the pid).
+// Returns NULL if it can't be created.
+TRE_ShmChannel* TRE_ShmChannel_create(const char* name, TRE_Off ring_size) {
+#ifdef _WIN32
+  (void)name, (void)ring_size;
+  return NULL;
+#else
+  assert((ring_size & (ring_size - 1)) == 0);
+  TRE_Off len = sizeof(shm_header_t) + 2 * (sizeof(TRE_ShmRing) + ring_size);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1) {
+    log_err("Unable to create shared memory %s: %s", name, strerror(errno));
+    return NULL;
+  }
+  if (0 != ftruncate(fd, len)) {
+    log_err("Unable to size shared memory: %s", strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  TRE_ShmChannel* ch = map_channel(fd, len);
+  close(fd);
+  if (ch == NULL) {
+    shm_unlink(name);
+    return NULL;
+  }
+  // The segment starts out zeroed, so the rings are empty.
+  shm_header_t* hdr = ch->addr;
+  hdr->magic = SHM_MAGIC;
+  hdr->version = 1;
+  hdr->ring_size = ring_size;
+  set_rings(ch, ring_size);
+  return ch;
+#endif
+}
+
+// Open a channel that a client has created. Only a segment with a channel's
+// name, owned by our own user, is opened, so a client can't have the server
+// map (or remove) anything else. Once it's been checked the name is removed,
+// since nothing else needs to find the segment when both ends have it
+// mapped. Returns NULL if it isn't a valid channel.
+TRE_ShmChannel* TRE_ShmChannel_open(const char* name) {
+#ifdef _WIN32
+  (void)name;
+  return NULL;
+#else
+  if (0 != strncmp(name, TRE_SHM_NAME_PREFIX, strlen(TRE_SHM_NAME_PREFIX))
+      || strchr(name + 1, '/')) {
+    log_err("Shared memory %s isn't a channel.", name);
+    return NULL;
+  }
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) {
+    log_err("Unable to open shared memory %s: %s", name, strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  TRE_ShmChannel* ch = NULL;
+  if (0 == fstat(fd, &st) && st.st_uid == geteuid()
+      && st.st_size >= (off_t)sizeof(shm_header_t)) {
+    ch = map_channel(fd, st.st_size);
+  }
+  close(fd);
+  if (ch == NULL) {
+    log_err("Shared memory %s isn't a channel.", name);
+    return NULL;
+  }
+  shm_header_t* hdr = ch->addr;
+  TRE_Off ring_size = hdr->ring_size;
+  if (hdr->magic != SHM_MAGIC || ring_size <= 0
+      || (ring_size & (ring_size - 1)) != 0
+      || ch->map_len != (TRE_Off)sizeof(shm_header_t)
+        + 2 * ((TRE_Off)sizeof(TRE_ShmRing) + ring_size)) {
+    log_err("Shared memory %s isn't a channel.", name);
+    TRE_ShmChannel_free(ch);
+    return NULL;
+  }
+  shm_unlink(name);
+  set_rings(ch, ring_size);
+  return ch;
+#endif
+}
+
+void TRE_ShmChannel_free(TRE_ShmChannel* ch) {
+#ifndef _WIN32
+  munmap(ch->addr, ch->map_len);
+#endif
+  my_free(ch);
+}
+
+// Client side: set up a channel on a (blocking) connection to the server.
+// Returns the channel, or NULL if the server couldn't attach it (in which
+// case the connection can still be used as it was).
+TRE_ShmChannel* TRE_ShmChannel_attach(int fd) {
+#ifdef _WIN32
+  (void)fd;
+  return NULL;
+#else
+  static int n_channels = 0;
+  char name[TRE_SHM_MAX_NAME];
+  snprintf(name, sizeof name, TRE_SHM_NAME_PREFIX "%ld-%d", (long)getpid(),
+      __atomic_add_fetch(&n_channels, 1, __ATOMIC_RELAXED));
+  TRE_ShmChannel* ch = TRE_ShmChannel_create(name, TRE_SHM_RING_SIZE);
+  if (ch == NULL) {
+    return NULL;
+  }
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  TRE_Proto_put_request(&q, TRE_PROTO_ATTACH_SHM, NULL, 0, name,
+      strlen(name));
+  int sent = send(fd, q.data, q.len, 0) == q.len;
+  TRE_ByteQueue_free(&q);
+  // Wait for the reply, which comes over the socket.
+  char reply_buf[64];
+  TRE_Off got = 0, frame_len = 0;
+  TRE_Proto_Reply reply;
+  while (sent && (frame_len =
+        TRE_Proto_get_reply(reply_buf, got, &reply)) == 0) {
+    int n = recv(fd, reply_buf + got, sizeof reply_buf - got, 0);
+    if (n <= 0) {
+      break;
+    }
+    got += n;
+  }
+  if (frame_len <= 0 || reply.status != TRE_PROTO_OK) {
+    // (If the server didn't accept it, the name's still there.)
+    shm_unlink(name);
+    TRE_ShmChannel_free(ch);
+    return NULL;
+  }
+  return ch;
+#endif
+}
+
+// Write as much of len bytes into a ring as will fit, without waiting.
+// Returns the number written.
+TRE_Off TRE_ShmChannel_write(TRE_ShmChannel* ch, TRE_Shm_Dir dir,
+    const char* src, TRE_Off len) {
+  TRE_ShmRing* ring = ch->rings[dir];
+  unsigned long long tail = ring->tail;
+  unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  TRE_Off space = ch->ring_size - (TRE_Off)(tail - head);
+  if (space < 0 || space > ch->ring_size) {
+    // The other end has scribbled on the ring.
+    space = 0;
+  }
+  if (len > space) {
+    len = space;
+  }
+  TRE_Off pos = tail & (ch->ring_size - 1);
+  TRE_Off first = ch->ring_size - pos < len ? ch->ring_size - pos : len;
+  memcpy(ch->data[dir] + pos, src, first);
+  memcpy(ch->data[dir], src + first, len - first);
+  __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+  return len;
+}
+
+// Read up to max bytes from a ring, without waiting. Returns the number
+// read.
+TRE_Off TRE_ShmChannel_read(TRE_ShmChannel* ch, TRE_Shm_Dir dir,
+    char* dst, TRE_Off max) {
+  TRE_ShmRing* ring = ch->rings[dir];
+  unsigned long long head = ring->head;
+  unsigned long long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  TRE_Off len = tail - head;
+  if (len < 0 || len > ch->ring_size) {
+    // The other end has scribbled on the ring.
+    len = 0;
+  }
+  if (len > max) {
+    len = max;
+  }
+  TRE_Off pos = head & (ch->ring_size - 1);
+  TRE_Off first = ch->ring_size - pos < len ? ch->ring_size - pos : len;
+  memcpy(dst, ch->data[dir] + pos, first);
+  memcpy(dst + first, ch->data[dir], len - first);
+  __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+  return len;
+}
+
+// Number of bytes waiting to be read from a ring.
+TRE_Off TRE_ShmChannel_available(TRE_ShmChannel* ch, TRE_Shm_Dir dir) {
+  TRE_ShmRing* ring = ch->rings[dir];
+  return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+    - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+// Called by a reader that's about to go to sleep. Returns nonzero if it can
+// (the ring is still empty); once it's set, a writer will ring the doorbell.
+int TRE_ShmChannel_prepare_wait(TRE_ShmChannel* ch, TRE_Shm_Dir dir) {
+  TRE_ShmRing* ring = ch->rings[dir];
+  __atomic_store_n(&ring->reader_waiting, 1, __ATOMIC_SEQ_CST);
+  // Check again, in case data came in before the flag was seen.
+  if (TRE_ShmChannel_available(ch, dir) > 0) {
+    __atomic_store_n(&ring->reader_waiting, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+void TRE_ShmChannel_end_wait(TRE_ShmChannel* ch, TRE_Shm_Dir dir) {
+  __atomic_store_n(&ch->rings[dir]->reader_waiting, 0, __ATOMIC_RELAXED);
+}
+
+// Called by a writer after writing. Returns nonzero if the reader is asleep
+// and needs to be woken up (with a byte on the doorbell socket).
+int TRE_ShmChannel_needs_wakeup(TRE_ShmChannel* ch, TRE_Shm_Dir dir) {
+  TRE_ShmRing* ring = ch->rings[dir];
+  // Pairs with the store in TRE_ShmChannel_prepare_wait: either the reader
+  // sees the data, or we see the flag.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_exchange_n(&ring->reader_waiting, 0, __ATOMIC_RELAXED);
+}
+
+// Client side: send len bytes to the server, waiting for room if the ring is
+// full. `fd` is the doorbell socket.
+void TRE_ShmChannel_send(TRE_ShmChannel* ch, int fd, const char* src,
+    TRE_Off len) {
+  while (len > 0) {
+    TRE_Off n = TRE_ShmChannel_write(ch, TRE_SHM_TO_SERVER, src, len);
+    src += n;
+    len -= n;
+    if (TRE_ShmChannel_needs_wakeup(ch, TRE_SHM_TO_SERVER)) {
+      net_send(fd, "", 1);
+    }
+    if (n == 0) {
+      // The server will make room soon.
+      shm_pause();
+    }
+  }
+}
+
+// Client side: read at least one and up to max bytes from the server,
+// waiting until some arrive. Returns the number read, or 0 if the server
+// closed the connection.
+TRE_Off TRE_ShmChannel_recv(TRE_ShmChannel* ch, int fd, char* dst,
+    TRE_Off max) {
+  for (;;) {
+    TRE_Off n = spin_read(ch, TRE_SHM_TO_CLIENT, dst, max);
+    if (n > 0) {
+      return n;
+    }
+    if (!TRE_ShmChannel_prepare_wait(ch, TRE_SHM_TO_CLIENT)) {
+      continue;
+    }
+    int ok = wait_doorbell(fd);
+    TRE_ShmChannel_end_wait(ch, TRE_SHM_TO_CLIENT);
+    if (!ok) {
+      // Read whatever was sent before the server went away.
+      return TRE_ShmChannel_read(ch, TRE_SHM_TO_CLIENT, dst, max);
+    }
+  }
+}
+
+// Read from a ring, spinning for a while (see TRE_shm_spin_ns) if it's
+// empty.
+LOCAL TRE_Off spin_read(TRE_ShmChannel* ch, TRE_Shm_Dir dir, char* dst,
+    TRE_Off max) {
+  TRE_Off n = TRE_ShmChannel_read(ch, dir, dst, max);
+  if (n > 0) {
+    return n;
+  }
+  long long deadline = TRE_shm_now_ns() + TRE_shm_spin_ns();
+  do {
+    for (int i = 0; i < 64; i++) {
+      if (TRE_ShmChannel_available(ch, dir) > 0) {
+        return TRE_ShmChannel_read(ch, dir, dst, max);
+      }
+      shm_pause();
+    }
+  } while (TRE_shm_now_ns() < deadline);
+  return 0;
+}
+
+// Wait for a byte on the doorbell socket (and throw away any others).
+// Returns zero if the connection was closed.
+LOCAL int wait_doorbell(int fd) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+#ifdef _WIN32
+  WSAPoll(&pfd, 1, -1);
+#else
+  poll(&pfd, 1, -1);
+#endif
+  char bells[64];
+  int n = recv(fd, bells, sizeof bells, 0);
+  return n > 0 || (n < 0 && net_would_block());
+}
+
+// How long a reader should spin waiting for data before going to sleep:
+// TRE_SHM_SPIN_NS, or 0 on a machine with one CPU.
+long long TRE_shm_spin_ns() {
+  static int n_cpus = 0;
+  int n = __atomic_load_n(&n_cpus, __ATOMIC_RELAXED);
+  if (n == 0) {
+#ifdef _WIN32
+    n = 1;
+#else
+    n = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 2 : 1;
+#endif
+    __atomic_store_n(&n_cpus, n, __ATOMIC_RELAXED);
+  }
+  return n > 1 ? TRE_SHM_SPIN_NS : 0;
+}
+
+// Nanoseconds on a monotonic clock.
+long long TRE_shm_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+LOCAL void shm_pause() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_ia32_pause();
+#endif
+}
+
+LOCAL TRE_ShmChannel* map_channel(int fd, TRE_Off len) {
+#ifdef _WIN32
+  (void)fd, (void)len;
+  return NULL;
+#else
+  void* addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    log_err("Unable to map shared memory: %s", strerror(errno));
+    return NULL;
+  }
+  TRE_ShmChannel* ch = my_alloc(sizeof(TRE_ShmChannel));
+  memset(ch, 0, sizeof(TRE_ShmChannel));
+  ch->addr = addr;
+  ch->map_len = len;
+  return ch;
+#endif
+}
+
+LOCAL void set_rings(TRE_ShmChannel* ch, TRE_Off ring_size) {
+  char* p = (char*)ch->addr + sizeof(shm_header_t);
+  ch->ring_size = ring_size;
+  for (int dir = 0; dir < 2; dir++) {
+    ch->rings[dir] = (TRE_ShmRing*)p;
+    ch->data[dir] = p + sizeof(TRE_ShmRing);
+    p += sizeof(TRE_ShmRing) + ring_size;
+  }
+}
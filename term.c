@@ -0,0 +1,81 @@
+#include "hdrs.c"
+#include "mh_term.h"
+
+// Terminal output for a screen (screen.c), without curses: spans become
+// VT100 cursor movements and text, collected in a buffer that's written to
+// the terminal in one go at the end of each frame.
+//
+// The terminal's cursor is tracked, so a span that starts where the last one
+// ended doesn't need a cursor movement before it.
+
+#if INTERFACE
+typedef struct {
+  int fd;
+  TRE_ByteQueue out;
+  int row;  // where the terminal's cursor is (-1 if not known)
+  int col;
+  long long bytes_written;
+} TRE_TermOut;
+#endif
+
+void TRE_TermOut_init(TRE_TermOut* term, int fd) {
+  memset(term, 0, sizeof(TRE_TermOut));
+  term->fd = fd;
+  term->row = term->col = -1;
+}
+
+void TRE_TermOut_free(TRE_TermOut* term) {
+  TRE_ByteQueue_free(&term->out);
+}
+
+// Screen emit function (see TRE_Screen_update) that puts a span on the
+// terminal.
+void TRE_TermOut_span(void* ctx, int row, int col, const char* text,
+    int len) {
+  TRE_TermOut* term = ctx;
+  TRE_TermOut_move_cursor(term, row, col);
+  TRE_ByteQueue_push(&term->out, text, len);
+  term->col += len;
+}
+
+// Put one char on the terminal.
+void TRE_TermOut_char(TRE_TermOut* term, int row, int col, char c) {
+  TRE_TermOut_move_cursor(term, row, col);
+  TRE_ByteQueue_push(&term->out, &c, 1);
+  term->col++;
+}
+
+void TRE_TermOut_move_cursor(TRE_TermOut* term, int row, int col) {
+  if (row == term->row && col == term->col) {
+    return;
+  }
+  char* p = TRE_ByteQueue_reserve(&term->out, 32);
+  term->out.len += sprintf(p, "\x1b[%d;%dH", row + 1, col + 1);
+  term->row = row;
+  term->col = col;
+}
+
+// Clear the terminal (e.g. to match a new or resized screen).
+void TRE_TermOut_clear(TRE_TermOut* term) {
+  TRE_ByteQueue_push(&term->out, "\x1b[2J", 4);
+  term->row = term->col = -1;
+}
+
+// Write out everything for the frame.
+TRE_OpResult TRE_TermOut_flush(TRE_TermOut* term) {
+  while (TRE_ByteQueue_length(&term->out) > 0) {
+    ssize_t n = write(term->fd, term->out.data + term->out.start,
+        TRE_ByteQueue_length(&term->out));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_err("Unable to write to terminal: %s", strerror(errno));
+      TRE_ByteQueue_consume(&term->out, TRE_ByteQueue_length(&term->out));
+      return TRE_FAIL;
+    }
+    TRE_ByteQueue_consume(&term->out, n);
+    term->bytes_written += n;
+  }
+  return TRE_SUCC;
+}
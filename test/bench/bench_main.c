@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "bench_main.h"
+
+// Runs the benchmarks. They aren't part of the test runner because they take
+// a while and their results depend on the machine. Pass part of a benchmark's
+// name as an argument to run only the matching benchmarks.
+
+#if INTERFACE
+struct bench {
+  const char* name;
+  void (*bench_func)();
+};
+#endif
+
+int main(int argc, char *argv[]) {
+  const char* filter = argc > 1 ? argv[1] : NULL;
+  run_benches(buffer_benches, filter);
+  run_benches(scan_benches, filter);
+  run_benches(proto_benches, filter);
+  run_benches(transport_benches, filter);
+  run_benches(frame_benches, filter);
+  return 0;
+}
+
+void run_benches(const struct bench* benches, const char* filter) {
+  for (int i = 0; benches[i].name != NULL; i++) {
+    if (filter && !strstr(benches[i].name, filter)) {
+      continue;
+    }
+    printf("%s\n", benches[i].name);
+    fflush(stdout);
+    benches[i].bench_func();
+  }
+}
+
+// Wall clock time in seconds.
+double bench_now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Print one result line.
+void bench_report(const char* what, double value, const char* unit) {
+  printf("  %-44s %14.1f %s\n", what, value, unit);
+  fflush(stdout);
+}
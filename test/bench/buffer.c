@@ -0,0 +1,138 @@
+#include "../../hdrs.c"
+#include "buffer.h"
+
+// Size of the text used by the buffer benchmarks.
+#define BENCH_TEXT_SIZE (32 * 1024 * 1024)
+// Size of the file the indexing benchmark loads.
+#define BENCH_INDEX_SIZE (512 * 1024 * 1024)
+
+struct bench buffer_benches[] = {
+  { "edits at random positions", bench_scattered_edits },
+  { "typing in one place", bench_local_edits },
+  { "index a big file", bench_index_threads },
+  { NULL, NULL }
+};
+
+// Set the cursor to a random position and make an edit there, over and over.
+// A gap buffer has to move the gap (up to the whole text) for every edit; a
+// piece buffer doesn't move any text.
+void bench_scattered_edits() {
+  const int n_edits = 1000;
+  static const TRE_Buf_Storage storages[] =
+    { TRE_BUF_STORAGE_GAP, TRE_BUF_STORAGE_PIECES };
+  for (int k = 0; k < 2; k++) {
+    TRE_Buf* buf = make_bench_buffer(BENCH_TEXT_SIZE);
+    TRE_Buf_set_storage(buf, storages[k]);
+    unsigned long long seed = 1;
+    double start = bench_now();
+    for (int i = 0; i < n_edits; i++) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      TRE_Off pos = (TRE_Off)(seed >> 33) % buf->text_len;
+      TRE_Buf_set_cursor_offset(buf, pos);
+      if (i % 2) {
+        TRE_Buf_insert_string(buf, "edit");
+      } else {
+        TRE_Buf_delete(buf);
+      }
+    }
+    double secs = bench_now() - start;
+    bench_report(storage_name(buf), n_edits / secs, "edits/s");
+    TRE_Buf_free(buf);
+  }
+}
+
+// Type and delete text at one place in the middle of the text, which is what
+// the gap buffer is good at.
+void bench_local_edits() {
+  const int n_edits = 2000000;
+  static const TRE_Buf_Storage storages[] =
+    { TRE_BUF_STORAGE_GAP, TRE_BUF_STORAGE_PIECES };
+  for (int k = 0; k < 2; k++) {
+    TRE_Buf* buf = make_bench_buffer(BENCH_TEXT_SIZE);
+    TRE_Buf_set_storage(buf, storages[k]);
+    TRE_Buf_set_cursor_offset(buf, buf->text_len / 2);
+    double start = bench_now();
+    for (int i = 0; i < n_edits; i++) {
+      if (i % 8 == 7) {
+        TRE_Buf_backspace(buf);
+      } else {
+        TRE_Buf_insert_char(buf, i % 64 ? 'a' : '\n');
+      }
+    }
+    double secs = bench_now() - start;
+    bench_report(storage_name(buf), n_edits / secs, "edits/s");
+    TRE_Buf_free(buf);
+  }
+}
+
+// Map a big file and count its lines, with 1 thread, 2, 4 and so on up to
+// one per core, to show how the indexer scales. (The file is written first,
+// so it's in the page cache and the times are for the scanning alone.)
+void bench_index_threads() {
+  char path[PATH_MAX];
+  const char* dir = getenv("TMPDIR");
+  // Don't touch the saved positions, and don't let a saved line table skip
+  // the counting.
+  TRE_fpos_set_default_store(NULL);
+  TRE_linecache_set_dir(NULL);
+  snprintf(path, PATH_MAX, "%s/tre-bench-index.tmp", dir ? dir : "/tmp");
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    printf("  unable to write %s\n", path);
+    return;
+  }
+  char line[128];
+  unsigned long long seed = 1;
+  for (TRE_Off written = 0; written < BENCH_INDEX_SIZE; ) {
+    // Lines of 1 to 127 chars.
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    int len = 1 + (int)(seed >> 33) % 127;
+    memset(line, 'a' + len % 26, len - 1);
+    line[len - 1] = '\n';
+    fwrite(line, 1, len, f);
+    written += len;
+  }
+  fclose(f);
+  int max_threads = TRE_Indexer_get_threads();
+  double one_thread = 0;
+  for (int n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) {
+    TRE_Indexer_set_threads(n);
+    double start = bench_now();
+    TRE_Buf* buf = TRE_Buf_load_mapped(path);
+    TRE_Off n_lines = TRE_Buf_count_lines(buf);
+    double secs = bench_now() - start;
+    TRE_Buf_free(buf);
+    if (n == 1) {
+      one_thread = secs;
+    }
+    char what[64];
+    snprintf(what, sizeof what, "%d thread%s (%lld lines)", n,
+        n == 1 ? "" : "s", n_lines);
+    bench_report(what, BENCH_INDEX_SIZE / secs / (1024 * 1024), "MB/s");
+    snprintf(what, sizeof what, "%d thread%s, speedup", n, n == 1 ? "" : "s");
+    bench_report(what, one_thread / secs, "x");
+    if (n == max_threads) {
+      break;
+    }
+  }
+  TRE_Indexer_set_threads(0);
+  remove(path);
+}
+
+// Make a buffer holding about `size` bytes of text, in lines of 64 chars.
+LOCAL TRE_Buf* make_bench_buffer(TRE_Off size) {
+  char* text = malloc(size + 1);
+  for (TRE_Off i = 0; i < size; i++) {
+    text[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  }
+  text[size] = '\0';
+  TRE_Buf* buf = TRE_Buf_load_from_string(text);
+  free(text);
+  return buf;
+}
+
+LOCAL const char* storage_name(const TRE_Buf* buf) {
+  return buf->storage == TRE_BUF_STORAGE_PIECES
+    ? "piece buffer"
+    : "gap buffer";
+}
@@ -0,0 +1,94 @@
+#include "../../hdrs.c"
+#include "frame.h"
+
+// Size of the screen drawn in the frame benchmarks.
+#define BENCH_FRAME_ROWS 100
+#define BENCH_FRAME_COLS 300
+// Frames drawn for each way of outputting them.
+#define BENCH_FRAMES 2000
+
+struct bench frame_benches[] = {
+  { "frame: full 300x100 screen", bench_frame_full },
+  { NULL, NULL }
+};
+
+#if LOCAL_INTERFACE
+typedef enum {
+  OUTPUT_CHARS,  // a cursor movement and a char for every cell
+  OUTPUT_SPANS   // a cursor movement (if needed) and the text of each span
+} output_t;
+#endif
+
+// Scroll a full screen of text up and down by a line, so that every cell
+// changes in every frame, and time the update plus the terminal output
+// (written to /dev/null, once per frame).
+void bench_frame_full() {
+  static const char* names[] = { "one char at a time", "whole spans" };
+  TRE_Buf* buf = make_frame_text(BENCH_FRAME_ROWS + 1, BENCH_FRAME_COLS);
+  int fd = open("/dev/null", O_WRONLY);
+  for (output_t o = OUTPUT_CHARS; o <= OUTPUT_SPANS; o++) {
+    TRE_Screen* screen = TRE_Screen_new(BENCH_FRAME_ROWS, BENCH_FRAME_COLS);
+    TRE_TermOut term;
+    TRE_TermOut_init(&term, fd);
+    TRE_Buf_goto_line(buf, 0, 0);
+    draw_frame(screen, buf, &term, o);
+    double start = bench_now();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+      // Go from the top line to the bottom one and back, which scrolls the
+      // screen by a line each time.
+      TRE_Buf_goto_line(buf, i % 2 == 0 ? BENCH_FRAME_ROWS : 0, 0);
+      draw_frame(screen, buf, &term, o);
+    }
+    double secs = bench_now() - start;
+    char what[64];
+    snprintf(what, sizeof what, "%s, time per frame", names[o]);
+    bench_report(what, secs / BENCH_FRAMES * 1e6, "us");
+    snprintf(what, sizeof what, "%s, output per frame", names[o]);
+    bench_report(what, (double)term.bytes_written / (BENCH_FRAMES + 1),
+        "bytes");
+    TRE_TermOut_free(&term);
+    TRE_Screen_free(screen);
+  }
+  close(fd);
+  TRE_Buf_free(buf);
+}
+
+LOCAL void draw_frame(TRE_Screen* screen, TRE_Buf* buf, TRE_TermOut* term,
+    output_t o) {
+  if (o == OUTPUT_CHARS) {
+    TRE_Screen_update(screen, buf, put_chars, term);
+  } else {
+    TRE_Screen_update(screen, buf, TRE_TermOut_span, term);
+  }
+  TRE_TermOut_move_cursor(term, screen->cursor_row, screen->cursor_col);
+  TRE_TermOut_flush(term);
+}
+
+// Output a span the way TRE_Win_display_char did, a char at a time. (The
+// terminal's cursor is forgotten after each one, since curses' wmove is
+// called for every char too.)
+LOCAL void put_chars(void* ctx, int row, int col, const char* text, int len) {
+  TRE_TermOut* term = ctx;
+  for (int i = 0; i < len; i++) {
+    term->row = -1;
+    TRE_TermOut_char(term, row, col + i, text[i]);
+  }
+}
+
+// Make a buffer of full-width lines of varying text.
+LOCAL TRE_Buf* make_frame_text(int n_lines, int line_len) {
+  char* text = malloc((size_t)n_lines * (line_len + 1) + 1);
+  char* p = text;
+  unsigned seed = 1;
+  for (int i = 0; i < n_lines; i++) {
+    for (int j = 0; j < line_len - 1; j++) {
+      seed = seed * 1103515245 + 12345;
+      *p++ = 'a' + (seed >> 16) % 26;
+    }
+    *p++ = '\n';
+  }
+  *p = '\0';
+  TRE_Buf* buf = TRE_Buf_load_from_string(text);
+  free(text);
+  return buf;
+}
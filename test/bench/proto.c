@@ -0,0 +1,153 @@
+#include "../../hdrs.c"
+#ifdef _WIN32
+# include <winsock2.h>
+#else
+# include <sys/socket.h>
+# include <netinet/in.h>
+#endif
+#include "proto.h"
+
+// Requests sent in the request/response benchmark.
+#define BENCH_LOCKSTEP_OPS 20000
+// Requests sent in the pipelined benchmarks.
+#define BENCH_PIPELINED_OPS 2000000
+
+struct bench proto_benches[] = {
+  { "protocol: one request per round trip", bench_proto_lockstep },
+  { "protocol: pipelined requests", bench_proto_pipelined },
+  { NULL, NULL }
+};
+
+#if LOCAL_INTERFACE
+typedef struct {
+  TRE_Server* srv;
+  int stop;
+} bench_server_t;
+#endif
+
+// Send a request and wait for its reply before sending the next, which is
+// how the old line-per-command loop worked.
+void bench_proto_lockstep() {
+  bench_server_t bs;
+  pthread_t thread;
+  int client = start_bench_server(&bs, &thread);
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  double start = bench_now();
+  for (int i = 0; i < BENCH_LOCKSTEP_OPS; i++) {
+    TRE_Proto_put_request(&q, TRE_PROTO_INSERT, NULL, 0, "a", 1);
+    send_requests(client, &q);
+    read_replies(client, 1);
+  }
+  double secs = bench_now() - start;
+  bench_report("1 per round trip", BENCH_LOCKSTEP_OPS / secs, "ops/s");
+  TRE_ByteQueue_free(&q);
+  stop_bench_server(&bs, thread, client);
+}
+
+// Send requests in batches and read the replies for each batch together.
+void bench_proto_pipelined() {
+  static const int batch_sizes[] = { 10, 100, 1000, 10000 };
+  for (int k = 0; k < 4; k++) {
+    int batch = batch_sizes[k];
+    bench_server_t bs;
+    pthread_t thread;
+    int client = start_bench_server(&bs, &thread);
+    TRE_ByteQueue q;
+    memset(&q, 0, sizeof q);
+    double start = bench_now();
+    for (int i = 0; i < BENCH_PIPELINED_OPS; i += batch) {
+      for (int j = 0; j < batch; j++) {
+        if (j % 8 == 7) {
+          TRE_Proto_put_request(&q, TRE_PROTO_BACKSPACE, NULL, 0, NULL, 0);
+        } else {
+          TRE_Proto_put_request(&q, TRE_PROTO_INSERT, NULL, 0, "a", 1);
+        }
+      }
+      send_requests(client, &q);
+      read_replies(client, batch);
+    }
+    double secs = bench_now() - start;
+    char what[64];
+    snprintf(what, sizeof what, "%d per round trip", batch);
+    bench_report(what, BENCH_PIPELINED_OPS / secs, "ops/s");
+    TRE_ByteQueue_free(&q);
+    stop_bench_server(&bs, thread, client);
+  }
+}
+
+// Start a server (serving a new buffer) on its own thread and connect to it
+// over loopback TCP. Returns the client's socket.
+LOCAL int start_bench_server(bench_server_t* bs, pthread_t* thread) {
+  net_init();
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  bind(listen_fd, (struct sockaddr*)&addr, sizeof addr);
+  listen(listen_fd, 1);
+  getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len);
+  int client_fd = socket(AF_INET, SOCK_STREAM, 0);
+  connect(client_fd, (struct sockaddr*)&addr, sizeof addr);
+  int server_fd = accept(listen_fd, NULL, NULL);
+  net_close(listen_fd);
+  bs->srv = TRE_Server_new(-1, TRE_Proto_handle);
+  bs->srv->data = TRE_Buf_new(NULL);
+  bs->stop = 0;
+  TRE_Server_add_conn(bs->srv, server_fd);
+  pthread_create(thread, NULL, run_bench_server, bs);
+  return client_fd;
+}
+
+LOCAL void* run_bench_server(void* arg) {
+  bench_server_t* bs = arg;
+  while (!__atomic_load_n(&bs->stop, __ATOMIC_ACQUIRE)) {
+    TRE_Server_poll(bs->srv, 10);
+  }
+  return NULL;
+}
+
+LOCAL void stop_bench_server(bench_server_t* bs, pthread_t thread,
+    int client) {
+  __atomic_store_n(&bs->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+  net_close(client);
+  TRE_Buf_free(bs->srv->data);
+  TRE_Server_free(bs->srv);
+}
+
+LOCAL void send_requests(int fd, TRE_ByteQueue* q) {
+  while (TRE_ByteQueue_length(q) > 0) {
+    int n = send(fd, q->data + q->start, TRE_ByteQueue_length(q), 0);
+    if (n <= 0) {
+      fprintf(stderr, "send failed\n");
+      exit(1);
+    }
+    TRE_ByteQueue_consume(q, n);
+  }
+}
+
+// Read n replies (blocking).
+LOCAL void read_replies(int fd, int n) {
+  static TRE_ByteQueue q;
+  TRE_Proto_Reply reply;
+  while (n > 0) {
+    TRE_Off frame_len;
+    while (n > 0 && (frame_len = TRE_Proto_get_reply(q.data + q.start,
+            TRE_ByteQueue_length(&q), &reply)) > 0) {
+      TRE_ByteQueue_consume(&q, frame_len);
+      n--;
+    }
+    if (n > 0) {
+      char* dst = TRE_ByteQueue_reserve(&q, 65536);
+      int len = recv(fd, dst, 65536, 0);
+      if (len <= 0) {
+        fprintf(stderr, "recv failed\n");
+        exit(1);
+      }
+      q.len += len;
+    }
+  }
+}
@@ -0,0 +1,95 @@
+#include "../../hdrs.c"
+#include "scan.h"
+
+// Size of the text the scan kernels are run over.
+#define BENCH_SCAN_SIZE (64 * 1024 * 1024)
+// Number of times each kernel goes over the text.
+#define BENCH_SCAN_PASSES 8
+
+struct bench scan_benches[] = {
+  { "count newlines", bench_count_newlines },
+  { "find every newline", bench_find_newlines },
+  { "find newline in long lines", bench_find_long_lines },
+  { NULL, NULL }
+};
+
+// Count all the newlines in the text with each kernel.
+void bench_count_newlines() {
+  char* text = make_scan_text(BENCH_SCAN_SIZE, 80);
+  for (int k = 0; k < TRE_SCAN_N_KERNELS; k++) {
+    if (TRE_FAIL == TRE_scan_use_kernel(k)) {
+      continue;
+    }
+    TRE_Off total = 0;
+    double start = bench_now();
+    for (int pass = 0; pass < BENCH_SCAN_PASSES; pass++) {
+      total += TRE_count_newlines(text, BENCH_SCAN_SIZE);
+    }
+    report_scan(k, bench_now() - start, total);
+  }
+  TRE_scan_use_best_kernel();
+  free(text);
+}
+
+// Walk from each newline to the next, the way the line indexer does, in text
+// with lines of typical length.
+void bench_find_newlines() {
+  char* text = make_scan_text(BENCH_SCAN_SIZE, 80);
+  find_all(text);
+  free(text);
+}
+
+// The same, but with lines long enough for the vector loops to matter.
+void bench_find_long_lines() {
+  char* text = make_scan_text(BENCH_SCAN_SIZE, 4096);
+  find_all(text);
+  free(text);
+}
+
+LOCAL void find_all(const char* text) {
+  const char* end = text + BENCH_SCAN_SIZE;
+  for (int k = 0; k < TRE_SCAN_N_KERNELS; k++) {
+    if (TRE_FAIL == TRE_scan_use_kernel(k)) {
+      continue;
+    }
+    TRE_Off total = 0;
+    double start = bench_now();
+    for (int pass = 0; pass < BENCH_SCAN_PASSES; pass++) {
+      const char* p = text;
+      const char* nl;
+      while ((nl = TRE_find_newline(p, end - p))) {
+        total++;
+        p = nl + 1;
+      }
+    }
+    report_scan(k, bench_now() - start, total);
+  }
+  TRE_scan_use_best_kernel();
+}
+
+// Make text with lines of random length, averaging about avg_line chars.
+LOCAL char* make_scan_text(TRE_Off size, int avg_line) {
+  char* text = malloc(size);
+  unsigned long long seed = 1;
+  TRE_Off next_nl = 0;
+  for (TRE_Off i = 0; i < size; i++) {
+    if (i == next_nl) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      next_nl = i + 1 + (TRE_Off)(seed >> 33) % (2 * avg_line);
+      text[i] = '\n';
+    } else {
+      text[i] = 'a' + i % 26;
+    }
+  }
+  return text;
+}
+
+// Report a kernel's throughput. The newline total is printed too, so the
+// compiler can't drop the scans (and so the kernels can be seen to agree).
+LOCAL void report_scan(TRE_Scan_Kernel k, double secs, TRE_Off total) {
+  char what[64];
+  snprintf(what, sizeof what, "%s (%lld newlines)", TRE_scan_kernel_name(k),
+      total / BENCH_SCAN_PASSES);
+  bench_report(what,
+      (double)BENCH_SCAN_SIZE * BENCH_SCAN_PASSES / secs / 1e9, "GB/s");
+}
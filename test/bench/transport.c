@@ -0,0 +1,173 @@
+#include "../../hdrs.c"
+#ifdef _WIN32
+# include <winsock2.h>
+#else
+# include <sys/socket.h>
+# include <netinet/in.h>
+#endif
+#include "transport.h"
+
+// Round trips measured for each transport.
+#define BENCH_ROUND_TRIPS 50000
+// Round trips done before measuring, to warm up caches and the scheduler.
+#define BENCH_WARMUP_TRIPS 2000
+
+struct bench transport_benches[] = {
+  { "transport: round trip latency", bench_transport_latency },
+  { NULL, NULL }
+};
+
+#if LOCAL_INTERFACE
+typedef enum {
+  TRANSPORT_TCP,
+  TRANSPORT_UNIX,
+  TRANSPORT_SHM
+} transport_t;
+
+typedef struct {
+  TRE_Server* srv;
+  pthread_t thread;
+  int stop;
+  int client;
+  TRE_ShmChannel* ch;
+  char path[64];
+} transport_server_t;
+#endif
+
+// Time single GET_CURSOR requests, one at a time, over each transport, and
+// report the median and 99th percentile round trip.
+void bench_transport_latency() {
+  static const char* names[] = { "tcp loopback", "unix socket", "shm ring" };
+  TRE_Off* samples = malloc(BENCH_ROUND_TRIPS * sizeof(TRE_Off));
+  for (transport_t t = TRANSPORT_TCP; t <= TRANSPORT_SHM; t++) {
+    transport_server_t ts;
+    if (!start_transport(&ts, t)) {
+      printf("  %-44s %14s\n", names[t], "unsupported");
+      continue;
+    }
+    for (int i = 0; i < BENCH_WARMUP_TRIPS; i++) {
+      round_trip(&ts);
+    }
+    for (int i = 0; i < BENCH_ROUND_TRIPS; i++) {
+      TRE_Off start = TRE_shm_now_ns();
+      round_trip(&ts);
+      samples[i] = TRE_shm_now_ns() - start;
+    }
+    qsort(samples, BENCH_ROUND_TRIPS, sizeof(TRE_Off), compare_off);
+    char what[64];
+    snprintf(what, sizeof what, "%s p50", names[t]);
+    bench_report(what, samples[BENCH_ROUND_TRIPS / 2] / 1e3, "us");
+    snprintf(what, sizeof what, "%s p99", names[t]);
+    bench_report(what, samples[BENCH_ROUND_TRIPS * 99 / 100] / 1e3, "us");
+    stop_transport(&ts);
+  }
+  free(samples);
+}
+
+LOCAL void round_trip(transport_server_t* ts) {
+  static TRE_ByteQueue q;
+  static char reply[256];
+  TRE_Proto_put_request(&q, TRE_PROTO_GET_CURSOR, NULL, 0, NULL, 0);
+  // A GET_CURSOR reply is 4 + 2 + 3 * 8 bytes.
+  TRE_Off want = TRE_PROTO_HEADER_LEN + 2 + 3 * 8, got = 0;
+  if (ts->ch) {
+    TRE_ShmChannel_send(ts->ch, ts->client, q.data + q.start,
+        TRE_ByteQueue_length(&q));
+    while (got < want) {
+      TRE_Off n = TRE_ShmChannel_recv(ts->ch, ts->client, reply + got,
+          want - got);
+      if (n <= 0) {
+        fprintf(stderr, "shm recv failed\n");
+        exit(1);
+      }
+      got += n;
+    }
+  } else {
+    if (send(ts->client, q.data + q.start, TRE_ByteQueue_length(&q), 0)
+        != TRE_ByteQueue_length(&q)) {
+      fprintf(stderr, "send failed\n");
+      exit(1);
+    }
+    while (got < want) {
+      int n = recv(ts->client, reply + got, want - got, 0);
+      if (n <= 0) {
+        fprintf(stderr, "recv failed\n");
+        exit(1);
+      }
+      got += n;
+    }
+  }
+  TRE_ByteQueue_consume(&q, TRE_ByteQueue_length(&q));
+}
+
+// Start a server on its own thread and connect a blocking client to it over
+// the given transport. Returns 0 if the transport isn't available.
+LOCAL int start_transport(transport_server_t* ts, transport_t t) {
+  net_init();
+  memset(ts, 0, sizeof *ts);
+  int listen_fd;
+  if (t == TRANSPORT_TCP) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    bind(listen_fd, (struct sockaddr*)&addr, sizeof addr);
+    listen(listen_fd, 1);
+    getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len);
+    ts->client = socket(AF_INET, SOCK_STREAM, 0);
+    connect(ts->client, (struct sockaddr*)&addr, sizeof addr);
+  } else {
+    snprintf(ts->path, sizeof ts->path, "/tmp/tre-bench-%ld.sock",
+        (long)getpid());
+    listen_fd = net_listen_unix(ts->path);
+    if (listen_fd < 0) {
+      return 0;
+    }
+    ts->client = net_connect_unix(ts->path);
+  }
+  int server_fd;
+  while (-1 == (server_fd = net_accept(listen_fd))) {
+  }
+  net_close(listen_fd);
+  ts->srv = TRE_Server_new(-1, TRE_Proto_handle);
+  ts->srv->data = TRE_Buf_new(NULL);
+  TRE_Server_add_conn(ts->srv, server_fd);
+  pthread_create(&ts->thread, NULL, run_transport_server, ts);
+  if (t == TRANSPORT_SHM) {
+    ts->ch = TRE_ShmChannel_attach(ts->client);
+    if (!ts->ch) {
+      stop_transport(ts);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+LOCAL void* run_transport_server(void* arg) {
+  transport_server_t* ts = arg;
+  while (!__atomic_load_n(&ts->stop, __ATOMIC_ACQUIRE)) {
+    TRE_Server_poll(ts->srv, 10);
+  }
+  return NULL;
+}
+
+LOCAL void stop_transport(transport_server_t* ts) {
+  __atomic_store_n(&ts->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(ts->thread, NULL);
+  net_close(ts->client);
+  if (ts->ch) {
+    TRE_ShmChannel_free(ts->ch);
+  }
+  if (ts->path[0]) {
+    unlink(ts->path);
+  }
+  TRE_Buf_free(ts->srv->data);
+  TRE_Server_free(ts->srv);
+}
+
+LOCAL int compare_off(const void* a, const void* b) {
+  TRE_Off x = *(const TRE_Off*)a, y = *(const TRE_Off*)b;
+  return (x > y) - (x < y);
+}
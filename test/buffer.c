@@ -1,7 +1,16 @@
 #include <CUnit/CUnit.h>
 #include "../hdrs.c"
+#include <sys/wait.h>
 #include "buffer.h"
 
+// Name of the file that tests which load files write to.
+#define TEST_TEMP_FILE "test_buffer.tmp"
+// Directory for the saved-position store tests.
+#define TEST_FPOS_DIR "test_fpos.tmp"
+#define TEST_FPOS_DB TEST_FPOS_DIR "/fpos.db"
+// Directory for the line table tests.
+#define TEST_LINES_DIR "test_lines.tmp"
+
 struct test buffer_tests[] = {
   { "create empty buffer", test_buffer_create },
   { "load buffer from string", test_buffer_load_from_string },
@@ -9,6 +18,7 @@ struct test buffer_tests[] = {
     test_empty_buf_from_string_matches_new_buf },
   { "move cursor right two spaces", test_move_cursor_right },
   { "move cursor right to end of line", test_move_cursor_right_to_eol },
+  { "moves by extreme distances", test_move_extremes },
   { "move cursor right past end of line (wrap to next line)",
     test_move_cursor_right_wrap_to_next_line },
   { "move cursor right to end of file", test_move_cursor_right_to_eof },
@@ -19,16 +29,72 @@ struct test buffer_tests[] = {
   { "delete at end of buffer", test_delete_at_end_of_buffer },
   { "backspace at start of buffer", test_backspace_at_start_of_buffer },
   { "backspace at start of line", test_backspace_at_start_of_line },
+  { "move many lines at once", test_move_many_lines },
+  { "move right across many lines", test_move_right_across_lines },
+  { "line index tracks inserted newlines", test_line_index_insert_newlines },
+  { "line index tracks joined lines", test_line_index_join_lines },
+  { "set cursor by offset", test_set_cursor_offset },
+  { "insert string within a line", test_insert_string_within_line },
+  { "insert string larger than the gap", test_insert_large_string },
+  { "insert bytes containing nulls", test_insert_bytes_with_nulls },
+  { "allocation grows geometrically", test_geometric_growth },
+  { "growth step is capped by the policy", test_growth_step_cap },
+  { "compact after a large delete", test_compact_after_delete },
+  { "load a file mapped", test_load_mapped },
+  { "mapped file without a final newline", test_load_mapped_no_final_newline },
+  { "edit a mapped file", test_edit_mapped },
+  { "load a file in the background", test_load_async },
+  { "background load without a final newline",
+    test_load_async_no_final_newline },
+  { "indexer lookups match the line index", test_indexer_lookups },
+  { "index with several threads", test_indexer_threads },
+  { "saved line tables", test_line_cache },
+  { "switching storage keeps the text", test_switch_storage },
+  { "scattered edits match across storage kinds", test_scattered_edits },
+  { "cursor movement leaves the gap alone", test_move_without_gap },
+  { "newline scan kernels agree", test_scan_kernels },
+  { "newline scans across the gap", test_scan_across_gap },
+  { "delete a range of lines", test_delete_range },
+  { "replace a range", test_replace_range },
+  { "read a range in place", test_get_range },
+  { "iterate over the text in blocks", test_iterate_blocks },
+  { "search across block boundaries", test_search },
+  { "save a gap buffer", test_save },
+  { "save a buffer of many pieces", test_save_pieces },
+  { "save in the background while editing", test_save_background },
+  { "saved positions store", test_fpos_store },
+  { "saved positions evict the least recent", test_fpos_eviction },
+  { "saved positions from several processes", test_fpos_processes },
+  { "buffers remember their positions", test_fpos_buffers },
+  { "buffer registry handles", test_bufreg_handles },
+  { "buffer registry evicts cold buffers", test_bufreg_eviction },
+  { "buffer registry reloads big spilled buffers", test_bufreg_big_spill },
+  { "follow a growing file", test_follow },
+  { "follow a file edited before following", test_follow_edited },
+  { "follow a mapped file through truncation", test_follow_mapped },
+  { "undo a run of typing in one step", test_undo_typing },
+  { "undo a run of deletes and backspaces", test_undo_deletes },
+  { "undo and redo a large paste", test_undo_large_paste },
+  { "save point tracks modification", test_undo_save_point },
+  { "undo history within a budget", test_undo_budget },
+  { "compressed blocks round trip", test_compress_round_trip },
   { NULL, NULL }
 };
 
 struct test_suite buffer_suite = {
   .name = "Buffer",
-  .init = NULL,
+  .init = init_buffer_suite,
   .cleanup = NULL,
   .tests = buffer_tests
 };
 
+int init_buffer_suite() {
+  // Keep the tests away from the user's own saved positions and line tables.
+  TRE_fpos_set_default_store(NULL);
+  TRE_linecache_set_dir(NULL);
+  return 0;
+}
+
 void test_buffer_create() {
   static const char TEST_FILE_NAME[] = "test_file.txt";
   TRE_Buf* buf = TRE_Buf_new(TEST_FILE_NAME);
@@ -44,7 +110,7 @@ void test_buffer_create() {
   CU_ASSERT(buf->cursor_line.off == 0);
   CU_ASSERT(buf->cursor_line.len == 1);
   CU_ASSERT(buf->cursor_col == 0);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
 }
 
 void test_empty_buf_from_string_matches_new_buf() {
@@ -62,8 +128,8 @@ void test_empty_buf_from_string_matches_new_buf() {
   CU_ASSERT(bn->cursor_line.len == bs->cursor_line.len);
   CU_ASSERT(bn->cursor_col == bs->cursor_col);
   CU_ASSERT(compare_buffers(bn, bs));
-  CU_ASSERT(gap_matches_cursor(bn));
-  CU_ASSERT(gap_matches_cursor(bs));
+  CU_ASSERT(cursor_is_valid(bn));
+  CU_ASSERT(cursor_is_valid(bs));
 }
 
 void test_buffer_load_from_string() {
@@ -85,16 +151,16 @@ void test_buffer_load_from_string() {
       memcmp(TEST_STRING,
         buf->text.c + buf->gap_start + buf->gap_len,
         strlen(TEST_STRING)));
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
 }
 
 void test_move_cursor_right() {
   static const char* TEST_STRING = "abc\ndef\nxyz\njkl\n";
   TRE_Buf* buf = TRE_Buf_load_from_string(TEST_STRING);
   TRE_Buf_move_charwise(buf, 1);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   TRE_Buf_move_charwise(buf, 1);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   CU_ASSERT(buf->cursor_line.num == 0);
   CU_ASSERT(buf->cursor_line.off == 0);
   CU_ASSERT(buf->cursor_line.len == 4);
@@ -106,7 +172,7 @@ void test_move_cursor_right_to_eol() {
   TRE_Buf* buf = TRE_Buf_load_from_string(TEST_STRING);
   for (int i=0; i < 3; i++) {
     TRE_Buf_move_charwise(buf, 1);
-    CU_ASSERT(gap_matches_cursor(buf));
+    CU_ASSERT(cursor_is_valid(buf));
   }
   CU_ASSERT(buf->cursor_line.num == 0);
   CU_ASSERT(buf->cursor_line.off == 0);
@@ -119,7 +185,7 @@ void test_move_cursor_right_wrap_to_next_line() {
   TRE_Buf* buf = TRE_Buf_load_from_string(TEST_STRING);
   for (int i=0; i < 4; i++) {
     TRE_Buf_move_charwise(buf, 1);
-    CU_ASSERT(gap_matches_cursor(buf));
+    CU_ASSERT(cursor_is_valid(buf));
   }
   CU_ASSERT(buf->cursor_line.num == 1);
   CU_ASSERT(buf->cursor_line.off == 4);
@@ -132,7 +198,7 @@ void test_move_cursor_right_to_eof() {
   TRE_Buf* buf = TRE_Buf_load_from_string(TEST_STRING);
   for (int i=0; i < 16; i++) {
     TRE_Buf_move_charwise(buf, 1);
-    CU_ASSERT(gap_matches_cursor(buf));
+    CU_ASSERT(cursor_is_valid(buf));
   }
   CU_ASSERT(buf->cursor_line.num == 3);
   CU_ASSERT(buf->cursor_line.off == 12);
@@ -145,7 +211,7 @@ void test_move_cursor_right_past_eof() {
   TRE_Buf* buf = TRE_Buf_load_from_string(TEST_STRING);
   for (int i=0; i < 17; i++) {
     TRE_Buf_move_charwise(buf, 1);
-    CU_ASSERT(gap_matches_cursor(buf));
+    CU_ASSERT(cursor_is_valid(buf));
   }
   CU_ASSERT(buf->cursor_line.num == 3);
   CU_ASSERT(buf->cursor_line.off == 12);
@@ -158,7 +224,7 @@ void test_move_cursor_right_past_eof_3_times() {
   TRE_Buf* buf = TRE_Buf_load_from_string(TEST_STRING);
   for (int i=0; i < 19; i++) {
     TRE_Buf_move_charwise(buf, 1);
-    CU_ASSERT(gap_matches_cursor(buf));
+    CU_ASSERT(cursor_is_valid(buf));
   }
   CU_ASSERT(buf->cursor_line.num == 3);
   CU_ASSERT(buf->cursor_line.off == 12);
@@ -170,9 +236,9 @@ void test_move_down_through_empty_line() {
   static const char test_file[] = "\n\n\n\n\n";
   TRE_Buf* buf = TRE_Buf_load_from_string(test_file);
   TRE_Buf_move_linewise(buf, 1);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   TRE_Buf_move_linewise(buf, 1);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   CU_ASSERT(buf->cursor_line.num == 2);
   CU_ASSERT(buf->cursor_line.off == 2);
   CU_ASSERT(buf->cursor_line.len == 1);
@@ -183,13 +249,13 @@ void test_move_up_through_empty_line() {
   static const char test_file[] = "\n\n\n\n\n";
   TRE_Buf* buf = TRE_Buf_load_from_string(test_file);
   TRE_Buf_move_linewise(buf, 1);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   TRE_Buf_move_linewise(buf, 1);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   TRE_Buf_move_linewise(buf, -1);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   TRE_Buf_move_linewise(buf, -1);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   CU_ASSERT(buf->cursor_line.num == 0);
   CU_ASSERT(buf->cursor_line.off == 0);
   CU_ASSERT(buf->cursor_line.len == 1);
@@ -201,7 +267,7 @@ void test_backspace_at_start_of_buffer() {
   TRE_Buf* buf = TRE_Buf_load_from_string(test_file);
   CU_ASSERT(buf->text_len == 1);
   TRE_Buf_backspace(buf);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   CU_ASSERT(buf->text_len == 1);
   CU_ASSERT(buf->gap_start == 0);
 }
@@ -211,7 +277,7 @@ void test_delete_at_end_of_buffer() {
   TRE_Buf* buf = TRE_Buf_load_from_string(test_file);
   CU_ASSERT(buf->text_len == 1);
   TRE_Buf_delete(buf);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   CU_ASSERT(buf->text_len == 1);
 }
 
@@ -221,13 +287,13 @@ void test_backspace_at_start_of_line() {
   CU_ASSERT(buf->text_len == 8);
   CU_ASSERT(buf->n_lines == 2);
   TRE_Buf_move_linewise(buf, 1);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   CU_ASSERT(buf->cursor_line.num == 1);
   CU_ASSERT(buf->cursor_line.off == 4);
   CU_ASSERT(buf->cursor_line.len == 4);
   CU_ASSERT(buf->cursor_col == 0);
   TRE_Buf_backspace(buf);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   CU_ASSERT(buf->text_len == 7);
   CU_ASSERT(buf->cursor_line.num == 0);
   CU_ASSERT(buf->cursor_line.off == 0);
@@ -242,14 +308,14 @@ void test_delete_at_end_of_line() {
   CU_ASSERT(buf->text_len == 8);
   CU_ASSERT(buf->n_lines == 2);
   TRE_Buf_move_linewise(buf, 1);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   TRE_Buf_move_charwise(buf, -1);
   CU_ASSERT(buf->cursor_line.num == 0);
   CU_ASSERT(buf->cursor_line.off == 0);
   CU_ASSERT(buf->cursor_line.len == 4);
   CU_ASSERT(buf->cursor_col == 3);
   TRE_Buf_delete(buf);
-  CU_ASSERT(gap_matches_cursor(buf));
+  CU_ASSERT(cursor_is_valid(buf));
   CU_ASSERT(buf->text_len == 7);
   CU_ASSERT(buf->cursor_line.num == 0);
   CU_ASSERT(buf->cursor_line.off == 0);
@@ -258,6 +324,1521 @@ void test_delete_at_end_of_line() {
   CU_ASSERT(buf->n_lines == 1);
 }
 
+void test_move_many_lines() {
+  TRE_Buf* buf = make_numbered_lines(1000);
+  TRE_Buf_move_linewise(buf, 500);
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(buf->cursor_line.num == 500);
+  CU_ASSERT(buf->cursor_line.off == 500 * 9);
+  CU_ASSERT(buf->cursor_line.len == 9);
+  TRE_Buf_move_linewise(buf, 1000);
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(buf->cursor_line.num == 999);
+  TRE_Buf_move_linewise(buf, -2000);
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(buf->cursor_line.num == 0);
+  CU_ASSERT(buf->cursor_line.off == 0);
+  TRE_Buf_free(buf);
+}
+
+void test_move_right_across_lines() {
+  TRE_Buf* buf = make_numbered_lines(1000);
+  TRE_Buf_move_charwise(buf, 9 * 300 + 4);
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(buf->cursor_line.num == 300);
+  CU_ASSERT(buf->cursor_col == 4);
+  TRE_Buf_move_charwise(buf, -(9 * 100 + 5));
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(buf->cursor_line.num == 199);
+  CU_ASSERT(buf->cursor_col == 8);
+  TRE_Buf_free(buf);
+}
+
+void test_line_index_insert_newlines() {
+  TRE_Buf* buf = make_numbered_lines(300);
+  TRE_Buf_move_linewise(buf, 150);
+  // Insert enough lines in one place to overflow an index block.
+  for (int i = 0; i < 2 * TRE_LINE_BLOCK_SIZE; i++) {
+    TRE_Buf_insert_char(buf, 'x');
+    TRE_Buf_insert_char(buf, '\n');
+  }
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(buf->n_lines == 300 + 2 * TRE_LINE_BLOCK_SIZE);
+  CU_ASSERT(buf->cursor_line.num == 150 + 2 * TRE_LINE_BLOCK_SIZE);
+  CU_ASSERT(index_matches_text(buf));
+  TRE_Buf_free(buf);
+}
+
+void test_line_index_join_lines() {
+  TRE_Buf* buf = make_numbered_lines(300);
+  TRE_Buf_move_linewise(buf, 100);
+  TRE_Buf_move_charwise(buf, -1);
+  for (int i = 0; i < 50; i++) {
+    TRE_Buf_delete(buf);
+  }
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(index_matches_text(buf));
+  TRE_Buf_move_linewise(buf, 100);
+  for (int i = 0; i < 200; i++) {
+    TRE_Buf_backspace(buf);
+  }
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(index_matches_text(buf));
+  TRE_Buf_free(buf);
+}
+
+void test_set_cursor_offset() {
+  TRE_Buf* buf = make_numbered_lines(100);
+  CU_ASSERT(TRE_Buf_set_cursor_offset(buf, 9 * 42 + 3) == TRE_SUCC);
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(buf->cursor_line.num == 42);
+  CU_ASSERT(buf->cursor_col == 3);
+  CU_ASSERT(TRE_Buf_set_cursor_offset(buf, buf->text_len) == TRE_FAIL);
+  CU_ASSERT(buf->cursor_line.num == 42);
+  TRE_Buf_free(buf);
+}
+
+void test_insert_string_within_line() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\ndef\n");
+  TRE_Buf_move_charwise(buf, 5);
+  TRE_Buf_insert_string(buf, "12\n345\n6");
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(buf->text_len == 16);
+  CU_ASSERT(buf->n_lines == 4);
+  CU_ASSERT(buf->cursor_line.num == 3);
+  CU_ASSERT(buf->cursor_line.off == 12);
+  CU_ASSERT(buf->cursor_line.len == 4);
+  CU_ASSERT(buf->cursor_col == 1);
+  CU_ASSERT(index_matches_text(buf));
+  char* text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, "abc\nd12\n345\n6ef\n"));
+  free(text);
+  TRE_Buf_free(buf);
+}
+
+void test_insert_large_string() {
+  TRE_Buf* src = make_numbered_lines(5000);
+  char* big = buffer_text(src);
+  TRE_Buf_free(src);
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\ndef\n");
+  TRE_Buf_move_linewise(buf, 1);
+  TRE_Buf_insert_string(buf, big);
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(buf->text_len == 8 + 5000 * 9);
+  CU_ASSERT(buf->n_lines == 5002);
+  CU_ASSERT(buf->cursor_line.num == 5001);
+  CU_ASSERT(buf->cursor_col == 0);
+  CU_ASSERT(index_matches_text(buf));
+  char* text = buffer_text(buf);
+  CU_ASSERT(!strncmp(text, "abc\nline0000\n", 13));
+  CU_ASSERT(!strcmp(text + buf->text_len - 13, "line4999\ndef\n"));
+  free(text);
+  free(big);
+  TRE_Buf_free(buf);
+}
+
+void test_insert_bytes_with_nulls() {
+  static const char bytes[] = { 'x', '\0', '\n', '\0', 'y' };
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\n");
+  TRE_Buf_move_charwise(buf, 1);
+  TRE_Buf_insert_bytes(buf, bytes, sizeof(bytes));
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(buf->text_len == 9);
+  CU_ASSERT(buf->n_lines == 2);
+  CU_ASSERT(buf->cursor_line.num == 1);
+  CU_ASSERT(buf->cursor_col == 2);
+  CU_ASSERT(buf->cursor_line.len == 5);
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(0 == memcmp(buf->text.c, "ax\0\n\0y", 6));
+  TRE_Buf_free(buf);
+}
+
+void test_geometric_growth() {
+  TRE_Buf* buf = TRE_Buf_new(NULL);
+  for (int i = 0; i < 200000; i++) {
+    TRE_Buf_insert_char(buf, i % 80 == 79 ? '\n' : 'x');
+  }
+  TRE_Buf_Stats stats = TRE_Buf_get_stats(buf);
+  CU_ASSERT(stats.n_reallocs > 0);
+  CU_ASSERT(stats.n_reallocs < 30);
+  CU_ASSERT(buf->text_len == 200001);
+  CU_ASSERT(buf->buf_size >= buf->text_len + buf->gap_len);
+  CU_ASSERT(index_matches_text(buf));
+  TRE_Buf_free(buf);
+  // Typing before a tail of text: growing puts all the new space in the gap,
+  // so the tail only moves when the allocation grows.
+  buf = make_numbered_lines(100);
+  TRE_Off tail_len = buf->text_len;
+  for (int i = 0; i < 200000; i++) {
+    TRE_Buf_insert_char(buf, 'x');
+  }
+  stats = TRE_Buf_get_stats(buf);
+  CU_ASSERT(stats.n_reallocs > 0);
+  CU_ASSERT(stats.bytes_moved == stats.n_reallocs * tail_len);
+  CU_ASSERT(buf->buf_size == buf->text_len + buf->gap_len);
+  TRE_Buf_free(buf);
+}
+
+void test_growth_step_cap() {
+  TRE_Buf_GrowthPolicy policy = TRE_buf_default_growth_policy;
+  policy.growth_num = 4;
+  policy.growth_den = 1;
+  policy.max_step = 4 * TRE_BUFFER_BLOCK_SIZE;
+  policy.adaptive = 0;
+  TRE_Buf* buf = TRE_Buf_new(NULL);
+  TRE_Buf_set_growth_policy(buf, &policy);
+  for (int i = 0; i < 100 * TRE_BUFFER_BLOCK_SIZE; i++) {
+    int old_size = buf->buf_size;
+    TRE_Buf_insert_char(buf, 'x');
+    CU_ASSERT(buf->buf_size <= old_size + policy.max_step);
+  }
+  CU_ASSERT(buf->gap_len <= policy.min_gap + policy.max_step);
+  TRE_Buf_free(buf);
+}
+
+void test_compact_after_delete() {
+  TRE_Buf* src = make_numbered_lines(9000);
+  char* big = buffer_text(src);
+  TRE_Buf_free(src);
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\n");
+  TRE_Buf_insert_string(buf, big);
+  free(big);
+  TRE_Buf_move_linewise(buf, -9000);
+  for (int i = 0; i < 8999 * 9; i++) {
+    TRE_Buf_delete(buf);
+  }
+  int old_size = buf->buf_size;
+  CU_ASSERT(TRE_Buf_compact(buf, 1) == TRE_SUCC);
+  CU_ASSERT(buf->buf_size < old_size);
+  CU_ASSERT(buf->buf_size >= buf->text_len + buf->growth.min_gap);
+  CU_ASSERT(TRE_Buf_get_stats(buf).n_compactions == 1);
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(index_matches_text(buf));
+  char* text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, "line8999\nabc\n"));
+  free(text);
+  // Compacting again has nothing left to trim.
+  CU_ASSERT(TRE_Buf_compact(buf, 1) == TRE_FAIL);
+  TRE_Buf_insert_string(buf, "more\n");
+  CU_ASSERT(index_matches_text(buf));
+  TRE_Buf_free(buf);
+}
+
+void test_load_mapped() {
+  TRE_Buf* src = make_numbered_lines(5000);
+  char* expected = buffer_text(src);
+  TRE_Buf_free(src);
+  write_test_file(expected, strlen(expected));
+  TRE_Buf* buf = TRE_Buf_load_mapped(TEST_TEMP_FILE);
+  CU_ASSERT_FATAL(buf != NULL);
+  CU_ASSERT(buf->storage == TRE_BUF_STORAGE_PIECES);
+  CU_ASSERT(buf->text_len == 5000 * 9);
+  CU_ASSERT(buf->cursor_line.num == 0 && buf->cursor_line.len == 9);
+  // Lines can be looked up while they're still being counted.
+  TRE_Line line = TRE_Buf_get_line(buf, 4321);
+  CU_ASSERT(line.off == 4321 * 9 && line.len == 9);
+  TRE_Buf_goto_line(buf, 6000, 3);
+  CU_ASSERT(buf->cursor_line.num == 4999 && buf->cursor_col == 3);
+  CU_ASSERT(TRE_Buf_get_line_at_offset(buf, 1234 * 9 + 4).num == 1234);
+  CU_ASSERT(TRE_Buf_count_lines(buf) == 5000);
+  CU_ASSERT(buf->indexer == NULL);
+  CU_ASSERT(index_matches_text(buf));
+  char* text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, expected));
+  free(text);
+  free(expected);
+  TRE_Buf_free(buf);
+  remove(TEST_TEMP_FILE);
+}
+
+void test_load_async() {
+  // Rows of 10 chars, enough that the load takes a few chunks.
+  int n_rows = 300000;
+  char* expected = malloc(n_rows * 10 + 1);
+  for (int i = 0; i < n_rows; i++) {
+    sprintf(expected + i * 10, "row%06d\n", i);
+  }
+  write_test_file(expected, n_rows * 10);
+  TRE_Buf* buf = TRE_Buf_load_async(TEST_TEMP_FILE);
+  CU_ASSERT_FATAL(buf != NULL);
+  CU_ASSERT(buf->storage == TRE_BUF_STORAGE_GAP);
+  CU_ASSERT(buf->text_len == n_rows * 10);
+  CU_ASSERT(buf->cursor_line.num == 0 && buf->cursor_line.len == 10);
+  CU_ASSERT(TRE_Buf_loaded(buf) > 0);
+  // Text and lines can be read while the rest of the file is coming in.
+  TRE_Line line = TRE_Buf_get_line(buf, 250000);
+  CU_ASSERT(line.off == 250000 * 10 && line.len == 10);
+  CU_ASSERT(TRE_Buf_get_line_at_offset(buf, 123456 * 10 + 7).num == 123456);
+  CU_ASSERT(TRE_Buf_search(buf, 0, "row299999", 9) == 299999 * 10);
+  CU_ASSERT(TRE_Buf_char_at(buf, n_rows * 10 - 2) == '9');
+  // Editing waits for the whole file.
+  TRE_Buf_insert_char(buf, 'x');
+  CU_ASSERT(buf->indexer == NULL);
+  CU_ASSERT(TRE_Buf_loaded(buf) == buf->text_len);
+  CU_ASSERT(TRE_Buf_count_lines(buf) == n_rows);
+  CU_ASSERT(index_matches_text(buf));
+  char* text = buffer_text(buf);
+  CU_ASSERT(text[0] == 'x' && !strcmp(text + 1, expected));
+  free(text);
+  TRE_Buf_free(buf);
+  // Files this big are loaded in the background by default.
+  buf = TRE_Buf_load(TEST_TEMP_FILE);
+  CU_ASSERT_FATAL(buf != NULL);
+  CU_ASSERT(file_matches_buffer(TEST_TEMP_FILE, buf));
+  TRE_Buf_free(buf);
+  free(expected);
+  remove(TEST_TEMP_FILE);
+}
+
+void test_load_async_no_final_newline() {
+  write_test_file("abc\ndef", 7);
+  TRE_Buf* buf = TRE_Buf_load_async(TEST_TEMP_FILE);
+  CU_ASSERT_FATAL(buf != NULL);
+  CU_ASSERT(buf->text_len == 8);
+  CU_ASSERT(TRE_Buf_char_at(buf, 7) == '\n');
+  TRE_Line line = TRE_Buf_get_line(buf, 1);
+  CU_ASSERT(line.off == 4 && line.len == 4);
+  CU_ASSERT(TRE_Buf_count_lines(buf) == 2);
+  CU_ASSERT(index_matches_text(buf));
+  TRE_Buf_free(buf);
+  remove(TEST_TEMP_FILE);
+}
+
+void test_load_mapped_no_final_newline() {
+  write_test_file("abc\ndef", 7);
+  TRE_Buf* buf = TRE_Buf_load_mapped(TEST_TEMP_FILE);
+  CU_ASSERT_FATAL(buf != NULL);
+  CU_ASSERT(buf->text_len == 8);
+  CU_ASSERT(TRE_Buf_char_at(buf, 7) == '\n');
+  TRE_Line line = TRE_Buf_get_line(buf, 1);
+  CU_ASSERT(line.off == 4 && line.len == 4);
+  CU_ASSERT(TRE_Buf_get_line_at_offset(buf, 7).num == 1);
+  CU_ASSERT(TRE_Buf_count_lines(buf) == 2);
+  CU_ASSERT(index_matches_text(buf));
+  TRE_Buf_free(buf);
+  remove(TEST_TEMP_FILE);
+}
+
+void test_edit_mapped() {
+  static const char TEXT[] = "one\ntwo\nthree\nfour\n";
+  write_test_file(TEXT, strlen(TEXT));
+  TRE_Buf* buf = TRE_Buf_load_mapped(TEST_TEMP_FILE);
+  CU_ASSERT_FATAL(buf != NULL);
+  // Make the same edits to a gap buffer to find out what the result should
+  // be.
+  TRE_Buf* gap_buf = TRE_Buf_load_from_string(TEXT);
+  TRE_Buf* bufs[] = { buf, gap_buf };
+  for (int i = 0; i < 2; i++) {
+    TRE_Buf* b = bufs[i];
+    TRE_Buf_move_linewise(b, 2);
+    TRE_Buf_move_charwise(b, 2);
+    TRE_Buf_insert_string(b, "XY\nZ");
+    TRE_Buf_delete(b);
+    TRE_Buf_move_linewise(b, -3);
+    TRE_Buf_backspace(b);
+    TRE_Buf_insert_char(b, '!');
+    TRE_Buf_move_charwise(b, 3);
+    TRE_Buf_delete(b);
+  }
+  char* text = buffer_text(buf);
+  char* expected = buffer_text(gap_buf);
+  CU_ASSERT(!strcmp(text, expected));
+  CU_ASSERT(!strcmp(text, "!ne\nwo\nthXY\nZee\nfour\n"));
+  CU_ASSERT(buf->cursor_line.num == gap_buf->cursor_line.num);
+  CU_ASSERT(buf->cursor_col == gap_buf->cursor_col);
+  CU_ASSERT(index_matches_text(buf));
+  // The file itself is left alone.
+  TRE_Buf* reloaded = TRE_Buf_load(TEST_TEMP_FILE);
+  char* file_text = buffer_text(reloaded);
+  CU_ASSERT(!strcmp(file_text, TEXT));
+  free(file_text);
+  free(text);
+  free(expected);
+  TRE_Buf_free(reloaded);
+  TRE_Buf_free(gap_buf);
+  TRE_Buf_free(buf);
+  remove(TEST_TEMP_FILE);
+}
+
+void test_indexer_lookups() {
+  // Lines of varying lengths, enough for several marks.
+  int n = 3 * TRE_INDEXER_STRIDE + 17;
+  char* text = malloc(n * 8 + 1);
+  int len = 0;
+  for (int i = 0; i < n; i++) {
+    int line_len = i % 7;
+    memset(text + len, 'a' + i % 26, line_len);
+    text[len + line_len] = '\n';
+    len += line_len + 1;
+  }
+  TRE_LineIdx expected;
+  TRE_LineIdx_init(&expected);
+  TRE_LineIdx_build_from_text(&expected, text, len);
+  TRE_Indexer* ix = TRE_Indexer_start(text, len, len);
+  int nums[] = { 0, 1, TRE_INDEXER_STRIDE - 1, TRE_INDEXER_STRIDE,
+    2 * TRE_INDEXER_STRIDE + 5, n - 1 };
+  for (int i = 0; i < (int)(sizeof(nums) / sizeof(nums[0])); i++) {
+    TRE_Line got = TRE_Indexer_get_line(ix, nums[i]);
+    TRE_Line want = TRE_LineIdx_get(&expected, nums[i]);
+    CU_ASSERT(got.off == want.off && got.len == want.len);
+    got = TRE_Indexer_find_offset(ix, want.off + want.len - 1);
+    CU_ASSERT(got.num == want.num && got.off == want.off);
+  }
+  CU_ASSERT(TRE_Indexer_wait_lines(ix, n + 1) == n);
+  TRE_LineIdx built;
+  TRE_LineIdx_init(&built);
+  TRE_Indexer_finish(ix, &built);
+  CU_ASSERT(TRE_LineIdx_count(&built) == n);
+  CU_ASSERT(TRE_LineIdx_length(&built) == len);
+  TRE_Indexer_free(ix);
+  TRE_LineIdx_free(&built);
+  TRE_LineIdx_free(&expected);
+  free(text);
+}
+
+void test_indexer_threads() {
+  // Lines of all sorts of lengths, including one long enough to cross
+  // several slices and a last line with no newline.
+  TRE_Off size = 3 * 1024 * 1024;
+  char* text = malloc(size);
+  unsigned long long seed = 1;
+  for (TRE_Off i = 0; i < size; i++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    int in_long_line = i > size / 3 && i < size / 3 + 1200 * 1024;
+    text[i] = !in_long_line && (seed >> 33) % 40 == 0 ? '\n' : 'a';
+  }
+  text[size - 1] = 'z';
+  write_test_file(text, size);
+  TRE_Off counts[2];
+  for (int k = 0; k < 2; k++) {
+    TRE_Indexer_set_threads(k == 0 ? 1 : 4);
+    TRE_Buf* buf = TRE_Buf_load_mapped(TEST_TEMP_FILE);
+    CU_ASSERT_FATAL(buf != NULL);
+    TRE_Line line = TRE_Buf_get_line_at_offset(buf, size / 3 + 1000);
+    CU_ASSERT(line.len > 1200 * 1024);
+    counts[k] = TRE_Buf_count_lines(buf);
+    CU_ASSERT(index_matches_text(buf));
+    CU_ASSERT(buf->text_len == size + 1);
+    TRE_Buf_free(buf);
+  }
+  CU_ASSERT(counts[0] == counts[1]);
+  CU_ASSERT(counts[0] == TRE_count_newlines(text, size) + 1);
+  TRE_Indexer_set_threads(0);
+  free(text);
+  remove(TEST_TEMP_FILE);
+}
+
+void test_line_cache() {
+  mkdir(TEST_LINES_DIR, 0755);
+  TRE_linecache_set_dir(TEST_LINES_DIR);
+  TRE_Buf* src = make_numbered_lines(5000);
+  char* text = buffer_text(src);
+  TRE_Buf_free(src);
+  TRE_Off size = strlen(text);
+  write_test_file(text, size);
+  TRE_LineCache* cache = TRE_LineCache_open(TEST_TEMP_FILE, text, size);
+  CU_ASSERT_FATAL(cache != NULL);
+  CU_ASSERT(cache->marks == NULL);
+  TRE_LineCache_free(cache);
+  // Counting the lines of a mapped file saves its table.
+  TRE_Buf* buf = TRE_Buf_load_mapped(TEST_TEMP_FILE);
+  CU_ASSERT(TRE_Buf_count_lines(buf) == 5000);
+  TRE_Buf_free(buf);
+  cache = TRE_LineCache_open(TEST_TEMP_FILE, text, size);
+  CU_ASSERT_FATAL(cache != NULL && cache->marks != NULL);
+  CU_ASSERT(cache->header.n_lines == 5000);
+  CU_ASSERT(cache->header.n_marks == 5);
+  CU_ASSERT(cache->marks[3] == 3 * TRE_INDEXER_STRIDE * 9);
+  // An indexer started from the table finds lines without counting them.
+  TRE_Indexer* ix = TRE_Indexer_start_seeded(text, size, size,
+      cache->marks, cache->header.n_marks, cache->header.n_lines);
+  CU_ASSERT(TRE_Indexer_wait_lines(ix, 1) == 5000);
+  CU_ASSERT(TRE_Indexer_get_line(ix, 4321).off == 4321 * 9);
+  CU_ASSERT(!TRE_Indexer_seed_was_wrong(ix));
+  TRE_Indexer_free(ix);
+  // Marks that don't match the text are caught.
+  TRE_Off wrong[5];
+  memcpy(wrong, cache->marks, sizeof wrong);
+  wrong[2] += 9;
+  ix = TRE_Indexer_start_seeded(text, size, size, wrong, 5, 5000);
+  CU_ASSERT(TRE_Indexer_seed_was_wrong(ix));
+  TRE_Indexer_free(ix);
+  // A wrong table is deleted, and the buffer gets the real index anyway.
+  TRE_LineCache_save(cache, wrong, 5, 5000);
+  TRE_LineCache_free(cache);
+  buf = TRE_Buf_load_mapped(TEST_TEMP_FILE);
+  CU_ASSERT(TRE_Buf_count_lines(buf) == 5000);
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(cursor_is_valid(buf));
+  TRE_Buf_free(buf);
+  cache = TRE_LineCache_open(TEST_TEMP_FILE, text, size);
+  CU_ASSERT(cache->marks == NULL);
+  TRE_LineCache_free(cache);
+  // A table is no good once the file has changed.
+  buf = TRE_Buf_load_mapped(TEST_TEMP_FILE);
+  TRE_Buf_count_lines(buf);
+  TRE_Buf_free(buf);
+  text[0] = 'L';
+  write_test_file(text, size);
+  cache = TRE_LineCache_open(TEST_TEMP_FILE, text, size);
+  CU_ASSERT(cache->marks == NULL);
+  TRE_LineCache_discard(cache);
+  TRE_LineCache_free(cache);
+  TRE_linecache_set_dir(NULL);
+  free(text);
+  remove(TEST_TEMP_FILE);
+  rmdir(TEST_LINES_DIR);
+}
+
+void test_switch_storage() {
+  TRE_Buf* buf = make_numbered_lines(100);
+  TRE_Buf_goto_line(buf, 50, 4);
+  TRE_Buf_set_storage(buf, TRE_BUF_STORAGE_PIECES);
+  CU_ASSERT(buf->storage == TRE_BUF_STORAGE_PIECES);
+  CU_ASSERT(buf->text.c == NULL);
+  CU_ASSERT(TRE_Buf_read_char_at_cursor(buf) == '0');
+  TRE_Buf_insert_string(buf, "xx");
+  TRE_Buf_move_linewise(buf, 10);
+  TRE_Buf_delete(buf);
+  TRE_Buf_set_storage(buf, TRE_BUF_STORAGE_GAP);
+  CU_ASSERT(buf->pieces == NULL);
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(buf->cursor_line.num == 60 && buf->cursor_col == 6);
+  CU_ASSERT(index_matches_text(buf));
+  char* text = buffer_text(buf);
+  CU_ASSERT(!strncmp(text + 50 * 9, "linexx0050\n", 11));
+  CU_ASSERT(!strncmp(text + 60 * 9 + 2, "line000\n", 8));
+  free(text);
+  TRE_Buf_free(buf);
+}
+
+void test_scattered_edits() {
+  TRE_Buf* gap_buf = make_numbered_lines(2000);
+  TRE_Buf* piece_buf = make_numbered_lines(2000);
+  TRE_Buf_set_storage(piece_buf, TRE_BUF_STORAGE_PIECES);
+  unsigned seed = 12345;
+  for (int i = 0; i < 3000; i++) {
+    seed = seed * 1103515245 + 12345;
+    unsigned r = seed >> 8;
+    TRE_Buf* bufs[] = { gap_buf, piece_buf };
+    for (int k = 0; k < 2; k++) {
+      TRE_Buf* b = bufs[k];
+      TRE_Buf_set_cursor_offset(b, r % b->text_len);
+      switch (r % 4) {
+        case 0: TRE_Buf_insert_string(b, "ab\ncd"); break;
+        case 1: TRE_Buf_insert_char(b, 'z'); break;
+        case 2: TRE_Buf_delete(b); break;
+        case 3: TRE_Buf_backspace(b); break;
+      }
+    }
+    CU_ASSERT(TRE_Buf_get_cursor_offset(gap_buf)
+        == TRE_Buf_get_cursor_offset(piece_buf));
+  }
+  // Enough pieces to fill several blocks.
+  CU_ASSERT(TRE_Pieces_count(piece_buf->pieces) > 4 * TRE_PIECE_BLOCK_SIZE);
+  char* expected = buffer_text(gap_buf);
+  char* text = buffer_text(piece_buf);
+  CU_ASSERT(!strcmp(text, expected));
+  CU_ASSERT(index_matches_text(piece_buf));
+  free(text);
+  free(expected);
+  TRE_Buf_free(gap_buf);
+  TRE_Buf_free(piece_buf);
+}
+
+void test_move_without_gap() {
+  TRE_Buf* buf = make_numbered_lines(1000);
+  TRE_Buf_move_linewise(buf, 500);
+  TRE_Buf_move_charwise(buf, 5);
+  TRE_Buf_goto_line(buf, 900, 2);
+  TRE_Buf_move_linewise(buf, -100);
+  CU_ASSERT(TRE_Buf_set_cursor_offset(buf, 700 * 9 + 6) == TRE_SUCC);
+  CU_ASSERT(buf->gap_start == 0);
+  CU_ASSERT(TRE_Buf_get_stats(buf).bytes_moved == 0);
+  CU_ASSERT(TRE_Buf_read_char_at_cursor(buf) == '0');
+  // An edit moves the gap to the cursor.
+  TRE_Buf_insert_char(buf, 'x');
+  CU_ASSERT(buf->gap_start == 700 * 9 + 7);
+  CU_ASSERT(TRE_Buf_get_stats(buf).bytes_moved == 700 * 9 + 6);
+  TRE_Buf_set_cursor_offset(buf, 0);
+  TRE_Buf_delete(buf);
+  CU_ASSERT(buf->gap_start == 0);
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(index_matches_text(buf));
+  char* text = buffer_text(buf);
+  CU_ASSERT(!strncmp(text, "ine0000\n", 8));
+  CU_ASSERT(!strncmp(text + 700 * 9 - 1, "line07x00\n", 10));
+  free(text);
+  TRE_Buf_free(buf);
+}
+
+// Run every kernel this machine supports over the same text, at every
+// alignment and for lengths around the vector sizes, and compare the results
+// with a plain loop.
+void test_scan_kernels() {
+  const int size = 4096;
+  char* text = malloc(size);
+  unsigned seed = 1;
+  for (int i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    text[i] = (seed >> 16) % 23 ? 'a' + i % 26 : '\n';
+  }
+  for (int k = 0; k < TRE_SCAN_N_KERNELS; k++) {
+    if (TRE_FAIL == TRE_scan_use_kernel(k)) {
+      continue;
+    }
+    int ok = 1;
+    for (int start = 0; start < 64; start++) {
+      for (int len = 0; start + len <= size; len += len < 80 ? 1 : 61) {
+        const char* p = text + start;
+        int n = 0, first = -1;
+        for (int i = 0; i < len; i++) {
+          if (p[i] == '\n') {
+            first = first < 0 ? i : first;
+            n++;
+          }
+        }
+        const char* nl = TRE_find_newline(p, len);
+        ok = ok && TRE_count_newlines(p, len) == n
+          && (first < 0 ? nl == NULL : nl == p + first);
+      }
+    }
+    CU_ASSERT(ok);
+  }
+  // All newlines, so that the per-byte counters in the vector kernels would
+  // overflow if they weren't summed often enough.
+  char* newlines = malloc(64 * 1024);
+  memset(newlines, '\n', 64 * 1024);
+  for (int k = 0; k < TRE_SCAN_N_KERNELS; k++) {
+    if (TRE_SUCC == TRE_scan_use_kernel(k)) {
+      CU_ASSERT(TRE_count_newlines(newlines, 64 * 1024) == 64 * 1024);
+    }
+  }
+  TRE_scan_use_best_kernel();
+  free(newlines);
+  free(text);
+}
+
+void test_scan_across_gap() {
+  TRE_Buf* buf = make_numbered_lines(100);
+  // Put the gap in the middle of line 10.
+  TRE_Buf_goto_line(buf, 10, 4);
+  TRE_Buf_insert_char(buf, 'x');
+  TRE_Off len = buf->text_len;
+  CU_ASSERT(TRE_Buf_count_newlines(buf, 0, len) == 100);
+  CU_ASSERT(TRE_Buf_count_newlines(buf, 91, 8) == 0);
+  CU_ASSERT(TRE_Buf_count_newlines(buf, 91, 9) == 1);
+  CU_ASSERT(TRE_Buf_find_newline(buf, 0) == 8);
+  CU_ASSERT(TRE_Buf_find_newline(buf, 91) == 99);
+  CU_ASSERT(TRE_Buf_find_newline(buf, len - 1) == len - 1);
+  TRE_Buf_set_storage(buf, TRE_BUF_STORAGE_PIECES);
+  CU_ASSERT(TRE_Buf_count_newlines(buf, 1, len - 2) == 99);
+  CU_ASSERT(TRE_Buf_find_newline(buf, 92) == 99);
+  TRE_Buf_free(buf);
+}
+
+// Write some text to the test file TEST_TEMP_FILE.
+void test_delete_range() {
+  TRE_Buf* buf = make_numbered_lines(1000);
+  // From the middle of line 10 to the middle of line 900.
+  TRE_Buf_delete_range(buf, 10 * 9 + 4, 890 * 9);
+  CU_ASSERT(buf->n_lines == 110);
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(TRE_Buf_get_cursor_offset(buf) == 10 * 9 + 4);
+  CU_ASSERT(TRE_Buf_read_char_at_cursor(buf) == '0');
+  TRE_Line line = TRE_Buf_get_line(buf, 10);
+  char text[16] = { 0 };
+  TRE_Buf_copy_text(buf, line.off, text, line.len);
+  CU_ASSERT(!strcmp(text, "line0900\n"));
+  // The final newline stays.
+  TRE_Buf_delete_range(buf, 0, buf->text_len);
+  CU_ASSERT(buf->text_len == 1 && buf->n_lines == 1);
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(cursor_is_valid(buf));
+  TRE_Buf_free(buf);
+}
+
+void test_replace_range() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("one\ntwo\nthree\n");
+  TRE_Buf_insert_char(buf, '>');
+  TRE_Buf_replace_range(buf, 3, 6, " 2\n3", 4);
+  char* text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, ">on 2\n3three\n"));
+  free(text);
+  CU_ASSERT(TRE_Buf_get_cursor_offset(buf) == 7);
+  CU_ASSERT(buf->n_lines == 2);
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(cursor_is_valid(buf));
+  // The replacement is undone in one step, apart from the typing before it.
+  TRE_Buf_undo(buf);
+  text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, ">one\ntwo\nthree\n"));
+  free(text);
+  TRE_Buf_undo(buf);
+  TRE_Buf_redo(buf);
+  TRE_Buf_redo(buf);
+  text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, ">on 2\n3three\n"));
+  free(text);
+  CU_ASSERT(index_matches_text(buf));
+  // Replacing nothing is an insert.
+  TRE_Buf_replace_range(buf, 0, 0, "<", 1);
+  text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, "<>on 2\n3three\n"));
+  free(text);
+  TRE_Buf_free(buf);
+}
+
+void test_get_range() {
+  TRE_Buf* buf = make_numbered_lines(100);
+  TRE_Buf_set_cursor_offset(buf, 50);
+  TRE_Buf_insert_char(buf, '#');
+  // The gap is now at 51, so a range across it comes in two pieces.
+  TRE_TextRange range;
+  CU_ASSERT(TRE_Buf_get_range(buf, 40, 20, &range) == 20);
+  CU_ASSERT(range.n == 2);
+  CU_ASSERT(range.len[0] == 11 && range.len[1] == 9);
+  CU_ASSERT(!strncmp(range.text[0], "0004\nline0#", 11));
+  CU_ASSERT(!strncmp(range.text[1], "005\nline0", 9));
+  CU_ASSERT(TRE_Buf_get_range(buf, 60, 20, &range) == 20);
+  CU_ASSERT(range.n == 1);
+  CU_ASSERT(TRE_Buf_get_range(buf, 60, 0, &range) == 0);
+  CU_ASSERT(range.n == 0);
+  // A piece buffer can need more than two pieces; the rest is read from
+  // where they end.
+  TRE_Buf_set_storage(buf, TRE_BUF_STORAGE_PIECES);
+  for (int i = 0; i < 5; i++) {
+    TRE_Buf_set_cursor_offset(buf, 100 + i * 20);
+    TRE_Buf_insert_char(buf, '#');
+  }
+  char* text = buffer_text(buf);
+  TRE_Off off = 90;
+  while (off < 200) {
+    TRE_Off got = TRE_Buf_get_range(buf, off, 200 - off, &range);
+    CU_ASSERT_FATAL(got > 0);
+    CU_ASSERT(range.len[0] + (range.n > 1 ? range.len[1] : 0) == got);
+    CU_ASSERT(!strncmp(range.text[0], text + off, range.len[0]));
+    off += got;
+  }
+  free(text);
+  TRE_Buf_free(buf);
+}
+
+void test_iterate_blocks() {
+  TRE_Buf* buf = make_numbered_lines(1000);
+  TRE_Buf_set_cursor_offset(buf, 4000);
+  TRE_Buf_insert_string(buf, "gap");
+  char* text = buffer_text(buf);
+  for (int storage = 0; storage < 2; storage++) {
+    TRE_BufIter it;
+    const char* block;
+    TRE_Off len;
+    TRE_Off off = 1234;
+    int n_blocks = 0;
+    TRE_BufIter_init(&it, buf, off, 5000);
+    while (TRE_BufIter_next(&it, &block, &len)) {
+      CU_ASSERT(it.block == off);
+      CU_ASSERT(!memcmp(block, text + off, len));
+      off += len;
+      n_blocks++;
+    }
+    CU_ASSERT(off == 1234 + 5000);
+    if (storage == 0) {
+      // The text before the gap and the text after it.
+      CU_ASSERT(n_blocks == 2);
+      CU_ASSERT(buf->gap_start == 4003);
+    }
+    TRE_Buf_set_storage(buf, TRE_BUF_STORAGE_PIECES);
+    for (int i = 0; i < 10; i++) {
+      TRE_Buf_set_cursor_offset(buf, 2000 + i * 301);
+      TRE_Buf_insert_char(buf, '#');
+      TRE_Buf_undo(buf);
+    }
+  }
+  free(text);
+  TRE_Buf_free(buf);
+}
+
+void test_search() {
+  TRE_Buf* buf = make_numbered_lines(1000);
+  CU_ASSERT(TRE_Buf_search(buf, 0, "line0500", 8) == 500 * 9);
+  CU_ASSERT(TRE_Buf_search(buf, 500 * 9 + 1, "line0500", 8) == -1);
+  CU_ASSERT(TRE_Buf_search(buf, 0, "\nline0001", 9) == 8);
+  CU_ASSERT(TRE_Buf_search(buf, 0, "zzz", 3) == -1);
+  // Put the gap in the middle of a line, and find the line either side of
+  // it, and straddling it.
+  TRE_Buf_set_cursor_offset(buf, 700 * 9 + 4);
+  TRE_Buf_insert_char(buf, 'X');
+  CU_ASSERT(buf->gap_start == 700 * 9 + 5);
+  CU_ASSERT(TRE_Buf_search(buf, 0, "lineX0700", 9) == 700 * 9);
+  CU_ASSERT(TRE_Buf_search(buf, 0, "X", 1) == 700 * 9 + 4);
+  CU_ASSERT(TRE_Buf_search(buf, 0, "X0", 2) == 700 * 9 + 4);
+  CU_ASSERT(TRE_Buf_search(buf, 700 * 9 + 5, "X", 1) == -1);
+  CU_ASSERT(TRE_Buf_search(buf, 0, "line0701", 8) == 701 * 9 + 1);
+  // Pieces shorter than the pattern.
+  TRE_Buf_set_storage(buf, TRE_BUF_STORAGE_PIECES);
+  TRE_Buf_set_cursor_offset(buf, 100 * 9 + 2);
+  TRE_Buf_insert_string(buf, "a");
+  TRE_Buf_set_cursor_offset(buf, 100 * 9 + 4);
+  TRE_Buf_insert_string(buf, "b");
+  CU_ASSERT(TRE_Buf_search(buf, 0, "liane0100", 9) == -1);
+  CU_ASSERT(TRE_Buf_search(buf, 0, "lianbe0100", 10) == 100 * 9);
+  TRE_Buf_free(buf);
+}
+
+void test_save() {
+  TRE_Buf* buf = make_numbered_lines(1000);
+  TRE_Buf_set_cursor_offset(buf, 4500);
+  TRE_Buf_insert_string(buf, "in the middle\n");
+  CU_ASSERT(buf->gap_start > 0 && buf->gap_start < buf->text_len);
+  write_test_file("old", 3);
+  chmod(TEST_TEMP_FILE, 0640);
+  CU_ASSERT(TRE_Buf_is_modified(buf));
+  CU_ASSERT(TRE_Buf_save(buf, TEST_TEMP_FILE) == TRE_SUCC);
+  CU_ASSERT(!TRE_Buf_is_modified(buf));
+  CU_ASSERT(!strcmp(buf->filename, TEST_TEMP_FILE));
+  CU_ASSERT(file_matches_buffer(TEST_TEMP_FILE, buf));
+  struct stat st;
+  CU_ASSERT(0 == stat(TEST_TEMP_FILE, &st) && (st.st_mode & 0777) == 0640);
+  // Saving again goes to the same file.
+  TRE_Buf_insert_char(buf, '!');
+  CU_ASSERT(TRE_Buf_save(buf, NULL) == TRE_SUCC);
+  CU_ASSERT(file_matches_buffer(TEST_TEMP_FILE, buf));
+  // A file that can't be written leaves the buffer modified.
+  TRE_Buf_insert_char(buf, '!');
+  CU_ASSERT(TRE_Buf_save(buf, "no/such/dir/file") == TRE_FAIL);
+  CU_ASSERT(TRE_Buf_is_modified(buf));
+  CU_ASSERT(!strcmp(buf->filename, TEST_TEMP_FILE));
+  remove(TEST_TEMP_FILE);
+  TRE_Buf_free(buf);
+}
+
+void test_save_pieces() {
+  TRE_Buf* buf = make_numbered_lines(5000);
+  TRE_Buf_set_storage(buf, TRE_BUF_STORAGE_PIECES);
+  // Enough pieces to need several writev calls.
+  for (int i = 0; i < 1000; i++) {
+    TRE_Buf_set_cursor_offset(buf, i * 41);
+    TRE_Buf_insert_char(buf, '*');
+  }
+  CU_ASSERT(TRE_Pieces_count(buf->pieces) > 1000);
+  CU_ASSERT(TRE_Buf_save(buf, TEST_TEMP_FILE) == TRE_SUCC);
+  CU_ASSERT(file_matches_buffer(TEST_TEMP_FILE, buf));
+  remove(TEST_TEMP_FILE);
+  TRE_Buf_free(buf);
+}
+
+void test_save_background() {
+  // Big enough to take a few chunks, so the edits below are likely to happen
+  // while the save is still going.
+  TRE_Off len = 3 * TRE_SAVE_CHUNK;
+  char* text = malloc(len + 1);
+  for (TRE_Off i = 0; i < len; i++) {
+    text[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  }
+  text[len] = '\0';
+  for (int storage = 0; storage < 2; storage++) {
+    TRE_Buf* buf = TRE_Buf_load_from_string(text);
+    TRE_Buf_set_storage(buf, storage);
+    CU_ASSERT(TRE_Buf_save_start(buf, TEST_TEMP_FILE) == TRE_SUCC);
+    for (int i = 0; i < 100; i++) {
+      TRE_Buf_set_cursor_offset(buf, i * 1000);
+      TRE_Buf_insert_string(buf, "edited");
+    }
+    TRE_Buf_delete_range(buf, 200000, 5000000);
+    CU_ASSERT(TRE_Buf_save_wait(buf) == TRE_SUCC);
+    CU_ASSERT(TRE_Buf_save_done(buf));
+    // The file has the text from before the edits.
+    TRE_Buf* saved = TRE_Buf_load_from_string(text);
+    CU_ASSERT(file_matches_buffer(TEST_TEMP_FILE, saved));
+    TRE_Buf_free(saved);
+    CU_ASSERT(TRE_Buf_is_modified(buf));
+    // Freeing a buffer waits for its save.
+    CU_ASSERT(TRE_Buf_save_start(buf, NULL) == TRE_SUCC);
+    char* edited_text = buffer_text(buf);
+    TRE_Buf_free(buf);
+    CU_ASSERT(file_has_text(TEST_TEMP_FILE, edited_text));
+    free(edited_text);
+  }
+  free(text);
+  remove(TEST_TEMP_FILE);
+}
+
+void test_fpos_store() {
+  mkdir(TEST_FPOS_DIR, 0755);
+  remove(TEST_FPOS_DB);
+  // Positions in the old text file are brought in when the store is made.
+  FILE* f = fopen(TEST_FPOS_DIR "/fpos", "w");
+  fputs("TRE_FPOS\n12 3 /old/file\n7 0 /another/old file\n", f);
+  fclose(f);
+  TRE_FposStore* store = TRE_FposStore_open(TEST_FPOS_DB);
+  CU_ASSERT_FATAL(store != NULL);
+  line_col_t pos;
+  CU_ASSERT(TRE_FposStore_get(store, "/old/file", &pos) == TRE_SUCC);
+  CU_ASSERT(pos.line == 12 && pos.col == 3);
+  CU_ASSERT(TRE_FposStore_get(store, "/another/old file", &pos) == TRE_SUCC);
+  CU_ASSERT(pos.line == 7 && pos.col == 0);
+  CU_ASSERT(TRE_FposStore_get(store, "/not/there", &pos) == TRE_FAIL);
+  pos.line = 100;
+  pos.col = 5;
+  TRE_FposStore_put(store, "/a/file", pos);
+  pos.line = 200;
+  TRE_FposStore_put(store, "/a/file", pos);
+  CU_ASSERT(store->header->n_used == 3);
+  TRE_FposStore_close(store);
+  // It's all still there when the store is opened again, and the file is
+  // the same size.
+  remove(TEST_FPOS_DIR "/fpos");
+  store = TRE_FposStore_open(TEST_FPOS_DB);
+  CU_ASSERT_FATAL(store != NULL);
+  CU_ASSERT(TRE_FposStore_get(store, "/a/file", &pos) == TRE_SUCC);
+  CU_ASSERT(pos.line == 200 && pos.col == 5);
+  CU_ASSERT(TRE_FposStore_get(store, "/old/file", &pos) == TRE_SUCC);
+  TRE_FposStore_close(store);
+  // A damaged file is replaced by an empty store.
+  f = fopen(TEST_FPOS_DB, "w");
+  fputs("garbage", f);
+  fclose(f);
+  store = TRE_FposStore_open(TEST_FPOS_DB);
+  CU_ASSERT_FATAL(store != NULL);
+  CU_ASSERT(TRE_FposStore_get(store, "/a/file", &pos) == TRE_FAIL);
+  TRE_FposStore_close(store);
+  remove(TEST_FPOS_DB);
+  rmdir(TEST_FPOS_DIR);
+}
+
+void test_fpos_eviction() {
+  mkdir(TEST_FPOS_DIR, 0755);
+  remove(TEST_FPOS_DB);
+  TRE_FposStore* store = TRE_FposStore_open(TEST_FPOS_DB);
+  CU_ASSERT_FATAL(store != NULL);
+  // Far more files than there are slots.
+  char path[64];
+  for (int i = 0; i < 5 * TRE_FPOS_SLOTS; i++) {
+    line_col_t pos = { i, 0 };
+    sprintf(path, "/file/%d", i);
+    TRE_FposStore_put(store, path, pos);
+  }
+  CU_ASSERT(store->header->n_used <= TRE_FPOS_SLOTS);
+  struct stat st;
+  CU_ASSERT(0 == stat(TEST_FPOS_DB, &st) && (size_t)st.st_size
+      == sizeof(TRE_FposHeader) + TRE_FPOS_SLOTS * sizeof(TRE_FposSlot));
+  // A file can only be evicted to make room for an older file than it, so
+  // the most recent ones are all there.
+  int n_found = 0;
+  for (int i = 5 * TRE_FPOS_SLOTS - 1; i >= 0; i--) {
+    line_col_t pos;
+    sprintf(path, "/file/%d", i);
+    if (TRE_FposStore_get(store, path, &pos) == TRE_SUCC) {
+      CU_ASSERT(pos.line == i);
+      n_found++;
+    } else {
+      CU_ASSERT(i < 5 * TRE_FPOS_SLOTS - TRE_FPOS_PROBE);
+    }
+  }
+  CU_ASSERT(n_found == (int)store->header->n_used);
+  TRE_FposStore_close(store);
+  remove(TEST_FPOS_DB);
+  rmdir(TEST_FPOS_DIR);
+}
+
+void test_fpos_processes() {
+  mkdir(TEST_FPOS_DIR, 0755);
+  remove(TEST_FPOS_DB);
+  // Several processes all creating the store and writing to it at once.
+  enum { N_PROCS = 4, N_FILES = 200 };
+  pid_t pids[N_PROCS];
+  for (int p = 0; p < N_PROCS; p++) {
+    pids[p] = fork();
+    if (pids[p] == 0) {
+      TRE_FposStore* store = TRE_FposStore_open(TEST_FPOS_DB);
+      if (!store) {
+        _exit(1);
+      }
+      char path[64];
+      for (int i = 0; i < N_FILES; i++) {
+        line_col_t pos = { p, i };
+        sprintf(path, "/proc/%d/%d", p, i);
+        TRE_FposStore_put(store, path, pos);
+      }
+      TRE_FposStore_close(store);
+      _exit(0);
+    }
+  }
+  for (int p = 0; p < N_PROCS; p++) {
+    int status;
+    CU_ASSERT(pids[p] == waitpid(pids[p], &status, 0));
+    CU_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  TRE_FposStore* store = TRE_FposStore_open(TEST_FPOS_DB);
+  CU_ASSERT_FATAL(store != NULL);
+  CU_ASSERT(store->header->n_used == N_PROCS * N_FILES);
+  CU_ASSERT(store->header->clock == N_PROCS * N_FILES);
+  int n_found = 0;
+  char path[64];
+  for (int p = 0; p < N_PROCS; p++) {
+    for (int i = 0; i < N_FILES; i++) {
+      line_col_t pos;
+      sprintf(path, "/proc/%d/%d", p, i);
+      if (TRE_FposStore_get(store, path, &pos) == TRE_SUCC
+          && pos.line == p && pos.col == i) {
+        n_found++;
+      }
+    }
+  }
+  CU_ASSERT(n_found == N_PROCS * N_FILES);
+  TRE_FposStore_close(store);
+  remove(TEST_FPOS_DB);
+  rmdir(TEST_FPOS_DIR);
+}
+
+void test_fpos_buffers() {
+  mkdir(TEST_FPOS_DIR, 0755);
+  remove(TEST_FPOS_DB);
+  TRE_FposStore* store = TRE_FposStore_open(TEST_FPOS_DB);
+  CU_ASSERT_FATAL(store != NULL);
+  TRE_fpos_set_default_store(store);
+  TRE_Buf* src = make_numbered_lines(100);
+  char* text = buffer_text(src);
+  TRE_Buf_free(src);
+  write_test_file(text, strlen(text));
+  free(text);
+  TRE_Buf* buf = TRE_Buf_load(TEST_TEMP_FILE);
+  CU_ASSERT(buf->cursor_line.num == 0 && buf->cursor_col == 0);
+  TRE_Buf_goto_line(buf, 42, 5);
+  TRE_Buf_free(buf);
+  buf = TRE_Buf_load(TEST_TEMP_FILE);
+  CU_ASSERT(buf->cursor_line.num == 42 && buf->cursor_col == 5);
+  CU_ASSERT(cursor_is_valid(buf));
+  // Saving remembers the position too.
+  TRE_Buf_goto_line(buf, 7, 1);
+  CU_ASSERT(TRE_Buf_save(buf, NULL) == TRE_SUCC);
+  TRE_Buf* other = TRE_Buf_load(TEST_TEMP_FILE);
+  CU_ASSERT(other->cursor_line.num == 7 && other->cursor_col == 1);
+  TRE_Buf_free(other);
+  TRE_Buf_free(buf);
+  TRE_fpos_set_default_store(NULL);
+  TRE_FposStore_close(store);
+  remove(TEST_TEMP_FILE);
+  remove(TEST_FPOS_DB);
+  rmdir(TEST_FPOS_DIR);
+}
+
+void test_bufreg_handles() {
+  write_test_file("one\ntwo\n", 8);
+  TRE_BufReg* reg = TRE_BufReg_new();
+  TRE_BufHandle a = TRE_BufReg_open(reg, TEST_TEMP_FILE);
+  CU_ASSERT_FATAL(a != 0);
+  // Opening the file again gets the same buffer.
+  CU_ASSERT(TRE_BufReg_open(reg, "./" TEST_TEMP_FILE) == a);
+  TRE_BufHandle b = TRE_BufReg_add(reg, TRE_Buf_load_from_string("x\n"));
+  CU_ASSERT(b != 0 && b != a);
+  TRE_Buf* buf = TRE_BufReg_get(reg, a);
+  CU_ASSERT_FATAL(buf != NULL);
+  CU_ASSERT(buf->text_len == 8);
+  CU_ASSERT(TRE_BufReg_memory(reg, a) >= buf->text_len);
+  CU_ASSERT(reg->memory == TRE_BufReg_memory(reg, a)
+      + TRE_BufReg_memory(reg, b));
+  // A closed buffer's handle stays stale, even once its slot is reused.
+  TRE_BufReg_close(reg, a);
+  CU_ASSERT(TRE_BufReg_get(reg, a) == NULL);
+  CU_ASSERT(TRE_BufReg_find(reg, TEST_TEMP_FILE) == 0);
+  TRE_BufHandle c = TRE_BufReg_open(reg, TEST_TEMP_FILE);
+  CU_ASSERT(c != 0 && c != a);
+  CU_ASSERT(TRE_BufReg_get(reg, a) == NULL);
+  CU_ASSERT(TRE_BufReg_get(reg, c) != NULL);
+  CU_ASSERT(TRE_BufReg_get(reg, 0) == NULL);
+  TRE_BufReg_free(reg);
+  remove(TEST_TEMP_FILE);
+}
+
+void test_bufreg_eviction() {
+  TRE_Buf* src = make_numbered_lines(1000);
+  char* text = buffer_text(src);
+  TRE_Buf_free(src);
+  write_test_file(text, strlen(text));
+  TRE_BufReg* reg = TRE_BufReg_new();
+  // An unmodified file, a modified file and a buffer with no file.
+  TRE_BufHandle clean = TRE_BufReg_open(reg, TEST_TEMP_FILE);
+  TRE_BufHandle dirty = TRE_BufReg_add(reg, TRE_Buf_load(TEST_TEMP_FILE));
+  TRE_BufHandle scratch = TRE_BufReg_add(reg,
+      TRE_Buf_load_from_string("scratch\n"));
+  TRE_Buf* buf = TRE_BufReg_get(reg, dirty);
+  TRE_Buf_goto_line(buf, 500, 3);
+  TRE_Buf_insert_string(buf, "edit");
+  TRE_Buf_goto_line(buf, 10, 2);
+  buf = TRE_BufReg_get(reg, scratch);
+  TRE_Buf_goto_line(buf, 0, 7);
+  TRE_Buf_insert_string(buf, " pad");
+  TRE_BufReg_pin(reg, scratch, 1);
+  // Over budget, the least recently used buffers go first, but a pinned one
+  // stays.
+  TRE_BufReg_set_budget(reg, 1);
+  CU_ASSERT(!TRE_BufReg_is_loaded(reg, clean));
+  CU_ASSERT(!TRE_BufReg_is_loaded(reg, dirty));
+  CU_ASSERT(TRE_BufReg_is_loaded(reg, scratch));
+  CU_ASSERT(TRE_BufReg_memory(reg, clean) == 0);
+  CU_ASSERT(reg->memory == TRE_BufReg_memory(reg, scratch));
+  CU_ASSERT(TRE_BufReg_evict(reg, scratch) == TRE_FAIL);
+  TRE_BufReg_pin(reg, scratch, 0);
+  CU_ASSERT(TRE_BufReg_evict(reg, scratch) == TRE_SUCC);
+  CU_ASSERT(reg->memory == 0);
+  // Each comes back as it was, evicting the others to make room.
+  TRE_BufReg_set_budget(reg, 0);
+  buf = TRE_BufReg_get(reg, dirty);
+  CU_ASSERT_FATAL(buf != NULL);
+  CU_ASSERT(!strcmp(buf->filename, TEST_TEMP_FILE));
+  CU_ASSERT(buf->cursor_line.num == 10 && buf->cursor_col == 2);
+  CU_ASSERT(buf->text_len == (TRE_Off)strlen(text) + 4);
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(TRE_Buf_is_modified(buf));
+  CU_ASSERT(TRE_Buf_undo(buf) == TRE_SUCC);
+  CU_ASSERT(!TRE_Buf_is_modified(buf));
+  CU_ASSERT(file_matches_buffer(TEST_TEMP_FILE, buf));
+  buf = TRE_BufReg_get(reg, scratch);
+  CU_ASSERT_FATAL(buf != NULL);
+  CU_ASSERT(buf->filename == NULL);
+  CU_ASSERT(buf->cursor_line.num == 0 && buf->cursor_col == 11);
+  char* scratch_text = buffer_text(buf);
+  CU_ASSERT(!strcmp(scratch_text, "scratch pad\n"));
+  free(scratch_text);
+  buf = TRE_BufReg_get(reg, clean);
+  CU_ASSERT_FATAL(buf != NULL);
+  CU_ASSERT(file_matches_buffer(TEST_TEMP_FILE, buf));
+  CU_ASSERT(reg->n_evictions == 3 && reg->n_reloads == 3);
+  TRE_BufReg_free(reg);
+  free(text);
+  remove(TEST_TEMP_FILE);
+}
+
+// A big buffer with no file comes back from its spill file mapped, but
+// without leaving a line table behind for the spill file.
+void test_bufreg_big_spill() {
+  mkdir(TEST_LINES_DIR, 0755);
+  TRE_linecache_set_dir(TEST_LINES_DIR);
+  TRE_Off n_lines = TRE_BUF_MAP_THRESHOLD / 8 + 1;
+  char* text = malloc(n_lines * 8 + 1);
+  for (TRE_Off i = 0; i < n_lines; i++) {
+    memcpy(text + i * 8, "spilled\n", 8);
+  }
+  text[n_lines * 8] = '\0';
+  TRE_BufReg* reg = TRE_BufReg_new();
+  TRE_BufHandle h = TRE_BufReg_add(reg, TRE_Buf_load_from_string(text));
+  CU_ASSERT(TRE_BufReg_evict(reg, h) == TRE_SUCC);
+  TRE_Buf* buf = TRE_BufReg_get(reg, h);
+  CU_ASSERT_FATAL(buf != NULL);
+  CU_ASSERT(buf->filename == NULL);
+  CU_ASSERT(TRE_Buf_count_lines(buf) == n_lines);
+  TRE_BufReg_free(reg);
+  // The directory's still empty.
+  CU_ASSERT(0 == rmdir(TEST_LINES_DIR));
+  TRE_linecache_set_dir(NULL);
+  free(text);
+}
+
+void test_follow() {
+  write_test_file("one\ntwo", 7);
+  TRE_Buf* buf = TRE_Buf_load(TEST_TEMP_FILE);
+  CU_ASSERT_FATAL(buf != NULL);
+  TRE_Follow* f = TRE_Follow_start(buf);
+  CU_ASSERT_FATAL(f != NULL);
+  TRE_Buf_insert_string(buf, "> ");
+  // The unfinished line gets finished. The cursor isn't on the last line, so
+  // it stays put, and the new text isn't an edit.
+  append_test_file(" more\nthree\n");
+  CU_ASSERT(TRE_Follow_wait(f, 5000) == 12);
+  CU_ASSERT(buffer_has_text(buf, "> one\ntwo more\nthree\n"));
+  CU_ASSERT(buf->n_lines == 3);
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(buf->cursor_line.num == 0 && buf->cursor_col == 2);
+  CU_ASSERT(TRE_Buf_undo(buf) == TRE_SUCC);
+  CU_ASSERT(!TRE_Buf_is_modified(buf));
+  CU_ASSERT(buffer_has_text(buf, "one\ntwo more\nthree\n"));
+  // On the last line, the cursor follows the end of the file.
+  TRE_Buf_goto_line(buf, 2, 1);
+  append_test_file("four\nfi");
+  CU_ASSERT(TRE_Follow_poll(f) == 7);
+  CU_ASSERT(buffer_has_text(buf, "one\ntwo more\nthree\nfour\nfi\n"));
+  CU_ASSERT(buf->cursor_line.num == 4 && buf->cursor_col == 1);
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(TRE_Follow_poll(f) == 0);
+  // A truncated file is read again from the start.
+  write_test_file("new\n", 4);
+  CU_ASSERT(TRE_Follow_poll(f) == 4);
+  CU_ASSERT(buffer_has_text(buf, "new\n"));
+  CU_ASSERT(f->n_truncations == 1);
+  CU_ASSERT(buf->cursor_line.num == 0 && cursor_is_valid(buf));
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(TRE_Buf_undo(buf) == TRE_FAIL);
+  // A rotated file: the rest of the old one, then the new one.
+  append_test_file("old\n");
+  CU_ASSERT(0 == rename(TEST_TEMP_FILE, TEST_TEMP_FILE ".1"));
+  write_test_file("rotated", 7);
+  CU_ASSERT(TRE_Follow_wait(f, 5000) == 11);
+  CU_ASSERT(buffer_has_text(buf, "new\nold\nrotated\n"));
+  CU_ASSERT(f->n_rotations == 1);
+  CU_ASSERT(buf->cursor_line.num == 2 && cursor_is_valid(buf));
+  CU_ASSERT(index_matches_text(buf));
+  append_test_file(" more\n");
+  CU_ASSERT(TRE_Follow_wait(f, 5000) == 6);
+  CU_ASSERT(buffer_has_text(buf, "new\nold\nrotated more\n"));
+  TRE_Follow_stop(f);
+  TRE_Buf_free(buf);
+  remove(TEST_TEMP_FILE);
+  remove(TEST_TEMP_FILE ".1");
+}
+
+void test_follow_edited() {
+  // Reading starts at the end of what was loaded, not at the buffer's length.
+  write_test_file("abc\n", 4);
+  TRE_Buf* buf = TRE_Buf_load(TEST_TEMP_FILE);
+  CU_ASSERT_FATAL(buf != NULL);
+  TRE_Buf_insert_string(buf, "XY");
+  TRE_Follow* f = TRE_Follow_start(buf);
+  CU_ASSERT_FATAL(f != NULL);
+  append_test_file("def\n");
+  CU_ASSERT(TRE_Follow_poll(f) == 4);
+  CU_ASSERT(buffer_has_text(buf, "XYabc\ndef\n"));
+  CU_ASSERT(index_matches_text(buf));
+  TRE_Follow_stop(f);
+  TRE_Buf_free(buf);
+  // The same with an unfinished last line, which the new bytes finish.
+  write_test_file("abc", 3);
+  buf = TRE_Buf_load(TEST_TEMP_FILE);
+  CU_ASSERT_FATAL(buf != NULL);
+  TRE_Buf_goto_line(buf, 0, 3);
+  TRE_Buf_insert_string(buf, "\nXY");
+  f = TRE_Follow_start(buf);
+  CU_ASSERT_FATAL(f != NULL);
+  append_test_file("d\n");
+  CU_ASSERT(TRE_Follow_poll(f) == 2);
+  CU_ASSERT(buffer_has_text(buf, "abc\nXYd\n"));
+  CU_ASSERT(index_matches_text(buf));
+  TRE_Follow_stop(f);
+  TRE_Buf_free(buf);
+  remove(TEST_TEMP_FILE);
+}
+
+void test_follow_mapped() {
+  TRE_Buf* src = make_numbered_lines(1000);
+  char* text = buffer_text(src);
+  TRE_Buf_free(src);
+  write_test_file(text, strlen(text));
+  TRE_Buf* buf = TRE_Buf_load_mapped(TEST_TEMP_FILE);
+  CU_ASSERT_FATAL(buf != NULL);
+  TRE_Buf_goto_line(buf, 999, 0);
+  TRE_Follow* f = TRE_Follow_start(buf);
+  CU_ASSERT_FATAL(f != NULL);
+  // The text no longer refers to the file, so it can shrink under it.
+  CU_ASSERT(buf->map_addr == NULL);
+  CU_ASSERT(buf->storage == TRE_BUF_STORAGE_GAP);
+  CU_ASSERT(buffer_has_text(buf, text));
+  write_test_file("short\n", 6);
+  CU_ASSERT(TRE_Buf_char_at(buf, 8000) == text[8000]);
+  CU_ASSERT(TRE_Follow_poll(f) == 6);
+  CU_ASSERT(buffer_has_text(buf, "short\n"));
+  CU_ASSERT(f->n_truncations == 1);
+  CU_ASSERT(buf->cursor_line.num == 0 && cursor_is_valid(buf));
+  CU_ASSERT(index_matches_text(buf));
+  TRE_Follow_stop(f);
+  TRE_Buf_free(buf);
+  free(text);
+  remove(TEST_TEMP_FILE);
+}
+
+void test_move_extremes() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\ndef\n");
+  TRE_Buf_goto_line(buf, 1, 1);
+  // Moves past either end aren't made.
+  TRE_Buf_move_charwise(buf, LLONG_MAX);
+  CU_ASSERT(TRE_Buf_get_cursor_offset(buf) == 5);
+  TRE_Buf_move_charwise(buf, LLONG_MIN);
+  CU_ASSERT(TRE_Buf_get_cursor_offset(buf) == 5);
+  // Line moves and line numbers stop at the first or last line.
+  TRE_Buf_move_linewise(buf, LLONG_MIN);
+  CU_ASSERT(buf->cursor_line.num == 0 && buf->cursor_col == 1);
+  TRE_Buf_move_linewise(buf, LLONG_MAX);
+  CU_ASSERT(buf->cursor_line.num == 1 && buf->cursor_col == 1);
+  TRE_Buf_goto_line(buf, LLONG_MIN, LLONG_MIN);
+  CU_ASSERT(TRE_Buf_get_cursor_offset(buf) == 0);
+  TRE_Buf_goto_line(buf, LLONG_MAX, LLONG_MAX);
+  CU_ASSERT(TRE_Buf_get_cursor_offset(buf) == 7);
+  CU_ASSERT(cursor_is_valid(buf));
+  TRE_Buf_free(buf);
+}
+
+void test_undo_typing() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\n");
+  for (const char* p = "hi\nthere "; *p; p++) {
+    TRE_Buf_insert_char(buf, *p);
+  }
+  CU_ASSERT(buf->undo.undo.n == 1);
+  CU_ASSERT(TRE_Buf_undo(buf) == TRE_SUCC);
+  char* text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, "abc\n"));
+  free(text);
+  CU_ASSERT(TRE_Buf_get_cursor_offset(buf) == 0);
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(cursor_is_valid(buf));
+  CU_ASSERT(TRE_Buf_undo(buf) == TRE_FAIL);
+  CU_ASSERT(TRE_Buf_redo(buf) == TRE_SUCC);
+  text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, "hi\nthere abc\n"));
+  free(text);
+  CU_ASSERT(TRE_Buf_get_cursor_offset(buf) == 9);
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(TRE_Buf_redo(buf) == TRE_FAIL);
+  // A boundary, or moving the cursor, starts a new step.
+  TRE_Buf_undo_boundary(buf);
+  TRE_Buf_insert_char(buf, 'x');
+  TRE_Buf_move_charwise(buf, 1);
+  TRE_Buf_insert_char(buf, 'y');
+  CU_ASSERT(buf->undo.undo.n == 3);
+  TRE_Buf_undo(buf);
+  TRE_Buf_undo(buf);
+  text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, "hi\nthere abc\n"));
+  free(text);
+  TRE_Buf_free(buf);
+}
+
+void test_undo_deletes() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("hello\nworld\n");
+  TRE_Buf_set_cursor_offset(buf, 8);
+  // Backspace over "wo" and the newline, then delete forwards over "rl".
+  for (int i = 0; i < 3; i++) {
+    TRE_Buf_backspace(buf);
+  }
+  TRE_Buf_undo_boundary(buf);
+  TRE_Buf_delete(buf);
+  TRE_Buf_delete(buf);
+  char* text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, "hellod\n"));
+  free(text);
+  CU_ASSERT(buf->undo.undo.n == 2);
+  TRE_Buf_undo(buf);
+  text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, "hellorld\n"));
+  free(text);
+  TRE_Buf_undo(buf);
+  text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, "hello\nworld\n"));
+  free(text);
+  CU_ASSERT(TRE_Buf_get_cursor_offset(buf) == 8);
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(cursor_is_valid(buf));
+  TRE_Buf_redo(buf);
+  TRE_Buf_redo(buf);
+  text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, "hellod\n"));
+  free(text);
+  CU_ASSERT(index_matches_text(buf));
+  // A new edit clears what could be redone.
+  TRE_Buf_undo(buf);
+  TRE_Buf_insert_char(buf, '!');
+  CU_ASSERT(TRE_Buf_redo(buf) == TRE_FAIL);
+  TRE_Buf_free(buf);
+}
+
+void test_undo_large_paste() {
+  TRE_Buf* src = make_numbered_lines(10000);
+  char* big = buffer_text(src);
+  TRE_Buf_free(src);
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\n");
+  TRE_Buf_move_charwise(buf, 1);
+  TRE_Buf_insert_string(buf, big);
+  TRE_Buf_delete_range(buf, 9 * 5000, 9 * 10);
+  CU_ASSERT(TRE_Buf_undo(buf) == TRE_SUCC);
+  CU_ASSERT(TRE_Buf_undo(buf) == TRE_SUCC);
+  char* text = buffer_text(buf);
+  CU_ASSERT(!strcmp(text, "abc\n"));
+  free(text);
+  CU_ASSERT(buf->n_lines == 1);
+  CU_ASSERT(TRE_Buf_redo(buf) == TRE_SUCC);
+  CU_ASSERT(buf->n_lines == 10001);
+  CU_ASSERT(index_matches_text(buf));
+  CU_ASSERT(cursor_is_valid(buf));
+  text = buffer_text(buf);
+  CU_ASSERT(!strncmp(text + 1, big, strlen(big)));
+  free(text);
+  free(big);
+  TRE_Buf_free(buf);
+}
+
+void test_undo_save_point() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\n");
+  CU_ASSERT(!TRE_Buf_is_modified(buf));
+  TRE_Buf_insert_char(buf, 'x');
+  CU_ASSERT(TRE_Buf_is_modified(buf));
+  TRE_Buf_set_save_point(buf);
+  CU_ASSERT(!TRE_Buf_is_modified(buf));
+  TRE_Buf_insert_char(buf, 'y');
+  CU_ASSERT(TRE_Buf_is_modified(buf));
+  TRE_Buf_undo(buf);
+  CU_ASSERT(!TRE_Buf_is_modified(buf));
+  TRE_Buf_undo(buf);
+  CU_ASSERT(TRE_Buf_is_modified(buf));
+  TRE_Buf_redo(buf);
+  CU_ASSERT(!TRE_Buf_is_modified(buf));
+  // Once the save point can't be reached any more, the buffer stays
+  // modified.
+  TRE_Buf_undo(buf);
+  TRE_Buf_insert_char(buf, 'z');
+  TRE_Buf_undo(buf);
+  CU_ASSERT(TRE_Buf_is_modified(buf));
+  TRE_Buf_free(buf);
+}
+
+void test_undo_budget() {
+  for (int spill = 0; spill <= 1; spill++) {
+    TRE_Buf* buf = make_numbered_lines(100);
+    char* orig = buffer_text(buf);
+    TRE_Buf_set_undo_limit(buf, 4096, spill);
+    // Separate edits all through the text, well over the budget in total.
+    for (int i = 0; i < 500; i++) {
+      TRE_Buf_set_cursor_offset(buf, i * 7 % 800);
+      TRE_Buf_insert_string(buf, "some text\n");
+      TRE_Buf_undo_boundary(buf);
+      TRE_Buf_delete_range(buf, i * 13 % 800, 3);
+    }
+    CU_ASSERT(TRE_Undo_bytes(&buf->undo) <= 4096);
+    int n_undone = 0;
+    while (TRE_Buf_undo(buf) == TRE_SUCC) {
+      n_undone++;
+    }
+    CU_ASSERT(index_matches_text(buf));
+    CU_ASSERT(cursor_is_valid(buf));
+    char* text = buffer_text(buf);
+    if (spill) {
+      CU_ASSERT(n_undone == 1000);
+      CU_ASSERT(buf->undo.n_dropped == 0);
+      CU_ASSERT(!strcmp(text, orig));
+    } else {
+      CU_ASSERT(n_undone > 0 && n_undone < 1000);
+      CU_ASSERT(buf->undo.n_dropped == 1000 - n_undone);
+    }
+    free(text);
+    free(orig);
+    TRE_Buf_free(buf);
+  }
+}
+
+void test_compress_round_trip() {
+  TRE_Buf* src = make_numbered_lines(2000);
+  char* text = buffer_text(src);
+  TRE_Buf_free(src);
+  TRE_Off len = strlen(text);
+  // Some bytes that don't repeat, so there are long runs of literals too.
+  for (int i = 0; i < 500; i++) {
+    text[i * 31] = (char)(i * 7919 >> 3);
+  }
+  char* packed = malloc(TRE_compress_bound(len));
+  TRE_Off packed_len = TRE_compress(text, len, packed);
+  CU_ASSERT(packed_len < len * 3 / 4);
+  char* unpacked = malloc(len);
+  CU_ASSERT(TRE_decompress(packed, packed_len, unpacked, len) == TRE_SUCC);
+  CU_ASSERT(!memcmp(text, unpacked, len));
+  // Corrupt or truncated data is caught.
+  CU_ASSERT(TRE_decompress(packed, packed_len - 1, unpacked, len)
+      == TRE_FAIL);
+  CU_ASSERT(TRE_decompress(packed, packed_len, unpacked, len - 1)
+      == TRE_FAIL);
+  // Tiny inputs are all literals.
+  CU_ASSERT(TRE_compress("ab", 2, packed) == 3);
+  CU_ASSERT(TRE_decompress(packed, 3, unpacked, 2) == TRE_SUCC);
+  CU_ASSERT(!memcmp(unpacked, "ab", 2));
+  free(packed);
+  free(unpacked);
+  free(text);
+}
+
+LOCAL void write_test_file(const char* text, size_t len) {
+  FILE* f = fopen(TEST_TEMP_FILE, "wb");
+  CU_ASSERT_FATAL(f != NULL);
+  CU_ASSERT(fwrite(text, 1, len, f) == len);
+  fclose(f);
+}
+
+LOCAL void append_test_file(const char* text) {
+  FILE* f = fopen(TEST_TEMP_FILE, "ab");
+  CU_ASSERT_FATAL(f != NULL);
+  CU_ASSERT(fputs(text, f) >= 0);
+  fclose(f);
+}
+
+// Check that a file holds exactly the text of a buffer.
+LOCAL int file_matches_buffer(const char* path, TRE_Buf* buf) {
+  char* text = buffer_text(buf);
+  int matches = file_has_text(path, text);
+  free(text);
+  return matches;
+}
+
+LOCAL int file_has_text(const char* path, const char* text) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    return 0;
+  }
+  size_t len = strlen(text);
+  char* contents = malloc(len + 1);
+  size_t n = fread(contents, 1, len + 1, f);
+  fclose(f);
+  int matches = n == len && 0 == memcmp(contents, text, len);
+  free(contents);
+  return matches;
+}
+
+LOCAL int buffer_has_text(TRE_Buf* buf, const char* text) {
+  char* buf_text = buffer_text(buf);
+  int matches = !strcmp(buf_text, text);
+  free(buf_text);
+  return matches;
+}
+
+// Copy the text of a buffer into a new null-terminated string.
+LOCAL char* buffer_text(TRE_Buf* buf) {
+  char* text = malloc(buf->text_len + 1);
+  TRE_Buf_copy_text(buf, 0, text, buf->text_len);
+  text[buf->text_len] = '\0';
+  return text;
+}
+
+// Make a buffer with lines "line0000" through "lineNNNN" (9 chars each,
+// including the newline). n must be at most 10000.
+LOCAL TRE_Buf* make_numbered_lines(int n) {
+  char* text = malloc(n * 9 + 1);
+  for (int i = 0; i < n; i++) {
+    sprintf(text + i * 9, "line%04d\n", i);
+  }
+  TRE_Buf* buf = TRE_Buf_load_from_string(text);
+  free(text);
+  return buf;
+}
+
+// Check the line index against the actual buffer text. Returns nonzero if
+// every line in the index matches the text.
+LOCAL int index_matches_text(TRE_Buf* buf) {
+  if (TRE_LineIdx_count(&buf->lines) != buf->n_lines
+      || TRE_LineIdx_length(&buf->lines) != buf->text_len) {
+    return 0;
+  }
+  int line_num = 0;
+  int line_start = 0;
+  for (int pos = 0; pos < buf->text_len; pos++) {
+    if (TRE_Buf_char_at(buf, pos) == '\n') {
+      TRE_Line line = TRE_Buf_get_line(buf, line_num);
+      if (line.off != line_start || line.len != pos + 1 - line_start) {
+        return 0;
+      }
+      line_num++;
+      line_start = pos + 1;
+    }
+  }
+  return line_num == buf->n_lines;
+}
+
 // Compare the gaps and text of two buffers to determine if they are identical.
 // Returns nonzero if they are identical, zero if not.
 // XXX: Include this in the actual program code?
@@ -280,6 +1861,10 @@ LOCAL int compare_buffers(TRE_Buf* b1, TRE_Buf* b2) {
   return 1;
 }
 
-LOCAL int gap_matches_cursor(TRE_Buf* buf) {
-  return buf->gap_start == buf->cursor_line.off + buf->cursor_col;
+// Check that the cursor agrees with the line index: the cursor line is the
+// line with that number, and the column is within it.
+LOCAL int cursor_is_valid(TRE_Buf* buf) {
+  TRE_Line line = TRE_Buf_get_line(buf, buf->cursor_line.num);
+  return line.off == buf->cursor_line.off && line.len == buf->cursor_line.len
+    && buf->cursor_col >= 0 && buf->cursor_col < line.len;
 }
@@ -0,0 +1,106 @@
+#include <CUnit/CUnit.h>
+#include "../hdrs.c"
+#include "log.h"
+
+// Number of messages each thread logs in the async logging test. This is more
+// than the ring holds, so some may be dropped.
+#define TEST_LOG_MESSAGES 10000
+#define TEST_LOG_THREADS 4
+
+struct test log_tests[] = {
+  { "async logging writes or counts every message", test_async_log },
+  { "async messages are formatted by the writer", test_async_log_formats },
+  { NULL, NULL }
+};
+
+struct test_suite log_suite = {
+  .name = "Log",
+  .init = NULL,
+  .cleanup = NULL,
+  .tests = log_tests
+};
+
+void test_async_log() {
+  // Start a fresh log file.
+  close_log_file();
+  CU_ASSERT_FATAL(TRE_log_start_async() == TRE_SUCC);
+  pthread_t threads[TEST_LOG_THREADS];
+  for (int i = 0; i < TEST_LOG_THREADS; i++) {
+    pthread_create(&threads[i], NULL, log_messages, NULL);
+  }
+  for (int i = 0; i < TEST_LOG_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  unsigned long long dropped = TRE_log_dropped();
+  // Closing the log writes out whatever is still in the ring.
+  close_log_file();
+  FILE* f = fopen(default_log_filename, "r");
+  CU_ASSERT_FATAL(f != NULL);
+  char line[512];
+  long long written = 0, dropped_noted = 0;
+  while (fgets(line, sizeof line, f)) {
+    if (strstr(line, "async test message")) {
+      written++;
+    } else if (strstr(line, "log messages dropped")) {
+      dropped_noted = 1;
+    }
+  }
+  fclose(f);
+  CU_ASSERT(written + (long long)dropped
+      == TEST_LOG_MESSAGES * TEST_LOG_THREADS);
+  CU_ASSERT(dropped_noted == (dropped > 0));
+}
+
+void test_async_log_formats() {
+  close_log_file();
+  CU_ASSERT_FATAL(TRE_log_start_async() == TRE_SUCC);
+  char name[16];
+  strcpy(name, "scratch");
+  char expected[3][256];
+  snprintf(expected[0], 256, "fmt0 %s|%5d|%-4x|%lld|%.2f|%c|%%|%*d", name, 42,
+      255u, -7LL, 3.14159, 'q', 6, 1);
+  log_err("fmt0 %s|%5d|%-4x|%lld|%.2f|%c|%%|%*d", name, 42,
+      255u, -7LL, 3.14159, 'q', 6, 1);
+  snprintf(expected[1], 256, "fmt1 %.*s|%zu|%hhd|%p|%Lg", 3, "abcdef",
+      (size_t)9, 300, (void*)name, 2.5L);
+  log_err("fmt1 %.*s|%zu|%hhd|%p|%Lg", 3, "abcdef",
+      (size_t)9, 300, (void*)name, 2.5L);
+  // The writer formats the message later, from its own copy of the string.
+  strcpy(name, "changed");
+  // Too many arguments to queue: formatted before it's queued.
+  snprintf(expected[2], 256, "fmt2 %d %d %d %d %d %d %d %d %d",
+      1, 2, 3, 4, 5, 6, 7, 8, 9);
+  log_err("fmt2 %d %d %d %d %d %d %d %d %d", 1, 2, 3, 4, 5, 6, 7, 8, 9);
+  close_log_file();
+  // A message after the log is closed is added to the file.
+  log_err("fmt3 after close");
+  close_log_file();
+  FILE* f = fopen(default_log_filename, "r");
+  CU_ASSERT_FATAL(f != NULL);
+  char line[512];
+  int found[4] = { 0, 0, 0, 0 };
+  while (fgets(line, sizeof line, f)) {
+    line[strcspn(line, "\n")] = '\0';
+    for (int i = 0; i < 3; i++) {
+      char prefix[8];
+      snprintf(prefix, sizeof prefix, "fmt%d ", i);
+      char* msg = strstr(line, prefix);
+      if (msg && !strcmp(msg, expected[i])) {
+        found[i] = 1;
+      }
+    }
+    if (strstr(line, "fmt3 after close")) {
+      found[3] = 1;
+    }
+  }
+  fclose(f);
+  CU_ASSERT(found[0] && found[1] && found[2] && found[3]);
+}
+
+LOCAL void* log_messages(void* arg) {
+  (void)arg;
+  for (int i = 0; i < TEST_LOG_MESSAGES; i++) {
+    log_err("async test message %d", i);
+  }
+  return NULL;
+}
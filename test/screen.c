@@ -0,0 +1,201 @@
+#include <CUnit/CUnit.h>
+#include "../hdrs.c"
+#include "screen.h"
+
+struct test screen_tests[] = {
+  { "damage ranges merge", test_damage_ranges },
+  { "edits redraw only what changed", test_screen_diffs },
+  { "wrapping and scrolling", test_screen_scroll },
+  { "line layouts are cached", test_screen_layout_cache },
+  { "terminal output", test_term_out },
+  { NULL, NULL }
+};
+
+struct test_suite screen_suite = {
+  .name = "Screen",
+  .init = NULL,
+  .cleanup = NULL,
+  .tests = screen_tests
+};
+
+#if LOCAL_INTERFACE
+// Collects the spans from a screen update, and applies them to a copy of
+// the screen (as a front-end would).
+#define TEST_SCREEN_MAX 1024
+typedef struct {
+  int rows;
+  int cols;
+  char cells[TEST_SCREEN_MAX];
+  int n_spans;
+  int n_cells;  // total length of the spans
+} term_t;
+#endif
+
+void test_damage_ranges() {
+  TRE_Damage d;
+  TRE_Damage_clear(&d);
+  CU_ASSERT(TRE_Damage_is_empty(&d));
+  TRE_Damage_add(&d, 5, 5);
+  TRE_Damage_add(&d, 7, 7);
+  CU_ASSERT(d.n == 2);
+  CU_ASSERT(!TRE_Damage_contains(&d, 6));
+  // Filling the hole joins the ranges.
+  TRE_Damage_add(&d, 6, 6);
+  CU_ASSERT(d.n == 1 && d.spans[0].first == 5 && d.spans[0].last == 7);
+  TRE_Damage_add(&d, 1, 2);
+  TRE_Damage_add(&d, 20, TRE_DAMAGE_END);
+  CU_ASSERT(d.n == 3);
+  CU_ASSERT(TRE_Damage_contains(&d, 2) && !TRE_Damage_contains(&d, 3));
+  CU_ASSERT(TRE_Damage_contains(&d, 1000000));
+  // A range covering several swallows them.
+  TRE_Damage_add(&d, 2, 30);
+  CU_ASSERT(d.n == 1 && d.spans[0].first == 1);
+  CU_ASSERT(d.spans[0].last == TRE_DAMAGE_END);
+  // Too many scattered ranges collapse into one.
+  TRE_Damage_clear(&d);
+  for (int i = 0; i <= TRE_DAMAGE_MAX_SPANS; i++) {
+    TRE_Damage_add(&d, 10 * i, 10 * i);
+  }
+  CU_ASSERT(d.n == 1 && d.spans[0].first == 0);
+  CU_ASSERT(d.spans[0].last == 10 * TRE_DAMAGE_MAX_SPANS);
+}
+
+void test_screen_diffs() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("hello\nworld\n");
+  TRE_Screen* screen = TRE_Screen_new(4, 8);
+  term_t term;
+  term_init(&term, 4, 8);
+  // The first update draws the text; the rows below it are already blank.
+  CU_ASSERT(update(screen, buf, &term) == 2);
+  CU_ASSERT(0 == memcmp(term.cells, "hello   world   ", 16));
+  // Typing redraws the rest of the line from the cursor, and nothing else.
+  TRE_Buf_insert_char(buf, 'X');
+  CU_ASSERT(update(screen, buf, &term) == 1);
+  CU_ASSERT(term.n_cells == 6);
+  CU_ASSERT(0 == memcmp(term.cells, "Xhello  world   ", 16));
+  CU_ASSERT(screen->cursor_row == 0 && screen->cursor_col == 1);
+  // Moving the cursor changes no cells.
+  TRE_Buf_move_linewise(buf, 1);
+  CU_ASSERT(update(screen, buf, &term) == 0);
+  CU_ASSERT(screen->cursor_row == 1 && screen->cursor_col == 1);
+  // Splitting a line moves the ones after it down.
+  TRE_Buf_insert_char(buf, '\n');
+  CU_ASSERT(update(screen, buf, &term) == 2);
+  CU_ASSERT(0 == memcmp(term.cells, "Xhello  w       orld    ", 24));
+  // Joining them again puts things back.
+  TRE_Buf_backspace(buf);
+  update(screen, buf, &term);
+  CU_ASSERT(0 == memcmp(term.cells, "Xhello  world           ", 24));
+  // The copy matches the screen's own idea of what's showing.
+  CU_ASSERT(0 == memcmp(term.cells, screen->cells, 32));
+  TRE_Screen_free(screen);
+  TRE_Buf_free(buf);
+}
+
+void test_screen_scroll() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("abcdefghij\n1\n2\n3\n4\n");
+  TRE_Screen* screen = TRE_Screen_new(3, 4);
+  term_t term;
+  term_init(&term, 3, 4);
+  // The long line wraps onto all three rows.
+  update(screen, buf, &term);
+  CU_ASSERT(0 == memcmp(term.cells, "abcdefghij  ", 12));
+  // Going down a line scrolls it off the top.
+  TRE_Buf_move_linewise(buf, 1);
+  update(screen, buf, &term);
+  CU_ASSERT(screen->top_line == 1);
+  CU_ASSERT(0 == memcmp(term.cells, "1   2   3   ", 12));
+  CU_ASSERT(screen->cursor_row == 0);
+  TRE_Buf_move_linewise(buf, 3);
+  update(screen, buf, &term);
+  CU_ASSERT(0 == memcmp(term.cells, "2   3   4   ", 12));
+  CU_ASSERT(screen->cursor_row == 2);
+  // Going back to the top scrolls back.
+  TRE_Buf_move_linewise(buf, -5);
+  TRE_Buf_move_charwise(buf, 9);
+  update(screen, buf, &term);
+  CU_ASSERT(screen->top_line == 0);
+  CU_ASSERT(screen->cursor_row == 2 && screen->cursor_col == 1);
+  CU_ASSERT(0 == memcmp(term.cells, screen->cells, 12));
+  TRE_Screen_free(screen);
+  TRE_Buf_free(buf);
+}
+
+void test_screen_layout_cache() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("0\n1\n2\n3\n4\n5\n6\n7\n");
+  TRE_Screen* screen = TRE_Screen_new(4, 8);
+  term_t term;
+  term_init(&term, 4, 8);
+  update(screen, buf, &term);
+  CU_ASSERT(screen->n_laid_out == 4);
+  // Scrolling down lays out just the new line, and scrolling back up again
+  // lays out nothing.
+  TRE_Buf_move_linewise(buf, 4);
+  update(screen, buf, &term);
+  CU_ASSERT(screen->top_line == 1 && screen->n_laid_out == 5);
+  TRE_Buf_move_linewise(buf, -4);
+  update(screen, buf, &term);
+  CU_ASSERT(screen->top_line == 0 && screen->n_laid_out == 5);
+  CU_ASSERT(0 == memcmp(term.cells, "0       1       2       3       ", 32));
+  // An edit lays out only the line it changed...
+  TRE_Buf_move_linewise(buf, 2);
+  TRE_Buf_insert_char(buf, 'x');
+  update(screen, buf, &term);
+  CU_ASSERT(screen->n_laid_out == 6 && term.n_spans == 1);
+  // ...unless it moves the lines after it.
+  TRE_Buf_insert_char(buf, '\n');
+  update(screen, buf, &term);
+  CU_ASSERT(screen->n_laid_out == 8);
+  CU_ASSERT(0 == memcmp(term.cells, "0       1       x       2       ", 32));
+  TRE_Screen_free(screen);
+  TRE_Buf_free(buf);
+}
+
+void test_term_out() {
+  int fds[2];
+  CU_ASSERT_FATAL(0 == pipe(fds));
+  TRE_TermOut term;
+  TRE_TermOut_init(&term, fds[1]);
+  // A span that carries on from the last one doesn't move the cursor.
+  TRE_TermOut_span(&term, 0, 0, "ab", 2);
+  TRE_TermOut_span(&term, 0, 2, "c", 1);
+  TRE_TermOut_char(&term, 2, 4, 'd');
+  TRE_TermOut_move_cursor(&term, 2, 5);
+  CU_ASSERT(TRE_TermOut_flush(&term) == TRE_SUCC);
+  const char* expected = "\x1b[1;1Habc\x1b[3;5Hd";
+  char out[64];
+  int n = read(fds[0], out, sizeof out);
+  CU_ASSERT(n == (int)strlen(expected) && 0 == memcmp(out, expected, n));
+  CU_ASSERT(term.bytes_written == n);
+  TRE_TermOut_free(&term);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+LOCAL void term_init(term_t* term, int rows, int cols) {
+  assert(rows * cols <= TEST_SCREEN_MAX);
+  term->rows = rows;
+  term->cols = cols;
+  memset(term->cells, ' ', rows * cols);
+}
+
+// Update a screen (with the buffer's damage) and apply the spans to a
+// terminal. Returns the number of spans.
+LOCAL int update(TRE_Screen* screen, TRE_Buf* buf, term_t* term) {
+  TRE_Damage damage;
+  TRE_Damage_clear(&damage);
+  TRE_Buf_take_damage(buf, &damage);
+  TRE_Screen_damage(screen, &damage);
+  term->n_spans = term->n_cells = 0;
+  return TRE_Screen_update(screen, buf, apply_span, term);
+}
+
+LOCAL void apply_span(void* ctx, int row, int col, const char* text,
+    int len) {
+  term_t* term = ctx;
+  CU_ASSERT(row >= 0 && row < term->rows);
+  CU_ASSERT(col >= 0 && col + len <= term->cols);
+  memcpy(term->cells + row * term->cols + col, text, len);
+  term->n_spans++;
+  term->n_cells += len;
+}
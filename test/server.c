@@ -0,0 +1,673 @@
+#include <CUnit/CUnit.h>
+#include "../hdrs.c"
+#ifdef _WIN32
+# include <winsock2.h>
+#else
+# include <sys/socket.h>
+# include <netinet/in.h>
+#endif
+#include "server.h"
+
+// Size of the reply that's too big to be sent in one go.
+#define TEST_BIG_REPLY (8 * 1024 * 1024)
+
+struct test server_tests[] = {
+  { "commands split across reads and run together", test_split_commands },
+  { "large replies are sent in pieces", test_partial_writes },
+  { "many connections are served at once", test_many_connections },
+  { "pipelined protocol requests", test_proto_pipeline },
+  { "protocol frames split across reads", test_proto_split_frames },
+  { "bad protocol requests", test_proto_bad_requests },
+  { "protocol moves with extreme arguments", test_proto_extreme_moves },
+  { "unix domain socket listener", test_unix_listener },
+  { "shared memory channel", test_shm_channel },
+  { "shared memory channels that aren't attached", test_shm_attach_checks },
+  { "screen updates for views", test_proto_view },
+  { NULL, NULL }
+};
+
+#if LOCAL_INTERFACE
+// A client's copy of a 3x8 view.
+typedef struct {
+  char cells[3 * 8];
+  int cursor_row;
+  int cursor_col;
+  int n_replies;
+  int n_screens;
+  int n_spans;
+  int n_cells;
+} view_client_t;
+
+typedef struct {
+  TRE_Server* srv;
+  pthread_t thread;
+  int stop;
+} test_server_t;
+#endif
+
+struct test_suite server_suite = {
+  .name = "Server",
+  .init = init_server_suite,
+  .cleanup = NULL,
+  .tests = server_tests
+};
+
+int init_server_suite() {
+  net_init();
+  return 0;
+}
+
+void test_split_commands() {
+  TRE_Server* srv = TRE_Server_new(-1, echo_lines);
+  int client = connect_client(srv);
+  send_all(client, "one\ntw");
+  TRE_Server_poll(srv, 100);
+  send_all(client, "o\nthree\nfour\nqu");
+  TRE_Server_poll(srv, 100);
+  send_all(client, "it\n");
+  TRE_Server_poll(srv, 100);
+  char reply[256];
+  int n = read_reply(srv, client, reply, sizeof reply);
+  CU_ASSERT(n == 27);
+  CU_ASSERT(!strncmp(reply, "+one\n+two\n+three\n+four\nbye\n", n));
+  // The server closed the connection after "quit".
+  CU_ASSERT(srv->n_conns == 0);
+  CU_ASSERT(recv(client, reply, sizeof reply, 0) == 0);
+  net_close(client);
+  TRE_Server_free(srv);
+}
+
+void test_partial_writes() {
+  TRE_Server* srv = TRE_Server_new(-1, echo_lines);
+  int client = connect_client(srv);
+  send_all(client, "big\nafter\n");
+  // The reply is far more than a socket buffer holds, so the server has to
+  // queue most of it.
+  TRE_Server_poll(srv, 100);
+  CU_ASSERT(TRE_ByteQueue_length(&srv->conns[0]->out) > 0);
+  char* reply = malloc(TEST_BIG_REPLY + 64);
+  int n = read_reply(srv, client, reply, TEST_BIG_REPLY + 7);
+  CU_ASSERT(n == TEST_BIG_REPLY + 7);
+  int ok = 1;
+  for (int i = 0; i < TEST_BIG_REPLY; i++) {
+    ok = ok && reply[i] == 'a' + i % 26;
+  }
+  CU_ASSERT(ok);
+  CU_ASSERT(!strncmp(reply + TEST_BIG_REPLY, "+after\n", 7));
+  free(reply);
+  net_close(client);
+  TRE_Server_free(srv);
+}
+
+void test_many_connections() {
+  const int n_clients = 100;
+  TRE_Server* srv = TRE_Server_new(-1, echo_lines);
+  int clients[n_clients];
+  for (int i = 0; i < n_clients; i++) {
+    clients[i] = connect_client(srv);
+  }
+  for (int i = n_clients - 1; i >= 0; i--) {
+    char cmd[32];
+    sprintf(cmd, "client %d\n", i);
+    send_all(clients[i], cmd);
+  }
+  int ok = 1;
+  for (int i = 0; i < n_clients; i++) {
+    char expected[32], reply[32];
+    int len = sprintf(expected, "+client %d\n", i);
+    ok = ok && read_reply(srv, clients[i], reply, len) == len
+      && !strncmp(reply, expected, len);
+  }
+  CU_ASSERT(ok);
+  CU_ASSERT(srv->n_conns == n_clients);
+  for (int i = 0; i < n_clients; i++) {
+    net_close(clients[i]);
+  }
+  // The server notices the clients have gone.
+  TRE_Server_poll(srv, 100);
+  CU_ASSERT(srv->n_conns == 0);
+  TRE_Server_free(srv);
+}
+
+void test_proto_pipeline() {
+  const int n_inserts = 5000;
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\ndef\n");
+  TRE_Server* srv = TRE_Server_new(-1, TRE_Proto_handle);
+  srv->data = buf;
+  int client = connect_client(srv);
+  // Send every request before reading any replies.
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  TRE_Off args[2] = { 1, 1 };
+  TRE_Proto_put_request(&q, TRE_PROTO_GOTO_LINE, args, 2, NULL, 0);
+  for (int i = 0; i < n_inserts; i++) {
+    TRE_Proto_put_request(&q, TRE_PROTO_INSERT, NULL, 0, "x", 1);
+  }
+  TRE_Proto_put_request(&q, TRE_PROTO_INSERT, NULL, 0, "\n", 1);
+  TRE_Proto_put_request(&q, TRE_PROTO_GET_CURSOR, NULL, 0, NULL, 0);
+  TRE_Proto_put_request(&q, TRE_PROTO_LINE_COUNT, NULL, 0, NULL, 0);
+  args[0] = -1;
+  TRE_Proto_put_request(&q, TRE_PROTO_MOVE_LINES, args, 1, NULL, 0);
+  TRE_Proto_put_request(&q, TRE_PROTO_QUIT, NULL, 0, NULL, 0);
+  send_queue(srv, client, &q);
+  int n_replies = n_inserts + 6;
+  TRE_Proto_Reply* replies = malloc(n_replies * sizeof(TRE_Proto_Reply));
+  CU_ASSERT(read_proto_replies(srv, client, replies, n_replies) == n_replies);
+  CU_ASSERT(replies[0].op == TRE_PROTO_GOTO_LINE);
+  CU_ASSERT(replies[0].n_results == 1 && replies[0].results[0] == 5);
+  int ok = 1;
+  for (int i = 1; i <= n_inserts + 1; i++) {
+    ok = ok && replies[i].op == TRE_PROTO_INSERT
+      && replies[i].status == TRE_PROTO_OK && replies[i].n_results == 0;
+  }
+  CU_ASSERT(ok);
+  TRE_Proto_Reply* r = &replies[n_inserts + 2];
+  CU_ASSERT(r->op == TRE_PROTO_GET_CURSOR && r->n_results == 3);
+  CU_ASSERT(r->results[0] == 2 && r->results[1] == 0);
+  CU_ASSERT(r->results[2] == 5 + n_inserts + 1);
+  CU_ASSERT(r[1].op == TRE_PROTO_LINE_COUNT && r[1].results[0] == 3);
+  CU_ASSERT(r[2].op == TRE_PROTO_MOVE_LINES && r[2].results[0] == 4);
+  CU_ASSERT(r[3].op == TRE_PROTO_QUIT);
+  CU_ASSERT(srv->n_conns == 0);
+  CU_ASSERT(buf->text_len == 8 + n_inserts + 1);
+  free(replies);
+  TRE_ByteQueue_free(&q);
+  net_close(client);
+  TRE_Server_free(srv);
+  TRE_Buf_free(buf);
+}
+
+void test_proto_split_frames() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\n");
+  TRE_Server* srv = TRE_Server_new(-1, TRE_Proto_handle);
+  srv->data = buf;
+  int client = connect_client(srv);
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  TRE_Proto_put_request(&q, TRE_PROTO_INSERT, NULL, 0, "hello", 5);
+  TRE_Off args[1] = { 2 };
+  TRE_Proto_put_request(&q, TRE_PROTO_SET_CURSOR, args, 1, NULL, 0);
+  // Send the requests a byte at a time.
+  for (TRE_Off i = 0; i < TRE_ByteQueue_length(&q); i++) {
+    CU_ASSERT(1 == send(client, q.data + i, 1, 0));
+    TRE_Server_poll(srv, 10);
+  }
+  TRE_Proto_Reply replies[2];
+  CU_ASSERT(read_proto_replies(srv, client, replies, 2) == 2);
+  CU_ASSERT(replies[0].op == TRE_PROTO_INSERT);
+  CU_ASSERT(replies[1].op == TRE_PROTO_SET_CURSOR);
+  CU_ASSERT(replies[1].results[0] == 2);
+  CU_ASSERT(buf->text_len == 9);
+  TRE_ByteQueue_free(&q);
+  net_close(client);
+  TRE_Server_free(srv);
+  TRE_Buf_free(buf);
+}
+
+void test_proto_bad_requests() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\n");
+  TRE_Server* srv = TRE_Server_new(-1, TRE_Proto_handle);
+  srv->data = buf;
+  int client = connect_client(srv);
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  // An unknown operation, a move with no distance, and a cursor position
+  // past the end of the buffer.
+  TRE_Proto_put_request(&q, 99, NULL, 0, NULL, 0);
+  TRE_Proto_put_request(&q, TRE_PROTO_MOVE_CHARS, NULL, 0, NULL, 0);
+  TRE_Off args[1] = { 100 };
+  TRE_Proto_put_request(&q, TRE_PROTO_SET_CURSOR, args, 1, NULL, 0);
+  send_queue(srv, client, &q);
+  TRE_Proto_Reply replies[3];
+  CU_ASSERT(read_proto_replies(srv, client, replies, 3) == 3);
+  CU_ASSERT(replies[0].status == TRE_PROTO_BAD_REQUEST);
+  CU_ASSERT(replies[1].status == TRE_PROTO_BAD_REQUEST);
+  CU_ASSERT(replies[2].status == TRE_PROTO_FAILED);
+  CU_ASSERT(srv->n_conns == 1);
+  // A frame that claims to be too long gets the connection closed.
+  send_all(client, "\xff\xff\xff\x7f");
+  CU_ASSERT(read_proto_replies(srv, client, replies, 1) == 1);
+  CU_ASSERT(replies[0].status == TRE_PROTO_BAD_REQUEST);
+  CU_ASSERT(srv->n_conns == 0);
+  TRE_ByteQueue_free(&q);
+  net_close(client);
+  TRE_Server_free(srv);
+  TRE_Buf_free(buf);
+}
+
+void test_proto_extreme_moves() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\ndef\n");
+  TRE_Server* srv = TRE_Server_new(-1, TRE_Proto_handle);
+  srv->data = buf;
+  int client = connect_client(srv);
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  // Arguments out of range are rejected before they reach the buffer.
+  const TRE_Off extremes[] = { LLONG_MAX, LLONG_MIN, (1LL << 48) + 1 };
+  TRE_Off args[2];
+  for (int i = 0; i < 3; i++) {
+    args[0] = args[1] = extremes[i];
+    TRE_Proto_put_request(&q, TRE_PROTO_MOVE_CHARS, args, 1, NULL, 0);
+    TRE_Proto_put_request(&q, TRE_PROTO_MOVE_LINES, args, 1, NULL, 0);
+    TRE_Proto_put_request(&q, TRE_PROTO_GOTO_LINE, args, 2, NULL, 0);
+  }
+  // In range: a character move past the end fails, but line moves and
+  // line numbers stop at the last line.
+  args[0] = args[1] = 1LL << 48;
+  TRE_Proto_put_request(&q, TRE_PROTO_MOVE_CHARS, args, 1, NULL, 0);
+  TRE_Proto_put_request(&q, TRE_PROTO_MOVE_LINES, args, 1, NULL, 0);
+  TRE_Proto_put_request(&q, TRE_PROTO_GOTO_LINE, args, 2, NULL, 0);
+  args[0] = -(1LL << 48);
+  TRE_Proto_put_request(&q, TRE_PROTO_MOVE_CHARS, args, 1, NULL, 0);
+  TRE_Proto_put_request(&q, TRE_PROTO_INSERT, NULL, 0, "x", 1);
+  send_queue(srv, client, &q);
+  TRE_Proto_Reply replies[14];
+  CU_ASSERT(read_proto_replies(srv, client, replies, 14) == 14);
+  int ok = 1;
+  for (int i = 0; i < 9; i++) {
+    ok = ok && replies[i].status == TRE_PROTO_BAD_REQUEST;
+  }
+  CU_ASSERT(ok);
+  CU_ASSERT(replies[9].status == TRE_PROTO_FAILED);
+  CU_ASSERT(replies[9].results[0] == 0);
+  CU_ASSERT(replies[10].status == TRE_PROTO_OK);
+  CU_ASSERT(replies[10].results[0] == 4);
+  CU_ASSERT(replies[11].status == TRE_PROTO_OK);
+  CU_ASSERT(replies[11].results[0] == 7);
+  CU_ASSERT(replies[12].status == TRE_PROTO_FAILED);
+  CU_ASSERT(replies[12].results[0] == 7);
+  CU_ASSERT(replies[13].status == TRE_PROTO_OK);
+  char text[10];
+  TRE_Buf_copy_text(buf, 0, text, buf->text_len);
+  CU_ASSERT(buf->text_len == 9 && 0 == memcmp(text, "abc\ndefx\n", 9));
+  TRE_ByteQueue_free(&q);
+  net_close(client);
+  TRE_Server_free(srv);
+  TRE_Buf_free(buf);
+}
+
+void test_unix_listener() {
+  char path[64];
+  snprintf(path, sizeof path, "/tmp/tre-test-%ld.sock", (long)getpid());
+  int listen_fd = net_listen_unix(path);
+  CU_ASSERT_FATAL(listen_fd >= 0);
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\ndef\n");
+  TRE_Server* srv = TRE_Server_new(listen_fd, TRE_Proto_handle);
+  srv->data = buf;
+  int client = net_connect_unix(path);
+  CU_ASSERT_FATAL(client >= 0);
+  net_set_nonblocking(client);
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  TRE_Proto_put_request(&q, TRE_PROTO_LINE_COUNT, NULL, 0, NULL, 0);
+  send_queue(srv, client, &q);
+  TRE_Proto_Reply reply;
+  CU_ASSERT(read_proto_replies(srv, client, &reply, 1) == 1);
+  CU_ASSERT(reply.op == TRE_PROTO_LINE_COUNT && reply.results[0] == 2);
+  CU_ASSERT(srv->n_conns == 1);
+  TRE_ByteQueue_free(&q);
+  net_close(client);
+  TRE_Server_free(srv);
+  net_close(listen_fd);
+  unlink(path);
+  TRE_Buf_free(buf);
+}
+
+void test_proto_view() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("hello\nworld\n");
+  TRE_Server* srv = TRE_Server_new(-1, TRE_Proto_handle);
+  srv->handle_close = TRE_Proto_close;
+  srv->data = buf;
+  int viewer = connect_client(srv);
+  int typist = connect_client(srv);
+  view_client_t vc;
+  memset(&vc, 0, sizeof vc);
+  memset(vc.cells, ' ', sizeof vc.cells);
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  TRE_Off size[2] = { 3, 8 };
+  TRE_Proto_put_request(&q, TRE_PROTO_VIEW, size, 2, NULL, 0);
+  send_queue(srv, viewer, &q);
+  // The reply, then the whole screen.
+  CU_ASSERT(read_view_frames(srv, viewer, &vc, 2) == 2);
+  CU_ASSERT(vc.n_replies == 1 && vc.n_screens == 1 && vc.n_spans == 2);
+  CU_ASSERT(0 == memcmp(vc.cells, "hello   world           ", 24));
+  // Another client's edit comes through as just the changed span.
+  TRE_Proto_put_request(&q, TRE_PROTO_INSERT, NULL, 0, "A ", 2);
+  send_queue(srv, typist, &q);
+  TRE_Proto_Reply reply;
+  CU_ASSERT(read_proto_replies(srv, typist, &reply, 1) == 1);
+  vc.n_spans = vc.n_cells = 0;
+  CU_ASSERT(read_view_frames(srv, viewer, &vc, 1) == 1);
+  CU_ASSERT(vc.n_spans == 1 && vc.n_cells == 7);
+  CU_ASSERT(0 == memcmp(vc.cells, "A hello world           ", 24));
+  CU_ASSERT(vc.cursor_row == 0 && vc.cursor_col == 2);
+  // Requests that don't change anything don't send a screen.
+  TRE_Proto_put_request(&q, TRE_PROTO_LINE_COUNT, NULL, 0, NULL, 0);
+  send_queue(srv, viewer, &q);
+  vc.n_screens = 0;
+  CU_ASSERT(read_view_frames(srv, viewer, &vc, 2) == 1);
+  CU_ASSERT(vc.n_screens == 0);
+  TRE_ByteQueue_free(&q);
+  net_close(viewer);
+  net_close(typist);
+  TRE_Server_free(srv);
+  TRE_Buf_free(buf);
+}
+
+// The client side of a shared memory channel blocks, so the server runs on
+// a thread of its own.
+void test_shm_channel() {
+  const int n_inserts = 100000;
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\n");
+  test_server_t ts;
+  int client = start_test_server(&ts, buf);
+  TRE_ShmChannel* ch = TRE_ShmChannel_attach(client);
+  CU_ASSERT_FATAL(ch != NULL);
+  // Requests one at a time, then a lot at once (more than fits in a ring).
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  TRE_Proto_Reply reply;
+  TRE_Proto_put_request(&q, TRE_PROTO_GET_CURSOR, NULL, 0, NULL, 0);
+  for (int i = 0; i < 3; i++) {
+    TRE_ShmChannel_send(ch, client, q.data, q.len);
+    CU_ASSERT(shm_replies(ch, client, &reply, 1) == 1);
+    CU_ASSERT(reply.op == TRE_PROTO_GET_CURSOR && reply.results[2] == 0);
+  }
+  TRE_ByteQueue_consume(&q, q.len);
+  for (int i = 0; i < n_inserts; i++) {
+    TRE_Proto_put_request(&q, TRE_PROTO_INSERT, NULL, 0, "x", 1);
+  }
+  TRE_Proto_put_request(&q, TRE_PROTO_GET_CURSOR, NULL, 0, NULL, 0);
+  TRE_ShmChannel_send(ch, client, q.data, q.len);
+  TRE_Proto_Reply* replies =
+    malloc((n_inserts + 1) * sizeof(TRE_Proto_Reply));
+  CU_ASSERT(shm_replies(ch, client, replies, n_inserts + 1)
+      == n_inserts + 1);
+  CU_ASSERT(replies[n_inserts].op == TRE_PROTO_GET_CURSOR);
+  CU_ASSERT(replies[n_inserts].results[2] == n_inserts);
+  free(replies);
+  TRE_ByteQueue_free(&q);
+  stop_test_server(&ts);
+  CU_ASSERT(buf->text_len == 4 + n_inserts);
+  TRE_ShmChannel_free(ch);
+  net_close(client);
+  TRE_Buf_free(buf);
+}
+
+// The server only opens its own user's channels, named the way a client
+// names them, and only for a client on a Unix domain socket. What it won't
+// open it leaves alone.
+void test_shm_attach_checks() {
+  TRE_Buf* buf = TRE_Buf_load_from_string("abc\n");
+  TRE_Server* srv = TRE_Server_new(-1, TRE_Proto_handle);
+  srv->data = buf;
+  char good[TRE_SHM_MAX_NAME], other[TRE_SHM_MAX_NAME], bad[TRE_SHM_MAX_NAME];
+  snprintf(good, sizeof good, TRE_SHM_NAME_PREFIX "test-%ld",
+      (long)getpid());
+  snprintf(other, sizeof other, "/other-test-%ld", (long)getpid());
+  snprintf(bad, sizeof bad, TRE_SHM_NAME_PREFIX "test-bad-%ld",
+      (long)getpid());
+  TRE_ShmChannel* good_ch = TRE_ShmChannel_create(good, 4096);
+  TRE_ShmChannel* other_ch = TRE_ShmChannel_create(other, 4096);
+  CU_ASSERT_FATAL(good_ch != NULL && other_ch != NULL);
+  // A segment with a channel's name, but not a channel.
+  int bad_fd = shm_open(bad, O_RDWR | O_CREAT | O_EXCL, 0600);
+  CU_ASSERT_FATAL(bad_fd >= 0);
+  char zeros[4096] = {0};
+  CU_ASSERT(sizeof zeros == write(bad_fd, zeros, sizeof zeros));
+  close(bad_fd);
+  int tcp_client = connect_client(srv);
+  int client = connect_local_client(srv);
+  TRE_Proto_Reply replies[3];
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  TRE_Proto_put_request(&q, TRE_PROTO_ATTACH_SHM, NULL, 0, good,
+      strlen(good));
+  send_queue(srv, tcp_client, &q);
+  CU_ASSERT(read_proto_replies(srv, tcp_client, replies, 1) == 1);
+  CU_ASSERT(replies[0].status == TRE_PROTO_FAILED);
+  TRE_ByteQueue_consume(&q, q.len);
+  TRE_Proto_put_request(&q, TRE_PROTO_ATTACH_SHM, NULL, 0, other,
+      strlen(other));
+  TRE_Proto_put_request(&q, TRE_PROTO_ATTACH_SHM, NULL, 0, bad,
+      strlen(bad));
+  TRE_Proto_put_request(&q, TRE_PROTO_ATTACH_SHM, NULL, 0, "/tre-../x", 9);
+  send_queue(srv, client, &q);
+  CU_ASSERT(read_proto_replies(srv, client, replies, 3) == 3);
+  for (int i = 0; i < 3; i++) {
+    CU_ASSERT(replies[i].op == TRE_PROTO_ATTACH_SHM
+        && replies[i].status == TRE_PROTO_FAILED);
+  }
+  // None of them were removed.
+  CU_ASSERT(0 == shm_unlink(good));
+  CU_ASSERT(0 == shm_unlink(other));
+  CU_ASSERT(0 == shm_unlink(bad));
+  TRE_ByteQueue_free(&q);
+  TRE_ShmChannel_free(good_ch);
+  TRE_ShmChannel_free(other_ch);
+  net_close(tcp_client);
+  net_close(client);
+  TRE_Server_free(srv);
+  TRE_Buf_free(buf);
+}
+
+// A handler that replies to each line with the line prefixed by "+". "big"
+// gets a TEST_BIG_REPLY byte reply, and "quit" closes the connection.
+LOCAL TRE_OpResult echo_lines(TRE_Server* srv, TRE_Conn* conn) {
+  (void)srv;
+  TRE_ByteQueue* in = &conn->in;
+  const char* line = in->data + in->start;
+  const char* nl;
+  while ((nl = memchr(line, '\n', TRE_ByteQueue_length(in)))) {
+    int len = nl + 1 - line;
+    if (!strncmp(line, "quit\n", len)) {
+      TRE_Conn_send(conn, "bye\n", 4);
+      TRE_Conn_close(conn);
+    } else if (!strncmp(line, "big\n", len)) {
+      char* big = malloc(TEST_BIG_REPLY);
+      for (int i = 0; i < TEST_BIG_REPLY; i++) {
+        big[i] = 'a' + i % 26;
+      }
+      TRE_Conn_send(conn, big, TEST_BIG_REPLY);
+      free(big);
+    } else {
+      TRE_Conn_send(conn, "+", 1);
+      TRE_Conn_send(conn, line, len);
+    }
+    TRE_ByteQueue_consume(in, len);
+    line = in->data + in->start;
+  }
+  return TRE_SUCC;
+}
+
+// Make a connection to the server and return the client's end of it (which
+// is nonblocking, so the test can't hang waiting on the server).
+// The connection is made over loopback TCP, on whatever port is free.
+LOCAL int connect_client(TRE_Server* srv) {
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  CU_ASSERT(0 == bind(listen_fd, (struct sockaddr*)&addr, sizeof addr));
+  CU_ASSERT(0 == listen(listen_fd, 1));
+  getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len);
+  int client_fd = socket(AF_INET, SOCK_STREAM, 0);
+  CU_ASSERT(0 == connect(client_fd, (struct sockaddr*)&addr, sizeof addr));
+  int server_fd = accept(listen_fd, NULL, NULL);
+  net_close(listen_fd);
+  CU_ASSERT(TRE_Server_add_conn(srv, server_fd) != NULL);
+  net_set_nonblocking(client_fd);
+  return client_fd;
+}
+
+// Make a connection to the server over a Unix domain socket pair, and
+// return the client's (nonblocking) end of it.
+LOCAL int connect_local_client(TRE_Server* srv) {
+  int fds[2];
+  CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  CU_ASSERT(TRE_Server_add_conn(srv, fds[1]) != NULL);
+  net_set_nonblocking(fds[0]);
+  return fds[0];
+}
+
+LOCAL void send_all(int fd, const char* s) {
+  CU_ASSERT((int)strlen(s) == send(fd, s, strlen(s), 0));
+}
+
+// Read up to n frames (replies or screens) sent to a client with a view,
+// applying the screens to its copy. Returns the number read.
+LOCAL int read_view_frames(TRE_Server* srv, int fd, view_client_t* vc,
+    int n) {
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  int got = 0, idle = 0;
+  while (got < n && idle < 20) {
+    TRE_Server_poll(srv, 10);
+    char* dst = TRE_ByteQueue_reserve(&q, 65536);
+    int len = recv(fd, dst, 65536, 0);
+    if (len > 0) {
+      q.len += len;
+      idle = 0;
+    } else {
+      idle++;
+    }
+    TRE_Off frame_len;
+    TRE_Proto_Reply reply;
+    while (got < n && (frame_len = TRE_Proto_get_reply(q.data + q.start,
+            TRE_ByteQueue_length(&q), &reply)) > 0) {
+      if (reply.op == TRE_PROTO_SCREEN) {
+        vc->n_screens++;
+        vc->cursor_row = reply.results[0];
+        vc->cursor_col = reply.results[1];
+        TRE_Proto_Span span;
+        int r;
+        while ((r = TRE_Proto_next_span(&reply.data, &reply.data_len,
+                &span)) > 0) {
+          CU_ASSERT(span.row < 3 && span.col + span.len <= 8);
+          memcpy(vc->cells + span.row * 8 + span.col, span.text, span.len);
+          vc->n_spans++;
+          vc->n_cells += span.len;
+        }
+        CU_ASSERT(r == 0);
+      } else {
+        vc->n_replies++;
+      }
+      TRE_ByteQueue_consume(&q, frame_len);
+      got++;
+    }
+  }
+  TRE_ByteQueue_free(&q);
+  return got;
+}
+
+// Start a protocol server for a buffer on its own thread, and connect a
+// (blocking) client to it.
+LOCAL int start_test_server(test_server_t* ts, TRE_Buf* buf) {
+  ts->srv = TRE_Server_new(-1, TRE_Proto_handle);
+  ts->srv->data = buf;
+  ts->stop = 0;
+  int client = connect_local_client(ts->srv);
+  int flags = fcntl(client, F_GETFL, 0);
+  fcntl(client, F_SETFL, flags & ~O_NONBLOCK);
+  pthread_create(&ts->thread, NULL, run_test_server, ts);
+  return client;
+}
+
+LOCAL void* run_test_server(void* arg) {
+  test_server_t* ts = arg;
+  while (!__atomic_load_n(&ts->stop, __ATOMIC_ACQUIRE)) {
+    TRE_Server_poll(ts->srv, 10);
+  }
+  return NULL;
+}
+
+LOCAL void stop_test_server(test_server_t* ts) {
+  __atomic_store_n(&ts->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(ts->thread, NULL);
+  TRE_Server_free(ts->srv);
+}
+
+// Read n replies from a shared memory channel.
+LOCAL int shm_replies(TRE_ShmChannel* ch, int fd, TRE_Proto_Reply* replies,
+    int n) {
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  int got = 0;
+  while (got < n) {
+    char* dst = TRE_ByteQueue_reserve(&q, 65536);
+    TRE_Off len = TRE_ShmChannel_recv(ch, fd, dst, 65536);
+    if (len == 0) {
+      break;
+    }
+    q.len += len;
+    TRE_Off frame_len;
+    while (got < n && (frame_len = TRE_Proto_get_reply(q.data + q.start,
+            TRE_ByteQueue_length(&q), &replies[got])) > 0) {
+      TRE_ByteQueue_consume(&q, frame_len);
+      got++;
+    }
+  }
+  TRE_ByteQueue_free(&q);
+  return got;
+}
+
+// Send everything in a queue, running the server while the socket is full.
+LOCAL void send_queue(TRE_Server* srv, int fd, TRE_ByteQueue* q) {
+  while (TRE_ByteQueue_length(q) > 0) {
+    int n = send(fd, q->data + q->start, TRE_ByteQueue_length(q), 0);
+    if (n > 0) {
+      TRE_ByteQueue_consume(q, n);
+    } else {
+      TRE_Server_poll(srv, 10);
+    }
+  }
+}
+
+// Read and parse up to n protocol replies, running the server while waiting
+// for them. Returns the number read.
+LOCAL int read_proto_replies(TRE_Server* srv, int fd,
+    TRE_Proto_Reply* replies, int n) {
+  TRE_ByteQueue q;
+  memset(&q, 0, sizeof q);
+  int got = 0, idle = 0;
+  while (got < n && idle < 100) {
+    TRE_Server_poll(srv, 10);
+    char* dst = TRE_ByteQueue_reserve(&q, 65536);
+    int len = recv(fd, dst, 65536, 0);
+    if (len > 0) {
+      q.len += len;
+      idle = 0;
+    } else {
+      idle++;
+    }
+    TRE_Off frame_len;
+    while (got < n && (frame_len = TRE_Proto_get_reply(q.data + q.start,
+            TRE_ByteQueue_length(&q), &replies[got])) > 0) {
+      TRE_ByteQueue_consume(&q, frame_len);
+      got++;
+    }
+  }
+  TRE_ByteQueue_free(&q);
+  return got;
+}
+
+// Read a reply of len bytes, running the server while waiting for it.
+// Returns the number of bytes read, which is less than len if the server
+// stops sending.
+LOCAL int read_reply(TRE_Server* srv, int fd, char* buf, int len) {
+  int got = 0, idle = 0;
+  while (got < len && idle < 100) {
+    TRE_Server_poll(srv, 10);
+    int n = recv(fd, buf + got, len - got, 0);
+    if (n > 0) {
+      got += n;
+      idle = 0;
+    } else {
+      idle++;
+    }
+  }
+  return got;
+}
@@ -49,6 +49,9 @@ int run_tests() {
   }
   /* Add test suites. */
   add_suite(&buffer_suite);
+  add_suite(&log_suite);
+  add_suite(&server_suite);
+  add_suite(&screen_suite);
   /* Run all tests using the CUnit Basic interface */
   CU_basic_set_mode(CU_BRM_VERBOSE);
   CU_basic_run_tests();
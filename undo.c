@@ -0,0 +1,462 @@
+#include "hdrs.c"
+#include "mh_undo.h"
+
+// Undo and redo for a buffer.
+//
+// Every edit is recorded as an insertion or a deletion of some text at an
+// offset, along with where the cursor was. Edits that carry on from the last
+// one (typing, deleting forwards, backspacing) are added to its record
+// rather than making a new one, so a run of keystrokes costs one record plus
+// its text, and is undone in one step. TRE_Buf_undo_boundary ends a run.
+//
+// Records live on two stacks, one for undo and one for redo. Each stack
+// keeps its records in an array and their text in one arena, and both only
+// ever change at the top, so undoing or redoing an edit costs time in
+// proportion to its size, not the buffer's. (Undo moves a record and its
+// text from the undo stack to the redo stack, and redo moves it back.) A new
+// edit clears the redo stack.
+//
+// History is kept within a byte budget. When it's over, the oldest quarter
+// or so of the undo stack is either dropped, or (if spilling is turned on)
+// compressed and written to a temporary file, to be read back in once
+// everything newer has been undone.
+//
+// The save point is the number of edits that had been made when the buffer
+// was saved, so undoing or redoing back to it makes the buffer unmodified
+// again.
+
+#if INTERFACE
+// History kept in memory by default, in bytes.
+#define TRE_UNDO_DEFAULT_BUDGET (16 * 1024 * 1024)
+
+typedef enum {
+  TRE_UNDO_INSERT,
+  TRE_UNDO_DELETE
+} TRE_Undo_Kind;
+
+typedef struct {
+  TRE_Undo_Kind kind;
+  int backward;     // a run of backspaces, so the text is stored backwards
+  int linked;       // undone and redone together with the record before it
+  TRE_Off off;      // where the text was inserted or deleted
+  TRE_Off len;
+  TRE_Off cursor;   // where the cursor was before the edit
+  TRE_Off text_at;  // where the text is in the stack's arena
+} TRE_UndoRec;
+
+typedef struct {
+  TRE_UndoRec* recs;
+  int n;
+  int cap;
+  char* text;
+  TRE_Off text_len;
+  TRE_Off text_cap;
+} TRE_UndoStack;
+
+// A block of old undo records on disk.
+typedef struct {
+  TRE_Off file_off;
+  TRE_Off packed_len;  // compressed length
+  TRE_Off raw_len;
+} TRE_UndoSpill;
+
+typedef struct {
+  TRE_UndoStack undo;
+  TRE_UndoStack redo;
+  int can_merge;      // the next edit can be added to the top undo record
+  int replaying;      // set while undoing or redoing (so it isn't recorded)
+  TRE_Off budget;     // most bytes of history to keep (0 for the default)
+  int spill;          // put old history on disk rather than dropping it
+  FILE* spill_file;
+  TRE_UndoSpill* spills;
+  int n_spills;
+  int cap_spills;
+  long long depth;        // edits made, less edits undone
+  long long saved_depth;  // depth at the save point (-1 if it's gone)
+  long long n_dropped;    // records thrown away to stay in the budget
+} TRE_Undo;
+#endif
+
+#if LOCAL_INTERFACE
+// Size of a record in a spill block: kind, flags, off, len, cursor.
+#define SPILL_REC_LEN (1 + 1 + 8 + 8 + 8)
+#endif
+
+void TRE_Undo_free(TRE_Undo* u) {
+  stack_free(&u->undo);
+  stack_free(&u->redo);
+  if (u->spill_file) {
+    fclose(u->spill_file);
+  }
+  if (u->spills) {
+    my_free(u->spills);
+  }
+  memset(u, 0, sizeof(TRE_Undo));
+}
+
+// Set how many bytes of history a buffer keeps in memory (0 for the
+// default), and whether older history goes to disk rather than being lost.
+void TRE_Buf_set_undo_limit(TRE_Buf* buf, TRE_Off budget, int spill) {
+  buf->undo.budget = budget;
+  buf->undo.spill = spill;
+  enforce_budget(&buf->undo);
+}
+
+// Make the next edit start a new undo step, even if it carries on from the
+// last one.
+void TRE_Buf_undo_boundary(TRE_Buf* buf) {
+  buf->undo.can_merge = 0;
+}
+
+// Mark the buffer's current state as saved.
+void TRE_Buf_set_save_point(TRE_Buf* buf) {
+  buf->undo.saved_depth = buf->undo.depth;
+  buf->undo.can_merge = 0;
+}
+
+// Check whether the buffer has changed since the save point.
+int TRE_Buf_is_modified(TRE_Buf* buf) {
+  return buf->undo.depth != buf->undo.saved_depth;
+}
+
+// Undo the last edit (or run of edits). Returns TRE_FAIL if there's nothing
+// to undo.
+TRE_OpResult TRE_Buf_undo(TRE_Buf* buf) {
+  TRE_Undo* u = &buf->undo;
+  if (u->undo.n == 0 && TRE_FAIL == reload_spill(u)) {
+    return TRE_FAIL;
+  }
+  while (undo_one(buf) && (u->undo.n > 0 || reload_spill(u))) {
+  }
+  u->can_merge = 0;
+  return TRE_SUCC;
+}
+
+// Redo the last edit that was undone. Returns TRE_FAIL if there's nothing to
+// redo.
+TRE_OpResult TRE_Buf_redo(TRE_Buf* buf) {
+  TRE_Undo* u = &buf->undo;
+  if (u->redo.n == 0) {
+    return TRE_FAIL;
+  }
+  do {
+    redo_one(buf);
+  } while (u->redo.n > 0 && u->redo.recs[u->redo.n - 1].linked);
+  u->can_merge = 0;
+  enforce_budget(u);
+  return TRE_SUCC;
+}
+
+// Make the last edit recorded part of the same undo step as the one before
+// it, so that (for instance) a replacement is undone all at once.
+void TRE_Buf_undo_link(TRE_Buf* buf) {
+  TRE_Undo* u = &buf->undo;
+  if (!u->replaying && u->undo.n > 1) {
+    u->undo.recs[u->undo.n - 1].linked = 1;
+    u->can_merge = 0;
+  }
+}
+
+// Record an insertion (called by the editing functions before they change
+// the text).
+void TRE_Buf_record_insert(TRE_Buf* buf, TRE_Off off, const char* text,
+    TRE_Off len, TRE_Off cursor) {
+  TRE_Undo* u = &buf->undo;
+  if (u->replaying) {
+    return;
+  }
+  start_edit(u);
+  TRE_UndoRec* top = u->undo.n ? &u->undo.recs[u->undo.n - 1] : NULL;
+  if (u->can_merge && top && top->kind == TRE_UNDO_INSERT
+      && top->off + top->len == off && cursor == off) {
+    memcpy(stack_grow(&u->undo, len), text, len);
+    top->len += len;
+  } else {
+    TRE_UndoRec rec = { TRE_UNDO_INSERT, 0, 0, off, len, cursor, 0 };
+    stack_push(&u->undo, &rec, text);
+    u->depth++;
+  }
+  u->can_merge = 1;
+  enforce_budget(u);
+}
+
+// Record a deletion (called by the editing functions before they change the
+// text, since the deleted text is copied from the buffer).
+void TRE_Buf_record_delete(TRE_Buf* buf, TRE_Off off, TRE_Off len,
+    TRE_Off cursor) {
+  TRE_Undo* u = &buf->undo;
+  if (u->replaying) {
+    return;
+  }
+  start_edit(u);
+  TRE_UndoRec* top = u->undo.n ? &u->undo.recs[u->undo.n - 1] : NULL;
+  int backward = len == 1 && cursor == off + 1;
+  if (u->can_merge && top && top->kind == TRE_UNDO_DELETE
+      && !top->backward && !backward && top->off == off && cursor == off) {
+    // Deleting forwards: the text goes on the end.
+    TRE_Buf_copy_text(buf, off, stack_grow(&u->undo, len), len);
+    top->len += len;
+  } else if (u->can_merge && top && top->kind == TRE_UNDO_DELETE
+      && backward && (top->backward || top->len == 1)
+      && off + 1 == top->off && top->cursor == top->off + top->len) {
+    // Backspacing: the text is stored backwards, so it goes on the end too.
+    *stack_grow(&u->undo, 1) = TRE_Buf_char_at(buf, off);
+    top->backward = 1;
+    top->off = off;
+    top->len++;
+  } else {
+    TRE_UndoRec rec = { TRE_UNDO_DELETE, backward, 0, off, len, cursor, 0 };
+    TRE_Buf_copy_text(buf, off, stack_grow(&u->undo, len), len);
+    rec.text_at = u->undo.text_len - len;
+    stack_add_rec(&u->undo, &rec);
+    u->depth++;
+  }
+  u->can_merge = 1;
+  enforce_budget(u);
+}
+
+// Bytes of history kept in memory.
+TRE_Off TRE_Undo_bytes(const TRE_Undo* u) {
+  return u->undo.text_len + u->undo.n * (TRE_Off)sizeof(TRE_UndoRec)
+    + u->redo.text_len + u->redo.n * (TRE_Off)sizeof(TRE_UndoRec);
+}
+
+// Undo the top record. Returns nonzero if it was linked to the one before.
+LOCAL int undo_one(TRE_Buf* buf) {
+  TRE_Undo* u = &buf->undo;
+  TRE_UndoRec* rec = &u->undo.recs[u->undo.n - 1];
+  const char* text = u->undo.text + rec->text_at;
+  logt("Undoing %s of %lld chars at %lld.",
+      rec->kind == TRE_UNDO_INSERT ? "insert" : "delete", rec->len, rec->off);
+  u->replaying = 1;
+  if (rec->kind == TRE_UNDO_INSERT) {
+    TRE_Buf_delete_range(buf, rec->off, rec->len);
+  } else {
+    reinsert(buf, rec, text);
+  }
+  TRE_Buf_set_cursor_offset(buf, rec->cursor);
+  u->replaying = 0;
+  int linked = rec->linked;
+  stack_push(&u->redo, rec, text);
+  stack_pop(&u->undo);
+  u->depth--;
+  return linked;
+}
+
+LOCAL void redo_one(TRE_Buf* buf) {
+  TRE_Undo* u = &buf->undo;
+  TRE_UndoRec* rec = &u->redo.recs[u->redo.n - 1];
+  const char* text = u->redo.text + rec->text_at;
+  u->replaying = 1;
+  if (rec->kind == TRE_UNDO_INSERT) {
+    reinsert(buf, rec, text);
+  } else {
+    TRE_Buf_delete_range(buf, rec->off, rec->len);
+  }
+  u->replaying = 0;
+  stack_push(&u->undo, rec, text);
+  stack_pop(&u->redo);
+  u->depth++;
+}
+
+// A new edit makes anything that was undone unreachable.
+LOCAL void start_edit(TRE_Undo* u) {
+  if (u->redo.n > 0) {
+    u->redo.n = 0;
+    u->redo.text_len = 0;
+    if (u->saved_depth > u->depth) {
+      u->saved_depth = -1;
+    }
+  }
+}
+
+// Put a deleted text back, with the cursor after it.
+LOCAL void reinsert(TRE_Buf* buf, const TRE_UndoRec* rec, const char* text) {
+  TRE_Buf_set_cursor_offset(buf, rec->off);
+  if (!rec->backward) {
+    TRE_Buf_insert_bytes(buf, text, rec->len);
+    return;
+  }
+  char* forward = my_alloc(rec->len);
+  for (TRE_Off i = 0; i < rec->len; i++) {
+    forward[i] = text[rec->len - 1 - i];
+  }
+  TRE_Buf_insert_bytes(buf, forward, rec->len);
+  my_free(forward);
+}
+
+// Get the history back within the budget by spilling or dropping the oldest
+// undo records. Enough go at once to get down to three quarters of the
+// budget, so this doesn't happen again on the next keystroke.
+LOCAL void enforce_budget(TRE_Undo* u) {
+  TRE_Off budget = u->budget ? u->budget : TRE_UNDO_DEFAULT_BUDGET;
+  TRE_Off excess = TRE_Undo_bytes(u) - budget * 3 / 4;
+  if (TRE_Undo_bytes(u) <= budget || u->undo.n == 0) {
+    return;
+  }
+  int n = 0;
+  TRE_Off freed = 0;
+  while (n < u->undo.n && freed < excess) {
+    freed += u->undo.recs[n].len + sizeof(TRE_UndoRec);
+    n++;
+  }
+  if (u->spill && TRE_SUCC == spill_oldest(u, n)) {
+    logt("Spilled %d undo records to disk.", n);
+  } else {
+    logt("Dropped %d undo records.", n);
+    // Anything spilled before is older still, so it can't be reached now.
+    u->n_dropped += n + u->n_spills;
+    u->n_spills = 0;
+  }
+  // Take them off the bottom of the stack.
+  TRE_Off text_freed = n < u->undo.n ? u->undo.recs[n].text_at
+    : u->undo.text_len;
+  memmove(u->undo.recs, u->undo.recs + n,
+      (u->undo.n - n) * sizeof(TRE_UndoRec));
+  u->undo.n -= n;
+  memmove(u->undo.text, u->undo.text + text_freed,
+      u->undo.text_len - text_freed);
+  u->undo.text_len -= text_freed;
+  for (int i = 0; i < u->undo.n; i++) {
+    u->undo.recs[i].text_at -= text_freed;
+  }
+  if (u->undo.n == 0) {
+    u->can_merge = 0;
+  }
+}
+
+// Write the oldest n undo records to the spill file as one compressed block.
+LOCAL TRE_OpResult spill_oldest(TRE_Undo* u, int n) {
+  if (!u->spill_file && !(u->spill_file = tmpfile())) {
+    log_err("Unable to make undo spill file: %s", strerror(errno));
+    return TRE_FAIL;
+  }
+  TRE_Off text_len = n < u->undo.n ? u->undo.recs[n].text_at
+    : u->undo.text_len;
+  TRE_Off raw_len = n * SPILL_REC_LEN + text_len;
+  unsigned char* raw = my_alloc(raw_len);
+  unsigned char* p = raw;
+  for (int i = 0; i < n; i++, p += SPILL_REC_LEN) {
+    const TRE_UndoRec* rec = &u->undo.recs[i];
+    p[0] = rec->kind;
+    p[1] = rec->backward | rec->linked << 1;
+    memcpy(p + 2, &rec->off, 8);
+    memcpy(p + 10, &rec->len, 8);
+    memcpy(p + 18, &rec->cursor, 8);
+  }
+  memcpy(p, u->undo.text, text_len);
+  char* packed = my_alloc(TRE_compress_bound(raw_len));
+  TRE_Off packed_len = TRE_compress((char*)raw, raw_len, packed);
+  my_free(raw);
+  TRE_Off file_off = u->n_spills ? u->spills[u->n_spills - 1].file_off
+    + u->spills[u->n_spills - 1].packed_len : 0;
+  TRE_OpResult result = TRE_SUCC;
+  if (0 != fseeko(u->spill_file, file_off, SEEK_SET)
+      || 1 != fwrite(packed, packed_len, 1, u->spill_file)) {
+    log_err("Unable to write undo spill file: %s", strerror(errno));
+    result = TRE_FAIL;
+  }
+  my_free(packed);
+  if (result == TRE_FAIL) {
+    return TRE_FAIL;
+  }
+  if (u->n_spills == u->cap_spills) {
+    u->cap_spills = u->cap_spills ? u->cap_spills * 2 : 16;
+    u->spills = my_realloc(u->spills, u->cap_spills * sizeof(TRE_UndoSpill));
+  }
+  TRE_UndoSpill* s = &u->spills[u->n_spills++];
+  s->file_off = file_off;
+  s->packed_len = packed_len;
+  s->raw_len = raw_len;
+  return TRE_SUCC;
+}
+
+// Read the newest spilled block back onto the (empty) undo stack.
+LOCAL TRE_OpResult reload_spill(TRE_Undo* u) {
+  assert(u->undo.n == 0);
+  if (u->n_spills == 0) {
+    return TRE_FAIL;
+  }
+  TRE_UndoSpill* s = &u->spills[--u->n_spills];
+  char* packed = my_alloc(s->packed_len);
+  char* raw = my_alloc(s->raw_len);
+  TRE_OpResult result = TRE_SUCC;
+  if (0 != fseeko(u->spill_file, s->file_off, SEEK_SET)
+      || 1 != fread(packed, s->packed_len, 1, u->spill_file)
+      || TRE_FAIL == TRE_decompress(packed, s->packed_len, raw, s->raw_len)) {
+    log_err("Unable to read back undo history.");
+    // Everything older is lost too, since it has to be undone in order.
+    u->n_dropped += u->n_spills + 1;
+    u->n_spills = 0;
+    result = TRE_FAIL;
+  }
+  my_free(packed);
+  if (result == TRE_SUCC) {
+    // The records come first, then all the text, in the same order.
+    const unsigned char* p = (const unsigned char*)raw;
+    TRE_Off text_at = 0;
+    while ((const char*)p < raw + s->raw_len - text_at) {
+      TRE_UndoRec rec;
+      rec.kind = p[0];
+      rec.backward = p[1] & 1;
+      rec.linked = p[1] >> 1 & 1;
+      memcpy(&rec.off, p + 2, 8);
+      memcpy(&rec.len, p + 10, 8);
+      memcpy(&rec.cursor, p + 18, 8);
+      rec.text_at = text_at;
+      text_at += rec.len;
+      stack_add_rec(&u->undo, &rec);
+      p += SPILL_REC_LEN;
+    }
+    memcpy(stack_grow(&u->undo, text_at), p, text_at);
+  }
+  my_free(raw);
+  return result;
+}
+
+// Push a record and its text onto a stack.
+LOCAL void stack_push(TRE_UndoStack* s, const TRE_UndoRec* rec,
+    const char* text) {
+  TRE_UndoRec copy = *rec;
+  memcpy(stack_grow(s, rec->len), text, rec->len);
+  copy.text_at = s->text_len - rec->len;
+  stack_add_rec(s, &copy);
+}
+
+LOCAL void stack_add_rec(TRE_UndoStack* s, const TRE_UndoRec* rec) {
+  if (s->n == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 64;
+    s->recs = my_realloc(s->recs, s->cap * sizeof(TRE_UndoRec));
+  }
+  s->recs[s->n++] = *rec;
+}
+
+// Make room for len more chars of text at the end of a stack's arena, and
+// return where they go.
+LOCAL char* stack_grow(TRE_UndoStack* s, TRE_Off len) {
+  if (s->text_len + len > s->text_cap) {
+    TRE_Off cap = s->text_cap ? s->text_cap : 4096;
+    while (cap < s->text_len + len) {
+      cap *= 2;
+    }
+    s->text = my_realloc(s->text, cap);
+    s->text_cap = cap;
+  }
+  s->text_len += len;
+  return s->text + s->text_len - len;
+}
+
+LOCAL void stack_pop(TRE_UndoStack* s) {
+  assert(s->n > 0);
+  s->n--;
+  s->text_len = s->recs[s->n].text_at;
+}
+
+LOCAL void stack_free(TRE_UndoStack* s) {
+  if (s->recs) {
+    my_free(s->recs);
+  }
+  if (s->text) {
+    my_free(s->text);
+  }
+}
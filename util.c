@@ -54,18 +54,41 @@ char* my_file_get_contents(const char* filename, const char** error) {
   long file_len = ftell(f);
   fseek(f, 0, SEEK_SET);
   char* contents = my_alloc(file_len + 1);
-    size_t n_read;
-    size_t n_left = file_len;
-    while ((n_read = fread(contents, 1, n_left, f)) < n_left) {
-      if (ferror(f)) {
-        *error = "Read error.";
-        return NULL;
-      }
-      n_left -= n_read;
+  size_t n_total = 0;
+  while (n_total < (size_t)file_len) {
+    size_t n_read = fread(contents + n_total, 1, file_len - n_total, f);
+    if (n_read == 0) {
+      *error = "Read error.";
+      fclose(f);
+      my_free(contents);
+      return NULL;
     }
+    n_total += n_read;
+  }
+  fclose(f);
+  // The contents are null-terminated, so they can be used as a string.
+  contents[file_len] = '\0';
   return contents;
 }
 
+// A 128-bit hash of a string, for keys that shouldn't match by accident. The
+// first half is 64-bit FNV-1a. The second uses the same prime from a
+// different starting value, and also folds the high bits down after each
+// byte, so it isn't just a function of the first. (They aren't independent,
+// but a pair that collides in both is far less likely than in either.) The
+// second half is never 0.
+void my_hash128(const char* str, uint64_t key[2]) {
+  uint64_t a = 14695981039346656037ULL;
+  uint64_t b = 0x9e3779b97f4a7c15ULL;
+  for (const unsigned char* p = (const unsigned char*)str; *p; p++) {
+    a = (a ^ *p) * 1099511628211ULL;
+    b = (b ^ *p) * 0x100000001b3ULL;
+    b ^= b >> 29;
+  }
+  key[0] = a;
+  key[1] = b | 1;
+}
+
 int my_realpath(const char* path, char* resolved_path) {
 #ifdef _WIN32
   DWORD path_len = GetFullPathName(path, PATH_MAX, resolved_path, NULL);